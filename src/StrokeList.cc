@@ -3,42 +3,137 @@
 
 #include "StrokeList.h"
 
+#include "StrokePager.h"
+
+void
+strokelist_init(StrokeList* list, Arena* arena, StrokePager* pager)
+{
+    list->arena = arena;
+    list->pager = pager;
+    strokelist_init_bucket(&list->root);
+    if ( pager ) {
+        stroke_pager_add_bucket(pager, list, &list->root, 0);
+    }
+}
+
 void
 strokelist_init_bucket(StrokeBucket* bucket)
 {
     bucket->bounding_rect = rect_without_size();
+    bucket->payload.min_block_size = STROKELIST_PAYLOAD_BLOCK_SIZE;
+}
+
+static size_t
+payload_block_size(i64 capacity)
+{
+    size_t size = (size_t)capacity * (sizeof(v2l) + sizeof(f32));
+    return (size + 7) & ~(size_t)7;
+}
+
+void
+strokelist_alloc_payload(StrokeBucket* bucket, i32 num_points, Stroke* stroke)
+{
+    i32 k = 0;
+    while ( k < STROKELIST_PAYLOAD_CLASSES && (1 << k) < num_points ) {
+        ++k;
+    }
+
+    i64 capacity = num_points;
+    u8* block = NULL;
+    stroke->payload_class = 0;
+    if ( k < STROKELIST_PAYLOAD_CLASSES ) {
+        capacity = (i64)1 << k;
+        stroke->payload_class = k + 1;
+        block = bucket->free_blocks[k];
+        if ( block ) {
+            memcpy(&bucket->free_blocks[k], block, sizeof(u8*));
+            bucket->free_bytes -= payload_block_size(capacity);
+        }
+    }
+    if ( !block ) {
+        block = arena_alloc_bytes(&bucket->payload, payload_block_size(capacity));
+    }
+    stroke->points = (v2l*)block;
+    stroke->pressures = (f32*)(block + (size_t)capacity * sizeof(v2l));
+}
+
+void
+strokelist_free_payload(StrokeBucket* bucket, Stroke* stroke)
+{
+    // Points that were paged in live in the page, which is freed as a whole.
+    if ( stroke->payload_class > 0 && stroke->points != NULL && !bucket->is_paged_out ) {
+        i32 k = stroke->payload_class - 1;
+        u8* block = (u8*)stroke->points;
+        memcpy(block, &bucket->free_blocks[k], sizeof(u8*));
+        bucket->free_blocks[k] = block;
+        bucket->free_bytes += payload_block_size((i64)1 << k);
+    }
+    stroke->points = NULL;
+    stroke->pressures = NULL;
+    stroke->payload_class = 0;
+}
+
+void
+strokelist_release_payload(StrokeBucket* bucket)
+{
+    arena_free(&bucket->payload);
+    bucket->payload = {};
+    bucket->payload.min_block_size = STROKELIST_PAYLOAD_BLOCK_SIZE;
+    memset(bucket->free_blocks, 0, sizeof(bucket->free_blocks));
+    bucket->free_bytes = 0;
 }
 
 static StrokeBucket*
-create_bucket(Arena* arena)
+create_bucket(StrokeList* list, i64 bucket_i)
 {
-    StrokeBucket* bucket = arena_alloc_elem(arena, StrokeBucket);
+    StrokeBucket* bucket = arena_alloc_elem(list->arena, StrokeBucket);
     strokelist_init_bucket(bucket);
+    if ( list->pager ) {
+        stroke_pager_add_bucket(list->pager, list, bucket, bucket_i);
+    }
     return bucket;
 }
 
-void
-push(StrokeList* list, const Stroke& element)
+StrokeBucket*
+strokelist_get_bucket(StrokeList* list, i64 idx)
 {
-    int bucket_i = list->count / STROKELIST_BUCKET_COUNT;
-    int i = list->count % STROKELIST_BUCKET_COUNT;
-
+    i64 bucket_i = idx / STROKELIST_BUCKET_COUNT;
     StrokeBucket* bucket = &list->root;
-    while ( bucket_i != 0 ) {
+    for ( i64 i = 1; i <= bucket_i; ++i ) {
         if ( !bucket->next ) {
-            bucket->next = create_bucket(list->arena);
+            bucket->next = create_bucket(list, i);
         }
         bucket = bucket->next;
-        bucket_i -= 1;
     }
+    return bucket;
+}
+
+void
+push(StrokeList* list, const Stroke& element)
+{
+    int i = list->count % STROKELIST_BUCKET_COUNT;
+
+    StrokeBucket* bucket = strokelist_get_bucket(list, list->count);
 
     bucket->data[i] = element;
 
     bucket->bounding_rect = rect_union(bucket->bounding_rect, element.bounding_rect);
+    // The copy in the backing file doesn't have this stroke.
+    bucket->page_size = 0;
 
     list->count += 1;
 }
 
+void
+strokelist_extend(StrokeList* list, i64 count)
+{
+    i64 new_count = list->count + count;
+    if ( new_count > 0 ) {
+        strokelist_get_bucket(list, new_count - 1);
+    }
+    list->count = new_count;
+}
+
 Stroke*
 get(StrokeList* list, i64 idx)
 {
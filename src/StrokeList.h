@@ -5,6 +5,11 @@
 //
 // - Works as a dynamically-sized array for Strokes.
 // - Pointers to elements in the StrokeList stay valid for the lifetime of the program.
+// - Points and pressures of the strokes in a bucket are allocated from the bucket's
+//   payload arena, so that the StrokePager can free them.
+// - Strokes drawn while the app runs get blocks of a power-of-two number of
+//   points. Blocks of strokes that are gone for good go back to a free list per
+//   size, and the next strokes pushed to the bucket reuse them.
 
 
 #pragma once
@@ -15,11 +20,29 @@
 
 #define STROKELIST_BUCKET_COUNT 4196
 
+#define STROKELIST_PAYLOAD_BLOCK_SIZE (256*1024)
+
+// Up to 2048 points (STROKE_MAX_POINTS). Larger strokes get blocks of their size, which are not reused.
+#define STROKELIST_PAYLOAD_CLASSES 12
+
+struct StrokePager;
+
 struct StrokeBucket
 {
     Stroke          data[STROKELIST_BUCKET_COUNT];
     StrokeBucket*   next;
     Rect            bounding_rect;
+    SDL_atomic_t    loading;  // Non-zero while a background load fills the bucket. See milton_load_poll
+
+    Arena           payload;
+    u8*             free_blocks[STROKELIST_PAYLOAD_CLASSES];    // By payload_class - 1. Linked through their first bytes.
+    size_t          free_bytes;
+
+    // See StrokePager
+    b32             is_paged_out;   // Stroke points are NULL. stroke_pager_touch reads them back.
+    u64             page_offset;    // Copy of the payload in the backing file,
+    u64             page_size;      //  valid while page_size is not zero.
+    i64             last_used;
 };
 
 struct StrokeList
@@ -29,9 +52,22 @@ struct StrokeList
     Stroke*         operator[](i64 i);
 
     Arena*          arena;
+    StrokePager*    pager;  // Can be NULL.
 };
 
+void strokelist_init(StrokeList* list, Arena* arena, StrokePager* pager);
 void strokelist_init_bucket(StrokeBucket* bucket);
+// Returns the bucket that holds stroke `idx`, creating buckets up to it.
+StrokeBucket* strokelist_get_bucket(StrokeList* list, i64 idx);
+// Adds `count` strokes to the end of the list, to be filled in place. Bucket bounds are not updated.
+void strokelist_extend(StrokeList* list, i64 count);
+
+// Points `stroke` at room for `num_points` points and pressures in the payload of the bucket.
+void strokelist_alloc_payload(StrokeBucket* bucket, i32 num_points, Stroke* stroke);
+// Gives the points of a stroke that is not in the list anymore back to the bucket it was allocated from.
+void strokelist_free_payload(StrokeBucket* bucket, Stroke* stroke);
+// Frees the whole payload. Strokes that pointed into it are left dangling.
+void strokelist_release_payload(StrokeBucket* bucket);
 
 void push(StrokeList* list, const Stroke& element);
 Stroke* get(StrokeList* list, i64 idx);
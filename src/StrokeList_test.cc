@@ -0,0 +1,94 @@
+// Copyright (c) 2015 Sergio Gonzalez. All rights reserved.
+// License: https://github.com/serge-rgb/milton#license
+
+// Allocates and frees stroke payloads in a bucket. Built in place of the entry
+// point, like darray_test.cc.
+
+// Fills the points and pressures of `stroke` with `tag`, or checks that they still have it.
+static void
+test_tag_payload(Stroke* stroke, i32 tag, b32 check)
+{
+    for ( i32 i = 0; i < stroke->num_points; ++i ) {
+        if ( check ) {
+            mlt_assert(stroke->points[i] == (v2l{ tag, i }));
+            mlt_assert(stroke->pressures[i] == (f32)tag);
+        } else {
+            stroke->points[i] = v2l{ tag, i };
+            stroke->pressures[i] = (f32)tag;
+        }
+    }
+}
+
+int
+milton_main()
+{
+    // Too big for the stack.
+    StrokeBucket* bucket = (StrokeBucket*)mlt_calloc(1, sizeof(StrokeBucket), "Strokes");
+    strokelist_init_bucket(bucket);
+
+    // Blocks have room for a power of two number of points.
+    struct { i32 num_points; i32 payload_class; } cases[] = {
+        { 1, 1 }, { 2, 2 }, { 3, 3 }, { 4, 3 }, { 5, 4 },
+        { 1000, 11 }, { 1024, 11 }, { 1025, 12 }, { STROKE_MAX_POINTS, 12 },
+        // Larger than every class.
+        { STROKE_MAX_POINTS + 1, 0 },
+    };
+    Stroke strokes[array_count(cases)] = {};
+    for ( i32 i = 0; i < (i32)array_count(cases); ++i ) {
+        Stroke* stroke = &strokes[i];
+        stroke->num_points = cases[i].num_points;
+        strokelist_alloc_payload(bucket, stroke->num_points, stroke);
+        mlt_assert(stroke->payload_class == cases[i].payload_class);
+        i64 capacity = stroke->payload_class > 0 ? (i64)1 << (stroke->payload_class - 1) : stroke->num_points;
+        mlt_assert((u8*)stroke->pressures == (u8*)(stroke->points + capacity));
+        test_tag_payload(stroke, i, false);
+    }
+    mlt_assert(bucket->free_bytes == 0);
+
+    // Freed blocks go to the list of their class, and the last one freed is reused first.
+    Stroke* a = &strokes[2];
+    Stroke* b = &strokes[3];
+    v2l* a_points = a->points;
+    v2l* b_points = b->points;
+    strokelist_free_payload(bucket, a);
+    strokelist_free_payload(bucket, b);
+    mlt_assert(a->points == NULL && a->payload_class == 0);
+    mlt_assert(bucket->free_bytes == 2 * payload_block_size(4));
+
+    // Other classes don't take them.
+    Stroke c = {};
+    c.num_points = 5;
+    strokelist_alloc_payload(bucket, c.num_points, &c);
+    mlt_assert(c.points != a_points && c.points != b_points);
+    mlt_assert(bucket->free_bytes == 2 * payload_block_size(4));
+
+    a->num_points = 4;
+    strokelist_alloc_payload(bucket, a->num_points, a);
+    mlt_assert(a->points == b_points);
+    b->num_points = 3;
+    strokelist_alloc_payload(bucket, b->num_points, b);
+    mlt_assert(b->points == a_points);
+    mlt_assert(bucket->free_bytes == 0);
+    test_tag_payload(a, 2, false);
+    test_tag_payload(b, 3, false);
+
+    // Blocks of strokes without a class are not kept.
+    Stroke* large = &strokes[array_count(cases) - 1];
+    strokelist_free_payload(bucket, large);
+    mlt_assert(large->points == NULL);
+    mlt_assert(bucket->free_bytes == 0);
+
+    // Reused blocks don't overlap the ones in use.
+    for ( i32 i = 0; i < (i32)array_count(cases) - 1; ++i ) {
+        test_tag_payload(&strokes[i], i, true);
+    }
+
+    strokelist_release_payload(bucket);
+    mlt_assert(bucket->free_bytes == 0);
+    for ( i32 k = 0; k < STROKELIST_PAYLOAD_CLASSES; ++k ) {
+        mlt_assert(bucket->free_blocks[k] == NULL);
+    }
+    mlt_free(bucket, "Strokes");
+
+    return 0;
+}
@@ -0,0 +1,512 @@
+// Copyright (c) 2015 Sergio Gonzalez. All rights reserved.
+// License: https://github.com/serge-rgb/milton#license
+
+#include "StrokePager.h"
+
+#include "platform.h"
+#include "profiler.h"
+
+// Buckets are only paged out every this many frames. Adding up payload sizes walks every block.
+#define STROKE_PAGER_TRIM_INTERVAL 30
+
+// Full buckets are compacted when at least this much of their payload, and a quarter of it, is free.
+#define STROKE_PAGER_COMPACT_MIN_FREE (64*1024)
+
+// A page is the payload of a full bucket. Each stroke, in order:
+struct StrokePageRecord
+{
+    i32 num_points;
+    i32 id;
+    // v2l points[num_points];
+    // f32 pressures[num_points];
+    // Padding to 8 bytes.
+};
+
+static size_t
+page_record_size(i32 num_points)
+{
+    size_t size = sizeof(StrokePageRecord) + (size_t)num_points * (sizeof(v2l) + sizeof(f32));
+    return (size + 7) & ~(size_t)7;
+}
+
+static b32
+pager_seek(FILE* fd, u64 offset)
+{
+#if defined(_WIN32)
+    return _fseeki64(fd, (__int64)offset, SEEK_SET) == 0;
+#else
+    return fseeko(fd, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+static size_t
+payload_size(Arena* payload)
+{
+    size_t total = 0;
+    u8* data = payload->ptr;
+    size_t size = payload->size;
+    while ( data ) {
+        ArenaFooter footer = *(ArenaFooter*)(data + size);
+        total += size;
+        data = footer.previous_block;
+        size = footer.previous_size;
+    }
+    return total;
+}
+
+// Points the strokes with NULL points at the records in `page`.
+static void
+page_assign_points(u8* page, u64 page_size, Stroke* strokes, i64 num_strokes)
+{
+    u8* p = page;
+    u8* end = page + page_size;
+    for ( i64 i = 0; i < num_strokes && end - p >= (i64)sizeof(StrokePageRecord); ++i ) {
+        StrokePageRecord* record = (StrokePageRecord*)p;
+        size_t size = page_record_size(record->num_points);
+        if ( record->num_points < 0 || (size_t)(end - p) < size ) {
+            break;
+        }
+        Stroke* s = &strokes[i];
+        if ( s->points == NULL && s->id == record->id && s->num_points == record->num_points ) {
+            s->points = (v2l*)(p + sizeof(StrokePageRecord));
+            s->pressures = (f32*)(p + sizeof(StrokePageRecord) + (size_t)record->num_points * sizeof(v2l));
+            s->payload_class = 0;
+        }
+        p += size;
+    }
+}
+
+// A page that is not in the file yet. Call with the mutex held.
+static StrokePagerWrite*
+find_write(StrokePager* pager, u64 page_offset)
+{
+    for ( i64 i = 0; i < pager->writes.count; ++i ) {
+        if ( pager->writes.data[i].offset == page_offset ) {
+            return &pager->writes.data[i];
+        }
+    }
+    return NULL;
+}
+
+// Copies a page from the write queue or reads it from the file. Call with the mutex held.
+static b32
+read_page(StrokePager* pager, u64 page_offset, u64 page_size, u8* page)
+{
+    b32 ok = false;
+    StrokePagerWrite* write = find_write(pager, page_offset);
+    if ( write ) {
+        ok = write->size == page_size;
+        if ( ok ) {
+            memcpy(page, write->data, (size_t)page_size);
+        }
+    } else {
+        SDL_LockMutex(pager->file_mutex);
+        ok =    pager->fd != NULL
+             && pager_seek(pager->fd, page_offset)
+             && fread(page, 1, (size_t)page_size, pager->fd) == page_size;
+        SDL_UnlockMutex(pager->file_mutex);
+    }
+    return ok;
+}
+
+static int  // Thread
+stroke_pager_thread(void* data)
+{
+    StrokePager* pager = (StrokePager*)data;
+    PROFILE_THREAD_NAME("Pager");
+
+    SDL_LockMutex(pager->mutex);
+    for ( ;; ) {
+        StrokePagerWrite* write = NULL;
+        for ( i64 i = 0; write == NULL && i < pager->writes.count; ++i ) {
+            if ( !pager->writes.data[i].failed ) {
+                write = &pager->writes.data[i];
+            }
+        }
+        if ( pager->quit ) {
+            break;
+        }
+        if ( !write ) {
+            SDL_CondWait(pager->write_cond, pager->mutex);
+            continue;
+        }
+        // The entry can move while the mutex is not held, but its data stays until we free it.
+        u64 offset = write->offset;
+        u64 size = write->size;
+        u8* page = write->data;
+        SDL_UnlockMutex(pager->mutex);
+
+        SDL_LockMutex(pager->file_mutex);
+        b32 ok =    pager_seek(pager->fd, offset)
+                 && fwrite(page, 1, (size_t)size, pager->fd) == size;
+        SDL_UnlockMutex(pager->file_mutex);
+
+        SDL_LockMutex(pager->mutex);
+        write = find_write(pager, offset);
+        if ( ok ) {
+            mlt_free(write->data, "Strokes");
+            *write = pager->writes.data[--pager->writes.count];
+        } else {
+            milton_log("Could not write a stroke page. Paging is disabled.\n");
+            write->failed = true;
+            pager->write_failed = true;
+        }
+    }
+    SDL_UnlockMutex(pager->mutex);
+
+    PROFILE_THREAD_RELEASE();
+    return 0;
+}
+
+void
+stroke_pager_init(StrokePager* pager, size_t budget)
+{
+    *pager = {};
+#if !STROKE_DEBUG_VIZ  // Debug flags are not paged.
+    pager->budget = budget;
+#endif
+    pager->mutex = SDL_CreateMutex();
+    pager->file_mutex = SDL_CreateMutex();
+    pager->write_cond = SDL_CreateCond();
+}
+
+void
+stroke_pager_release(StrokePager* pager)
+{
+    if ( pager->thread ) {
+        // Pages that are still queued are not needed anymore.
+        SDL_LockMutex(pager->mutex);
+        pager->quit = true;
+        SDL_CondSignal(pager->write_cond);
+        SDL_UnlockMutex(pager->mutex);
+        SDL_WaitThread(pager->thread, NULL);
+    }
+    for ( i64 i = 0; i < pager->writes.count; ++i ) {
+        mlt_free(pager->writes.data[i].data, "Strokes");
+    }
+    for ( i64 i = 0; i < pager->buckets.count; ++i ) {
+        strokelist_release_payload(pager->buckets.data[i].bucket);
+    }
+    if ( pager->fd ) {
+        fclose(pager->fd);  // tmpfile() files are deleted when closed.
+    }
+    if ( pager->mutex ) {
+        SDL_DestroyMutex(pager->mutex);
+    }
+    if ( pager->file_mutex ) {
+        SDL_DestroyMutex(pager->file_mutex);
+    }
+    if ( pager->write_cond ) {
+        SDL_DestroyCond(pager->write_cond);
+    }
+    release(&pager->writes);
+    release(&pager->buckets);
+    release(&pager->freed_strokes);
+    release(&pager->freed_lists);
+    *pager = {};
+}
+
+void
+stroke_pager_add_bucket(StrokePager* pager, StrokeList* list, StrokeBucket* bucket, i64 bucket_i)
+{
+    StrokePagerEntry entry = { bucket, list, bucket_i };
+    push(&pager->buckets, entry);
+}
+
+static b32
+stroke_pager_page_out(StrokePager* pager, StrokeBucket* bucket)
+{
+    b32 ok = true;
+    SDL_LockMutex(pager->mutex);
+
+    // Pages stay valid while the bucket doesn't change, so a bucket that was read back is just freed.
+    if ( bucket->page_size == 0 ) {
+        if ( !pager->fd ) {
+            pager->fd = tmpfile();
+            if ( pager->fd ) {
+                pager->thread = SDL_CreateThread(stroke_pager_thread, "Pager Thread", (void*)pager);
+                if ( !pager->thread ) {
+                    fclose(pager->fd);
+                    pager->fd = NULL;
+                }
+            }
+            if ( !pager->fd || !pager->thread ) {
+                milton_log("Could not create a file for stroke pages. Paging is disabled.\n");
+                pager->budget = 0;
+                ok = false;
+            }
+        }
+
+        size_t size = 0;
+        for ( i64 i = 0; i < STROKELIST_BUCKET_COUNT; ++i ) {
+            size += page_record_size(bucket->data[i].num_points);
+        }
+        u8* page = ok ? (u8*)mlt_calloc(size, 1, "Strokes") : NULL;
+        if ( ok && !page ) {
+            milton_log("Could not allocate a stroke page.\n");
+            ok = false;
+        }
+        if ( ok ) {
+            u8* p = page;
+            for ( i64 i = 0; i < STROKELIST_BUCKET_COUNT; ++i ) {
+                Stroke* s = &bucket->data[i];
+                StrokePageRecord record = { s->num_points, s->id };
+                memcpy(p, &record, sizeof(record));
+                memcpy(p + sizeof(record), s->points, (size_t)s->num_points * sizeof(v2l));
+                memcpy(p + sizeof(record) + (size_t)s->num_points * sizeof(v2l), s->pressures, (size_t)s->num_points * sizeof(f32));
+                p += page_record_size(s->num_points);
+            }
+            StrokePagerWrite write = {};
+            write.offset = pager->file_size;
+            write.size = size;
+            write.data = page;
+            push(&pager->writes, write);
+            SDL_CondSignal(pager->write_cond);
+
+            bucket->page_offset = pager->file_size;
+            bucket->page_size = size;
+            pager->file_size += size;
+        }
+    }
+
+    if ( ok ) {
+        for ( i64 i = 0; i < STROKELIST_BUCKET_COUNT; ++i ) {
+            bucket->data[i].points = NULL;
+            bucket->data[i].pressures = NULL;
+            bucket->data[i].payload_class = 0;
+        }
+        strokelist_release_payload(bucket);
+        bucket->is_paged_out = true;
+    }
+
+    SDL_UnlockMutex(pager->mutex);
+    return ok;
+}
+
+static b32
+stroke_pager_page_in(StrokePager* pager, StrokeBucket* bucket)
+{
+    u8* page = arena_alloc_bytes(&bucket->payload, (size_t)bucket->page_size);
+
+    SDL_LockMutex(pager->mutex);
+    b32 ok =    page != NULL
+             && read_page(pager, bucket->page_offset, bucket->page_size, page);
+    if ( ok ) {
+        page_assign_points(page, bucket->page_size, bucket->data, STROKELIST_BUCKET_COUNT);
+        bucket->is_paged_out = false;
+    } else {
+        milton_log("Could not read a stroke page.\n");
+    }
+    SDL_UnlockMutex(pager->mutex);
+
+    return ok;
+}
+
+b32
+stroke_pager_touch(StrokePager* pager, StrokeBucket* bucket)
+{
+    b32 ok = true;
+    if ( pager ) {
+        bucket->last_used = pager->tick;
+        if ( bucket->is_paged_out ) {
+            ok = stroke_pager_page_in(pager, bucket);
+        }
+    }
+    return ok;
+}
+
+void
+stroke_pager_free_stroke(StrokePager* pager, StrokeBucket* bucket, Stroke* stroke)
+{
+    if ( pager && stroke->payload_class > 0 ) {
+        StrokePagerFree f = { bucket, *stroke };
+        push(&pager->freed_strokes, f);
+    }
+}
+
+void
+stroke_pager_free_list(StrokePager* pager, StrokeList* list)
+{
+    if ( pager ) {
+        push(&pager->freed_lists, list);
+    }
+}
+
+static void
+stroke_pager_reclaim(StrokePager* pager)
+{
+    for ( i64 i = 0; i < pager->freed_strokes.count; ++i ) {
+        StrokePagerFree* f = &pager->freed_strokes.data[i];
+        strokelist_free_payload(f->bucket, &f->stroke);
+    }
+    reset(&pager->freed_strokes);
+
+    for ( i64 i = 0; i < pager->freed_lists.count; ++i ) {
+        StrokeList* list = pager->freed_lists.data[i];
+        for ( StrokeBucket* bucket = &list->root; bucket != NULL; bucket = bucket->next ) {
+            for ( i64 si = 0; si < STROKELIST_BUCKET_COUNT; ++si ) {
+                bucket->data[si].points = NULL;
+                bucket->data[si].pressures = NULL;
+                bucket->data[si].payload_class = 0;
+            }
+            strokelist_release_payload(bucket);
+            bucket->is_paged_out = false;
+            bucket->page_size = 0;
+        }
+        list->count = 0;
+    }
+    reset(&pager->freed_lists);
+}
+
+static b32
+payload_contains(Arena* payload, void* ptr)
+{
+    b32 contains = false;
+    u8* data = payload->ptr;
+    size_t size = payload->size;
+    while ( data && !contains ) {
+        contains = (u8*)ptr >= data && (u8*)ptr < data + size;
+        ArenaFooter footer = *(ArenaFooter*)(data + size);
+        data = footer.previous_block;
+        size = footer.previous_size;
+    }
+    return contains;
+}
+
+// Copies the points of the strokes into a new payload without the free blocks.
+static void
+stroke_pager_compact(StrokePager* pager, StrokeBucket* bucket)
+{
+    Arena old_payload = bucket->payload;
+    bucket->payload = {};
+    strokelist_release_payload(bucket);
+
+    SDL_LockMutex(pager->mutex);
+    for ( i64 i = 0; i < STROKELIST_BUCKET_COUNT; ++i ) {
+        Stroke* s = &bucket->data[i];
+        // Loaded strokes can point into the file, and strokes from the journal into the canvas arena.
+        if ( s->points != NULL && payload_contains(&old_payload, s->points) ) {
+            Stroke moved = *s;
+            if ( s->payload_class > 0 ) {
+                strokelist_alloc_payload(bucket, s->num_points, &moved);
+            } else {
+                size_t size = ((size_t)s->num_points * (sizeof(v2l) + sizeof(f32)) + 7) & ~(size_t)7;
+                u8* block = arena_alloc_bytes(&bucket->payload, size);
+                moved.points = (v2l*)block;
+                moved.pressures = (f32*)(block + (size_t)s->num_points * sizeof(v2l));
+            }
+            memcpy(moved.points, s->points, (size_t)s->num_points * sizeof(v2l));
+            memcpy(moved.pressures, s->pressures, (size_t)s->num_points * sizeof(f32));
+            s->points = moved.points;
+            s->pressures = moved.pressures;
+        }
+    }
+    SDL_UnlockMutex(pager->mutex);
+
+    arena_free(&old_payload);
+}
+
+static int
+compare_last_used(const void* a, const void* b)
+{
+    i64 la = ((StrokePagerEntry*)a)->bucket->last_used;
+    i64 lb = ((StrokePagerEntry*)b)->bucket->last_used;
+    return (la > lb) - (la < lb);
+}
+
+void
+stroke_pager_trim(StrokePager* pager)
+{
+    PROFILE_SCOPE("pager trim");
+    i64 tick = pager->tick++;
+    stroke_pager_reclaim(pager);
+    if ( (tick % STROKE_PAGER_TRIM_INTERVAL) != 0 ) {
+        return;
+    }
+
+#if MILTON_COMPACT_STROKE_MEMORY && !STROKE_DEBUG_VIZ  // Debug flags are not moved.
+    for ( i64 i = 0; i < pager->buckets.count; ++i ) {
+        StrokePagerEntry* e = &pager->buckets.data[i];
+        StrokeBucket* bucket = e->bucket;
+        b32 below_top = e->bucket_i < (e->list->count - 1) / STROKELIST_BUCKET_COUNT;
+        if (    below_top
+             && !bucket->is_paged_out
+             && !SDL_AtomicGet(&bucket->loading)
+             && bucket->free_bytes >= STROKE_PAGER_COMPACT_MIN_FREE
+             && bucket->free_bytes * 4 >= payload_size(&bucket->payload) ) {
+            stroke_pager_compact(pager, bucket);
+        }
+    }
+#endif
+
+    SDL_LockMutex(pager->mutex);
+    if ( pager->write_failed ) {
+        pager->budget = 0;
+    }
+    SDL_UnlockMutex(pager->mutex);
+    if ( pager->budget == 0 ) {
+        return;
+    }
+
+    size_t resident = 0;
+    for ( i64 i = 0; i < pager->buckets.count; ++i ) {
+        StrokeBucket* bucket = pager->buckets.data[i].bucket;
+        if ( !bucket->is_paged_out && !SDL_AtomicGet(&bucket->loading) ) {
+            resident += payload_size(&bucket->payload);
+        }
+    }
+    if ( resident <= pager->budget ) {
+        return;
+    }
+
+    DArray<StrokePagerEntry> candidates = {};
+    for ( i64 i = 0; i < pager->buckets.count; ++i ) {
+        StrokePagerEntry* e = &pager->buckets.data[i];
+        StrokeBucket* bucket = e->bucket;
+        b32 below_top = e->bucket_i < (e->list->count - 1) / STROKELIST_BUCKET_COUNT;
+        if (    below_top
+             && !bucket->is_paged_out
+             && !SDL_AtomicGet(&bucket->loading)
+             && bucket->last_used < tick
+             && bucket->payload.ptr != NULL ) {
+            push(&candidates, *e);
+        }
+    }
+    qsort(candidates.data, (size_t)candidates.count, sizeof(StrokePagerEntry), compare_last_used);
+
+    i64 num_paged = 0;
+    for ( i64 i = 0; i < candidates.count && resident > pager->budget; ++i ) {
+        StrokeBucket* bucket = candidates.data[i].bucket;
+        size_t size = payload_size(&bucket->payload);
+        if ( !stroke_pager_page_out(pager, bucket) ) {
+            break;
+        }
+        resident -= min(size, resident);
+        ++num_paged;
+    }
+    if ( num_paged > 0 ) {
+        milton_log("Paged out %" PRIi64 " stroke buckets. %d MB resident.\n", num_paged, (int)(resident / (1024*1024)));
+    }
+    release(&candidates);
+}
+
+u8*
+stroke_pager_read_page(StrokePager* pager, u64 page_offset, u64 page_size, Stroke* strokes, i64 num_strokes)
+{
+    u8* page = (u8*)mlt_calloc((size_t)page_size, 1, "Strokes");
+
+    SDL_LockMutex(pager->mutex);
+    b32 ok =    page != NULL
+             && read_page(pager, page_offset, page_size, page);
+    SDL_UnlockMutex(pager->mutex);
+
+    if ( ok ) {
+        page_assign_points(page, page_size, strokes, num_strokes);
+    } else {
+        milton_log("Could not read a stroke page.\n");
+        if ( page ) {
+            mlt_free(page, "Strokes");
+        }
+    }
+    return page;
+}
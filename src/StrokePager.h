@@ -0,0 +1,101 @@
+// Copyright (c) 2015 Sergio Gonzalez. All rights reserved.
+// License: https://github.com/serge-rgb/milton#license
+
+// StrokePager
+//
+// Keeps the memory taken by stroke points bounded, for canvases that don't fit
+// in RAM. When the payloads of all buckets (see StrokeList.h) take more than the
+// budget, the buckets that were used least recently are written to a backing
+// file and their payloads are freed. Bucket bounds and the Stroke structs stay
+// in memory, so clipping still works, but stroke points are NULL until
+// stroke_pager_touch reads them back.
+//
+// Only full buckets below the top one of their list are paged out. Strokes are
+// pushed and popped (undo, redo) at the top.
+//
+// Points of strokes that are gone for good, and layers that can't come back,
+// are given back to the buckets at the next trim, when no save points into
+// them. Trims also compact the payloads of full buckets that have too much free
+// space.
+//
+// Everything runs on the main thread, except stroke_pager_read_page, which the
+// saver thread uses for strokes that are paged out, and the writes to the
+// backing file. Paging out copies the points into a page and queues it for the
+// pager thread, so the frame doesn't wait for the disk. Pages are read from the
+// queue until they are written. If a write fails, the page stays in memory and
+// paging stops.
+
+
+#pragma once
+
+#include "DArray.h"
+#include "StrokeList.h"
+
+struct StrokePagerEntry
+{
+    StrokeBucket*   bucket;
+    StrokeList*     list;
+    i64             bucket_i;   // Position of the bucket in the list.
+};
+
+struct StrokePagerWrite
+{
+    u64     offset;
+    u64     size;
+    u8*     data;
+    b32     failed;     // Kept in memory for good.
+};
+
+struct StrokePagerFree
+{
+    StrokeBucket*   bucket;
+    Stroke          stroke;
+};
+
+struct StrokePager
+{
+    size_t                      budget;     // Bytes of payload to keep in memory. Zero disables paging.
+    i64                         tick;       // Incremented by stroke_pager_trim, once per frame.
+
+    // Held while stroke points of a bucket change, and for `writes`.
+    SDL_mutex*                  mutex;
+    FILE*                       fd;         // Backing file. Created on the first page out.
+    u64                         file_size;  // Including the pages that are queued.
+
+    // Pages that are not in the file yet. The pager thread writes them in order.
+    DArray<StrokePagerWrite>    writes;
+    SDL_Thread*                 thread;     // Started on the first page out.
+    SDL_cond*                   write_cond; // Signaled when a page is queued, and to stop the thread.
+    SDL_mutex*                  file_mutex; // Held for every seek and read or write of `fd`.
+    b32                         quit;
+    b32                         write_failed;
+
+    DArray<StrokePagerEntry>    buckets;    // Of every list, including deleted layers.
+
+    DArray<StrokePagerFree>     freed_strokes;  // Given back at the next trim.
+    DArray<StrokeList*>         freed_lists;
+};
+
+void stroke_pager_init(StrokePager* pager, size_t budget);
+// Frees the payloads of every bucket and deletes the backing file.
+void stroke_pager_release(StrokePager* pager);
+
+void stroke_pager_add_bucket(StrokePager* pager, StrokeList* list, StrokeBucket* bucket, i64 bucket_i);
+
+// Reads the stroke points of the bucket back if it is paged out, and marks it as used.
+// Call before anything reads the points. `pager` can be NULL.
+b32  stroke_pager_touch(StrokePager* pager, StrokeBucket* bucket);
+
+// Frees the points of a stroke that was taken out of `bucket` and won't be pushed again.
+void stroke_pager_free_stroke(StrokePager* pager, StrokeBucket* bucket, Stroke* stroke);
+// Frees the points of every stroke of a list that won't be used again. (A layer that can't come back.)
+void stroke_pager_free_list(StrokePager* pager, StrokeList* list);
+
+// Gives freed points back, compacts payloads, and pages out the buckets that were used least
+// recently until the payloads fit in the budget.
+// Nothing other than the strokes themselves may point into payloads. (No save in flight.)
+void stroke_pager_trim(StrokePager* pager);
+
+// Reads the page of a paged out bucket and points the strokes with NULL points at it. `strokes` are
+// copies of the strokes of the bucket, in order. Returns the memory to release with mlt_free, or NULL.
+u8*  stroke_pager_read_page(StrokePager* pager, u64 page_offset, u64 page_size, Stroke* strokes, i64 num_strokes);
@@ -0,0 +1,164 @@
+// Copyright (c) 2015 Sergio Gonzalez. All rights reserved.
+// License: https://github.com/serge-rgb/milton#license
+
+#include "WorkerPool.h"
+
+#include "memory.h"
+#include "platform.h"
+#include "profiler.h"
+
+struct WorkerBatch
+{
+    WorkerPoolFunc* func;
+    void*           data;
+    i64             count;
+    i32             max_threads;
+
+    SDL_atomic_t    next_task;
+    SDL_atomic_t    num_done;
+
+    // Under the pool mutex.
+    i32             num_threads;    // Workers that took tasks from it, and have not let go of it yet.
+    WorkerBatch*    next;
+};
+
+static struct
+{
+    SDL_SpinLock    init_lock;
+    b32             is_initialized;
+
+    SDL_mutex*      mutex;
+    SDL_cond*       work_cond;      // Signaled when a batch is added.
+    SDL_cond*       done_cond;      // Signaled when a worker lets go of a batch.
+    WorkerBatch*    batches;        // Batches that are running.
+
+    i32             num_workers;
+} g_worker_pool;
+
+static void
+worker_run_tasks(WorkerBatch* batch)
+{
+    for ( ;; ) {
+        i64 task_i = SDL_AtomicAdd(&batch->next_task, 1);
+        if ( task_i >= batch->count ) {
+            break;
+        }
+        batch->func(batch->data, task_i);
+        SDL_AtomicAdd(&batch->num_done, 1);
+    }
+}
+
+// A batch with tasks that nobody took yet, which can take one more thread. Call with the mutex held.
+static WorkerBatch*
+worker_find_batch()
+{
+    for ( WorkerBatch* batch = g_worker_pool.batches; batch != NULL; batch = batch->next ) {
+        b32 has_tasks = SDL_AtomicGet(&batch->next_task) < batch->count;
+        // The calling thread counts as one.
+        b32 has_room = batch->max_threads == 0 || batch->num_threads + 1 < batch->max_threads;
+        if ( has_tasks && has_room ) {
+            return batch;
+        }
+    }
+    return NULL;
+}
+
+static int
+worker_thread(void*)
+{
+    PROFILE_THREAD_NAME("Worker");
+    SDL_LockMutex(g_worker_pool.mutex);
+    for ( ;; ) {
+        WorkerBatch* batch = worker_find_batch();
+        if ( !batch ) {
+            SDL_CondWait(g_worker_pool.work_cond, g_worker_pool.mutex);
+            continue;
+        }
+        batch->num_threads += 1;
+        SDL_UnlockMutex(g_worker_pool.mutex);
+
+        worker_run_tasks(batch);
+
+        SDL_LockMutex(g_worker_pool.mutex);
+        batch->num_threads -= 1;
+        SDL_CondBroadcast(g_worker_pool.done_cond);
+    }
+    // Pool threads are never done. Their scratch arenas go away with the process.
+    return 0;
+}
+
+static void
+worker_pool_init()
+{
+    SDL_AtomicLock(&g_worker_pool.init_lock);
+    if ( !g_worker_pool.is_initialized ) {
+        g_worker_pool.mutex = SDL_CreateMutex();
+        g_worker_pool.work_cond = SDL_CreateCond();
+        g_worker_pool.done_cond = SDL_CreateCond();
+
+#if MILTON_MULTITHREADED
+        i32 num_workers = min(max(SDL_GetCPUCount() - 1, 0), WORKER_POOL_MAX_THREADS);
+#else
+        i32 num_workers = 0;
+#endif
+        for ( i32 i = 0; i < num_workers; ++i ) {
+            SDL_Thread* thread = SDL_CreateThread(worker_thread, "Worker", NULL);
+            if ( !thread ) {
+                milton_log("Could not create worker thread %d\n", i);
+                break;
+            }
+            SDL_DetachThread(thread);
+            g_worker_pool.num_workers += 1;
+        }
+        g_worker_pool.is_initialized = true;
+    }
+    SDL_AtomicUnlock(&g_worker_pool.init_lock);
+}
+
+i32
+worker_pool_num_threads()
+{
+    worker_pool_init();
+    return g_worker_pool.num_workers + 1;
+}
+
+void
+worker_pool_run(WorkerPoolFunc* func, void* data, i64 count, i32 max_threads)
+{
+    if ( count <= 0 ) {
+        return;
+    }
+    worker_pool_init();
+
+    WorkerBatch batch = {};
+    batch.func = func;
+    batch.data = data;
+    batch.count = count;
+    batch.max_threads = max_threads;
+
+    b32 wants_workers = count > 1 && max_threads != 1 && g_worker_pool.num_workers > 0;
+    if ( wants_workers ) {
+        SDL_LockMutex(g_worker_pool.mutex);
+        batch.next = g_worker_pool.batches;
+        g_worker_pool.batches = &batch;
+        SDL_CondBroadcast(g_worker_pool.work_cond);
+        SDL_UnlockMutex(g_worker_pool.mutex);
+    }
+
+    worker_run_tasks(&batch);
+
+    if ( wants_workers ) {
+        // Wait for the tasks that workers took, and for the workers to let go of the batch.
+        SDL_LockMutex(g_worker_pool.mutex);
+        while ( SDL_AtomicGet(&batch.num_done) < count || batch.num_threads > 0 ) {
+            SDL_CondWait(g_worker_pool.done_cond, g_worker_pool.mutex);
+        }
+        WorkerBatch** link = &g_worker_pool.batches;
+        while ( *link != &batch ) {
+            link = &(*link)->next;
+        }
+        *link = batch.next;
+        SDL_UnlockMutex(g_worker_pool.mutex);
+    }
+    mlt_assert(SDL_AtomicGet(&batch.num_done) == count);
+}
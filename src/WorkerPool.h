@@ -0,0 +1,30 @@
+// Copyright (c) 2015 Sergio Gonzalez. All rights reserved.
+// License: https://github.com/serge-rgb/milton#license
+
+// WorkerPool
+//
+// Threads that live as long as the program, for work that splits into many
+// independent tasks: raster tiles, stroke buckets to decode or encode. Creating
+// threads for every pass costs more than small passes take, and each new thread
+// has to set up its scratch arenas (see arena_scratch_begin) again. Pool threads
+// keep theirs.
+//
+// worker_pool_run calls func(data, i) for every i in [0, count) and returns when
+// they are all done. The calling thread runs tasks too, so a batch finishes even
+// when every worker is busy with other batches. Any thread can call it, at the
+// same time as others, including from inside a task.
+
+#pragma once
+
+#include "common.h"
+
+#define WORKER_POOL_MAX_THREADS 64
+
+typedef void WorkerPoolFunc(void* data, i64 task_i);
+
+// Threads that can run the tasks of a batch, counting the one that calls worker_pool_run.
+i32  worker_pool_num_threads();
+
+// `max_threads` limits the threads that take tasks from this batch, counting the calling one. Zero
+// is no limit. Starts the workers the first time it is called.
+void worker_pool_run(WorkerPoolFunc* func, void* data, i64 count, i32 max_threads = 0);
@@ -122,6 +122,64 @@ layer_push_stroke(Layer* layer, Stroke stroke)
     return peek(&layer->strokes);
 }
 
+Rect
+layer_bounds(Layer* layer)
+{
+    Rect bounds = rect_without_size();
+    i64 count = layer->strokes.count;
+    for ( StrokeBucket* bucket = &layer->strokes.root;
+          bucket != NULL && count > 0;
+          bucket = bucket->next ) {
+        // Buckets that are loading are drawn when they arrive.
+        if ( !SDL_AtomicGet(&bucket->loading) ) {
+            bounds = rect_union(bounds, bucket->bounding_rect);
+        }
+        count -= STROKELIST_BUCKET_COUNT;
+    }
+    return bounds;
+}
+
+void
+layer_get_properties(Layer* layer, LayerProperties* out_properties)
+{
+    memcpy(out_properties->name, layer->name, MAX_LAYER_NAME_LEN);
+    out_properties->flags = layer->flags;
+    out_properties->alpha = layer->alpha;
+    reset(&out_properties->effects);
+    for ( LayerEffect* e = layer->effects; e != NULL; e = e->next ) {
+        LayerEffectState state = { e, *e };
+        push(&out_properties->effects, state);
+    }
+}
+
+void
+layer_swap_properties(Layer* layer, LayerProperties* properties)
+{
+    LayerProperties current = {};
+    layer_get_properties(layer, &current);
+
+    memcpy(layer->name, properties->name, MAX_LAYER_NAME_LEN);
+    layer->flags = properties->flags;
+    layer->alpha = properties->alpha;
+    layer->effects = NULL;
+    for ( i64 i = properties->effects.count - 1; i >= 0; --i ) {
+        LayerEffectState* state = &properties->effects.data[i];
+        *state->effect = state->value;
+        state->effect->next = layer->effects;
+        layer->effects = state->effect;
+    }
+
+    layer_release_properties(properties);
+    *properties = current;
+}
+
+void
+layer_release_properties(LayerProperties* properties)
+{
+    release(&properties->effects);
+    properties->effects = {};
+}
+
 b32
 layer_has_blur_effect(Layer* layer)
 {
@@ -5,6 +5,7 @@
 #pragma once
 
 #include "vector.h"
+#include "DArray.h"
 #include "StrokeList.h"
 
 #define MAX_LAYER_NAME_LEN          64
@@ -49,6 +50,22 @@ struct Layer
     Layer* next;
 };
 
+struct LayerEffectState
+{
+    LayerEffect* effect;
+    LayerEffect  value;
+};
+
+// Everything about a layer that the GUI changes, other than its place in the list.
+struct LayerProperties
+{
+    char                        name[MAX_LAYER_NAME_LEN];
+    i32                         flags;
+    f32                         alpha;
+    // The effect list, in order. Effects are never freed, so the same nodes are linked back.
+    DArray<LayerEffectState>    effects;
+};
+
 enum LayerEffectType
 {
     LayerEffectType_BLUR,
@@ -105,6 +122,11 @@ namespace layer {
     void    layer_toggle_visibility (Layer* layer);
     b32     layer_has_blur_effect (Layer* layer);
     Stroke* layer_push_stroke (Layer* layer, Stroke stroke);
+    Rect    layer_bounds (Layer* layer);  // Canvas rect that contains every stroke.
+    // Exchanges the properties of the layer with `properties`.
+    void    layer_swap_properties (Layer* layer, LayerProperties* properties);
+    void    layer_get_properties (Layer* layer, LayerProperties* out_properties);
+    void    layer_release_properties (LayerProperties* properties);
     i32     number_of_layers (Layer* root);
     void    free_layers (Layer* root);
     i64     count_strokes (Layer* root);
@@ -3,7 +3,9 @@
 
 
 // Per-stroke uniforms
-uniform vec4 u_brush_color;
+uniform vec4  u_brush_color;
+uniform ivec2 u_stroke_origin;  // Stroke vertices are relative to this point.
+uniform int   u_stroke_z;
 
 // CanvasView elements:
 uniform ivec2 u_pan_center;
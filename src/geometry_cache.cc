@@ -0,0 +1,285 @@
+// Copyright (c) 2015 Sergio Gonzalez. All rights reserved.
+// License: https://github.com/serge-rgb/milton#license
+
+#include "geometry_cache.h"
+
+#include "milton.h"
+
+#define GEOMETRY_CACHE_MAGIC    0x4F45474D  // "MGEO"
+#define GEOMETRY_CACHE_VERSION  2
+
+static size_t
+geometry_blob_size(i64 num_points)
+{
+    size_t size = (size_t)num_points * sizeof(v3f);
+    return (size + 7) & ~(size_t)7;
+}
+
+static u32
+hash_words(u32 hash, const void* data, size_t num_words)
+{
+    // FNV-1a, a word at a time.
+    const u32* words = (const u32*)data;
+    for ( size_t i = 0; i < num_words; ++i ) {
+        hash = (hash ^ words[i]) * 16777619u;
+    }
+    return hash;
+}
+
+i64
+stroke_geometry_num_segments(Stroke* stroke)
+{
+    return max((i64)stroke->num_points - 1, (i64)1);
+}
+
+// The four vertices and six indices of the i-th segment. Points are relative to the origin, with the
+// pressure in z.
+static void
+geometry_fill_segment(StrokeGeometry* g, i64 i, v3f a, v3f b, f32 brush_radius)
+{
+    // Pressures are in (0,1] and scale the brush radius.
+    f32 radius_a = a.z*brush_radius;
+    f32 radius_b = b.z*brush_radius;
+
+    f32 min_x = floorf(min(a.x - radius_a, b.x - radius_b));
+    f32 min_y = floorf(min(a.y - radius_a, b.y - radius_b));
+    f32 max_x = ceilf(max(a.x + radius_a, b.x + radius_b));
+    f32 max_y = ceilf(max(a.y + radius_a, b.y + radius_b));
+
+    i64 v = 4*i;
+    g->bounds[v + 0] = { min_x, min_y };
+    g->bounds[v + 1] = { min_x, max_y };
+    g->bounds[v + 2] = { max_x, max_y };
+    g->bounds[v + 3] = { max_x, min_y };
+
+    u16* indices = g->indices + 6*i;
+    indices[0] = (u16)(v + 0);
+    indices[1] = (u16)(v + 1);
+    indices[2] = (u16)(v + 2);
+    indices[3] = (u16)(v + 2);
+    indices[4] = (u16)(v + 0);
+    indices[5] = (u16)(v + 3);
+
+    for ( int repeat = 0; repeat < 4; ++repeat ) {
+        g->apoints[v + repeat] = a;
+        g->bpoints[v + repeat] = b;
+    }
+}
+
+// Relative to the first point, with the pressure in z.
+static v3f
+stroke_geometry_point(Stroke* stroke, i64 i)
+{
+    v2l p = stroke->points[i] - stroke->points[0];
+    return { (f32)p.x, (f32)p.y, stroke->pressures[i] };
+}
+
+void
+stroke_geometry_fill(Stroke* stroke, StrokeGeometry* g)
+{
+    i64 num_segments = stroke_geometry_num_segments(stroke);
+    g->origin = stroke->points[0];
+    g->num_vertices = 4*num_segments;
+    g->num_indices = 6*num_segments;
+
+    for ( i64 i = 0; i < num_segments; ++i ) {
+        i64 j = min(i + 1, (i64)stroke->num_points - 1);
+        geometry_fill_segment(g, i, stroke_geometry_point(stroke, i), stroke_geometry_point(stroke, j), stroke->brush.radius);
+    }
+}
+
+u32
+stroke_geometry_hash(Stroke* stroke)
+{
+    u32 hash = 2166136261u;
+    hash = hash_words(hash, &stroke->num_points, 1);
+    hash = hash_words(hash, &stroke->brush.radius, 1);
+    hash = hash_words(hash, stroke->points, (size_t)stroke->num_points * sizeof(v2l) / sizeof(u32));
+    hash = hash_words(hash, stroke->pressures, (size_t)stroke->num_points);
+    return hash;
+}
+
+void
+geometry_cache_open(GeometryCache* cache, PATH_CHAR* mlt_path)
+{
+    geometry_cache_close(cache);
+    if ( !platform_can_map_files() ) {
+        return;
+    }
+
+    PATH_CHAR path[MAX_PATH] = {};
+    PATH_SNPRINTF(path, MAX_PATH, TO_PATH_STR("%s.geometry"), mlt_path);
+
+    size_t size = 0;
+    u8* data = (u8*)platform_map_file(path, &size);
+    if ( data ) {
+        GeometryCacheHeader* header = (GeometryCacheHeader*)data;
+        b32 ok =    size >= sizeof(GeometryCacheHeader)
+                 && header->magic == GEOMETRY_CACHE_MAGIC
+                 && header->version == GEOMETRY_CACHE_VERSION
+                 && (header->entries_offset % 8) == 0
+                 && header->entries_offset <= size
+                 && header->num_entries <= (size - header->entries_offset) / sizeof(GeometryCacheEntry);
+        if ( ok ) {
+            cache->mapping = data;
+            cache->mapping_size = size;
+            cache->entries = (GeometryCacheEntry*)(data + header->entries_offset);
+            cache->num_entries = (i64)header->num_entries;
+            milton_log("Geometry cache has %" PRIi64 " strokes.\n", cache->num_entries);
+        } else {
+            milton_log("Ignoring invalid geometry cache.\n");
+            platform_unmap_file(data, size);
+        }
+    }
+}
+
+void
+geometry_cache_close(GeometryCache* cache)
+{
+    if ( cache->mapping ) {
+        platform_unmap_file(cache->mapping, cache->mapping_size);
+    }
+    cache->mapping = NULL;
+    cache->mapping_size = 0;
+    cache->entries = NULL;
+    cache->num_entries = 0;
+}
+
+void
+geometry_cache_install(GeometryCache* cache, PATH_CHAR* mlt_path)
+{
+    geometry_cache_open(cache, mlt_path);
+    // Strokes cooked since the request were cooked against the old file.
+    cache->num_misses = 0;
+}
+
+b32
+geometry_cache_find(GeometryCache* cache, Stroke* stroke, StrokeGeometry* out)
+{
+    b32 found = false;
+#if !STROKE_DEBUG_VIZ  // Debug colors are not cached.
+    if ( cache && cache->num_entries > 0 && stroke->num_points > 0 ) {
+        i64 lo = 0;
+        i64 hi = cache->num_entries;
+        while ( lo < hi ) {
+            i64 mid = lo + (hi - lo) / 2;
+            if ( cache->entries[mid].id < stroke->id ) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        GeometryCacheEntry* e = lo < cache->num_entries ? &cache->entries[lo] : NULL;
+        if ( e && e->id == stroke->id && e->num_points == stroke->num_points ) {
+            u8* entries = (u8*)cache->entries;
+            b32 in_bounds =    e->offset < (u64)(entries - (u8*)cache->mapping)
+                            && geometry_blob_size(e->num_points) <= (u64)(entries - (u8*)cache->mapping) - e->offset;
+            if ( in_bounds && e->hash == stroke_geometry_hash(stroke) ) {
+                v3f* points = (v3f*)((u8*)cache->mapping + e->offset);
+                i64 num_segments = stroke_geometry_num_segments(stroke);
+                out->origin = e->origin;
+                out->num_vertices = 4*num_segments;
+                out->num_indices = 6*num_segments;
+                for ( i64 i = 0; i < num_segments; ++i ) {
+                    i64 j = min(i + 1, (i64)e->num_points - 1);
+                    geometry_fill_segment(out, i, points[i], points[j], stroke->brush.radius);
+                }
+                found = true;
+            }
+        }
+    }
+#endif
+    if ( cache && !found ) {
+        ++cache->num_misses;
+    }
+    return found;
+}
+
+b32
+geometry_cache_wants_rebuild(GeometryCache* cache, i64 num_strokes)
+{
+    b32 stale = cache->mapping == NULL || cache->num_misses >= GEOMETRY_CACHE_MAX_MISSES;
+    return    MILTON_GEOMETRY_CACHE
+           && platform_can_map_files()  // Otherwise it would never be read.
+           && !cache->rebuild_requested
+           && num_strokes >= GEOMETRY_CACHE_MIN_STROKES
+           && cache->num_misses > 0
+           && stale;
+}
+
+b32
+geometry_cache_writer_begin(GeometryCacheWriter* w, PATH_CHAR* mlt_path)
+{
+    *w = {};
+    PATH_SNPRINTF(w->final_path, MAX_PATH, TO_PATH_STR("%s.geometry"), mlt_path);
+    PATH_SNPRINTF(w->path, MAX_PATH, TO_PATH_STR("%s.geometry.tmp"), mlt_path);
+
+    w->fd = platform_fopen(w->path, TO_PATH_STR("wb"));
+    w->ok = w->fd != NULL;
+    if ( w->ok ) {
+        // Written again by geometry_cache_writer_end
+        GeometryCacheHeader header = {};
+        w->ok = fwrite(&header, sizeof(header), 1, w->fd) == 1;
+        w->size = sizeof(header);
+    }
+    return w->ok;
+}
+
+void
+geometry_cache_writer_add(GeometryCacheWriter* w, Stroke* strokes, i64 count)
+{
+    for ( i64 i = 0; w->ok && i < count; ++i ) {
+        Stroke* stroke = &strokes[i];
+        if ( stroke->num_points <= 0 || stroke->num_points > STROKE_MAX_POINTS ) {
+            continue;
+        }
+        size_t blob_size = geometry_blob_size(stroke->num_points);
+
+        ArenaMark scratch = arena_scratch_begin();
+        u8* blob = arena_alloc_array(scratch.arena, blob_size, u8);
+        memset(blob, 0, blob_size);
+        v3f* points = (v3f*)blob;
+        for ( i64 pi = 0; pi < stroke->num_points; ++pi ) {
+            points[pi] = stroke_geometry_point(stroke, pi);
+        }
+
+        GeometryCacheEntry entry = {};
+        entry.id = w->next_id++;
+        entry.hash = stroke_geometry_hash(stroke);
+        entry.num_points = stroke->num_points;
+        entry.origin = stroke->points[0];
+        entry.offset = w->size;
+        push(&w->entries, entry);
+
+        w->ok = fwrite(blob, 1, blob_size, w->fd) == blob_size;
+        w->size += blob_size;
+        arena_scratch_end(scratch);
+    }
+}
+
+b32
+geometry_cache_writer_end(GeometryCacheWriter* w)
+{
+    if ( w->ok ) {
+        GeometryCacheHeader header = {};
+        header.magic = GEOMETRY_CACHE_MAGIC;
+        header.version = GEOMETRY_CACHE_VERSION;
+        header.num_entries = (u64)w->entries.count;
+        header.entries_offset = w->size;
+        w->ok =    fwrite(w->entries.data, sizeof(GeometryCacheEntry), (size_t)w->entries.count, w->fd) == (size_t)w->entries.count
+                && fseek(w->fd, 0, SEEK_SET) == 0
+                && fwrite(&header, sizeof(header), 1, w->fd) == 1;
+    }
+    if ( w->fd ) {
+        w->ok = (fclose(w->fd) == 0) && w->ok;
+        w->fd = NULL;
+    }
+    if ( w->ok ) {
+        w->ok = platform_move_file(w->path, w->final_path);
+    }
+    if ( !w->ok ) {
+        milton_log("Could not write the geometry cache.\n");
+    }
+    release(&w->entries);
+    return w->ok;
+}
@@ -0,0 +1,107 @@
+// Copyright (c) 2015 Sergio Gonzalez. All rights reserved.
+// License: https://github.com/serge-rgb/milton#license
+
+// Geometry cache
+//
+// What the vertex data of every stroke of a canvas is made from, kept in
+// <mlt file>.geometry between sessions. For each stroke, its points relative to
+// its origin, as floats, and their pressures: 12 bytes per segment instead of the
+// 140 bytes of vertex data. The file is mapped, and cooking a stroke that is in
+// it expands the mapped points into vertex data.
+// Only where files can be mapped. See platform_can_map_files
+//
+// Entries are keyed by the id the stroke gets when the canvas is loaded and by
+// a hash of its points, so strokes that don't match are cooked as usual. When
+// the file is missing or too many strokes miss, the saver thread writes a new
+// one. See milton_update_geometry_cache
+
+#pragma once
+
+#include "DArray.h"
+#include "platform.h"
+#include "stroke.h"
+
+// Canvases with fewer strokes cook fast enough without a cache.
+#define GEOMETRY_CACHE_MIN_STROKES 10000
+// Rebuild once this many strokes were cooked from scratch.
+#define GEOMETRY_CACHE_MAX_MISSES 4096
+
+// Vertex data of a stroke, as it is sent to the GPU. Positions are relative to
+// `origin`, so the data doesn't change with the render center.
+struct StrokeGeometry
+{
+    v2l     origin;
+    i64     num_vertices;   // Four per segment.
+    i64     num_indices;    // Six per segment.
+    v2f*    bounds;
+    v3f*    apoints;        // Segment start and pressure.
+    v3f*    bpoints;        // Segment end and pressure.
+    u16*    indices;
+};
+
+// A stroke with a single point is drawn as a zero-length segment.
+i64  stroke_geometry_num_segments(Stroke* stroke);
+// Fills the arrays of `g`, which have room for the segments of the stroke.
+void stroke_geometry_fill(Stroke* stroke, StrokeGeometry* g);
+// Hash of everything the geometry depends on.
+u32  stroke_geometry_hash(Stroke* stroke);
+
+#pragma pack(push, 1)
+struct GeometryCacheHeader
+{
+    u32 magic;
+    u32 version;
+    u64 num_entries;
+    u64 entries_offset;
+};
+
+struct GeometryCacheEntry
+{
+    i32 id;
+    u32 hash;
+    i32 num_points;
+    i32 padding;
+    v2l origin;
+    u64 offset;     // v3f points[num_points]. Relative to origin, and the pressure in z.
+};
+#pragma pack(pop)
+
+struct GeometryCache
+{
+    void*               mapping;        // NULL when there is no valid cache file.
+    size_t              mapping_size;
+    GeometryCacheEntry* entries;        // Sorted by id.
+    i64                 num_entries;
+
+    i64                 num_misses;
+    b32                 rebuild_requested;  // At most once per canvas.
+    SDL_atomic_t        rebuild_pending;    // The next save writes a new file.
+    SDL_atomic_t        rebuilt;            // Set by the saver thread when the new file is in place.
+};
+
+void geometry_cache_open(GeometryCache* cache, PATH_CHAR* mlt_path);
+void geometry_cache_close(GeometryCache* cache);
+// Maps the file the saver thread wrote in place of the current one. Main thread only.
+void geometry_cache_install(GeometryCache* cache, PATH_CHAR* mlt_path);
+
+// Fills the arrays of `out` like stroke_geometry_fill if the stroke is cached. Counts a miss
+// otherwise. `cache` can be NULL.
+b32  geometry_cache_find(GeometryCache* cache, Stroke* stroke, StrokeGeometry* out);
+b32  geometry_cache_wants_rebuild(GeometryCache* cache, i64 num_strokes);
+
+// Writes a new cache file next to the MLT file. It replaces the old one when it is complete.
+struct GeometryCacheWriter
+{
+    FILE*                       fd;
+    PATH_CHAR                   path[MAX_PATH];     // The temporary file.
+    PATH_CHAR                   final_path[MAX_PATH];
+    u64                         size;
+    i32                         next_id;
+    DArray<GeometryCacheEntry>  entries;
+    b32                         ok;
+};
+
+b32  geometry_cache_writer_begin(GeometryCacheWriter* w, PATH_CHAR* mlt_path);
+// Adds the strokes of a layer, bottom layer first. Skips the same strokes as the MLT writer.
+void geometry_cache_writer_add(GeometryCacheWriter* w, Stroke* strokes, i64 count);
+b32  geometry_cache_writer_end(GeometryCacheWriter* w);
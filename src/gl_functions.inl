@@ -72,6 +72,7 @@
     X(void,     glDetachShader,           GLuint program, GLuint shader)                          \
     X(void,     glDeleteProgram,          GLuint program)                                         \
     X(void,     glDeleteTextures,         GLsizei n, const GLuint *textures)\
+    X(void,     glFinish,                 void)                                                   \
     X(void,     glDeleteShader,           GLuint shader)                                          \
 
     // X(void,     glBindAttribLocation,     GLuint program, GLuint index, GLchar* name)       \
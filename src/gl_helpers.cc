@@ -16,8 +16,48 @@
 #endif  //_WIN32
 
 
-// Global variable that keeps track of Milton's GL configuration. See GLHelperFlags.
-static int g_gl_helper_flags;
+// The state below belongs to the GL context that is current on the thread. Headless exports
+// run one context per thread (see milton_main_export), so it can't be shared.
+
+// Keeps track of Milton's GL configuration. See GLHelperFlags.
+static thread_local int g_gl_helper_flags;
+
+// Calls to set_uniform_* that found their uniform. See num_uniform_updates.
+static thread_local u64 g_num_uniform_updates;
+
+// Functions that not every driver has. SDL gives us NULL for the missing ones.
+typedef void (APIENTRY *GenQueriesProc)(GLsizei n, GLuint* ids);
+typedef void (APIENTRY *DeleteQueriesProc)(GLsizei n, const GLuint* ids);
+typedef void (APIENTRY *BeginQueryProc)(GLenum target, GLuint id);
+typedef void (APIENTRY *EndQueryProc)(GLenum target);
+typedef void (APIENTRY *GetQueryObjectivProc)(GLuint id, GLenum pname, GLint* params);
+typedef void (APIENTRY *GetQueryObjectui64vProc)(GLuint id, GLenum pname, GLuint64* params);
+typedef void (APIENTRY *PushDebugGroupProc)(GLenum source, GLuint id, GLsizei length, const GLchar* message);
+typedef void (APIENTRY *PopDebugGroupProc)(void);
+typedef GLsync (APIENTRY *FenceSyncProc)(GLenum condition, GLbitfield flags);
+typedef GLenum (APIENTRY *ClientWaitSyncProc)(GLsync sync, GLbitfield flags, GLuint64 timeout);
+typedef void (APIENTRY *DeleteSyncProc)(GLsync sync);
+typedef void* (APIENTRY *MapBufferProc)(GLenum target, GLenum access);
+typedef GLboolean (APIENTRY *UnmapBufferProc)(GLenum target);
+
+static thread_local struct
+{
+    GenQueriesProc          gen_queries;
+    DeleteQueriesProc       delete_queries;
+    BeginQueryProc          begin_query;
+    EndQueryProc            end_query;
+    GetQueryObjectivProc    get_query_objectiv;
+    GetQueryObjectui64vProc get_query_objectui64v;
+
+    PushDebugGroupProc      push_debug_group;
+    PopDebugGroupProc       pop_debug_group;
+
+    FenceSyncProc           fence_sync;
+    ClientWaitSyncProc      client_wait_sync;
+    DeleteSyncProc          delete_sync;
+    MapBufferProc           map_buffer;
+    UnmapBufferProc         unmap_buffer;
+} g_gl_optional;
 
 namespace gl {
 
@@ -89,6 +129,12 @@ check_flags (int flags)
     return result;
 }
 
+u64
+num_uniform_updates ()
+{
+    return g_num_uniform_updates;
+}
+
 bool
 load ()
 {
@@ -193,6 +239,47 @@ load ()
     }
 #endif
 
+    // Optional functionality. Milton works without it.
+    if ( SDL_GL_ExtensionSupported("GL_ARB_timer_query") || SDL_GL_ExtensionSupported("GL_EXT_timer_query") ) {
+        g_gl_optional.gen_queries = (GenQueriesProc)SDL_GL_GetProcAddress("glGenQueries");
+        g_gl_optional.delete_queries = (DeleteQueriesProc)SDL_GL_GetProcAddress("glDeleteQueries");
+        g_gl_optional.begin_query = (BeginQueryProc)SDL_GL_GetProcAddress("glBeginQuery");
+        g_gl_optional.end_query = (EndQueryProc)SDL_GL_GetProcAddress("glEndQuery");
+        g_gl_optional.get_query_objectiv = (GetQueryObjectivProc)SDL_GL_GetProcAddress("glGetQueryObjectiv");
+        g_gl_optional.get_query_objectui64v = (GetQueryObjectui64vProc)SDL_GL_GetProcAddress("glGetQueryObjectui64v");
+        if ( !g_gl_optional.get_query_objectui64v ) {
+            g_gl_optional.get_query_objectui64v = (GetQueryObjectui64vProc)SDL_GL_GetProcAddress("glGetQueryObjectui64vEXT");
+        }
+        if ( g_gl_optional.gen_queries && g_gl_optional.delete_queries
+             && g_gl_optional.begin_query && g_gl_optional.end_query
+             && g_gl_optional.get_query_objectiv && g_gl_optional.get_query_objectui64v ) {
+            set_flags(GLHelperFlags_TIMER_QUERY);
+        }
+    }
+    if ( SDL_GL_ExtensionSupported("GL_KHR_debug") ) {
+        g_gl_optional.push_debug_group = (PushDebugGroupProc)SDL_GL_GetProcAddress("glPushDebugGroup");
+        g_gl_optional.pop_debug_group = (PopDebugGroupProc)SDL_GL_GetProcAddress("glPopDebugGroup");
+        if ( g_gl_optional.push_debug_group && g_gl_optional.pop_debug_group ) {
+            set_flags(GLHelperFlags_DEBUG_GROUPS);
+        }
+    }
+    if ( SDL_GL_ExtensionSupported("GL_ARB_sync")
+         && (SDL_GL_ExtensionSupported("GL_ARB_pixel_buffer_object") || SDL_GL_ExtensionSupported("GL_EXT_pixel_buffer_object")) ) {
+        g_gl_optional.fence_sync = (FenceSyncProc)SDL_GL_GetProcAddress("glFenceSync");
+        g_gl_optional.client_wait_sync = (ClientWaitSyncProc)SDL_GL_GetProcAddress("glClientWaitSync");
+        g_gl_optional.delete_sync = (DeleteSyncProc)SDL_GL_GetProcAddress("glDeleteSync");
+        g_gl_optional.map_buffer = (MapBufferProc)SDL_GL_GetProcAddress("glMapBuffer");
+        g_gl_optional.unmap_buffer = (UnmapBufferProc)SDL_GL_GetProcAddress("glUnmapBuffer");
+        if ( g_gl_optional.fence_sync && g_gl_optional.client_wait_sync && g_gl_optional.delete_sync
+             && g_gl_optional.map_buffer && g_gl_optional.unmap_buffer ) {
+            set_flags(GLHelperFlags_ASYNC_READBACK);
+        }
+    }
+    milton_log("GPU timer queries: %s. Debug groups: %s. Async readback: %s.\n",
+               check_flags(GLHelperFlags_TIMER_QUERY) ? "yes" : "no",
+               check_flags(GLHelperFlags_DEBUG_GROUPS) ? "yes" : "no",
+               check_flags(GLHelperFlags_ASYNC_READBACK) ? "yes" : "no");
+
 #if defined(_WIN32)
 #pragma warning(push, 0)
     if ( !check_flags(GLHelperFlags_SAMPLE_SHADING) ) {
@@ -351,6 +438,7 @@ set_uniform_vec4(GLuint program, char* name, size_t count, float* vals)
     ok = loc >= 0;
 
     if ( ok ) {
+        ++g_num_uniform_updates;
         glUniform4fv(loc, (GLsizei)count, vals);
     }
     glUseProgram(last_program);
@@ -367,6 +455,7 @@ set_uniform_vec3i(GLuint program, char* name, size_t count, i32* vals)
     ok = loc >= 0;
 
     if ( ok ) {
+        ++g_num_uniform_updates;
         glUniform3iv(loc, (GLsizei)count, vals);
     }
     glUseProgram(last_program);
@@ -383,6 +472,7 @@ set_uniform_vec3(GLuint program, char* name, size_t count, float* vals)
     ok = loc >= 0;
 
     if ( ok ) {
+        ++g_num_uniform_updates;
         glUniform3fv(loc, (GLsizei)count, vals);
     }
     glUseProgram(last_program);
@@ -398,6 +488,7 @@ set_uniform_vec2(GLuint program, char* name, size_t count, float* vals)
     GLint loc = glGetUniformLocation(program, (GLchar*)name);
     ok = loc >= 0;
     if ( ok ) {
+        ++g_num_uniform_updates;
         glUniform2fv(loc, (GLsizei)count, vals);
     }
     glUseProgram(last_program);
@@ -413,6 +504,7 @@ set_uniform_vec2(GLuint program, char* name, float x, float y)
     GLint loc = glGetUniformLocation(program, (GLchar*)name);
     ok = loc >= 0;
     if ( ok ) {
+        ++g_num_uniform_updates;
         glUniform2f(loc, x, y);
     }
     glUseProgram(last_program);
@@ -428,6 +520,7 @@ set_uniform_vec2i(GLuint program, char* name, size_t count, i32* vals)
     GLint loc = glGetUniformLocation(program, (GLchar*)name);
     ok = loc >= 0;
     if ( ok ) {
+        ++g_num_uniform_updates;
         glUniform2iv(loc, (GLsizei)count, vals);
     }
     glUseProgram(last_program);
@@ -443,6 +536,7 @@ set_uniform_f(GLuint program, char* name, float val)
     GLint loc = glGetUniformLocation(program, (GLchar*)name);
     ok = loc >= 0;
     if ( ok ) {
+        ++g_num_uniform_updates;
         glUniform1f(loc, val);
     }
     glUseProgram(last_program);
@@ -458,6 +552,7 @@ set_uniform_i(GLuint program, char* name, i32 val)
     GLint loc = glGetUniformLocation(program, (GLchar*)name);
     ok = loc >= 0;
     if ( ok ) {
+        ++g_num_uniform_updates;
         glUniform1i(loc, val);
     }
     glUseProgram(last_program);
@@ -473,6 +568,7 @@ set_uniform_vec2i(GLuint program, char* name, i32 x, i32 y)
     GLint loc = glGetUniformLocation(program, (GLchar*)name);
     ok = loc >= 0;
     if ( ok ) {
+        ++g_num_uniform_updates;
         glUniform2i(loc, x, y);
     }
     glUseProgram(last_program);
@@ -630,6 +726,117 @@ resize_depth_stencil_texture(GLuint t, int w, int h)
                  /*data = */ NULL);
 }
 
+void
+gen_queries(GLsizei n, GLuint* queries)
+{
+    g_gl_optional.gen_queries(n, queries);
+}
+
+void
+delete_queries(GLsizei n, GLuint* queries)
+{
+    g_gl_optional.delete_queries(n, queries);
+}
+
+void
+begin_time_elapsed(GLuint query)
+{
+    g_gl_optional.begin_query(GL_TIME_ELAPSED, query);
+}
+
+void
+end_time_elapsed()
+{
+    g_gl_optional.end_query(GL_TIME_ELAPSED);
+}
+
+bool
+time_elapsed_result(GLuint query, u64* out_ns)
+{
+    GLint available = 0;
+    g_gl_optional.get_query_objectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+    if ( available ) {
+        GLuint64 ns = 0;
+        g_gl_optional.get_query_objectui64v(query, GL_QUERY_RESULT, &ns);
+        *out_ns = (u64)ns;
+    }
+    return available != 0;
+}
+
+void
+async_read_begin(AsyncRead* read, GLint x, GLint y, GLsizei w, GLsizei h)
+{
+    mlt_assert(check_flags(GLHelperFlags_ASYNC_READBACK));
+    size_t size = (size_t)w * h * 4;
+    if ( read->pbo == 0 ) {
+        glGenBuffers(1, &read->pbo);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, read->pbo);
+    if ( size != read->size ) {
+        glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)size, NULL, GL_STREAM_READ);
+        read->size = size;
+    }
+    // With a pack buffer bound, the last argument is an offset into it and glReadPixels returns right away.
+    glReadPixels(x, y, w, h, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    if ( read->fence ) {
+        g_gl_optional.delete_sync(read->fence);
+    }
+    read->fence = g_gl_optional.fence_sync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+bool
+async_read_result(AsyncRead* read, void* out_pixels)
+{
+    if ( !read->fence ) {
+        return false;
+    }
+    GLenum status = g_gl_optional.client_wait_sync(read->fence, GL_SYNC_FLUSH_COMMANDS_BIT, /*timeout*/0);
+    if ( status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED ) {
+        return false;
+    }
+    g_gl_optional.delete_sync(read->fence);
+    read->fence = NULL;
+
+    bool ok = false;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, read->pbo);
+    void* pixels = g_gl_optional.map_buffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+    if ( pixels ) {
+        memcpy(out_pixels, pixels, read->size);
+        ok = g_gl_optional.unmap_buffer(GL_PIXEL_PACK_BUFFER) == GL_TRUE;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    return ok;
+}
+
+void
+async_read_release(AsyncRead* read)
+{
+    if ( read->fence ) {
+        g_gl_optional.delete_sync(read->fence);
+    }
+    if ( read->pbo ) {
+        glDeleteBuffers(1, &read->pbo);
+    }
+    *read = {};
+}
+
+void
+push_debug_group(const char* name)
+{
+    if ( check_flags(GLHelperFlags_DEBUG_GROUPS) ) {
+        g_gl_optional.push_debug_group(GL_DEBUG_SOURCE_APPLICATION, 0, -1, name);
+    }
+}
+
+void
+pop_debug_group()
+{
+    if ( check_flags(GLHelperFlags_DEBUG_GROUPS) ) {
+        g_gl_optional.pop_debug_group();
+    }
+}
 
 }  // namespace gl
 
@@ -28,11 +28,18 @@ enum GLHelperFlags
 {
     GLHelperFlags_SAMPLE_SHADING        = 1<<0,
     GLHelperFlags_TEXTURE_MULTISAMPLE   = 1<<1,
+    GLHelperFlags_TIMER_QUERY           = 1<<2,  // ARB_timer_query or EXT_timer_query
+    GLHelperFlags_DEBUG_GROUPS          = 1<<3,  // KHR_debug
+    GLHelperFlags_ASYNC_READBACK        = 1<<4,  // ARB_pixel_buffer_object and ARB_sync
 };
 
 namespace gl {
 
+// Flags and counters are kept for the context that is current on the calling thread. load() sets
+// them up for it.
 bool    check_flags (int flags);
+// Uniforms set through the set_uniform_* functions since the start, on this thread's context.
+u64     num_uniform_updates ();
 
 bool    load ();
 void    log (char* str);
@@ -65,6 +72,34 @@ void    resize_depth_stencil_texture_multisample (GLuint t, int w, int h);
 void    resize_color_texture (GLuint t, int w, int h);
 void    resize_depth_stencil_texture (GLuint t, int w, int h);
 
+// GL_TIME_ELAPSED queries. Only with GLHelperFlags_TIMER_QUERY. They can't nest.
+void    gen_queries (GLsizei n, GLuint* queries);
+void    delete_queries (GLsizei n, GLuint* queries);
+void    begin_time_elapsed (GLuint query);
+void    end_time_elapsed ();
+// False if the GPU is not done with the query yet. Doesn't wait.
+bool    time_elapsed_result (GLuint query, u64* out_ns);
+
+// Reads of RGBA8 pixels from the read framebuffer into a pixel buffer object. The GPU does the copy
+// in the background, and async_read_result picks it up on a later frame. Only with
+// GLHelperFlags_ASYNC_READBACK.
+struct AsyncRead
+{
+    GLuint  pbo;
+    GLsync  fence;  // NULL when no read is in flight.
+    size_t  size;   // Of the last read.
+};
+
+// Replaces the read in flight, if there is one.
+void    async_read_begin (AsyncRead* read, GLint x, GLint y, GLsizei w, GLsizei h);
+// Copies the pixels of the read in flight to `out_pixels` once the GPU is done. False until then. Doesn't wait.
+bool    async_read_result (AsyncRead* read, void* out_pixels);
+void    async_read_release (AsyncRead* read);
+
+// Named groups of commands, shown by GPU debuggers. Do nothing without GLHelperFlags_DEBUG_GROUPS.
+void    push_debug_group (const char* name);
+void    pop_debug_group ();
+
 }  // namespace gl
 
 #if defined(__linux__)
@@ -273,10 +273,16 @@ milton_imgui_tick(MiltonInput* input, PlatformState* platform_state,  Milton* mi
                 if ( ImGui::MenuItem(LOC(toggle_gui_visibility)) ) {
                     gui_toggle_visibility(milton);
                 }
+                if ( ImGui::MenuItem("Memory Usage") ) {
+                    milton->memory_window_visible = !milton->memory_window_visible;
+                }
 #if MILTON_ENABLE_PROFILING
                 if ( ImGui::MenuItem("Toggle Debug Data [BACKQUOTE]") ) {
                     milton->viz_window_visible = !milton->viz_window_visible;
                 }
+                if ( ImGui::MenuItem("Frame Timing") ) {
+                    milton->frame_timing_visible = !milton->frame_timing_visible;
+                }
 #endif
                 ImGui::EndMenu();
             }
@@ -415,6 +421,7 @@ milton_imgui_tick(MiltonInput* input, PlatformState* platform_state,  Milton* mi
                 bool v = layer->flags & LayerFlags_VISIBLE;
                 ImGui::PushID(layer->id);
                 if ( ImGui::Checkbox("##select", &v) ) {
+                    milton_layer_properties_will_change(milton, layer, 0);
                     layer::layer_toggle_visibility(layer);
                     input->flags |= (i32)MiltonInputFlags_FULL_REFRESH;
                 }
@@ -431,7 +438,7 @@ milton_imgui_tick(MiltonInput* input, PlatformState* platform_state,  Milton* mi
             ImGui::BeginGroup();
             ImGui::BeginChild("item view", ImVec2(0, 25));
             if ( ImGui::Button(LOC(new_layer)) ) {
-                milton_new_layer(milton);
+                milton_new_layer(milton, /*undoable*/true);
             }
             ImGui::SameLine();
 
@@ -467,6 +474,8 @@ milton_imgui_tick(MiltonInput* input, PlatformState* platform_state,  Milton* mi
                             if ( alpha > 1 ) { alpha = 1; }
                             if ( alpha < 0 ) { alpha = 0; }
 
+                            // Changes made with the slider, one after the other, are undone all at once.
+                            milton_layer_properties_will_change(milton, canvas->working_layer, ImGui::GetID("##opacity"));
                             canvas->working_layer->alpha = alpha;
                         }
 
@@ -475,6 +484,7 @@ milton_imgui_tick(MiltonInput* input, PlatformState* platform_state,  Milton* mi
                         ImGui::Separator();
 
                         if ( ImGui::Button("Add Blur") ) {
+                            milton_layer_properties_will_change(milton, working_layer, 0);
                             LayerEffect* e = arena_alloc_elem(canvas_arena, LayerEffect);
                             e->next = working_layer->effects;
                             working_layer->effects = e;
@@ -488,18 +498,24 @@ milton_imgui_tick(MiltonInput* input, PlatformState* platform_state,  Milton* mi
                         int effect_id = 1;
                         for ( LayerEffect* e = working_layer->effects; e != NULL; e = e->next ) {
                             ImGui::PushID(effect_id);
-                            static bool v = 0;
-                            if ( ImGui::Checkbox("Enabled", (bool*)&e->enabled) ) {
+                            bool enabled = e->enabled != 0;
+                            if ( ImGui::Checkbox("Enabled", &enabled) ) {
+                                milton_layer_properties_will_change(milton, working_layer, 0);
+                                e->enabled = enabled;
                                 input->flags |= MiltonInputFlags_FULL_REFRESH;
                             }
-                            if ( ImGui::SliderInt("Level", &e->blur.kernel_size, 2, 100, 0) ) {
-                                if (e->blur.kernel_size % 2 == 0) {
-                                    --e->blur.kernel_size;
+                            i32 kernel_size = e->blur.kernel_size;
+                            if ( ImGui::SliderInt("Level", &kernel_size, 2, 100, 0) ) {
+                                if (kernel_size % 2 == 0) {
+                                    --kernel_size;
                                 }
+                                milton_layer_properties_will_change(milton, working_layer, ImGui::GetID("Level"));
+                                e->blur.kernel_size = kernel_size;
                                 input->flags |= MiltonInputFlags_FULL_REFRESH;
                             }
                             {
                                 if (ImGui::Button("Delete")) {
+                                    milton_layer_properties_will_change(milton, working_layer, 0);
                                     if (prev) {
                                         prev->next = e->next;
                                     } else {  // Was the first.
@@ -524,63 +540,53 @@ milton_imgui_tick(MiltonInput* input, PlatformState* platform_state,  Milton* mi
             ImGui::BeginChild("buttons");
 
             static b32 is_renaming = false;
+            // Edited here and copied to the layer when done, so that a rename is a single change.
+            static char new_name[MAX_LAYER_NAME_LEN] = {};
             if ( is_renaming == false ) {
                 ImGui::Text(milton->canvas->working_layer->name);
                 ImGui::Indent();
                 if ( ImGui::Button(LOC(rename)) )
                 {
                     is_renaming = true;
+                    strncpy(new_name, milton->canvas->working_layer->name, MAX_LAYER_NAME_LEN - 1);
                 }
                 ImGui::Unindent();
             }
             else if ( is_renaming ) {
+                b32 done = false;
                 if (ImGui::InputText("##rename",
-                                      milton->canvas->working_layer->name,
+                                      new_name,
                                       13,
                                       //MAX_LAYER_NAME_LEN,
                                       ImGuiInputTextFlags_EnterReturnsTrue
                                       //,ImGuiInputTextFlags flags = 0, ImGuiTextEditCallback callback = NULL, void* user_data = NULL
                                      )) {
-                    is_renaming = false;
+                    done = true;
                 }
                 ImGui::SameLine();
                 if ( ImGui::Button(LOC(ok)) )
                 {
+                    done = true;
+                }
+                if ( done ) {
                     is_renaming = false;
+                    Layer* working_layer = milton->canvas->working_layer;
+                    if ( strcmp(new_name, working_layer->name) != 0 ) {
+                        milton_layer_properties_will_change(milton, working_layer, 0);
+                        strncpy(working_layer->name, new_name, MAX_LAYER_NAME_LEN - 1);
+                    }
                 }
             }
             ImGui::Text(LOC(move));
 
-            Layer* a = NULL;
-            Layer* b = NULL;
-            if ( ImGui::Button(LOC(up)) ) {
-                b = milton->canvas->working_layer;
-                a = b->next;
+            Layer* working_layer = milton->canvas->working_layer;
+            if ( ImGui::Button(LOC(up)) && working_layer->next ) {
+                milton_move_layer(milton, working_layer, working_layer->next);
+                input->flags |= (i32)MiltonInputFlags_FULL_REFRESH;
             }
             ImGui::SameLine();
-            if ( ImGui::Button(LOC(down)) ) {
-                a = milton->canvas->working_layer;
-                b = a->prev;
-            }
-
-
-            if ( a && b ) {
-                // n <-> a <-> b <-> p
-                // n <-> b <-> a <-> p
-                Layer* n = a->next;
-                Layer* p = b->prev;
-                b->next = n;
-                if ( n ) n->prev = b;
-                a->prev = p;
-                if ( p ) p->next = a;
-
-                a->next = b;
-                b->prev = a;
-
-                // Make sure root is first
-                while ( milton->canvas->root_layer->prev ) {
-                    milton->canvas->root_layer = milton->canvas->root_layer->prev;
-                }
+            if ( ImGui::Button(LOC(down)) && working_layer->prev ) {
+                milton_move_layer(milton, working_layer, working_layer->prev->prev);
                 input->flags |= (i32)MiltonInputFlags_FULL_REFRESH;
             }
 
@@ -594,7 +600,6 @@ milton_imgui_tick(MiltonInput* input, PlatformState* platform_state,  Milton* mi
                 }
                 else if ( deleting ) {
                     ImGui::Text(LOC(are_you_sure));
-                    ImGui::Text(LOC(cant_be_undone));
                     if ( ImGui::Button(LOC(yes)) ) {
                         milton_delete_working_layer(milton);
                         deleting = false;
@@ -751,11 +756,11 @@ milton_imgui_tick(MiltonInput* input, PlatformState* platform_state,  Milton* mi
             float poll     = perf_count_to_sec(milton->graph_frame.polling) * 1000.0f;
             float update   = perf_count_to_sec(milton->graph_frame.update) * 1000.0f;
             float clipping = perf_count_to_sec(milton->graph_frame.clipping) * 1000.0f;
-            float raster   = perf_count_to_sec(milton->graph_frame.raster) * 1000.0f;
             float GL       = perf_count_to_sec(milton->graph_frame.GL) * 1000.0f;
             float system   = perf_count_to_sec(milton->graph_frame.system) * 1000.0f;
 
-            float sum = poll + update + raster + GL + system;
+            // Update and clipping are part of GL.
+            float sum = poll + GL + system;
 
             snprintf(msg, array_count(msg),
                      "Input Polling %f ms\n",
@@ -782,12 +787,34 @@ milton_imgui_tick(MiltonInput* input, PlatformState* platform_state,  Milton* mi
                      system);
             ImGui::Text(msg);
 
+            u64 gpu_ns[GpuPass_COUNT] = {};
+            if ( gpu_get_pass_times(milton->render_data, gpu_ns) ) {
+                float gpu_total = 0.0f;
+                for ( i32 i = 0; i < GpuPass_COUNT; ++i ) {
+                    float pass_ms = (float)gpu_ns[i] / 1000000.0f;
+                    snprintf(msg, array_count(msg),
+                             "GPU %s %f ms\n",
+                             gpu_pass_name(i), pass_ms);
+                    ImGui::Text(msg);
+                    gpu_total += pass_ms;
+                }
+                snprintf(msg, array_count(msg),
+                         "GPU total %f ms\n",
+                         gpu_total);
+                ImGui::Text(msg);
+            }
+            else {
+                ImGui::Text("GPU timers are not available\n");
+            }
+
+            RenderStats render_stats = {};
+            gpu_get_stats(milton->render_data, &render_stats);
             snprintf(msg, array_count(msg),
-                     "Number of strokes in GPU memory: %d\n",
-                     gpu_get_num_clipped_strokes(milton->canvas->root_layer));
+                     "Number of strokes in GPU memory: %" PRIi64 "\n",
+                     render_stats.gpu_strokes);
             ImGui::Text(msg);
 
-            float hist[] = { poll, update, raster, GL, system };
+            float hist[] = { poll, update, clipping, GL, system };
             ImGui::PlotHistogram("Graph",
                           (const float*)hist, array_count(hist));
 
@@ -813,6 +840,13 @@ milton_imgui_tick(MiltonInput* input, PlatformState* platform_state,  Milton* mi
             }
             ImGui::Text(msg);
 
+            if ( ImGui::Button("Save trace") ) {
+                PATH_CHAR trace_fname[MAX_PATH] = {};
+                milton_save_profiler_trace(trace_fname, MAX_PATH);
+            }
+            ImGui::SameLine();
+            ImGui::Text("Last %d frames, to milton_trace.json in the settings folder.", PROFILER_NUM_FRAMES);
+
             ImGui::Dummy({0,30});
 
             i64 stroke_count = layer::count_strokes(milton->canvas->root_layer);
@@ -878,7 +912,199 @@ milton_imgui_tick(MiltonInput* input, PlatformState* platform_state,  Milton* mi
 
         } ImGui::End();
     } // profiling
+
+    if ( milton->frame_timing_visible ) {
+        ImGui::SetNextWindowPos(ImVec2(ui_scale*300, ui_scale*205), ImGuiSetCond_FirstUseEver);
+        ImGui::SetNextWindowSize({ui_scale*460, ui_scale*320}, ImGuiSetCond_FirstUseEver);
+        bool opened = true;
+        if ( ImGui::Begin("Frame Timing", &opened, ImGuiWindowFlags_NoCollapse) ) {
+            FrameHistory* history = &milton->frame_history;
+            FrameStats cpu = {};
+            FrameStats gpu = {};
+            frame_history_stats(history, false, &cpu);
+            frame_history_stats(history, true, &gpu);
+
+            static const ImVec4 phase_colors[FramePhase_COUNT] =
+            {
+                { 0.4f, 0.6f, 0.9f, 1.0f },
+                { 0.3f, 0.8f, 0.4f, 1.0f },
+                { 0.9f, 0.8f, 0.3f, 1.0f },
+                { 0.9f, 0.5f, 0.2f, 1.0f },
+                { 0.8f, 0.3f, 0.7f, 1.0f },
+            };
+
+            ImGui::Text("Budget %.2f ms. %" PRIi64 " of %" PRIi64 " frames went over it.",
+                        history->budget_ms, history->num_missed, history->count);
+            ImGui::Text("CPU  p50 %.2f ms  p95 %.2f ms  p99 %.2f ms  over budget: %d of the last %d",
+                        cpu.p50, cpu.p95, cpu.p99, cpu.num_missed, cpu.num_frames);
+            if ( gpu.p99 > 0.0f ) {
+                ImGui::Text("GPU  p50 %.2f ms  p95 %.2f ms  p99 %.2f ms  over budget: %d of the last %d",
+                            gpu.p50, gpu.p95, gpu.p99, gpu.num_missed, gpu.num_frames);
+            }
+            else {
+                ImGui::Text("GPU timers are not available");
+            }
+
+            // Legend, with the last frame.
+            for ( i32 p = 0; p < FramePhase_COUNT; ++p ) {
+                f32 last_ms = history->count > 0 ? frame_history_get(history, 0)->phase_ms[p] : 0.0f;
+                if ( p > 0 ) {
+                    ImGui::SameLine();
+                }
+                ImGui::TextColored(phase_colors[p], "%s %.2f", frame_phase_name(p), last_ms);
+            }
+            ImGui::SameLine();
+            ImGui::Text("GPU");
+
+            // Stacked CPU phases of each frame, newest on the right. GPU time and the budget are lines.
+            ImDrawList* draw_list = ImGui::GetWindowDrawList();
+            ImVec2 origin = ImGui::GetCursorScreenPos();
+            f32 width = max(ImGui::GetContentRegionAvailWidth(), 1.0f);
+            f32 height = ui_scale*120;
+            i64 num_slots = min((i64)FRAME_HISTORY_SIZE, (i64)width);
+            i64 num_frames = min(history->count, num_slots);
+            f32 bar_width = width / num_slots;
+            f32 scale_ms = max(2*history->budget_ms, max(cpu.p99, gpu.p99));
+            f32 px_per_ms = scale_ms > 0.0f ? height / scale_ms : 0.0f;
+            f32 bottom = origin.y + height;
+
+            ImU32 phase_u32[FramePhase_COUNT];
+            for ( i32 p = 0; p < FramePhase_COUNT; ++p ) {
+                phase_u32[p] = ImGui::ColorConvertFloat4ToU32(phase_colors[p]);
+            }
+
+            draw_list->AddRectFilled(origin, ImVec2(origin.x + width, bottom), ImGui::ColorConvertFloat4ToU32({ 0, 0, 0, 0.5f }));
+
+            ImVec2 gpu_points[FRAME_HISTORY_SIZE];
+            for ( i64 age = 0; age < num_frames; ++age ) {
+                FrameTimes* f = frame_history_get(history, age);
+                f32 x1 = origin.x + width - age*bar_width;
+                f32 x0 = x1 - bar_width;
+                f32 y = bottom;
+                for ( i32 p = 0; p < FramePhase_COUNT && y > origin.y; ++p ) {
+                    f32 top = max(y - f->phase_ms[p]*px_per_ms, origin.y);
+                    if ( top < y ) {
+                        draw_list->AddRectFilled(ImVec2(x0, top), ImVec2(x1, y), phase_u32[p]);
+                    }
+                    y = top;
+                }
+                gpu_points[age] = ImVec2((x0 + x1) / 2, max(bottom - f->gpu_ms*px_per_ms, origin.y));
+            }
+            if ( gpu.p99 > 0.0f && num_frames > 1 ) {
+                draw_list->AddPolyline(gpu_points, (int)num_frames, ImGui::ColorConvertFloat4ToU32({ 1, 1, 1, 1 }),
+                                       false, 1.0f, true);
+            }
+            f32 budget_y = max(bottom - history->budget_ms*px_per_ms, origin.y);
+            draw_list->AddLine(ImVec2(origin.x, budget_y), ImVec2(origin.x + width, budget_y),
+                               ImGui::ColorConvertFloat4ToU32({ 1, 0.2f, 0.2f, 1 }));
+
+            ImGui::Dummy(ImVec2(width, height));
+
+            if ( ImGui::CollapsingHeader("Render work, last frame") ) {
+                static b32 stats_saved = false;
+                RenderStats stats = {};
+                gpu_get_stats(milton->render_data, &stats);
+
+                ImGui::Columns(2, "render_stats");
+                ImGui::Text("Strokes tested"); ImGui::NextColumn();
+                ImGui::Text("%" PRIi64, stats.strokes_tested); ImGui::NextColumn();
+                ImGui::Text("Strokes in view"); ImGui::NextColumn();
+                ImGui::Text("%" PRIi64, stats.strokes_clipped); ImGui::NextColumn();
+                ImGui::Text("Strokes cooked"); ImGui::NextColumn();
+                ImGui::Text("%" PRIi64, stats.strokes_cooked); ImGui::NextColumn();
+                ImGui::Text("KB uploaded"); ImGui::NextColumn();
+                ImGui::Text("%" PRIi64, stats.bytes_uploaded / 1024); ImGui::NextColumn();
+                ImGui::Text("Draw calls"); ImGui::NextColumn();
+                ImGui::Text("%" PRIi64, stats.draw_calls); ImGui::NextColumn();
+                ImGui::Text("Uniform updates"); ImGui::NextColumn();
+                ImGui::Text("%" PRIi64, stats.uniform_updates); ImGui::NextColumn();
+                ImGui::Text("Full-screen passes"); ImGui::NextColumn();
+                ImGui::Text("%" PRIi64, stats.fullscreen_passes); ImGui::NextColumn();
+                ImGui::Text("Layers composited"); ImGui::NextColumn();
+                ImGui::Text("%" PRIi64, stats.layers_composited); ImGui::NextColumn();
+                ImGui::Text("Blur passes"); ImGui::NextColumn();
+                ImGui::Text("%" PRIi64, stats.blur_passes); ImGui::NextColumn();
+                ImGui::Text("Strokes on the GPU"); ImGui::NextColumn();
+                ImGui::Text("%" PRIi64 " (%" PRIi64 " KB)", stats.gpu_strokes, stats.gpu_bytes / 1024); ImGui::NextColumn();
+                ImGui::Columns(1);
+
+                if ( ImGui::Button("Save as JSON") ) {
+                    PATH_CHAR stats_fname[MAX_PATH] = {};
+                    stats_saved = milton_save_render_stats(milton, stats_fname, MAX_PATH);
+                }
+                if ( stats_saved ) {
+                    ImGui::SameLine();
+                    ImGui::Text("render_stats.json, in the settings folder.");
+                }
+            }
+        } ImGui::End();
+        if ( !opened ) {
+            milton->frame_timing_visible = false;
+        }
+    }
 #endif
+
+    if ( milton->memory_window_visible ) {
+        ImGui::SetNextWindowPos(ImVec2(ui_scale*300, ui_scale*205), ImGuiSetCond_FirstUseEver);
+        ImGui::SetNextWindowSize({ui_scale*420, ui_scale*380}, ImGuiSetCond_FirstUseEver);
+        bool opened = true;
+        if ( ImGui::Begin("Memory Usage", &opened, ImGuiWindowFlags_NoCollapse) ) {
+            static b32 json_saved = false;
+            PATH_CHAR json_fname[MAX_PATH] = {};
+            MemoryTelemetry t = {};
+            memory_telemetry_get(&t);
+
+            ImGui::Columns(4, "memory_categories");
+            ImGui::Text("Category"); ImGui::NextColumn();
+            ImGui::Text("Live KB"); ImGui::NextColumn();
+            ImGui::Text("Peak KB"); ImGui::NextColumn();
+            ImGui::Text("Allocs/frame"); ImGui::NextColumn();
+            ImGui::Separator();
+            for ( i32 i = 0; i < t.num_categories; ++i ) {
+                MemoryCategoryStats* c = &t.categories[i];
+                ImGui::Text("%s", c->name); ImGui::NextColumn();
+                ImGui::Text("%" PRIi64, c->live_bytes / 1024); ImGui::NextColumn();
+                ImGui::Text("%" PRIi64, c->peak_bytes / 1024); ImGui::NextColumn();
+                ImGui::Text("%" PRIi64, c->frame_allocations); ImGui::NextColumn();
+            }
+            ImGui::Columns(1);
+            ImGui::Separator();
+
+            char* arena_names[] = { "Root arena", "Canvas arena" };
+            Arena* arenas[] = { &milton->root_arena, &milton->canvas->arena };
+            for ( size_t i = 0; i < array_count(arenas); ++i ) {
+                ImGui::Text("%s: %" PRIi64 " KB used, %" PRIi64 " KB high water, %" PRIi64 " KB committed",
+                            arena_names[i], (i64)arenas[i]->count / 1024, (i64)arenas[i]->high_water / 1024,
+                            (i64)arena_committed_bytes(arenas[i]) / 1024);
+            }
+            ImGui::Text("Scratch arenas: %" PRIi64 " threads, %" PRIi64 " KB peak",
+                        t.scratch_num_threads, t.scratch_peak_bytes / 1024);
+            ImGui::Text("Stroke buffers on the GPU: %" PRIi64 " KB, %" PRIi64 " KB peak",
+                        t.gpu_bytes / 1024, t.gpu_peak_bytes / 1024);
+
+            // Oldest frame first.
+            float frames[MEMORY_TELEMETRY_NUM_FRAMES] = {};
+            for ( i32 i = 0; i < MEMORY_TELEMETRY_NUM_FRAMES; ++i ) {
+                frames[i] = (float)t.frame_allocations[(t.frame_i + 1 + i) % MEMORY_TELEMETRY_NUM_FRAMES];
+            }
+            char overlay[64] = {};
+            snprintf(overlay, array_count(overlay), "%" PRIi64 " last frame", t.frame_allocations[t.frame_i]);
+            ImGui::PlotLines("Allocations", frames, MEMORY_TELEMETRY_NUM_FRAMES, 0, overlay,
+                             0.0f, FLT_MAX, ImVec2(0, ui_scale*60));
+
+            if ( ImGui::Button("Save as JSON") ) {
+                json_saved = milton_save_memory_telemetry(milton, json_fname, MAX_PATH);
+            }
+            if ( json_saved ) {
+                ImGui::SameLine();
+                ImGui::Text("memory.json, in the settings folder.");
+            }
+        } ImGui::End();
+        if ( !opened ) {
+            milton->memory_window_visible = false;
+        }
+    }
+
     ImGui::PopStyleColor(color_stack);
 }
 
@@ -7,11 +7,40 @@
 #include "utils.h"
 #include "platform.h"
 
+static void telemetry_arena_bytes(i64 delta, b32 is_allocation);
+
+// Reserved arenas commit this much at a time. The size of a huge page.
+#define ARENA_COMMIT_GRANULARITY (2*1024*1024)
+
+static size_t
+arena_commit_size(size_t num_bytes)
+{
+    return (num_bytes + ARENA_COMMIT_GRANULARITY - 1) & ~(size_t)(ARENA_COMMIT_GRANULARITY - 1);
+}
+
+// Commits the pages of a reserved arena up to `total` bytes.
+static void
+arena_commit(Arena* arena, size_t total)
+{
+    if ( total > arena->reserved ) {
+        milton_die_gracefully("Arena ran out of reserved address space.");
+    }
+    size_t new_size = min(arena_commit_size(total), arena->reserved);
+    if ( !platform_commit(arena->ptr + arena->size, new_size - arena->size) ) {
+        milton_die_gracefully("Could not commit memory for arena.");
+    }
+    telemetry_arena_bytes((i64)(new_size - arena->size), true);
+    arena->size = new_size;
+}
+
 u8*
 arena_alloc_bytes(Arena* arena, size_t num_bytes, int alloc_flags)
 {
     size_t total = arena->count + num_bytes;
-    if ( total > arena->size ) {
+    if ( total > arena->size && arena->reserved ) {
+        arena_commit(arena, total);
+    }
+    else if ( total > arena->size ) {
         size_t new_size = max(num_bytes, arena->min_block_size);
         ArenaFooter arena_footer = {};
         arena_footer.previous_block = arena->ptr;
@@ -20,9 +49,13 @@ arena_alloc_bytes(Arena* arena, size_t num_bytes, int alloc_flags)
         arena->size = new_size;
         arena->count = 0;
         *(ArenaFooter*)(arena->ptr + arena->size) = arena_footer;
+        telemetry_arena_bytes((i64)new_size, true);
     }
     u8* result = arena->ptr + arena->count;
     arena->count += num_bytes;
+    if ( arena->count > arena->high_water ) {
+        arena->high_water = arena->count;
+    }
     return result;
 }
 
@@ -41,6 +74,9 @@ arena_init(size_t min_block_size, void* base)
     }
     else {
         arena.ptr = (u8*)platform_allocate(arena.min_block_size + sizeof(ArenaFooter));
+        if ( arena.ptr ) {
+            telemetry_arena_bytes((i64)arena.min_block_size, true);
+        }
     }
 
     if ( arena.ptr ) {
@@ -55,6 +91,28 @@ arena_init(size_t min_block_size, void* base)
     return arena;
 }
 
+Arena
+arena_init_reserve(size_t reserve_size, size_t min_block_size)
+{
+    Arena arena = {};
+    arena.min_block_size = min_block_size ? min_block_size : 1024;
+    reserve_size = arena_commit_size(max(reserve_size, arena.min_block_size));
+
+    // Reserving doesn't leave much room for anything else in a 32 bit address space.
+    if ( sizeof(void*) >= 8 ) {
+        arena.ptr = (u8*)platform_reserve(reserve_size);
+    }
+    if ( arena.ptr ) {
+        arena.reserved = reserve_size;
+        arena_commit(&arena, arena.min_block_size);
+    }
+    else {
+        milton_log("Could not reserve address space for arena. Using blocks.\n");
+        arena = arena_init(min_block_size);
+    }
+    return arena;
+}
+
 void*
 arena_bootstrap_(size_t size, size_t obj_size, size_t offset)
 {
@@ -63,15 +121,29 @@ arena_bootstrap_(size_t size, size_t obj_size, size_t offset)
     return arena_alloc_bytes((Arena*)(arena.ptr + offset), obj_size);
 }
 
+void*
+arena_bootstrap_reserve_(size_t size, size_t obj_size, size_t offset)
+{
+    Arena arena = arena_init_reserve((size_t)MILTON_ARENA_RESERVE_GB << 30, size + obj_size);
+    *(Arena*)(arena.ptr + offset) = arena;
+    return arena_alloc_bytes((Arena*)(arena.ptr + offset), obj_size);
+}
+
 
 void
 arena_free(Arena* arena)
 {
-    if ( arena ) {
+    if ( arena && arena->reserved ) {
+        telemetry_arena_bytes(-(i64)arena->size, false);
+        // Note: If the arena was bootstrapped, it is no longer valid.
+        platform_release(arena->ptr, arena->reserved);
+    }
+    else if ( arena ) {
         u8* data = arena->ptr;
         size_t size = arena->size;
         while ( data ) {
             ArenaFooter footer = *(ArenaFooter*)(data + size);
+            telemetry_arena_bytes(-(i64)size, false);
             platform_deallocate(data);
             // Note: If the arena was bootstrapped, it is no longer valid.
             data = footer.previous_block;
@@ -126,6 +198,7 @@ arena_pop(Arena* child)
     mlt_assert ((parent->num_children - 1) == child->id);
     ArenaFooter* footer = (ArenaFooter*)(child->ptr + child->size);
     while ( footer->previous_block ) {
+        telemetry_arena_bytes(-(i64)child->size, false);
         platform_deallocate(child->ptr);
         child->size = footer->previous_size;
         child->ptr = footer->previous_block;
@@ -153,7 +226,19 @@ arena_pop_noclear(Arena* child)
 void
 arena_reset(Arena* arena)
 {
-    memset (arena->ptr, 0, arena->count);
+    if ( arena->reserved ) {
+        // Give all but the first block back to the OS. Decommitted pages read as zero when committed again.
+        size_t keep = min(arena_commit_size(arena->min_block_size), arena->size);
+        if ( arena->size > keep ) {
+            telemetry_arena_bytes(-(i64)(arena->size - keep), false);
+            platform_decommit(arena->ptr + keep, arena->size - keep);
+            arena->size = keep;
+        }
+        memset (arena->ptr, 0, min(arena->count, keep));
+    }
+    else {
+        memset (arena->ptr, 0, arena->count);
+    }
     arena->count = 0;
 }
 
@@ -163,6 +248,283 @@ arena_reset_noclear(Arena* arena)
     arena->count = 0;
 }
 
+ArenaMark
+arena_mark(Arena* arena)
+{
+    ArenaMark mark = {};
+    mark.arena = arena;
+    mark.ptr = arena->ptr;
+    mark.count = arena->count;
+    return mark;
+}
+
+void
+arena_reset_to_mark(ArenaMark mark)
+{
+    Arena* arena = mark.arena;
+    while ( arena->ptr != mark.ptr ) {
+        ArenaFooter footer = *(ArenaFooter*)(arena->ptr + arena->size);
+        mlt_assert(footer.previous_block);
+        telemetry_arena_bytes(-(i64)arena->size, false);
+        platform_deallocate(arena->ptr);
+        arena->ptr = footer.previous_block;
+        arena->size = footer.previous_size;
+    }
+    mlt_assert(mark.count <= arena->count);
+    arena->count = mark.count;
+}
+
+static SDL_atomic_t g_scratch_num_threads;
+static SDL_atomic_t g_scratch_peak_kb;
+
+static thread_local Arena g_scratch[2];
+
+ArenaMark
+arena_scratch_begin(Arena* conflict)
+{
+    Arena* scratch = conflict == &g_scratch[0] ? &g_scratch[1] : &g_scratch[0];
+    if ( scratch->ptr == NULL ) {
+        *scratch = arena_init_reserve((size_t)MILTON_SCRATCH_RESERVE_MB << 20, 64*1024);
+        if ( scratch == &g_scratch[0] ) {
+            SDL_AtomicAdd(&g_scratch_num_threads, 1);
+        }
+    }
+    // Counted as a child, so that ARENA_VALIDATE catches a missing arena_scratch_end.
+    ArenaMark mark = arena_mark(scratch);
+    scratch->num_children += 1;
+    return mark;
+}
+
+void
+arena_scratch_end(ArenaMark scratch)
+{
+    int kb = (int)(scratch.arena->high_water / 1024);
+    int peak = SDL_AtomicGet(&g_scratch_peak_kb);
+    while ( kb > peak && !SDL_AtomicCAS(&g_scratch_peak_kb, peak, kb) ) {
+        peak = SDL_AtomicGet(&g_scratch_peak_kb);
+    }
+    scratch.arena->num_children -= 1;
+    arena_reset_to_mark(scratch);
+}
+
+void
+arena_scratch_validate()
+{
+    ARENA_VALIDATE(&g_scratch[0]);
+    ARENA_VALIDATE(&g_scratch[1]);
+}
+
+void
+arena_scratch_release()
+{
+    arena_scratch_validate();
+    for ( int i = 0; i < 2; ++i ) {
+        if ( g_scratch[i].ptr ) {
+            arena_free(&g_scratch[i]);
+            g_scratch[i] = {};
+            if ( i == 0 ) {
+                SDL_AtomicAdd(&g_scratch_num_threads, -1);
+            }
+        }
+    }
+}
+
+size_t
+arena_committed_bytes(Arena* arena)
+{
+    size_t bytes = 0;
+    if ( arena->reserved ) {
+        bytes = arena->size;
+    }
+    else {
+        u8* data = arena->ptr;
+        size_t size = arena->size;
+        while ( data ) {
+            bytes += size;
+            ArenaFooter footer = *(ArenaFooter*)(data + size);
+            data = footer.previous_block;
+            size = footer.previous_size;
+        }
+    }
+    return bytes;
+}
+
+// ---- Telemetry
+
+// Counters are updated from any thread, under g_telemetry_lock.
+static SDL_SpinLock     g_telemetry_lock;
+static MemoryTelemetry  g_telemetry;
+static i64              g_telemetry_frame_counts[MEMORY_TELEMETRY_MAX_CATEGORIES];  // Of the frame being recorded.
+
+// Header of allocations made with calloc_with_telemetry. Keeps the data 16 byte aligned.
+struct TelemetryHeader
+{
+    size_t  size;
+    i64     category;
+};
+
+// Index of a category in g_telemetry. Called with the lock held.
+static i64
+telemetry_category(char* name)
+{
+    i64 found = -1;
+    for ( i64 i = 0; i < g_telemetry.num_categories && found < 0; ++i ) {
+        if ( g_telemetry.categories[i].name == name || strcmp(g_telemetry.categories[i].name, name) == 0 ) {
+            found = i;
+        }
+    }
+    if ( found < 0 ) {
+        // Past the limit, everything else is counted in the last category.
+        found = min((i64)g_telemetry.num_categories, (i64)MEMORY_TELEMETRY_MAX_CATEGORIES - 1);
+        if ( found == g_telemetry.num_categories ) {
+            g_telemetry.categories[found].name = name;
+            g_telemetry.num_categories += 1;
+        }
+    }
+    return found;
+}
+
+static void
+telemetry_record(i64 category, i64 delta, b32 is_allocation)
+{
+    MemoryCategoryStats* stats = &g_telemetry.categories[category];
+    stats->live_bytes += delta;
+    stats->peak_bytes = max(stats->peak_bytes, stats->live_bytes);
+    if ( is_allocation ) {
+        stats->num_allocations += 1;
+        g_telemetry_frame_counts[category] += 1;
+    }
+}
+
+static void
+telemetry_arena_bytes(i64 delta, b32 is_allocation)
+{
+    SDL_AtomicLock(&g_telemetry_lock);
+    telemetry_record(telemetry_category("Arena"), delta, is_allocation);
+    SDL_AtomicUnlock(&g_telemetry_lock);
+}
+
+#if MILTON_MEMORY_TELEMETRY
+void*
+calloc_with_telemetry(size_t n, size_t sz, char* category)
+{
+    TelemetryHeader* header = (TelemetryHeader*)calloc(1, sizeof(TelemetryHeader) + n*sz);
+    void* result = NULL;
+    if ( header ) {
+        SDL_AtomicLock(&g_telemetry_lock);
+        header->size = n*sz;
+        header->category = telemetry_category(category);
+        telemetry_record(header->category, (i64)header->size, true);
+        SDL_AtomicUnlock(&g_telemetry_lock);
+        result = header + 1;
+    }
+    return result;
+}
+
+void
+free_with_telemetry(void* ptr)
+{
+    TelemetryHeader* header = (TelemetryHeader*)ptr - 1;
+    SDL_AtomicLock(&g_telemetry_lock);
+    telemetry_record(header->category, -(i64)header->size, false);
+    SDL_AtomicUnlock(&g_telemetry_lock);
+    free(header);
+}
+
+void*
+realloc_with_telemetry(void* ptr, size_t sz, char* category)
+{
+    void* result = NULL;
+    if ( ptr == NULL ) {
+        result = calloc_with_telemetry(1, sz, category);
+    }
+    else {
+        TelemetryHeader* header = (TelemetryHeader*)ptr - 1;
+        size_t old_size = header->size;
+        i64 old_category = header->category;
+        header = (TelemetryHeader*)realloc(header, sizeof(TelemetryHeader) + sz);
+        if ( header ) {
+            SDL_AtomicLock(&g_telemetry_lock);
+            telemetry_record(old_category, -(i64)old_size, false);
+            header->size = sz;
+            header->category = telemetry_category(category);
+            telemetry_record(header->category, (i64)sz, true);
+            SDL_AtomicUnlock(&g_telemetry_lock);
+            result = header + 1;
+        }
+    }
+    return result;
+}
+#endif  // MILTON_MEMORY_TELEMETRY
+
+void
+memory_telemetry_end_frame()
+{
+    SDL_AtomicLock(&g_telemetry_lock);
+    i64 total = 0;
+    for ( i64 i = 0; i < g_telemetry.num_categories; ++i ) {
+        g_telemetry.categories[i].frame_allocations = g_telemetry_frame_counts[i];
+        total += g_telemetry_frame_counts[i];
+        g_telemetry_frame_counts[i] = 0;
+    }
+    g_telemetry.frame_i = (g_telemetry.frame_i + 1) % MEMORY_TELEMETRY_NUM_FRAMES;
+    g_telemetry.frame_allocations[g_telemetry.frame_i] = total;
+    SDL_AtomicUnlock(&g_telemetry_lock);
+}
+
+void
+memory_telemetry_get(MemoryTelemetry* out)
+{
+    SDL_AtomicLock(&g_telemetry_lock);
+    *out = g_telemetry;
+    SDL_AtomicUnlock(&g_telemetry_lock);
+    out->scratch_peak_bytes = (i64)SDL_AtomicGet(&g_scratch_peak_kb) * 1024;
+    out->scratch_num_threads = SDL_AtomicGet(&g_scratch_num_threads);
+}
+
+void
+memory_telemetry_gpu_bytes(i64 delta)
+{
+    SDL_AtomicLock(&g_telemetry_lock);
+    g_telemetry.gpu_bytes += delta;
+    g_telemetry.gpu_peak_bytes = max(g_telemetry.gpu_peak_bytes, g_telemetry.gpu_bytes);
+    SDL_AtomicUnlock(&g_telemetry_lock);
+}
+
+b32
+memory_telemetry_write_json(FILE* fd, char** arena_names, Arena** arenas, i32 num_arenas)
+{
+    MemoryTelemetry t = {};
+    memory_telemetry_get(&t);
+
+    fprintf(fd, "{\n  \"categories\": [\n");
+    for ( i32 i = 0; i < t.num_categories; ++i ) {
+        MemoryCategoryStats* c = &t.categories[i];
+        fprintf(fd, "    { \"name\": \"%s\", \"live_bytes\": %" PRIi64 ", \"peak_bytes\": %" PRIi64
+                    ", \"allocations\": %" PRIi64 ", \"frame_allocations\": %" PRIi64 " }%s\n",
+                c->name, c->live_bytes, c->peak_bytes, c->num_allocations, c->frame_allocations,
+                i + 1 < t.num_categories ? "," : "");
+    }
+    fprintf(fd, "  ],\n  \"arenas\": [\n");
+    for ( i32 i = 0; i < num_arenas; ++i ) {
+        Arena* a = arenas[i];
+        fprintf(fd, "    { \"name\": \"%s\", \"used_bytes\": %" PRIi64 ", \"high_water_bytes\": %" PRIi64
+                    ", \"committed_bytes\": %" PRIi64 ", \"reserved_bytes\": %" PRIi64 " }%s\n",
+                arena_names[i], (i64)a->count, (i64)a->high_water, (i64)arena_committed_bytes(a), (i64)a->reserved,
+                i + 1 < num_arenas ? "," : "");
+    }
+    fprintf(fd, "  ],\n  \"frame_allocations\": [");
+    // Oldest frame first.
+    for ( i32 i = 1; i <= MEMORY_TELEMETRY_NUM_FRAMES; ++i ) {
+        fprintf(fd, "%s%" PRIi64, i > 1 ? ", " : "",
+                t.frame_allocations[(t.frame_i + i) % MEMORY_TELEMETRY_NUM_FRAMES]);
+    }
+    int written = fprintf(fd, "],\n  \"gpu_bytes\": %" PRIi64 ",\n  \"gpu_peak_bytes\": %" PRIi64
+                              ",\n  \"scratch_peak_bytes\": %" PRIi64 ",\n  \"scratch_threads\": %" PRIi64 "\n}\n",
+                          t.gpu_bytes, t.gpu_peak_bytes, t.scratch_peak_bytes, t.scratch_num_threads);
+    return written > 0 && !ferror(fd);
+}
+
 #if DEBUG_MEMORY_USAGE
 
 #define NUM_MEMORY_DEBUG_BUCKETS    23
@@ -297,6 +659,9 @@ debug_memory_dump_allocations()
         }
     }
 
+    milton_log("Scratch arenas: %d threads, peak of %d KB.\n",
+               SDL_AtomicGet(&g_scratch_num_threads), SDL_AtomicGet(&g_scratch_peak_kb));
+
     milton_log("Dumping reachable memory: --    \n");
     for ( MemDebugHeader* h = g_mem_debug_root;
           h != NULL;
@@ -5,6 +5,8 @@
 
 #include "common.h"
 
+#include <stdio.h>
+
 // TODO: out of memory handler.
 
 #define mlt_malloc(sz) INVALID_CODE_PATH
@@ -12,6 +14,10 @@
     #define mlt_calloc(n, sz, category) calloc_with_debug(n, sz, category, __FILE__, __LINE__)
     #define mlt_free(ptr, category) free_with_debug(ptr, category); ptr=NULL
     #define mlt_realloc(ptr, sz, category) realloc_with_debug(ptr, sz, category, __FILE__, __LINE__)
+#elif MILTON_MEMORY_TELEMETRY
+    #define mlt_calloc(n, sz, category) calloc_with_telemetry(n, sz, category)
+    #define mlt_free(ptr, category) do { if (ptr) { free_with_telemetry(ptr); ptr = NULL; } else { mlt_assert(!"Freeing null"); } } while(0)
+    #define mlt_realloc(ptr, sz, category) realloc_with_telemetry(ptr, sz, category)
 #else
     #define mlt_calloc(n, sz, category) calloc(n, sz)
     #define mlt_free(ptr, category) do { if (ptr) { free(ptr); ptr = NULL; } else { mlt_assert(!"Freeing null"); } } while(0)
@@ -26,6 +32,8 @@ struct Arena
     size_t  count;
     size_t  min_block_size;
     u8*     ptr;
+    size_t  reserved;   // Non-zero for arenas that grow in place. `size` bytes of it are committed.
+    size_t  high_water; // Largest `count` so far.
 
     // For pushing/popping
     Arena*  parent;
@@ -43,6 +51,9 @@ struct ArenaFooter
 
 // Create a root arena from a memory block.
 Arena arena_init(size_t min_block_size = 0, void* base = NULL);
+// Create a root arena that reserves address space and commits pages as it grows, instead of
+// chaining blocks. Falls back to arena_init if the space can't be reserved.
+Arena arena_init_reserve(size_t reserve_size, size_t min_block_size = 0);
 Arena arena_spawn(Arena* parent, size_t size);
 void  arena_reset(Arena* arena);
 void  arena_reset_noclear(Arena* arena);
@@ -57,12 +68,40 @@ Arena  arena_push(Arena* parent, size_t size = 0);
 void   arena_pop(Arena* child);
 void   arena_pop_noclear(Arena* child);
 
+// ==== Marks.
+// Cheaper than arena_push when the arena isn't shared. Blocks the arena chained after the mark are freed.
+struct ArenaMark
+{
+    Arena*  arena;
+    u8*     ptr;
+    size_t  count;
+};
+
+ArenaMark arena_mark(Arena* arena);
+void      arena_reset_to_mark(ArenaMark mark);
+
+// ==== Scratch arenas.
+// Every thread has two, so worker threads can allocate temporaries without
+// locks or malloc. A function that allocates its results from an arena it was
+// given passes it as `conflict`, and its temporaries go in the other one.
+// Usage:
+//      ArenaMark scratch = arena_scratch_begin(out_arena);
+//      u8* tmp = arena_alloc_bytes(scratch.arena, size);
+//      arena_scratch_end(scratch);
+ArenaMark arena_scratch_begin(Arena* conflict = NULL);
+void      arena_scratch_end(ArenaMark scratch);
+// Asserts that the scratch arenas of the calling thread are not in use.
+void      arena_scratch_validate();
+// Unmaps the scratch arenas of the calling thread. Call when a thread is done.
+void      arena_scratch_release();
+
 #define     arena_alloc_elem_(arena, T, flags)          (T *)arena_alloc_bytes((arena), sizeof(T), flags)
 #define     arena_alloc_array_(arena, count, T, flags)  (T *)arena_alloc_bytes((arena), (count) * sizeof(T), flags)
 #define     arena_alloc_elem(arena, T)                  arena_alloc_elem_(arena, T, Arena_NONE)
 #define     arena_alloc_array(arena, count, T)          arena_alloc_array_(arena, count, T, Arena_NONE)
 #define     ARENA_VALIDATE(arena)                       mlt_assert ((arena)->num_children == 0)
 #define     arena_bootstrap(Type, member, size)         (Type*)arena_bootstrap_(size, sizeof(Type), offsetof(Type, member))
+#define     arena_bootstrap_reserve(Type, member, size) (Type*)arena_bootstrap_reserve_(size, sizeof(Type), offsetof(Type, member))
 
 enum ArenaAllocOpts
 {
@@ -74,9 +113,58 @@ enum ArenaAllocOpts
 u8* arena_alloc_bytes(Arena* arena, size_t num_bytes, int alloc_flags=Arena_NONE);
 
 void* arena_bootstrap_(size_t size, size_t obj_size, size_t offset);
+void* arena_bootstrap_reserve_(size_t size, size_t obj_size, size_t offset);
+
+// ==== Telemetry.
+// Live bytes and allocation counts per category, for the Memory window. With
+// MILTON_MEMORY_TELEMETRY, mlt_calloc keeps the size and category of each
+// allocation in a header. Memory that arenas get from the OS is counted
+// under "Arena".
+#define MEMORY_TELEMETRY_MAX_CATEGORIES 16
+#define MEMORY_TELEMETRY_NUM_FRAMES     128
+
+struct MemoryCategoryStats
+{
+    char*   name;
+    i64     live_bytes;
+    i64     peak_bytes;
+    i64     num_allocations;    // Since startup.
+    i64     frame_allocations;  // During the last frame.
+};
+
+struct MemoryTelemetry
+{
+    MemoryCategoryStats categories[MEMORY_TELEMETRY_MAX_CATEGORIES];
+    i32                 num_categories;
+
+    i64                 gpu_bytes;          // Vertex buffers of strokes.
+    i64                 gpu_peak_bytes;
+    i64                 scratch_peak_bytes; // Of any thread.
+    i64                 scratch_num_threads;
+
+    // Allocations of every category in each of the last frames. frame_allocations[frame_i] is the last frame.
+    i64                 frame_allocations[MEMORY_TELEMETRY_NUM_FRAMES];
+    i32                 frame_i;
+};
+
+// Starts counting the allocations of a new frame. Main thread, once per frame.
+void memory_telemetry_end_frame();
+void memory_telemetry_get(MemoryTelemetry* out);
+void memory_telemetry_gpu_bytes(i64 delta);
+// Bytes an arena got from the OS.
+size_t arena_committed_bytes(Arena* arena);
+// Writes the counters and the state of the given arenas as a JSON object.
+b32  memory_telemetry_write_json(FILE* fd, char** arena_names, Arena** arenas, i32 num_arenas);
+
+#if MILTON_MEMORY_TELEMETRY
+    void* calloc_with_telemetry(size_t n, size_t sz, char* category);
+    void  free_with_telemetry(void* ptr);
+    void* realloc_with_telemetry(void* ptr, size_t sz, char* category);
+#endif
 
 #if DEBUG_MEMORY_USAGE
     void* calloc_with_debug(size_t n, size_t sz, char* category, char* file, i64 line);
     void  free_with_debug(void* ptr, char* category);
     void* realloc_with_debug(void* ptr, size_t sz, char* category, char* file, i64 line);
+    void  debug_memory_dump_allocations();
 #endif
@@ -107,38 +107,44 @@ milton_update_brushes(Milton* milton)
 
 // Eyedropper
 void
-eyedropper_init(Milton* milton)
+eyedropper_input(Eyedropper* e, RenderData* render_data, MiltonGui* gui, i32 w, i32 h, v2i point)
 {
-    size_t bpp = 4;
-    i32 w = milton->view->screen_size.w;
-    i32 h = milton->view->screen_size.h;
-
-    Eyedropper* e = milton->eyedropper;
-    if (!e->buffer)
-    {
-        e->buffer = (u8*)mlt_calloc(w*h*bpp, 1, "Bitmap");
-        gpu_render_to_buffer(milton, e->buffer, 1, 0, 0, w, h, 1.0f);
-    }
-}
-
-void
-eyedropper_input(Eyedropper* e, MiltonGui* gui, i32 w, i32 h, v2i point)
-{
-
-    u32* pixels = (u32*)e->buffer;
-    if ( point.y > 0 && point.y <= h && point.x > 0 && point.x <= w ) {
-        v4f color = color_u32_to_v4f(pixels[point.y * w + point.x]);
-        gui_picker_from_rgb(&gui->picker, color.rgb);
+    if ( point.y >= 0 && point.y < h && point.x >= 0 && point.x < w ) {
+        // Pick up the read in flight before asking for another one. A new request would drop it,
+        // and while the cursor keeps moving no result would ever arrive.
+        if ( e->is_read_pending && gpu_canvas_pixel_result(render_data, &e->color) ) {
+            e->is_read_pending = false;
+            e->is_sample_valid = true;
+        }
+        b32 is_read_needed = !e->is_sample_valid || e->point != point || gpu_canvas_pixel_is_stale(render_data);
+        // One read at a time. The newest point is read once the one in flight is done.
+        if ( is_read_needed && !e->is_read_pending ) {
+            gpu_request_canvas_pixel(render_data, point.x, point.y);
+            e->point = point;
+            e->is_read_pending = true;
+            // Without async readback the result is already there.
+            if ( gpu_canvas_pixel_result(render_data, &e->color) ) {
+                e->is_read_pending = false;
+                e->is_sample_valid = true;
+            }
+        }
+        if ( e->is_read_pending ) {
+            // Make sure there is a frame to pick up the result.
+            SDL_Event event = {};
+            event.type = SDL_USEREVENT;
+            SDL_PushEvent(&event);
+        }
+        if ( e->is_sample_valid ) {
+            gui_picker_from_rgb(&gui->picker, e->color);
+        }
     }
 }
 
 void
 eyedropper_deinit(Eyedropper* e)
 {
-    if ( e->buffer ) {
-        mlt_free(e->buffer, "Bitmap");
-        e->buffer = NULL;
-    }
+    e->is_sample_valid = false;
+    e->is_read_pending = false;
 }
 
 static Brush
@@ -175,19 +181,359 @@ milton_current_mode_is_for_drawing(Milton* milton)
     return result;
 }
 
+// ---- History
+//
+// Every change that can be undone pushes a record onto the history. Undo pops
+// the top record, reverts it and pushes it onto the redo stack, and redo does
+// the opposite. Records point to their layers, and undone strokes wait in the
+// graveyard in the same order as their records, so both are O(1).
+//
+// A new change clears the redo stack. Past MILTON_HISTORY_MAX_RECORDS, a
+// checkpoint drops the oldest records, which can't be undone anymore.
+//
+// Every push, undo and redo is appended to the journal, if there is one, and
+// marks the canvas for saving. Property changes are journaled at the next
+// history change or frame, after the GUI made them.
+
+// A background load decodes the top bucket of every layer first, so history
+// changes don't wait for it. They only do when they reach the other buckets:
+// undoing a bucket's worth of strokes, or freeing a layer that is gone.
+static void
+history_wait_for_bucket(Milton* milton, StrokeBucket* bucket)
+{
+    if ( SDL_AtomicGet(&bucket->loading) ) {
+        milton_load_wait(milton);
+    }
+}
+
+// Releases what a record that won't be applied again keeps alive.
+static void
+history_record_release(Milton* milton, HistoryRecord* h, b32 from_redo_stack)
+{
+    b32 layer_is_gone = from_redo_stack ? h->type == HistoryElement_LAYER_ADD
+                                        : h->type == HistoryElement_LAYER_DELETE;
+    if ( layer_is_gone ) {
+        i64 count = h->layer->strokes.count;
+        for ( StrokeBucket* bucket = &h->layer->strokes.root;
+              bucket != NULL && count > 0;
+              bucket = bucket->next ) {
+            history_wait_for_bucket(milton, bucket);
+            count -= STROKELIST_BUCKET_COUNT;
+        }
+        gpu_free_layer_strokes(milton->render_data, h->layer);
+        stroke_pager_free_list(&milton->canvas->pager, &h->layer->strokes);
+    }
+    if ( h->properties ) {
+        layer::layer_release_properties(h->properties);
+        mlt_free(h->properties, "History");
+        h->properties = NULL;
+    }
+}
+
+static void
+history_clear_redo(Milton* milton)
+{
+    CanvasState* canvas = milton->canvas;
+    i64 graveyard_i = 0;
+    for ( i64 i = 0; i < canvas->redo_stack.count; ++i ) {
+        HistoryRecord* h = &canvas->redo_stack.data[i];
+        if ( h->type == HistoryElement_STROKE_ADD && graveyard_i < canvas->stroke_graveyard.count ) {
+            StrokeBucket* bucket = strokelist_get_bucket(&h->layer->strokes, h->stroke_index);
+            stroke_pager_free_stroke(&canvas->pager, bucket, &canvas->stroke_graveyard.data[graveyard_i++]);
+        }
+        history_record_release(milton, h, true);
+    }
+    gpu_free_strokes(canvas->stroke_graveyard.data, canvas->stroke_graveyard.count, milton->render_data);
+    reset(&canvas->redo_stack);
+    reset(&canvas->stroke_graveyard);
+}
+
 static void
-clear_stroke_redo(Milton* milton)
+history_release(Milton* milton)
 {
-    while ( milton->canvas->stroke_graveyard.count > 0 ) {
-        Stroke s = pop(&milton->canvas->stroke_graveyard);
-    }
-    for ( i64 i = 0; i < milton->canvas->redo_stack.count; ++i ) {
-        HistoryElement h = milton->canvas->redo_stack.data[i];
-        if ( h.type == HistoryElement_STROKE_ADD ) {
-            for ( i64 j = i; j < milton->canvas->redo_stack.count-1; ++j ) {
-                milton->canvas->redo_stack.data[j] = milton->canvas->redo_stack.data[j+1];
+    CanvasState* canvas = milton->canvas;
+    history_clear_redo(milton);
+    for ( i64 i = 0; i < canvas->history.count; ++i ) {
+        history_record_release(milton, &canvas->history.data[i], false);
+    }
+    release(&canvas->history);
+    release(&canvas->redo_stack);
+    release(&canvas->stroke_graveyard);
+    canvas->history = {};
+    canvas->redo_stack = {};
+    canvas->stroke_graveyard = {};
+}
+
+// Drops the oldest records. Called once the history is a quarter over the limit, so that pushes stay O(1) on average.
+static void
+history_checkpoint(Milton* milton)
+{
+    DArray<HistoryRecord>* history = &milton->canvas->history;
+    i64 num_dropped = history->count - MILTON_HISTORY_MAX_RECORDS;
+    if ( num_dropped > 0 ) {
+        for ( i64 i = 0; i < num_dropped; ++i ) {
+            history_record_release(milton, &history->data[i], false);
+        }
+        memmove(history->data, history->data + num_dropped,
+                (size_t)(history->count - num_dropped) * sizeof(HistoryRecord));
+        history->count -= num_dropped;
+    }
+}
+
+// Journals the properties of the top record's layer if they changed since they were journaled.
+static void
+history_journal_properties(Milton* milton)
+{
+    CanvasState* canvas = milton->canvas;
+    if ( canvas->properties_changed ) {
+        canvas->properties_changed = false;
+        HistoryRecord* top = peek(&canvas->history);
+        mlt_assert(top && top->type == HistoryElement_LAYER_PROPERTIES);
+        milton_journal_push(milton, top, NULL);
+    }
+}
+
+static void
+history_push(Milton* milton, HistoryRecord h)
+{
+    history_journal_properties(milton);
+    history_clear_redo(milton);
+    push(&milton->canvas->history, h);
+    if ( milton->canvas->history.count > MILTON_HISTORY_MAX_RECORDS + MILTON_HISTORY_MAX_RECORDS / 4 ) {
+        history_checkpoint(milton);
+    }
+}
+
+// Puts a layer back in the list, above `below`, and makes it the working layer.
+static void
+history_link_layer(Milton* milton, Layer* layer, Layer* below)
+{
+    CanvasState* canvas = milton->canvas;
+    Layer* above = below ? below->next : canvas->root_layer;
+    layer->prev = below;
+    layer->next = above;
+    if ( below ) {
+        below->next = layer;
+    } else {
+        canvas->root_layer = layer;
+    }
+    if ( above ) {
+        above->prev = layer;
+    }
+    milton_set_working_layer(milton, layer);
+}
+
+// Takes a layer out of the list. Returns the layer that was under it.
+static Layer*
+history_unlink_layer(Milton* milton, Layer* layer)
+{
+    CanvasState* canvas = milton->canvas;
+    mlt_assert(layer->next || layer->prev);
+    Layer* below = layer->prev;
+    if ( layer->next ) { layer->next->prev = layer->prev; }
+    if ( layer->prev ) { layer->prev->next = layer->next; }
+    if ( layer == canvas->root_layer ) {
+        canvas->root_layer = layer->next;
+    }
+    if ( layer == canvas->working_layer ) {
+        milton_set_working_layer(milton, layer->next ? layer->next : layer->prev);
+    }
+    layer->next = NULL;
+    layer->prev = NULL;
+    return below;
+}
+
+// Reverts a record, or applies it again. Returns false if it no longer applies.
+static b32
+history_apply(Milton* milton, HistoryRecord* h, b32 undo, HistoryChange* change)
+{
+    CanvasState* canvas = milton->canvas;
+    b32 applied = true;
+
+    *change = {};
+    change->type = h->type;
+    change->layer = h->layer;
+    change->bounds = rect_without_size();
+
+    switch ( h->type ) {
+    case HistoryElement_STROKE_ADD: {
+        Layer* l = h->layer;
+        if ( undo ) {
+            // The stroke leaves the list, so its points have to be in memory.
+            StrokeBucket* bucket = l->strokes.count > 0 ? strokelist_get_bucket(&l->strokes, l->strokes.count - 1) : NULL;
+            if ( bucket ) {
+                history_wait_for_bucket(milton, bucket);
             }
-            pop(&milton->canvas->redo_stack);
+            applied = bucket && stroke_pager_touch(l->strokes.pager, bucket);
+            if ( applied ) {
+                milton_save_preserve_top_stroke(milton, l);
+                Stroke stroke = pop(&l->strokes);
+                push(&canvas->stroke_graveyard, stroke);
+                h->stroke_index = l->strokes.count;
+                change->bounds = stroke.bounding_rect;
+            }
+        } else {
+            applied = canvas->stroke_graveyard.count > 0;
+            if ( applied ) {
+                Stroke stroke = pop(&canvas->stroke_graveyard);
+                mlt_assert(stroke.layer_id == l->id);
+                change->stroke = layer::layer_push_stroke(l, stroke);
+                change->bounds = stroke.bounding_rect;
+            }
+        }
+    } break;
+    case HistoryElement_LAYER_ADD:
+    case HistoryElement_LAYER_DELETE: {
+        b32 link = undo == (h->type == HistoryElement_LAYER_DELETE);
+        if ( link ) {
+            history_link_layer(milton, h->layer, h->below);
+        } else {
+            history_unlink_layer(milton, h->layer);
+        }
+        change->bounds = layer::layer_bounds(h->layer);
+    } break;
+    case HistoryElement_LAYER_PROPERTIES: {
+        layer::layer_swap_properties(h->layer, h->properties);
+        change->bounds = layer::layer_bounds(h->layer);
+    } break;
+    case HistoryElement_LAYER_MOVE: {
+        // Same for undo and redo. Put it back, and remember where it was.
+        Layer* below = history_unlink_layer(milton, h->layer);
+        history_link_layer(milton, h->layer, h->below);
+        h->below = below;
+        change->bounds = layer::layer_bounds(h->layer);
+    } break;
+    default: {
+        applied = false;
+    } break;
+    }
+    return applied;
+}
+
+Stroke*
+milton_add_stroke(Milton* milton, Layer* layer, Stroke stroke)
+{
+    // Loaded first. See history_wait_for_bucket
+    mlt_assert(!SDL_AtomicGet(&strokelist_get_bucket(&layer->strokes, layer->strokes.count)->loading));
+
+    Stroke* result = layer::layer_push_stroke(layer, stroke);
+
+    HistoryRecord h = {};
+    h.type = HistoryElement_STROKE_ADD;
+    h.layer = layer;
+    history_push(milton, h);
+    milton_journal_push(milton, peek(&milton->canvas->history), result);
+
+    return result;
+}
+
+b32
+milton_undo(Milton* milton, HistoryChange* out_change)
+{
+    history_journal_properties(milton);
+
+    b32 undone = false;
+    CanvasState* canvas = milton->canvas;
+    if ( canvas->history.count > 0 ) {
+        HistoryRecord h = pop(&canvas->history);
+        undone = history_apply(milton, &h, /*undo*/true, out_change);
+        if ( undone ) {
+            milton_journal_undo(milton, push(&canvas->redo_stack, h));
+            if ( h.type != HistoryElement_STROKE_ADD ) {
+                milton->flags |= MiltonStateFlags_LAYERS_CHANGED;
+            }
+        } else {
+            history_record_release(milton, &h, false);
+        }
+    }
+    return undone;
+}
+
+b32
+milton_redo(Milton* milton, HistoryChange* out_change)
+{
+    // Redone strokes go back to the bucket they were undone from, which is loaded.
+    history_journal_properties(milton);
+
+    b32 redone = false;
+    CanvasState* canvas = milton->canvas;
+    if ( canvas->redo_stack.count > 0 ) {
+        HistoryRecord h = pop(&canvas->redo_stack);
+        redone = history_apply(milton, &h, /*undo*/false, out_change);
+        if ( redone ) {
+            milton_journal_redo(milton, push(&canvas->history, h), out_change->stroke);
+            if ( h.type != HistoryElement_STROKE_ADD ) {
+                milton->flags |= MiltonStateFlags_LAYERS_CHANGED;
+            }
+        } else {
+            history_record_release(milton, &h, true);
+        }
+    }
+    return redone;
+}
+
+void
+milton_layer_properties_will_change(Milton* milton, Layer* layer, u32 merge_id)
+{
+    CanvasState* canvas = milton->canvas;
+    HistoryRecord* top = peek(&canvas->history);
+    b32 merged =    merge_id != 0
+                 && top != NULL
+                 && canvas->redo_stack.count == 0
+                 && top->type == HistoryElement_LAYER_PROPERTIES
+                 && top->layer == layer
+                 && top->merge_id == merge_id;
+    if ( !merged ) {
+        HistoryRecord h = {};
+        h.type = HistoryElement_LAYER_PROPERTIES;
+        h.layer = layer;
+        h.merge_id = merge_id;
+        h.properties = (LayerProperties*)mlt_calloc(1, sizeof(LayerProperties), "History");
+        layer::layer_get_properties(layer, h.properties);
+        history_push(milton, h);
+    }
+    canvas->properties_changed = true;
+    milton->flags |= MiltonStateFlags_LAYERS_CHANGED;
+}
+
+void
+milton_history_from_elements(Milton* milton, HistoryElement* elements, i64 count)
+{
+    CanvasState* canvas = milton->canvas;
+    history_release(milton);
+    reserve(&canvas->history, count);
+    // Elements of layers that were deleted before the file was saved have nothing to undo.
+    Layer* layer = NULL;
+    for ( i64 i = 0; i < count; ++i ) {
+        if ( elements[i].type != HistoryElement_STROKE_ADD ) {
+            continue;
+        }
+        if ( layer == NULL || layer->id != elements[i].layer_id ) {
+            layer = layer::get_by_id(canvas->root_layer, elements[i].layer_id);
+        }
+        if ( layer ) {
+            HistoryRecord h = {};
+            h.type = HistoryElement_STROKE_ADD;
+            h.layer = layer;
+            push(&canvas->history, h);
+        }
+    }
+    history_checkpoint(milton);
+}
+
+void
+milton_history_to_elements(Milton* milton, DArray<HistoryElement>* out)
+{
+    CanvasState* canvas = milton->canvas;
+    reset(out);
+    reserve(out, canvas->history.count);
+    for ( i64 i = 0; i < canvas->history.count; ++i ) {
+        HistoryRecord* h = &canvas->history.data[i];
+        // Deleted layers are not saved.
+        if (    h->type == HistoryElement_STROKE_ADD
+             && layer::get_by_id(canvas->root_layer, h->layer->id) == h->layer ) {
+            HistoryElement e = { HistoryElement_STROKE_ADD, h->layer->id };
+            push(out, e);
         }
     }
 }
@@ -401,6 +747,11 @@ milton_set_canvas_file_(Milton* milton, PATH_CHAR* fname, b32 is_default)
     }
     milton->mlt_file_path = fname;
 
+    // Headless instances leave the preferences of the interactive app alone.
+    if ( milton->flags & MiltonStateFlags_HEADLESS ) {
+        return;
+    }
+
     if ( !is_default ) {
         milton_set_last_canvas_fname(fname);
     } else {
@@ -497,22 +848,77 @@ settings_init(MiltonSettings* s)
     s->background_color = v3f{1,1,1};
 }
 
+#if MILTON_SAVE_ASYNC
+int  // Thread
+milton_saver_thread(void* state_)
+{
+    Milton* milton = (Milton*)state_;
+    PROFILE_THREAD_NAME("Saver");
+
+    SDL_LockMutex(milton->save_mutex);
+    for ( ;; ) {
+        while ( !milton->save_pending && !milton->slow_frame_pending && !milton->save_quit ) {
+            SDL_CondWait(milton->save_cond, milton->save_mutex);
+        }
+        if ( milton->slow_frame_pending ) {
+            SlowFrameCapture* capture = milton->slow_frame_pending;
+            milton->slow_frame_pending = NULL;
+            SDL_UnlockMutex(milton->save_mutex);
+
+            milton_write_slow_frame(capture);
+            milton_release_slow_frame(capture);
+
+            SDL_LockMutex(milton->save_mutex);
+            continue;
+        }
+        if ( !milton->save_pending ) {
+            break;
+        }
+        milton->save_current = milton->save_pending;
+        milton->save_pending = NULL;
+        SDL_UnlockMutex(milton->save_mutex);
+
+        milton_save_snapshot_to_file(milton, milton->save_current);
+
+        SDL_LockMutex(milton->save_mutex);
+        milton_release_save_snapshot(milton->save_current);
+        milton->save_current = NULL;
+        SDL_CondBroadcast(milton->save_cond);
+    }
+    SDL_UnlockMutex(milton->save_mutex);
+
+    return 0;
+}
+#endif
+
 void
-milton_init(Milton* milton, i32 width, i32 height, f32 ui_scale, PATH_CHAR* file_to_open)
+milton_init(Milton* milton, i32 width, i32 height, f32 ui_scale, PATH_CHAR* file_to_open, int init_flags)
 {
     init_localization();
 
-    milton->canvas = arena_bootstrap(CanvasState, arena, 1024*1024);
+    if ( init_flags & MiltonInitFlags_HEADLESS ) {
+        milton->flags |= MiltonStateFlags_HEADLESS;
+    }
+    if ( init_flags & MiltonInitFlags_NO_GPU ) {
+        milton->flags |= MiltonStateFlags_NO_GPU;
+    }
+
+    milton->canvas = arena_bootstrap_reserve(CanvasState, arena, 1024*1024);
+    stroke_pager_init(&milton->canvas->pager, (size_t)MILTON_STROKE_MEMORY_BUDGET_MB*1024*1024);
     milton->working_stroke.points    = arena_alloc_array(&milton->root_arena, STROKE_MAX_POINTS, v2l);
     milton->working_stroke.pressures = arena_alloc_array(&milton->root_arena, STROKE_MAX_POINTS, f32);
 #if STROKE_DEBUG_VIZ
     milton->working_stroke.debug_flags = arena_alloc_array(&milton->root_arena, STROKE_MAX_POINTS, int);
 #endif
 
-#if MILTON_SAVE_ASYNC
+    milton->journal.mutex = SDL_CreateMutex();
+
     milton->save_mutex = SDL_CreateMutex();
-    milton->save_flag = SaveEnum_GOOD_TO_GO;
     milton->save_cond = SDL_CreateCond();
+#if MILTON_SAVE_ASYNC
+    if ( !(milton->flags & MiltonStateFlags_HEADLESS) ) {
+        milton->save_thread = SDL_CreateThread(milton_saver_thread, "Saver Thread", (void*)milton);
+    }
 #endif
 
     milton->current_mode = MiltonMode::PEN;
@@ -533,7 +939,10 @@ milton_init(Milton* milton, i32 width, i32 height, f32 ui_scale, PATH_CHAR* file
 
     milton->view->screen_size = { width, height };
 
-    gpu_init(milton->render_data, milton->view, &milton->gui->picker);
+    if ( !(milton->flags & MiltonStateFlags_NO_GPU) ) {
+        gpu_init(milton->render_data, milton->view, &milton->gui->picker);
+    }
+    gpu_set_geometry_cache(milton->render_data, &milton->geometry_cache);
 
     gpu_update_background(milton->render_data, milton->view->background_color);
 
@@ -587,18 +996,20 @@ milton_init(Milton* milton, i32 width, i32 height, f32 ui_scale, PATH_CHAR* file
 
 #if MILTON_ENABLE_PROFILING
     milton->viz_window_visible = false;  // hidden by default
+    milton->frame_timing_visible = false;
 #endif
 
     milton->flags |= MiltonStateFlags_RUNNING;
 
-#if MILTON_ENABLE_PROFILING
-    profiler_init();
-#endif
+    PROFILE_THREAD_NAME("Main");
 }
 
 void
 upload_gui(Milton* milton)
 {
+    if ( milton->flags & MiltonStateFlags_NO_GPU ) {
+        return;
+    }
     gpu_update_canvas(milton->render_data, milton->canvas, milton->view);
     gpu_resize(milton->render_data, milton->view);
     gpu_update_picker(milton->render_data, &milton->gui->picker);
@@ -634,18 +1045,42 @@ milton_reset_canvas(Milton* milton)
 {
     CanvasState* canvas = milton->canvas;
 
+    // Loads and saves in flight use the strokes in the canvas arena.
+    milton_load_cancel(milton);
+    milton_save_flush(milton);
+    milton->flags &= ~MiltonStateFlags_LOAD_REJECTED;
+    // Only had the strokes that were loaded.
+    milton->save_after_load = false;
+    milton->flags &= ~MiltonStateFlags_LAYERS_CHANGED;
+    // Of the canvas that goes away.
+    milton->save_after_preview = false;
+    milton->preview_request_size = {};
+
     gpu_free_strokes(milton->render_data, milton->canvas);
-    milton->mlt_binary_version = MILTON_MINOR_VERSION;
+    milton->mlt_binary_version = MILTON_MLT_VERSION;
     milton->last_save_time = {};
 
     // Clear history
-    release(&canvas->history);
-    release(&canvas->redo_stack);
-    release(&canvas->stroke_graveyard);
+    history_release(milton);
+    reset(&milton->preview_pixels);
+    milton_journal_close(milton);
+
+    geometry_cache_close(&milton->geometry_cache);
+    milton->geometry_cache.num_misses = 0;
+    milton->geometry_cache.rebuild_requested = false;
+    SDL_AtomicSet(&milton->geometry_cache.rebuild_pending, 0);
+    SDL_AtomicSet(&milton->geometry_cache.rebuilt, 0);
+
+    if ( canvas->mapped_file ) {
+        platform_unmap_file(canvas->mapped_file, canvas->mapped_file_size);
+    }
+
+    stroke_pager_release(&canvas->pager);
 
     size_t size = canvas->arena.min_block_size;
     arena_free(&canvas->arena);  // Note: This destroys the canvas
-    milton->canvas = arena_bootstrap(CanvasState, arena, size);
+    milton->canvas = arena_bootstrap_reserve(CanvasState, arena, size);
+    stroke_pager_init(&milton->canvas->pager, (size_t)MILTON_STROKE_MEMORY_BUDGET_MB*1024*1024);
 
     mlt_assert(milton->canvas->history.count == 0);
 }
@@ -720,47 +1155,86 @@ milton_try_quit(Milton* milton)
 }
 
 void
-milton_save_postlude(Milton* milton)
+milton_apply_save_result(Milton* milton)
 {
-    milton->last_save_time = platform_get_walltime();
-    milton->last_save_stroke_count = layer::count_strokes(milton->canvas->root_layer);
-
-    milton->flags &= ~MiltonStateFlags_LAST_SAVE_FAILED;
+    SDL_LockMutex(milton->save_mutex);
+    SaveResult result = milton->save_result;
+    milton->save_result.is_new = false;
+    SDL_UnlockMutex(milton->save_mutex);
+
+    if ( result.is_new ) {
+        if ( result.ok ) {
+            milton->last_save_time = result.time;
+            milton->last_save_stroke_count = result.num_strokes;
+            milton->flags &= ~MiltonStateFlags_LAST_SAVE_FAILED;
+        } else {
+            milton->flags |= MiltonStateFlags_LAST_SAVE_FAILED;
+        }
+        if ( result.move_file_failed ) {
+            milton->flags |= MiltonStateFlags_MOVE_FILE_FAILED;
+        }
+    }
 }
 
-#if MILTON_SAVE_ASYNC
-int  // Thread
-milton_save_async(void* state_)
+void
+milton_request_save(Milton* milton)
 {
-    Milton* milton = (Milton*)state_;
-
-    SDL_LockMutex(milton->save_mutex);
-    i64 flag = milton->save_flag;
+    PROFILE_SCOPE("request save");
+    if ( milton->flags & MiltonStateFlags_LOAD_REJECTED ) {
+        // The canvas is about to be replaced. See milton_load_poll
+        return;
+    }
+    else if ( milton->load ) {
+        // Snapshots need every stroke. Waiting for them here would freeze the UI until the load is
+        // done, so milton_update_and_render asks again then.
+        milton->save_after_load = true;
+    }
+    else if ( milton->save_thread ) {
+        // Taking the snapshot only copies small things. The strokes are read by the saver thread.
+        SaveSnapshot* snapshot = milton_save_snapshot(milton);
+        SaveSnapshot* replaced = NULL;
 
-    if( flag == SaveEnum_GOOD_TO_GO ) {
-        milton->save_flag = SaveEnum_IN_USE;
+        SDL_LockMutex(milton->save_mutex);
+        replaced = milton->save_pending;
+        milton->save_pending = snapshot;
+        SDL_CondBroadcast(milton->save_cond);
         SDL_UnlockMutex(milton->save_mutex);
 
+        // The saver didn't get to it. The new snapshot has everything it had.
+        milton_release_save_snapshot(replaced);
+    } else {
         milton_save(milton);
+    }
+}
 
-        SDL_LockMutex(milton->save_mutex);
-
-        milton->save_flag = SaveEnum_GOOD_TO_GO;
+void
+milton_save_flush(Milton* milton)
+{
+    SDL_LockMutex(milton->save_mutex);
+    while ( milton->save_pending || milton->save_current ) {
+        SDL_CondWait(milton->save_cond, milton->save_mutex);
+    }
+    SDL_UnlockMutex(milton->save_mutex);
 
-        SDL_CondSignal(milton->save_cond);
+    milton_apply_save_result(milton);
+}
 
+static void
+milton_stop_saver_thread(Milton* milton)
+{
+    if ( milton->save_thread ) {
+        SDL_LockMutex(milton->save_mutex);
+        milton->save_quit = true;
+        SDL_CondBroadcast(milton->save_cond);
         SDL_UnlockMutex(milton->save_mutex);
-    }
-    else if ( flag == SaveEnum_IN_USE ) {
-        SDL_UnlockMutex(milton->save_mutex);
-    }
 
-    return flag;
+        SDL_WaitThread(milton->save_thread, NULL);
+        milton->save_thread = NULL;
+    }
 }
-#endif
 
 void
-milton_new_layer(Milton* milton)
+milton_new_layer(Milton* milton, b32 undoable)
 {
     CanvasState* canvas = milton->canvas;
     i32 id = canvas->layer_guid++;
@@ -770,9 +1244,8 @@ milton_new_layer(Milton* milton)
     {
         layer->id = id;
         layer->flags = LayerFlags_VISIBLE;
-        layer->strokes.arena = &canvas->arena;
         layer->alpha = 1.0f;
-        strokelist_init_bucket(&layer->strokes.root);
+        strokelist_init(&layer->strokes, &canvas->arena, &canvas->pager);
     }
     snprintf(layer->name, MAX_LAYER_NAME_LEN, "Layer %d", layer->id);
 
@@ -785,6 +1258,16 @@ milton_new_layer(Milton* milton)
         canvas->root_layer = layer;
         milton_set_working_layer(milton, layer);
     }
+
+    if ( undoable ) {
+        HistoryRecord h = {};
+        h.type = HistoryElement_LAYER_ADD;
+        h.layer = layer;
+        h.below = layer->prev;
+        history_push(milton, h);
+        milton_journal_push(milton, peek(&canvas->history), NULL);
+        milton->flags |= MiltonStateFlags_LAYERS_CHANGED;
+    }
 }
 
 void
@@ -798,19 +1281,31 @@ void
 milton_delete_working_layer(Milton* milton)
 {
     Layer* layer = milton->canvas->working_layer;
+    // The last layer can't be deleted.
     if ( layer->next || layer->prev ) {
-        if (layer->next) layer->next->prev = layer->prev;
-        if (layer->prev) layer->prev->next = layer->next;
-
-        Layer* wl = NULL;
-        if (layer->next) wl = layer->next;
-        else wl = layer->prev;
-        milton_set_working_layer(milton, wl);
+        HistoryRecord h = {};
+        h.type = HistoryElement_LAYER_DELETE;
+        h.layer = layer;
+        h.below = history_unlink_layer(milton, layer);
+        history_push(milton, h);
+        milton_journal_push(milton, peek(&milton->canvas->history), NULL);
+        milton->flags |= MiltonStateFlags_LAYERS_CHANGED;
     }
-    if ( layer == milton->canvas->root_layer )
-        milton->canvas->root_layer = milton->canvas->working_layer;
+}
 
-    // milton->flags |= MiltonStateFlags_REQUEST_QUALITY_REDRAW;
+void
+milton_move_layer(Milton* milton, Layer* layer, Layer* below)
+{
+    if ( below != layer && below != layer->prev ) {
+        HistoryRecord h = {};
+        h.type = HistoryElement_LAYER_MOVE;
+        h.layer = layer;
+        h.below = history_unlink_layer(milton, layer);
+        history_link_layer(milton, layer, below);
+        history_push(milton, h);
+        milton_journal_push(milton, peek(&milton->canvas->history), NULL);
+        milton->flags |= MiltonStateFlags_LAYERS_CHANGED;
+    }
 }
 
 b32
@@ -833,67 +1328,63 @@ milton_toggle_brush_smoothing(Milton* milton)
 static void
 milton_validate(Milton* milton)
 {
-    // Make sure that the history reflects the strokes that exist
-    i64 num_layers=0;
-    for ( Layer* l = milton->canvas->root_layer; l != NULL; l = l->next ) {
-        ++num_layers;
-    }
-    i32* layer_ids = (i32*)mlt_calloc((size_t)num_layers, sizeof(i32), "Validate");
-    i64 i = 0;
-    for ( Layer* l = milton->canvas->root_layer; l != NULL; l = l->next ) {
-        layer_ids[i] = l->id;
-        ++i;
-    }
-
+    // Make sure that the history reflects the strokes that exist. A layer can't have more records
+    // than strokes. It has fewer only when the oldest records were dropped.
+    CanvasState* canvas = milton->canvas;
+    b32 valid = true;
     i64 history_count = 0;
-    for ( i64 hi = 0; hi < milton->canvas->history.count; ++hi ) {
-        i32 id = milton->canvas->history.data[hi].layer_id;
-        for ( i64 li = 0; li < num_layers; ++li ) {
-            if ( id == layer_ids[li] ) {
-                ++history_count;
+    for ( Layer* l = canvas->root_layer; l != NULL; l = l->next ) {
+        i64 layer_count = 0;
+        for ( i64 hi = 0; hi < canvas->history.count; ++hi ) {
+            HistoryRecord* h = &canvas->history.data[hi];
+            if ( h->type == HistoryElement_STROKE_ADD && h->layer == l ) {
+                ++layer_count;
             }
         }
+        valid = valid && layer_count <= l->strokes.count;
+        history_count += layer_count;
     }
 
-    i64 stroke_count = layer::count_strokes(milton->canvas->root_layer);
-    if ( history_count != stroke_count ) {
-        milton_log("WARNING: Recreating history. File says History: %d(max %d) Actual strokes: %d\n",
-                   history_count, milton->canvas->history.count,
+    i64 stroke_count = layer::count_strokes(canvas->root_layer);
+    if ( history_count < min(stroke_count, (i64)MILTON_HISTORY_MAX_RECORDS) ) {
+        valid = false;
+    }
+    if ( !valid ) {
+        milton_log("WARNING: Recreating history. File says History: %" PRIi64 "(max %" PRIi64 ") Actual strokes: %" PRIi64 "\n",
+                   history_count, canvas->history.count,
                    stroke_count);
-        reset(&milton->canvas->history);
-        i32 id = 0;
-        for ( Layer *l = milton->canvas->root_layer;
+        history_release(milton);
+        for ( Layer *l = canvas->root_layer;
               l != NULL;
               l = l->next ) {
             for ( i64 si = 0; si < l->strokes.count; ++si ) {
-                Stroke* s = get(&l->strokes, si);
-                HistoryElement he = { HistoryElement_STROKE_ADD, s->layer_id };
-                push(&milton->canvas->history, he);
+                HistoryRecord h = {};
+                h.type = HistoryElement_STROKE_ADD;
+                h.layer = l;
+                push(&canvas->history, h);
             }
         }
+        history_checkpoint(milton);
     }
-
-    mlt_free(layer_ids, "Validate");
 }
 
 
 // Copy points from in_stroke to out_stroke, but do interpolation to smooth it out.
 static void
-copy_stroke(Arena* arena, CanvasView* view, Stroke* in_stroke, Stroke* out_stroke)
+copy_stroke(StrokeBucket* bucket, CanvasView* view, Stroke* in_stroke, Stroke* out_stroke)
 {
     i32 num_points = in_stroke->num_points;
     // Shallow copy
     *out_stroke = *in_stroke;
 
     // Deep copy
-    out_stroke->points    = arena_alloc_array(arena, num_points, v2l);
-    out_stroke->pressures = arena_alloc_array(arena, num_points, f32);
+    strokelist_alloc_payload(bucket, num_points, out_stroke);
 
     memcpy(out_stroke->points, in_stroke->points, num_points * sizeof(v2l));
     memcpy(out_stroke->pressures, in_stroke->pressures, num_points * sizeof(f32));
 
 #if STROKE_DEBUG_VIZ
-    out_stroke->debug_flags = arena_alloc_array(arena, num_points * sizeof(int), int);
+    out_stroke->debug_flags = arena_alloc_array(&bucket->payload, num_points * sizeof(int), int);
     memcpy(out_stroke->debug_flags, in_stroke->debug_flags, num_points*sizeof(int));
 #endif
 
@@ -903,6 +1394,7 @@ copy_stroke(Arena* arena, CanvasView* view, Stroke* in_stroke, Stroke* out_strok
 void
 milton_update_and_render(Milton* milton, MiltonInput* input)
 {
+    PROFILE_SCOPE("milton_update_and_render");
     PROFILE_GRAPH_BEGIN(update);
 
     b32 end_stroke = (input->flags & MiltonInputFlags_END_STROKE);
@@ -915,10 +1407,17 @@ milton_update_and_render(Milton* milton, MiltonInput* input)
 
     b32 should_save =
             ((input->flags & MiltonInputFlags_OPEN_FILE)) ||
-            ((input->flags & MiltonInputFlags_SAVE_FILE)) ||
+            ((input->flags & MiltonInputFlags_SAVE_FILE));
+    // Layer changes come from the GUI, before this.
+    history_journal_properties(milton);
+
+    // These are appended to the journal when there is one, and only need a full save to compact it.
+    b32 canvas_changed =
             ((input->flags & MiltonInputFlags_END_STROKE)) ||
             ((input->flags & MiltonInputFlags_UNDO)) ||
-            ((input->flags & MiltonInputFlags_REDO));
+            ((input->flags & MiltonInputFlags_REDO)) ||
+            ((milton->flags & MiltonStateFlags_LAYERS_CHANGED));
+    milton->flags &= ~MiltonStateFlags_LAYERS_CHANGED;
 
     if ( input->flags & MiltonInputFlags_OPEN_FILE ) {
         milton_load(milton);
@@ -927,6 +1426,18 @@ milton_update_and_render(Milton* milton, MiltonInput* input)
         render_flags |= RenderDataFlags_WITH_BLUR;
     }
 
+    if ( milton_load_poll(milton) ) {
+        // More strokes were loaded in the background, or they were damaged and the canvas was replaced.
+        do_full_redraw = true;
+        render_flags |= RenderDataFlags_WITH_BLUR;
+    }
+    if ( milton->save_after_load && !milton->load ) {
+        milton->save_after_load = false;
+        should_save = true;
+    }
+
+    milton_apply_save_result(milton);
+
     if ( milton->flags & MiltonStateFlags_REQUEST_QUALITY_REDRAW ) {
         milton->flags &= ~MiltonStateFlags_REQUEST_QUALITY_REDRAW;
         do_full_redraw = true;
@@ -979,50 +1490,32 @@ milton_update_and_render(Milton* milton, MiltonInput* input)
     }
 
     { // Undo / Redo
+        HistoryChange change = {};
+        b32 changed = false;
         if ( (input->flags & MiltonInputFlags_UNDO) ) {
-            // Grab undo elements. They might be from deleted layers, so discard dead results.
-            while ( milton->canvas->history.count > 0 ) {
-                HistoryElement h = pop(&milton->canvas->history);
-                Layer* l = layer::get_by_id(milton->canvas->root_layer, h.layer_id);
-                // found a thing to undo.
-                if ( l ) {
-                    if ( l->strokes.count > 0 ) {
-                        Stroke* stroke_ptr = peek(&l->strokes);
-                        Stroke stroke = pop(&l->strokes);
-                        push(&milton->canvas->stroke_graveyard, stroke);
-                        push(&milton->canvas->redo_stack, h);
-
-                        do_full_redraw = true;
-                        render_flags |= RenderDataFlags_WITH_BLUR;
-                    }
-                    break;
-                }
-            }
+            changed = milton_undo(milton, &change);
         }
         else if ( (input->flags & MiltonInputFlags_REDO) ) {
-            if ( milton->canvas->redo_stack.count > 0 ) {
-                HistoryElement h = pop(&milton->canvas->redo_stack);
-                switch ( h.type ) {
-                case HistoryElement_STROKE_ADD: {
-                    Layer* l = layer::get_by_id(milton->canvas->root_layer, h.layer_id);
-                    if ( l && count(&milton->canvas->stroke_graveyard) > 0 ) {
-                        Stroke stroke = pop(&milton->canvas->stroke_graveyard);
-                        if ( stroke.layer_id == h.layer_id ) {
-                            push(&l->strokes, stroke);
-                            push(&milton->canvas->history, h);
-
-                            do_full_redraw = true;
-                            render_flags |= RenderDataFlags_WITH_BLUR;
-
-
-                            break;
-                        }
-                        stroke = pop(&milton->canvas->stroke_graveyard);  // Keep popping in case the graveyard has info from deleted layers
-                    }
+            changed = milton_redo(milton, &change);
+        }
 
-                } break;
-                /* case HistoryElement_LAYER_DELETE: { */
-                /* } break; */
+        if ( changed ) {
+            // Blurred layers change past the bounds of what changed.
+            b32 blur =    change.type == HistoryElement_LAYER_PROPERTIES
+                       || layer::layer_has_blur_effect(change.layer);
+            for ( Layer* l = milton->canvas->root_layer; l != NULL && !blur; l = l->next ) {
+                blur = (l->flags & LayerFlags_VISIBLE) && layer::layer_has_blur_effect(l);
+            }
+            if ( blur ) {
+                do_full_redraw = true;
+                render_flags |= RenderDataFlags_WITH_BLUR;
+            }
+            else if ( rect_is_valid(change.bounds) ) {
+                Rect bounds = canvas_rect_to_raster_rect(milton->view, change.bounds);
+                bounds = rect_clip_to_screen(bounds, milton->view->screen_size);
+                if ( bounds.left < bounds.right && bounds.top < bounds.bottom ) {
+                    draw_custom_rectangle = true;
+                    custom_rectangle = rect_union(custom_rectangle, bounds);
                 }
             }
         }
@@ -1121,9 +1614,9 @@ milton_update_and_render(Milton* milton, MiltonInput* input)
     }
 
     if ( milton->current_mode == MiltonMode::EYEDROPPER ) {
-        eyedropper_init(milton);
-        v2i point = {};
-        b32 in = false;
+        // Without input, keep polling the read in flight.
+        v2i point = milton->eyedropper->point;
+        b32 in = milton->eyedropper->is_read_pending;
         if ( (input->flags & MiltonInputFlags_CLICK) ) {
             point = input->click;
             in = true;
@@ -1133,7 +1626,7 @@ milton_update_and_render(Milton* milton, MiltonInput* input)
             in = true;
         }
         if ( in ) {
-            eyedropper_input(milton->eyedropper, milton->gui,
+            eyedropper_input(milton->eyedropper, milton->render_data, milton->gui,
                              milton->view->screen_size.w,
                              milton->view->screen_size.h,
                              point);
@@ -1163,10 +1656,11 @@ milton_update_and_render(Milton* milton, MiltonInput* input)
                     // Tell the renderer to update the picker
                     gpu_update_picker(milton->render_data, &milton->gui->picker);
                 }
-                // Copy current stroke.
+                // Copy current stroke, into the bucket it is pushed to.
                 Stroke new_stroke = {};
-                CanvasState* canvas = milton->canvas;
-                copy_stroke(&canvas->arena, milton->view, &milton->working_stroke, &new_stroke);
+                StrokeList* strokes = &milton->canvas->working_layer->strokes;
+                copy_stroke(strokelist_get_bucket(strokes, strokes->count),
+                            milton->view, &milton->working_stroke, &new_stroke);
                 {
                     new_stroke.brush = milton->working_stroke.brush;
                     new_stroke.layer_id = milton->view->working_layer_id;
@@ -1184,20 +1678,16 @@ milton_update_and_render(Milton* milton, MiltonInput* input)
 
                 mlt_assert(new_stroke.num_points > 0);
                 mlt_assert(new_stroke.num_points <= STROKE_MAX_POINTS);
-                auto* stroke = layer::layer_push_stroke(milton->canvas->working_layer, new_stroke);
+                milton_add_stroke(milton, milton->canvas->working_layer, new_stroke);
 
                 // Invalidate working stroke render element
 
-                HistoryElement h = { HistoryElement_STROKE_ADD, milton->canvas->working_layer->id };
-                push(&milton->canvas->history, h);
                 // Clear working_stroke
                 {
                     milton->working_stroke.num_points = 0;
                     milton->working_stroke.render_element.count = 0;
                 }
 
-                clear_stroke_redo(milton);
-
                 // Make sure we show blurred layers when finishing a stroke.
                 render_flags |= RenderDataFlags_WITH_BLUR;
                 do_full_redraw = true;
@@ -1278,6 +1768,10 @@ milton_update_and_render(Milton* milton, MiltonInput* input)
 
     PROFILE_GRAPH_END(update);
 
+    if ( canvas_changed && milton_journal_needs_full_save(milton) ) {
+        should_save = true;
+    }
+
     if ( !(milton->flags & MiltonStateFlags_RUNNING) ) {
         // Someone tried to kill milton from outside the update. Make sure we save.
         should_save = true;
@@ -1290,11 +1784,8 @@ milton_update_and_render(Milton* milton, MiltonInput* input)
             // Always save synchronously when exiting.
             milton_save(milton);
         } else {
-#if MILTON_SAVE_ASYNC
-            SDL_CreateThread(milton_save_async, "Async Save Thread", (void*)milton);
-#else
-            milton_save(milton);
-#endif
+            // Requested after this frame is drawn.
+            milton->save_after_preview = true;
         }
         // We're about to close and the last save failed and the drawing changed.
         if (    !(milton->flags & MiltonStateFlags_RUNNING)
@@ -1339,13 +1830,9 @@ milton_update_and_render(Milton* milton, MiltonInput* input)
         // About to quit.
         if ( !(milton->flags & MiltonStateFlags_RUNNING) ) {
 
-            // Make sure that async save threads have finished.
-#if MILTON_SAVE_ASYNC
-            while ( milton->save_flag == SaveEnum_IN_USE ) {
-                SDL_CondWait(milton->save_cond, milton->save_mutex);
-                mlt_assert(milton->save_flag == SaveEnum_GOOD_TO_GO);
-            }
-#endif
+            // Make sure that the saver thread has finished.
+            milton_save_flush(milton);
+            milton_stop_saver_thread(milton);
 
             // Release resources
             milton_reset_canvas(milton);
@@ -1400,12 +1887,44 @@ milton_update_and_render(Milton* milton, MiltonInput* input)
 
     PROFILE_GRAPH_BEGIN(clipping);
 
-    gpu_clip_strokes_and_update(&milton->root_arena, milton->render_data, milton->view,
+    gpu_clip_strokes_and_update(milton->render_data, milton->view,
                                 milton->canvas->root_layer, &milton->working_stroke,
                                 view_x, view_y, view_width, view_height, clip_flags);
     PROFILE_GRAPH_END(clipping);
+#if MILTON_ENABLE_PROFILING
+    milton->graph_frame.cooking = gpu_get_cook_time(milton->render_data);
+#endif
 
     gpu_render(milton->render_data, view_x, view_y, view_width, view_height);
 
+    // Full saves carry a preview of the canvas. Reading it back right away would stall until the
+    // GPU is done drawing, so the save waits a frame or two for it.
+    if ( milton->save_after_preview ) {
+        if ( milton->preview_request_size == v2i{} ) {
+            milton_request_preview(milton);
+        }
+        if ( milton_poll_preview(milton, /*wait*/false) ) {
+            milton->save_after_preview = false;
+            milton_request_save(milton);
+        } else {
+            // Make sure there is a frame to pick up the result.
+            SDL_Event event = {};
+            event.type = SDL_USEREVENT;
+            SDL_PushEvent(&event);
+        }
+    }
+
+    // Snapshots of a save in flight point into the payloads.
+    SDL_LockMutex(milton->save_mutex);
+    if ( !milton->save_pending && !milton->save_current ) {
+        stroke_pager_trim(&milton->canvas->pager);
+    }
+    SDL_UnlockMutex(milton->save_mutex);
+
+    milton_update_geometry_cache(milton);
+
     ARENA_VALIDATE(&milton->root_arena);
+    arena_scratch_validate();
+
+    memory_telemetry_end_frame();
 }
@@ -9,6 +9,8 @@
 #include "canvas.h"
 #include "DArray.h"
 #include "profiler.h"
+#include "StrokePager.h"
+#include "geometry_cache.h"
 
 #define STROKE_MAX_POINTS           2048
 #define MILTON_DEFAULT_SCALE        (1 << 10)
@@ -53,19 +55,49 @@ enum
 enum HistoryElementType
 {
     HistoryElement_STROKE_ADD,
-    //HistoryElement_LAYER_DELETE,
+    HistoryElement_LAYER_ADD,
+    HistoryElement_LAYER_DELETE,
+    HistoryElement_LAYER_PROPERTIES,
+    HistoryElement_LAYER_MOVE,
 };
 
+// History as it is saved in MLT files. Only STROKE_ADD elements are saved.
 struct HistoryElement
 {
     int type;
     i32 layer_id;  // HistoryElement_STROKE_ADD
 };
 
+// An entry of the undo history or the redo stack. Layers that were deleted, or
+// whose creation was undone, stay in memory while a record can bring them back.
+struct HistoryRecord
+{
+    int                 type;           // HistoryElementType
+    Layer*              layer;
+    Layer*              below;          // LAYER_ADD, LAYER_DELETE, LAYER_MOVE: Layer under it in the list. NULL
+                                        // for the bottom one. For LAYER_MOVE, where undo or redo puts it back.
+    LayerProperties*    properties;     // LAYER_PROPERTIES: What undo or redo puts back. Swapped with the layer's.
+    u32                 merge_id;       // LAYER_PROPERTIES: See milton_layer_properties_will_change
+    i64                 stroke_index;   // STROKE_ADD: Position of the stroke in its layer. Set when undone.
+    u64                 journal_seq;    // One past the sequence number of the last journal record about it. Zero if none.
+};
+
+// What an undo or a redo changed.
+struct HistoryChange
+{
+    int     type;       // HistoryElementType
+    Layer*  layer;
+    Stroke* stroke;     // STROKE_ADD: The stroke that was redone. NULL for undo.
+    Rect    bounds;     // Canvas area to draw again.
+};
+
 struct MiltonGui;
 struct RenderData;
 struct CanvasView;
 struct Layer;
+struct SaveSnapshot;
+struct SlowFrameCapture;
+struct CanvasLoad;
 
 // Stuff than can be reset when unloading a canvas
 struct CanvasState
@@ -76,12 +108,21 @@ struct CanvasState
     Layer*      root_layer;
     Layer*      working_layer;
 
-    DArray<HistoryElement> history;
-    DArray<HistoryElement> redo_stack;
-    //Layer**         layer_graveyard;
-    DArray<Stroke>         stroke_graveyard;
+    // Undo and redo are O(1). See milton_undo
+    DArray<HistoryRecord>   history;
+    DArray<HistoryRecord>   redo_stack;
+    DArray<Stroke>          stroke_graveyard;  // Strokes of the STROKE_ADD records in redo_stack, in the same order.
 
     i32         stroke_id_count;
+
+    // The properties of the layer of the top history record changed since they were journaled.
+    b32         properties_changed;
+
+    // Read-only mapping of the MLT file this canvas was loaded from. Loaded strokes point into it.
+    void*       mapped_file;
+    size_t      mapped_file_size;
+
+    StrokePager pager;
 };
 
 enum PrimitiveFSM
@@ -98,9 +139,47 @@ struct MiltonSettings
 };
 #pragma pack(pop)
 
+// Outcome of a save. The thread that wrote the file leaves it in Milton::save_result, and the main
+// thread applies it. See milton_apply_save_result
+struct SaveResult
+{
+    b32         is_new;             // Not applied yet.
+    b32         ok;
+    b32         move_file_failed;
+    WallTime    time;
+    i64         num_strokes;
+};
+
+// Changes appended to <mlt file>.journal since the last full save. See persist.cc
+struct MiltonJournal
+{
+    SDL_mutex*  mutex;
+    FILE*       fd;                 // Open for appending. NULL when the MLT file on disk has no journal.
+
+    u64         id;                 // Written to the MLT file. Ties the journal to it.
+    u64         next_seq;           // Sequence number of the next record.
+    u64         snapshot_seq;       // Records before this are in the MLT file.
+    u64         unjournaled_seq;    // A change that couldn't be journaled happened before this.
+                                    // The journal is not used until a full save includes it.
+    u32         canvas_signature;   // Background at the time of the last full save.
+    b32         replaying;          // Records are being replayed, not appended. See milton_journal_open
+    b32         unsynced;           // Records were appended since the file was last flushed to disk.
+
+    PATH_CHAR   mlt_path[MAX_PATH]; // The MLT file that the journal belongs to,
+    u64         mlt_size;           // and its size when the journal was opened or compacted.
+    u64         size;               // Bytes of records in the file.
+    i64         num_records;
+    DArray<u8>  buffer;             // The record being appended or copied.
+};
+
 struct Eyedropper
 {
-    u8* buffer;
+    // Last sample taken from the canvas. It is read again when the point moves or the canvas is
+    // drawn over it. See gpu_canvas_pixel_is_stale
+    v2i point;
+    v3f color;
+    b32 is_sample_valid;
+    b32 is_read_pending;    // The read of `point` is in flight. `color` is from the previous one.
 };
 
 struct Milton
@@ -120,11 +199,32 @@ struct Milton
                                         // when the mlt file gets large.
                                         // Check that all the strokes are saved at quit time in case that
                                         // the last MoveFileEx failed.
-#if MILTON_SAVE_ASYNC
-    SDL_mutex*  save_mutex;
-    i64         save_flag;   // See SaveEnum
-    SDL_cond*   save_cond;
-#endif
+    MiltonJournal journal;
+
+    // Last rendered frame, scaled down. Saves write it as a JPEG at the end of the MLT file. See
+    // milton_request_preview
+    DArray<u8>  preview_pixels;         // RGBA, top row first.
+    i32         preview_width;
+    i32         preview_height;
+    v2i         preview_request_size;   // Of the preview being read back. Zero when there is none.
+    b32         save_after_preview;     // A save goes out when the preview is read back.
+
+    // Saver thread. See milton_request_save
+    SDL_mutex*      save_mutex;
+    SDL_cond*       save_cond;      // Signaled when a save is requested and when one finishes.
+    SDL_Thread*     save_thread;    // NULL when saves are synchronous.
+    SaveSnapshot*   save_pending;   // Latest request. Replaced by newer ones until the saver takes it.
+    SaveSnapshot*   save_current;   // Being written by the saver thread.
+    b32             save_quit;
+    SaveResult      save_result;    // Guarded by save_mutex.
+    SlowFrameCapture* slow_frame_pending;  // Flight recorder capture for the saver to write. See milton_save_slow_frame
+    b32             save_after_load;  // A save was requested while strokes were loading.
+
+    // Strokes that are still loading in the background. See milton_load_poll
+    CanvasLoad*     load;
+
+    // Vertex data of the canvas from the last session. See milton_update_geometry_cache
+    GeometryCache   geometry_cache;
 
     // ---- The Painting
     CanvasState*    canvas;
@@ -161,23 +261,28 @@ struct Milton
     MiltonGui* gui;
     MiltonSettings* settings;  // User settings
 
+    b32 memory_window_visible;
+
 #if MILTON_ENABLE_PROFILING
     b32 viz_window_visible;
     GraphData graph_frame;
+
+    b32 frame_timing_visible;
+    FrameHistory frame_history;
 #endif
 };
 
 enum MiltonStateFlags
 {
     MiltonStateFlags_RUNNING                = 1 << 0,
-                                           // 1 << 1 unused
+    MiltonStateFlags_HEADLESS               = 1 << 1,  // Running without a window. See MiltonInitFlags_HEADLESS
     MiltonStateFlags_REQUEST_QUALITY_REDRAW = 1 << 2,
-                                           // 1 << 3 unused
+    MiltonStateFlags_LAYERS_CHANGED         = 1 << 3,  // A layer change since the last update. See milton_update_and_render
     MiltonStateFlags_NEW_CANVAS             = 1 << 4,
     MiltonStateFlags_DEFAULT_CANVAS         = 1 << 5,
     MiltonStateFlags_IGNORE_NEXT_CLICKUP    = 1 << 6,  // When selecting eyedropper from menu, avoid the click from selecting the color...
-                                           // 1 << 7 unused
-                                           // 1 << 8 unused
+    MiltonStateFlags_LOAD_REJECTED          = 1 << 7,  // A background load found damaged strokes. See milton_load_poll
+    MiltonStateFlags_NO_GPU                 = 1 << 8,  // There is no GL context. See MiltonInitFlags_NO_GPU
     MiltonStateFlags_LAST_SAVE_FAILED       = 1 << 9,
     MiltonStateFlags_MOVE_FILE_FAILED       = 1 << 10,
     MiltonStateFlags_BRUSH_SMOOTHING        = 1 << 11,
@@ -218,13 +323,15 @@ struct MiltonInput
 };
 
 
-enum SaveEnum
+enum MiltonInitFlags
 {
-    SaveEnum_IN_USE,
-    SaveEnum_GOOD_TO_GO,
+    MiltonInitFlags_NONE        = 0,
+    MiltonInitFlags_HEADLESS    = 1 << 0,  // No window. Opening files doesn't change the last opened canvas.
+    MiltonInitFlags_NO_GPU      = 1 << 1,  // Loads canvases without a GL context, to draw them with cpu_render_to_buffer.
 };
 
-void milton_init(Milton* milton, i32 width, i32 height, f32 ui_scale, PATH_CHAR* file_to_open);
+void milton_init(Milton* milton, i32 width, i32 height, f32 ui_scale, PATH_CHAR* file_to_open,
+                 int init_flags = MiltonInitFlags_NONE);
 
 // Expects absolute path
 void milton_set_canvas_file(Milton* milton, PATH_CHAR* fname);
@@ -232,7 +339,15 @@ void milton_set_default_canvas_file(Milton* milton);
 void milton_set_last_canvas_fname(PATH_CHAR* last_fname);
 void milton_unset_last_canvas_fname();
 
-void milton_save_postlude(Milton* milton);
+// Saves the canvas as it is now, on the saver thread when there is one. Requests that come in while
+// a save is being written are merged into one. While strokes are loading in the background, the
+// save waits for them on later frames instead.
+void milton_request_save(Milton* milton);
+// Waits until requested saves are written.
+void milton_save_flush(Milton* milton);
+// Updates the save flags and times with the last save that finished. Called once per frame, and
+// after saving.
+void milton_apply_save_result(Milton* milton);
 
 
 void milton_reset_canvas(Milton* milton);
@@ -262,9 +377,28 @@ void milton_update_and_render(Milton* milton, MiltonInput* input);
 
 void milton_try_quit(Milton* milton);
 
-void milton_new_layer(Milton* milton);
+// Pushes a stroke onto a layer and into the undo history.
+Stroke* milton_add_stroke(Milton* milton, Layer* layer, Stroke stroke);
+// Return false if there was nothing to undo or redo. Fill `out_change` otherwise.
+b32     milton_undo(Milton* milton, HistoryChange* out_change);
+b32     milton_redo(Milton* milton, HistoryChange* out_change);
+
+// Call before changing the name, flags, alpha or effects of a layer, so that the change can be
+// undone. Changes in a row to the same layer with the same nonzero `merge_id` are undone at once.
+// Pass the id of the control that makes them, for sliders.
+void milton_layer_properties_will_change(Milton* milton, Layer* layer, u32 merge_id);
+
+// Replaces the history with the elements of a loaded file.
+void milton_history_from_elements(Milton* milton, HistoryElement* elements, i64 count);
+// The elements to save, for the strokes in the layers that are not deleted.
+void milton_history_to_elements(Milton* milton, DArray<HistoryElement>* out);
+
+// Adds a layer at the top. `undoable` puts it in the history.
+void milton_new_layer(Milton* milton, b32 undoable = false);
 void milton_set_working_layer(Milton* milton, Layer* layer);
 void milton_delete_working_layer(Milton* milton);
+// Moves a layer right above `below`, or to the bottom if it is NULL.
+void milton_move_layer(Milton* milton, Layer* layer, Layer* below);
 void milton_set_background_color(Milton* milton, v3f background_color);
 
 // Set the center of the zoom
@@ -7,6 +7,10 @@
 #define MILTON_MINOR_VERSION 6
 #define MILTON_MICRO_VERSION 2
 
+// Newest MLT file format. New canvases are saved with it, and newer files are not opened.
+// See milton_file_format.md
+#define MILTON_MLT_VERSION 8
+
 #if !defined(MILTON_DEBUG)
     #define MILTON_DEBUG 1
 #endif
@@ -70,9 +74,41 @@
 
 #define DEBUG_MEMORY_USAGE 0
 
+// Count live bytes and allocations per category. See the Memory window.
+#define MILTON_MEMORY_TELEMETRY 1
+
 // Spawn threads to save the canvas.
 #define MILTON_SAVE_ASYNC 1
 
+// Append strokes, undo and redo to a journal next to the MLT file instead of
+// rewriting the whole file. Only for MLT v7 and up.
+#define MILTON_SAVE_JOURNAL 1
+
+// Show the canvas once the strokes in view are loaded, and load the rest in
+// the background. Only for MLT v7 and up.
+#define MILTON_LOAD_PROGRESSIVE 1
+
+// Megabytes of stroke points to keep in memory. Buckets of strokes that were
+// used least recently go to a temporary file past that. 0 disables paging.
+#define MILTON_STROKE_MEMORY_BUDGET_MB 1024
+
+// Gigabytes of address space reserved for the root and canvas arenas. They grow
+// in place, and pages are only committed when they are used.
+#define MILTON_ARENA_RESERVE_GB 64
+
+// Megabytes of address space reserved for each scratch arena. Every thread has two.
+#define MILTON_SCRATCH_RESERVE_MB 1024
+
+// Undo steps to keep. Past that, the oldest ones can't be undone anymore.
+#define MILTON_HISTORY_MAX_RECORDS (1 << 16)
+
+// Move stroke points out of the way of freed ones, so that long sessions give memory back.
+#define MILTON_COMPACT_STROKE_MEMORY 1
+
+// Keep the vertex data of large canvases in a file next to the MLT file, so
+// that opening them doesn't cook every stroke again.
+#define MILTON_GEOMETRY_CACHE 1
+
 #ifdef CMAKE_TRY_GL2
     #undef USE_GL_3_2
     #define USE_GL_3_2 0
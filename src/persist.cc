@@ -3,6 +3,7 @@
 
 #include "persist.h"
 
+#include <stb_image.h>
 #include <stb_image_write.h>
 
 #include "common.h"
@@ -11,37 +12,2382 @@
 #include "milton.h"
 #include "platform.h"
 #include "tiny_jpeg.h"
+#include "WorkerPool.h"
 
 
 #define MILTON_MAGIC_NUMBER 0X11DECAF3
+#define MLT_PREVIEW_MAGIC_NUMBER 0x50524556  // "VERP"
+
+// Written after the JPEG data of the preview, at the very end of the file.
+struct MltPreviewFooter
+{
+    u32 magic;
+    i32 width;
+    i32 height;
+    u32 jpeg_size;
+};
 
 // Will allocate memory so that if the read fails, we will restore what was
 // originally in there.
 static b32
-fread_checked(void* dst, size_t sz, size_t count, FILE* fd)
+fread_checked(void* dst, size_t sz, size_t count, FILE* fd)
+{
+    b32 ok = false;
+
+    size_t read = fread(dst, sz, count, fd);
+    if ( read == count && !ferror(fd)) {
+        ok = true;
+    }
+
+    return ok;
+}
+
+static b32
+fwrite_checked(void* data, size_t sz, size_t count, FILE* fd)
+{
+    b32 ok = false;
+    size_t written = fwrite(data, sz, count, fd);
+    if ( written == count ) {
+        ok = true;
+    }
+
+    return ok;
+}
+
+static b32
+fseek_checked(FILE* fd, u64 offset)
+{
+#if defined(_WIN32)
+    return _fseeki64(fd, (__int64)offset, SEEK_SET) == 0;
+#else
+    return fseeko(fd, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+// Zero if the file can't be opened.
+static u64
+file_size(PATH_CHAR* fname)
+{
+    u64 size = 0;
+    FILE* fd = platform_fopen(fname, TO_PATH_STR("rb"));
+    if ( fd ) {
+#if defined(_WIN32)
+        if ( _fseeki64(fd, 0, SEEK_END) == 0 ) {
+            size = (u64)_ftelli64(fd);
+        }
+#else
+        if ( fseeko(fd, 0, SEEK_END) == 0 ) {
+            size = (u64)ftello(fd);
+        }
+#endif
+        fclose(fd);
+    }
+    return size;
+}
+
+// Appends to a byte buffer, growing it geometrically.
+static u8*
+push_bytes(DArray<u8>* buffer, const void* data, size_t size)
+{
+    i64 needed = buffer->count + (i64)size;
+    if ( buffer->capacity < needed ) {
+        reserve(buffer, max(needed, 2 * buffer->capacity));
+    }
+    u8* out = buffer->data + buffer->count;
+    if ( data && size > 0 ) {
+        memcpy(out, data, size);
+    }
+    buffer->count = needed;
+    return out;
+}
+
+// ---- Save snapshots
+//
+// Saves write a SaveSnapshot instead of reading the canvas, so that the file can
+// be written on the saver thread while the main thread keeps painting. Taking a
+// snapshot copies everything but the strokes.
+//
+// Stroke points don't change once the stroke is in a layer (see stroke.h), and
+// a slot in a StrokeList only changes when its stroke is undone and another one
+// is pushed in its place. milton_undo calls milton_save_preserve_top_stroke
+// before popping, which copies the stroke into the snapshots that still use it.
+
+struct SnapshotLayer
+{
+    Layer*              layer;          // Strokes are read from here. Layers live as long as the canvas.
+    i32                 id;
+    i32                 flags;
+    f32                 alpha;
+    char                name[MAX_LAYER_NAME_LEN];
+    DArray<LayerEffect> effects;
+
+    i64                 num_strokes;
+
+    // Guarded by save_mutex.
+    i64                 shared_count;   // Strokes below this are still the ones in the layer.
+    DArray<Stroke>      undone;         // Copies of the strokes from shared_count up, top first.
+};
+
+struct SaveSnapshot
+{
+    PATH_CHAR               mlt_file_path[MAX_PATH];
+    u32                     mlt_binary_version;
+
+    CanvasView              view;
+    i32                     layer_guid;
+    i32                     num_layers;
+    SnapshotLayer*          layers;     // Bottom to top.
+    i64                     num_strokes;
+
+    v3f                     picker_rgb;
+    PickerData              picker_data;    // For MLT v4.
+    DArray<v4f>             button_colors;
+    Brush                   brushes[BrushEnum_COUNT];
+    i32                     brush_sizes[BrushEnum_COUNT];
+    DArray<HistoryElement>  history;
+
+    DArray<u8>              preview_pixels; // See Milton::preview_pixels. Encoded by the saver.
+    DArray<u8>              preview_jpeg;
+    i32                     preview_width;
+    i32                     preview_height;
+
+    // Zero when there is no journal. See milton_journal_compact.
+    u64                     journal_id;
+    u64                     journal_seq;
+    u32                     canvas_signature;
+
+    b32                     geometry_only;  // Only write the geometry cache. See milton_update_geometry_cache
+};
+
+struct SnapshotPage
+{
+    i64 first;  // First stroke of the bucket.
+    i64 count;
+    u64 offset;
+    u64 size;
+};
+
+// Copies the strokes of a layer as they were when the snapshot was taken. Returns sl->num_strokes strokes,
+// allocated from `arena`. Points of buckets that are paged out are read into `pages`, to release with mlt_free
+// once the strokes are written.
+static Stroke*
+snapshot_copy_strokes(Milton* milton, SnapshotLayer* sl, Arena* arena, DArray<u8*>* pages)
+{
+    StrokePager* pager = &milton->canvas->pager;
+    DArray<SnapshotPage> paged_out = {};
+
+    Stroke* out = arena_alloc_array(arena, max(sl->num_strokes, (i64)1), Stroke);
+
+    // In batches, so that an undo on the main thread never waits for long.
+    const i64 batch_size = STROKELIST_BUCKET_COUNT;
+    for ( i64 first = 0; first < sl->num_strokes; first += batch_size ) {
+        i64 end = min(first + batch_size, sl->num_strokes);
+        SDL_LockMutex(milton->save_mutex);
+        // The main thread may be reading a bucket back.
+        SDL_LockMutex(pager->mutex);
+        if ( first < sl->shared_count ) {
+            StrokeBucket* bucket = strokelist_get_bucket(&sl->layer->strokes, first);
+            if ( bucket->is_paged_out ) {
+                SnapshotPage page = { first, min(end, sl->shared_count) - first, bucket->page_offset, bucket->page_size };
+                push(&paged_out, page);
+            }
+        }
+        for ( i64 i = first; i < end; ++i ) {
+            if ( i < sl->shared_count ) {
+                out[i] = *get(&sl->layer->strokes, i);
+            } else {
+                out[i] = sl->undone.data[sl->num_strokes - 1 - i];
+            }
+        }
+        SDL_UnlockMutex(pager->mutex);
+        SDL_UnlockMutex(milton->save_mutex);
+    }
+
+    // Pages are not rewritten while a save is in flight.
+    for ( i64 i = 0; i < paged_out.count; ++i ) {
+        SnapshotPage* p = &paged_out.data[i];
+        u8* page = stroke_pager_read_page(pager, p->offset, p->size, out + p->first, p->count);
+        if ( !page ) {
+            milton_die_gracefully("FATAL. Could not read strokes back from the page file.");
+        }
+        push(pages, page);
+    }
+    release(&paged_out);
+    return out;
+}
+
+static void
+snapshot_release_pages(DArray<u8*>* pages)
+{
+    for ( i64 i = 0; i < pages->count; ++i ) {
+        mlt_free(pages->data[i], "Strokes");
+    }
+    reset(pages);
+}
+
+static void
+snapshot_preserve_top_stroke(SaveSnapshot* snapshot, Layer* layer)
+{
+    for ( i32 i = 0; i < snapshot->num_layers; ++i ) {
+        SnapshotLayer* sl = &snapshot->layers[i];
+        // The stroke about to be popped is the last one the snapshot shares with the layer.
+        if ( sl->layer == layer && sl->shared_count > 0 && layer->strokes.count == sl->shared_count ) {
+            --sl->shared_count;
+            push(&sl->undone, *get(&layer->strokes, sl->shared_count));
+        }
+    }
+}
+
+void
+milton_save_preserve_top_stroke(Milton* milton, Layer* layer)
+{
+    SDL_LockMutex(milton->save_mutex);
+    if ( milton->save_pending ) {
+        snapshot_preserve_top_stroke(milton->save_pending, layer);
+    }
+    if ( milton->save_current ) {
+        snapshot_preserve_top_stroke(milton->save_current, layer);
+    }
+    SDL_UnlockMutex(milton->save_mutex);
+}
+
+// ---- MLT v7
+//
+// A header and a directory of chunks, followed by the contents of each chunk.
+// Every chunk can be located and read without reading any other one.
+// See milton_file_format.md
+
+enum MltChunkType
+{
+    MltChunk_VIEW    = 1,  // CanvasView
+    MltChunk_CANVAS  = 2,  // Number of layers and layer guid
+    MltChunk_LAYER   = 3,  // One per layer, from bottom to top
+    MltChunk_PICKER  = 4,  // Picker color and color buttons
+    MltChunk_BRUSHES = 5,
+    MltChunk_HISTORY = 6,
+    MltChunk_PREVIEW = 7,  // MltPreviewFooter followed by the JPEG data
+    MltChunk_JOURNAL = 8,  // Journal id and the sequence number of the first record not in the file
+    MltChunk_BOUNDS  = 9,  // One per layer. Bounds of groups of strokes. See milton_load_chunks
+};
+
+// Chunks and stroke points start at multiples of this, relative to the start of the file.
+#define MLT_CHUNK_ALIGNMENT 8
+
+// Limit on the directory size, to avoid huge allocations with corrupt files.
+#define MLT_MAX_CHUNKS (1 << 20)
+
+struct MltFileHeader
+{
+    u32 magic;
+    u32 version;
+    u32 num_chunks;
+    u32 directory_checksum;  // CRC-32 of the directory
+};
+
+struct MltChunkEntry
+{
+    u32 type;       // MltChunkType
+    u32 checksum;   // CRC-32 of the chunk contents
+    u64 offset;     // From the start of the file
+    u64 size;
+};
+
+// Tables for slicing-by-8. Every byte of the file is checked on load, so this needs to be
+// close to memory speed.
+struct Crc32Table
+{
+    u32 values[8][256];
+
+    Crc32Table()
+    {
+        for ( u32 i = 0; i < 256; ++i ) {
+            u32 c = i;
+            for ( int k = 0; k < 8; ++k ) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            values[0][i] = c;
+        }
+        for ( u32 i = 0; i < 256; ++i ) {
+            for ( int s = 1; s < 8; ++s ) {
+                values[s][i] = (values[s-1][i] >> 8) ^ values[0][values[s-1][i] & 0xFF];
+            }
+        }
+    }
+};
+
+// Pass 0 as `crc` for the first block.
+static u32
+mlt_crc32(u32 crc, const void* data, size_t size)
+{
+    static const Crc32Table table;
+    const u32 (*t)[256] = table.values;
+
+    const u8* bytes = (const u8*)data;
+    crc = ~crc;
+    while ( size >= 8 ) {
+        // Little-endian
+        u32 lo = 0;
+        u32 hi = 0;
+        memcpy(&lo, bytes, sizeof(u32));
+        memcpy(&hi, bytes + 4, sizeof(u32));
+        lo ^= crc;
+        crc =   t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24]
+              ^ t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+        bytes += 8;
+        size -= 8;
+    }
+    while ( size-- > 0 ) {
+        crc = t[0][(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static u32
+gf2_matrix_times(const u32* mat, u32 vec)
+{
+    u32 sum = 0;
+    for ( ; vec != 0; vec >>= 1, ++mat ) {
+        if ( vec & 1 ) {
+            sum ^= *mat;
+        }
+    }
+    return sum;
+}
+
+static void
+gf2_matrix_square(u32* square, const u32* mat)
+{
+    for ( int n = 0; n < 32; ++n ) {
+        square[n] = gf2_matrix_times(mat, mat[n]);
+    }
+}
+
+// CRC-32 of A followed by B, from the CRC-32 of each and the size of B. Same as zlib's crc32_combine.
+static u32
+mlt_crc32_combine(u32 crc_a, u32 crc_b, u64 size_b)
+{
+    if ( size_b == 0 ) {
+        return crc_a;
+    }
+    u32 even[32];   // Operator for an even number of zero bits.
+    u32 odd[32];    // For an odd number.
+    odd[0] = 0xEDB88320u;
+    for ( int n = 1; n < 32; ++n ) {
+        odd[n] = 1u << (n - 1);
+    }
+    gf2_matrix_square(even, odd);   // Two zero bits
+    gf2_matrix_square(odd, even);   // Four zero bits
+    // Apply size_b zero bytes to crc_a.
+    for ( ;; ) {
+        gf2_matrix_square(even, odd);
+        if ( size_b & 1 ) {
+            crc_a = gf2_matrix_times(even, crc_a);
+        }
+        size_b >>= 1;
+        if ( size_b == 0 ) {
+            break;
+        }
+        gf2_matrix_square(odd, even);
+        if ( size_b & 1 ) {
+            crc_a = gf2_matrix_times(odd, crc_a);
+        }
+        size_b >>= 1;
+        if ( size_b == 0 ) {
+            break;
+        }
+    }
+    return crc_a ^ crc_b;
+}
+
+// A chunk, serialized in memory. Chunks start at MLT_CHUNK_ALIGNMENT boundaries in the file, so
+// alignment inside a chunk only depends on the offset from the start of the chunk.
+struct MltWriter
+{
+    u32         type;       // MltChunkType
+    u32         checksum;   // CRC-32 of data
+    DArray<u8>  data;
+};
+
+static b32
+mlt_write(MltWriter* w, const void* data, size_t sz, size_t count)
+{
+    size_t bytes = sz * count;
+    push_bytes(&w->data, data, bytes);
+    w->checksum = mlt_crc32(w->checksum, data, bytes);
+    return true;
+}
+
+static b32
+mlt_write_padding(MltWriter* w)
+{
+    static const u8 zeros[MLT_CHUNK_ALIGNMENT] = {};
+    size_t padding = (size_t)((MLT_CHUNK_ALIGNMENT - w->data.count % MLT_CHUNK_ALIGNMENT) % MLT_CHUNK_ALIGNMENT);
+    return padding == 0 || mlt_write(w, zeros, 1, padding);
+}
+
+struct MltReader
+{
+    u8* data;
+    u64 size;
+    u64 pos;        // Chunks are aligned, so this is aligned the same way as the file offset.
+    b32 is_mapped;  // data points into the file mapping instead of a buffer owned by the reader.
+    u32 checksum;   // Of the chunk, when it was opened without checking it. See mlt_open_chunk
+};
+
+static b32
+mlt_read(MltReader* r, void* dst, size_t sz, size_t count)
+{
+    u64 bytes = (u64)sz * count;
+    if ( r->pos > r->size || r->size - r->pos < bytes ) {
+        return false;
+    }
+    memcpy(dst, r->data + r->pos, (size_t)bytes);
+    r->pos += bytes;
+    return true;
+}
+
+static void
+mlt_skip_padding(MltReader* r)
+{
+    r->pos = (r->pos + MLT_CHUNK_ALIGNMENT - 1) & ~(u64)(MLT_CHUNK_ALIGNMENT - 1);
+}
+
+struct MltFile
+{
+    FILE*           fd;
+    u32             num_chunks;
+    MltChunkEntry*  chunks;
+
+    // When set, chunks are read from here instead of fd.
+    u8*             mapping;
+    u64             mapping_size;
+};
+
+// `fd` must be positioned right after the magic number and version.
+static b32
+mlt_read_directory(FILE* fd, MltFile* file)
+{
+    *file = {};
+    file->fd = fd;
+
+    u32 directory_checksum = 0;
+    b32 ok =    fread_checked(&file->num_chunks, sizeof(u32), 1, fd)
+             && fread_checked(&directory_checksum, sizeof(u32), 1, fd)
+             && file->num_chunks <= MLT_MAX_CHUNKS;
+    if ( ok && file->num_chunks > 0 ) {
+        file->chunks = (MltChunkEntry*)mlt_calloc(file->num_chunks, sizeof(MltChunkEntry), "Persist");
+        ok =    file->chunks != NULL
+             && fread_checked(file->chunks, sizeof(MltChunkEntry), file->num_chunks, fd)
+             && mlt_crc32(0, file->chunks, file->num_chunks * sizeof(MltChunkEntry)) == directory_checksum;
+    }
+    if ( !ok ) {
+        milton_log("MLT directory could not be read.\n");
+    }
+    return ok;
+}
+
+static void
+mlt_release_directory(MltFile* file)
+{
+    if ( file->chunks ) {
+        mlt_free(file->chunks, "Persist");
+    }
+    *file = {};
+}
+
+// Returns the n-th chunk of the given type, or NULL.
+static MltChunkEntry*
+mlt_find_chunk(MltFile* file, u32 type, i32 n)
+{
+    for ( u32 i = 0; i < file->num_chunks; ++i ) {
+        if ( file->chunks[i].type == type && n-- == 0 ) {
+            return &file->chunks[i];
+        }
+    }
+    return NULL;
+}
+
+// Reads the contents of a chunk and checks them against the checksum. Layer chunks are most of the
+// file, so they are opened with `verify` false and checked piece by piece as their strokes get
+// decoded. See mlt_verify_layer_chunk. Release with mlt_close_chunk.
+static b32
+mlt_open_chunk(MltFile* file, MltChunkEntry* chunk, MltReader* out_reader, b32 verify = true)
+{
+    *out_reader = {};
+    if ( chunk == NULL || chunk->size > SIZE_MAX ) {
+        return false;
+    }
+
+    b32 ok = true;
+    u8* data = NULL;
+    if ( file->mapping ) {
+        if ( chunk->offset > file->mapping_size || file->mapping_size - chunk->offset < chunk->size ) {
+            return false;
+        }
+        if ( verify && mlt_crc32(0, file->mapping + chunk->offset, (size_t)chunk->size) != chunk->checksum ) {
+            milton_log("MLT chunk of type %d at offset %llu has a bad checksum.\n",
+                       chunk->type, (unsigned long long)chunk->offset);
+            return false;
+        }
+        out_reader->data = file->mapping + chunk->offset;
+        out_reader->size = chunk->size;
+        out_reader->is_mapped = true;
+        out_reader->checksum = chunk->checksum;
+        return true;
+    }
+
+    if ( chunk->size > 0 ) {
+        data = (u8*)mlt_calloc((size_t)chunk->size, 1, "Persist");
+        ok =    data != NULL
+             && fseek_checked(file->fd, chunk->offset)
+             && fread_checked(data, 1, (size_t)chunk->size, file->fd);
+        if ( ok && verify && mlt_crc32(0, data, (size_t)chunk->size) != chunk->checksum ) {
+            milton_log("MLT chunk of type %d at offset %llu has a bad checksum.\n",
+                       chunk->type, (unsigned long long)chunk->offset);
+            ok = false;
+        }
+    }
+
+    if ( ok ) {
+        out_reader->data = data;
+        out_reader->size = chunk->size;
+        out_reader->checksum = chunk->checksum;
+    } else if ( data ) {
+        mlt_free(data, "Persist");
+    }
+    return ok;
+}
+
+static void
+mlt_close_chunk(MltReader* r)
+{
+    if ( r->data && !r->is_mapped ) {
+        mlt_free(r->data, "Persist");
+    }
+    *r = {};
+}
+
+// ---- Compact strokes (MLT v8)
+//
+// Points are zigzag varint deltas from the previous point. Pressures are
+// quantized to 8 bits when that loses nothing, 12 bits otherwise. Consecutive
+// strokes with the same brush share one brush record.
+
+// Upper bound of the encoded size of one stroke.
+#define MLT_COMPACT_STROKE_MAX_BYTES(num_points) (32 + (size_t)(num_points) * (2*10 + 2))
+
+// Flush the encoding buffer to the file when it gets this big.
+#define MLT_COMPACT_FLUSH_SIZE (1 << 20)
+// Room for one more brush record and stroke after the buffer reaches the flush size.
+#define MLT_COMPACT_BUFFER_SIZE (MLT_COMPACT_FLUSH_SIZE + 10 + sizeof(Brush) + MLT_COMPACT_STROKE_MAX_BYTES(STROKE_MAX_POINTS))
+
+static u64
+zigzag_encode(i64 v)
+{
+    return ((u64)v << 1) ^ (u64)(v >> 63);
+}
+
+static i64
+zigzag_decode(u64 v)
+{
+    return (i64)(v >> 1) ^ -(i64)(v & 1);
+}
+
+static u8*
+varint_encode(u8* out, u64 v)
+{
+    while ( v >= 0x80 ) {
+        *out++ = (u8)(v | 0x80);
+        v >>= 7;
+    }
+    *out++ = (u8)v;
+    return out;
+}
+
+// Returns NULL if the varint is malformed or runs past `end`.
+static u8*
+varint_decode(u8* in, u8* end, u64* out)
+{
+    // Most deltas fit in one byte.
+    if ( in < end && *in < 0x80 ) {
+        *out = *in;
+        return in + 1;
+    }
+    u64 v = 0;
+    for ( int shift = 0; in < end && shift < 64; shift += 7 ) {
+        u8 b = *in++;
+        v |= (u64)(b & 0x7F) << shift;
+        if ( !(b & 0x80) ) {
+            *out = v;
+            return in;
+        }
+    }
+    return NULL;
+}
+
+static i32
+pressure_quantize(f32 pressure, i32 max_value)
+{
+    f32 p = pressure < 0.0f ? 0.0f : pressure > 1.0f ? 1.0f : pressure;
+    return (i32)(p * max_value + 0.5f);
+}
+
+static u8*
+stroke_encode_compact(u8* out, Stroke* stroke, i32 layer_id)
+{
+    i32 n = stroke->num_points;
+
+    // Use 8 bits if 12 bits wouldn't be more precise. That's the case for mouse input (always 1.0)
+    b32 fits_8_bits = true;
+    for ( i32 i = 0; fits_8_bits && i < n; ++i ) {
+        i32 q12 = pressure_quantize(stroke->pressures[i], 4095);
+        i32 q8 = pressure_quantize(stroke->pressures[i], 255);
+        fits_8_bits = q12 == pressure_quantize(q8 / 255.0f, 4095);
+    }
+
+    out = varint_encode(out, (u64)n);
+    out = varint_encode(out, zigzag_encode((i64)stroke->layer_id - layer_id));
+    *out++ = fits_8_bits ? 8 : 12;
+
+    v2l prev = {};
+    for ( i32 i = 0; i < n; ++i ) {
+        v2l p = stroke->points[i];
+        out = varint_encode(out, zigzag_encode(p.x - prev.x));
+        out = varint_encode(out, zigzag_encode(p.y - prev.y));
+        prev = p;
+    }
+
+    if ( fits_8_bits ) {
+        for ( i32 i = 0; i < n; ++i ) {
+            *out++ = (u8)pressure_quantize(stroke->pressures[i], 255);
+        }
+    } else {
+        // Two pressures in three bytes.
+        i32 i = 0;
+        for ( ; i + 1 < n; i += 2 ) {
+            i32 a = pressure_quantize(stroke->pressures[i], 4095);
+            i32 b = pressure_quantize(stroke->pressures[i + 1], 4095);
+            *out++ = (u8)(a & 0xFF);
+            *out++ = (u8)((a >> 8) | ((b & 0xF) << 4));
+            *out++ = (u8)(b >> 4);
+        }
+        if ( i < n ) {
+            i32 a = pressure_quantize(stroke->pressures[i], 4095);
+            *out++ = (u8)(a & 0xFF);
+            *out++ = (u8)(a >> 8);
+        }
+    }
+    return out;
+}
+
+// Writes the strokes of a layer as runs of strokes that share a brush.
+static b32
+mlt_write_compact_strokes(MltWriter* w, i32 layer_id, Stroke* strokes, i64 count)
+{
+    b32 ok = true;
+    ArenaMark scratch = arena_scratch_begin();
+    u8* buffer = arena_alloc_array(scratch.arena, MLT_COMPACT_BUFFER_SIZE, u8);
+    u8* out = buffer;
+
+    i64 stroke_i = 0;
+    while ( ok && stroke_i < count ) {
+        Stroke* first = &strokes[stroke_i];
+        if ( first->num_points <= 0 || first->num_points > STROKE_MAX_POINTS ) {
+            // Skipped, like in v7. Not counted in num_strokes.
+            ++stroke_i;
+            continue;
+        }
+
+        // Find the run of strokes that share this brush.
+        i64 run_end = stroke_i + 1;
+        u64 run_length = 1;
+        while ( run_end < count ) {
+            Stroke* s = &strokes[run_end];
+            if ( s->num_points > 0 && s->num_points <= STROKE_MAX_POINTS ) {
+                if ( memcmp(&s->brush, &first->brush, sizeof(Brush)) != 0 ) {
+                    break;
+                }
+                ++run_length;
+            }
+            ++run_end;
+        }
+
+        out = varint_encode(out, run_length);
+        memcpy(out, &first->brush, sizeof(Brush));
+        out += sizeof(Brush);
+
+        for ( ; ok && stroke_i < run_end; ++stroke_i ) {
+            Stroke* s = &strokes[stroke_i];
+            if ( s->num_points > 0 && s->num_points <= STROKE_MAX_POINTS ) {
+                out = stroke_encode_compact(out, s, layer_id);
+            }
+            if ( out - buffer >= MLT_COMPACT_FLUSH_SIZE ) {
+                ok = mlt_write(w, buffer, 1, (size_t)(out - buffer));
+                out = buffer;
+            }
+        }
+    }
+    if ( ok && out > buffer ) {
+        ok = mlt_write(w, buffer, 1, (size_t)(out - buffer));
+    }
+    arena_scratch_end(scratch);
+    return ok;
+}
+
+// Returns a pointer past the compact stroke at `in`, or NULL if it is malformed.
+static u8*
+mlt_skip_compact_stroke(u8* in, u8* end, i32* out_num_points)
+{
+    u64 num_points = 0;
+    u64 layer_delta = 0;
+    if (    (in = varint_decode(in, end, &num_points)) == NULL
+         || num_points == 0 || num_points > STROKE_MAX_POINTS
+         || (in = varint_decode(in, end, &layer_delta)) == NULL
+         || in >= end ) {
+        return NULL;
+    }
+    i64 n = (i64)num_points;
+    u8 pressure_bits = *in++;
+
+    // Each point is two varints. Count the bytes that end one.
+    i64 remaining = 2 * n;
+    while ( remaining > 0 && in < end ) {
+        remaining -= (*in++ < 0x80);
+    }
+    if ( remaining > 0 ) {
+        return NULL;
+    }
+
+    i64 size = 0;
+    if ( pressure_bits == 8 ) {
+        size = n;
+    } else if ( pressure_bits == 12 ) {
+        size = (n / 2) * 3 + (n % 2) * 2;
+    } else {
+        return NULL;
+    }
+    if ( end - in < size ) {
+        return NULL;
+    }
+    *out_num_points = (i32)n;
+    return in + size;
+}
+
+// Decodes the compact stroke at `in` into stroke->points and stroke->pressures, which must have room
+// for the points. Sets num_points and layer_id.
+static b32
+mlt_decode_compact_stroke(u8* in, u8* end, i32 layer_id, Stroke* stroke)
+{
+    u64 num_points = 0;
+    u64 layer_delta = 0;
+    if (    (in = varint_decode(in, end, &num_points)) == NULL
+         || num_points == 0 || num_points > STROKE_MAX_POINTS
+         || (in = varint_decode(in, end, &layer_delta)) == NULL
+         || in >= end ) {
+        milton_log("ERROR: Corrupt compact stroke\n");
+        return false;
+    }
+    i32 n = (i32)num_points;
+    stroke->num_points = n;
+    stroke->layer_id = (i32)(layer_id + zigzag_decode(layer_delta));
+    u8 pressure_bits = *in++;
+
+    // One pass, point by point. Each varint starts where the last one ended, and each point adds to
+    // the one before it, so neither part vectorizes. Splitting the zigzag into its own loop, so that
+    // it vectorizes, was slower: the extra pass costs more than the zigzag it speeds up.
+    v2l p = {};
+    for ( i32 i = 0; i < n; ++i ) {
+        u64 dx = 0;
+        u64 dy = 0;
+        if (    (in = varint_decode(in, end, &dx)) == NULL
+             || (in = varint_decode(in, end, &dy)) == NULL ) {
+            return false;
+        }
+        p.x += zigzag_decode(dx);
+        p.y += zigzag_decode(dy);
+        stroke->points[i] = p;
+    }
+
+    if ( pressure_bits == 8 ) {
+        if ( end - in < n ) {
+            return false;
+        }
+        const f32 k = 1.0f / 255.0f;
+        for ( i32 i = 0; i < n; ++i ) {
+            stroke->pressures[i] = in[i] * k;
+        }
+    } else if ( pressure_bits == 12 ) {
+        i64 size = (n / 2) * 3 + (n % 2) * 2;
+        if ( end - in < size ) {
+            return false;
+        }
+        const f32 k = 1.0f / 4095.0f;
+        i32 i = 0;
+        for ( ; i + 1 < n; i += 2, in += 3 ) {
+            stroke->pressures[i]     = (in[0] | ((in[1] & 0xF) << 8)) * k;
+            stroke->pressures[i + 1] = ((in[1] >> 4) | (in[2] << 4)) * k;
+        }
+        if ( i < n ) {
+            stroke->pressures[i] = (in[0] | ((in[1] & 0xF) << 8)) * k;
+        }
+    } else {
+        milton_log("ERROR: Unknown pressure encoding %d\n", pressure_bits);
+        return false;
+    }
+    return true;
+}
+
+// ---- Loading strokes
+//
+// Layer chunks are scanned first, on the loading thread. That is cheap: it finds
+// where each stroke starts and how many points it has, creates the buckets of
+// the StrokeList and reserves memory for the points. Then workers decode the
+// strokes and compute their bounds, one bucket at a time, filling the buckets
+// in place.
+
+#define LOAD_MAX_WORKERS 16
+
+struct MltStrokeRef
+{
+    u64     offset;         // In the chunk. v7: of the points. v8: of the encoded stroke.
+    i64     first_point;    // Into MltLayerLoad::points.
+    i32     num_points;
+    i32     layer_id;       // v7 only. v8 strokes store it with the points.
+    Brush   brush;
+};
+
+struct MltLayerLoad
+{
+    Layer*                  layer;
+    MltReader               reader;     // Stays open until the strokes are decoded.
+    DArray<MltStrokeRef>    refs;
+    i32                     first_stroke_id;
+    DArray<u32>             bucket_checksums;   // Of the bytes of each bucket. See mlt_bucket_bytes
+
+    b32                     in_place;   // Strokes point into the file mapping. Otherwise, into bucket payloads.
+#if STROKE_DEBUG_VIZ
+    int*                    debug_flags;
+#endif
+};
+
+// Reads where the strokes of a layer chunk are, and makes room for them in the layer.
+static b32
+mlt_scan_layer_strokes(CanvasState* canvas, MltLayerLoad* load, i32 num_strokes, u32 version)
+{
+    MltReader* r = &load->reader;
+    i64 total_points = 0;
+    b32 ok = r->pos <= r->size;
+
+    reserve(&load->refs, max((i64)num_strokes, (i64)1));
+    // Use the points in the file mapping when we can. Pages are only read when something touches the stroke.
+    // Compact strokes are always decoded into the arena.
+    load->in_place = version < 8 && r->is_mapped;
+
+    if ( ok && version >= 8 ) {
+        u8* in = r->data + r->pos;
+        u8* end = r->data + r->size;
+        i32 stroke_i = 0;
+        while ( ok && stroke_i < num_strokes ) {
+            u64 run_length = 0;
+            Brush brush = {};
+            in = varint_decode(in, end, &run_length);
+            ok =    in != NULL
+                 && run_length > 0 && run_length <= (u64)(num_strokes - stroke_i)
+                 && (size_t)(end - in) >= sizeof(Brush);
+            if ( ok ) {
+                memcpy(&brush, in, sizeof(Brush));
+                in += sizeof(Brush);
+            }
+            for ( u64 run_i = 0; ok && run_i < run_length; ++run_i, ++stroke_i ) {
+                MltStrokeRef ref = {};
+                ref.offset = (u64)(in - r->data);
+                ref.brush = brush;
+                in = mlt_skip_compact_stroke(in, end, &ref.num_points);
+                ok = in != NULL;
+                if ( ok ) {
+                    ref.first_point = total_points;
+                    total_points += ref.num_points;
+                    push(&load->refs, ref);
+                } else {
+                    milton_log("ERROR: Corrupt compact stroke\n");
+                }
+            }
+        }
+        if ( ok ) {
+            r->pos = (u64)(in - r->data);
+        }
+    } else {
+        for ( i32 stroke_i = 0; ok && stroke_i < num_strokes; ++stroke_i ) {
+            MltStrokeRef ref = {};
+            mlt_skip_padding(r);
+            ok =    mlt_read(r, &ref.num_points, sizeof(i32), 1)
+                 && mlt_read(r, &ref.layer_id, sizeof(i32), 1)
+                 && mlt_read(r, &ref.brush, sizeof(Brush), 1);
+            if ( ok && (ref.num_points <= 0 || ref.num_points > STROKE_MAX_POINTS) ) {
+                milton_log("ERROR: File has a stroke with %d points\n", ref.num_points);
+                ok = false;
+            }
+            size_t bytes = (size_t)ref.num_points * (sizeof(v2l) + sizeof(f32));
+            ok = ok && r->pos <= r->size && r->size - r->pos >= bytes;
+            if ( ok ) {
+                ref.offset = r->pos;
+                if ( ((uintptr_t)(r->data + r->pos) % sizeof(i64)) != 0 ) {
+                    load->in_place = false;
+                }
+                r->pos += bytes;
+                ref.first_point = total_points;
+                total_points += ref.num_points;
+                push(&load->refs, ref);
+            }
+        }
+    }
+
+    if ( ok ) {
+        load->first_stroke_id = canvas->stroke_id_count;
+        canvas->stroke_id_count += num_strokes;
+#if STROKE_DEBUG_VIZ
+        if ( total_points > 0 ) {
+            load->debug_flags = arena_alloc_array(&canvas->arena, total_points, int);
+        }
+#endif
+        strokelist_extend(&load->layer->strokes, num_strokes);
+
+        i64 num_buckets = (num_strokes + STROKELIST_BUCKET_COUNT - 1) / STROKELIST_BUCKET_COUNT;
+        reserve(&load->bucket_checksums, max(num_buckets, (i64)1));
+        load->bucket_checksums.count = num_buckets;
+    }
+    return ok;
+}
+
+// The bytes of the layer chunk that belong to the bucket starting at stroke `first`. Buckets cover
+// the chunk from start to end, so that their checksums add up to the checksum of the chunk. The
+// first one covers the layer header too.
+static void
+mlt_bucket_bytes(MltLayerLoad* load, i64 first, i64 count, u64* out_begin, u64* out_end)
+{
+    *out_begin = first == 0 ? 0 : load->refs.data[first].offset;
+    *out_end = first + count < load->refs.count ? load->refs.data[first + count].offset : load->reader.size;
+}
+
+// Checks the layer chunk against its checksum. Call when all its buckets were decoded.
+static b32
+mlt_verify_layer_chunk(MltLayerLoad* load)
+{
+    MltReader* r = &load->reader;
+    u32 crc = 0;
+    if ( load->refs.count == 0 ) {
+        crc = mlt_crc32(0, r->data, (size_t)r->size);
+    }
+    for ( i64 first = 0; first < load->refs.count; first += STROKELIST_BUCKET_COUNT ) {
+        u64 begin = 0;
+        u64 end = 0;
+        mlt_bucket_bytes(load, first, min((i64)STROKELIST_BUCKET_COUNT, load->refs.count - first), &begin, &end);
+        crc = mlt_crc32_combine(crc, load->bucket_checksums.data[first / STROKELIST_BUCKET_COUNT], end - begin);
+    }
+    if ( crc != r->checksum ) {
+        milton_log("MLT chunk of layer %d has a bad checksum.\n", load->layer->id);
+        return false;
+    }
+    return true;
+}
+
+struct MltLoadItem
+{
+    MltLayerLoad*   load;
+    StrokeBucket*   bucket;
+    i64             first;  // Index of the first stroke of the bucket.
+    i64             count;
+};
+
+struct MltLoadPass
+{
+    u32             version;
+    MltLoadItem*    items;
+    i64             num_items;
+    b32             wake_main_thread;   // Push an event for every decoded bucket, so that it gets drawn.
+    SDL_atomic_t    num_done;
+    SDL_atomic_t    failed;             // One past the index of the first item that could not be decoded.
+    SDL_atomic_t    cancel;
+};
+
+// Strokes that are still being loaded after milton_load returns. See milton_load_poll
+struct CanvasLoad
+{
+    SDL_Thread*             thread;
+    MltLoadPass             pass;
+    DArray<MltLayerLoad>    layers;     // Owns the readers, which strokes may point into.
+    DArray<MltLoadItem>     items;
+    i64                     num_seen;   // Buckets done at the last milton_load_poll.
+    b32                     damaged;    // A layer chunk has a bad checksum. Set by the load thread.
+};
+
+static b32
+mlt_decode_bucket(MltLoadItem* item, u32 version)
+{
+    PROFILE_SCOPE("decode bucket");
+    MltLayerLoad* load = item->load;
+    MltReader* r = &load->reader;
+    Rect bounds = rect_without_size();
+
+    // Each bucket is decoded by one thread, into its own payload.
+    v2l* points = NULL;
+    f32* pressures = NULL;
+    if ( !load->in_place && item->count > 0 ) {
+        MltStrokeRef* last = &load->refs.data[item->first + item->count - 1];
+        i64 num_points = last->first_point + last->num_points - load->refs.data[item->first].first_point;
+        points = arena_alloc_array(&item->bucket->payload, num_points, v2l);
+        pressures = arena_alloc_array(&item->bucket->payload, num_points, f32);
+    }
+
+    for ( i64 i = 0; i < item->count; ++i ) {
+        i64 stroke_i = item->first + i;
+        MltStrokeRef* ref = &load->refs.data[stroke_i];
+        u8* data = r->data + ref->offset;
+
+        Stroke stroke = Stroke{};
+        stroke.id = load->first_stroke_id + (i32)stroke_i;
+        stroke.brush = ref->brush;
+        stroke.num_points = ref->num_points;
+        stroke.layer_id = ref->layer_id;
+        if ( load->in_place ) {
+            stroke.points = (v2l*)data;
+            stroke.pressures = (f32*)(data + (size_t)ref->num_points * sizeof(v2l));
+        } else {
+            stroke.points = points;
+            stroke.pressures = pressures;
+            points += ref->num_points;
+            pressures += ref->num_points;
+            if ( version >= 8 ) {
+                if ( !mlt_decode_compact_stroke(data, r->data + r->size, load->layer->id, &stroke) ) {
+                    return false;
+                }
+            } else {
+                memcpy(stroke.points, data, (size_t)ref->num_points * sizeof(v2l));
+                memcpy(stroke.pressures, data + (size_t)ref->num_points * sizeof(v2l), (size_t)ref->num_points * sizeof(f32));
+            }
+        }
+#if STROKE_DEBUG_VIZ
+        stroke.debug_flags = load->debug_flags + ref->first_point;
+#endif
+        stroke.bounding_rect = bounding_box_for_stroke(&stroke);
+        bounds = rect_union(bounds, stroke.bounding_rect);
+
+        item->bucket->data[i] = stroke;
+    }
+    item->bucket->bounding_rect = bounds;
+    return true;
+}
+
+static void
+load_task(void* data, i64 item_i)
+{
+    MltLoadPass* pass = (MltLoadPass*)data;
+    if ( SDL_AtomicGet(&pass->cancel) ) {
+        return;
+    }
+    MltLoadItem* item = &pass->items[item_i];
+
+    // Check the bytes while decoding touches them anyway.
+    u64 begin = 0;
+    u64 end = 0;
+    mlt_bucket_bytes(item->load, item->first, item->count, &begin, &end);
+    item->load->bucket_checksums.data[item->first / STROKELIST_BUCKET_COUNT] =
+            mlt_crc32(0, item->load->reader.data + begin, (size_t)(end - begin));
+
+    if ( !mlt_decode_bucket(item, pass->version) ) {
+        SDL_AtomicCAS(&pass->failed, 0, (int)item_i + 1);
+        // Leave the strokes empty rather than half decoded.
+        for ( i64 i = 0; i < item->count; ++i ) {
+            item->bucket->data[i] = Stroke{};
+            item->bucket->data[i].id = item->load->first_stroke_id + (i32)(item->first + i);
+            item->bucket->data[i].layer_id = item->load->layer->id;
+        }
+        item->bucket->bounding_rect = rect_without_size();
+    }
+    // Publish the bucket to the renderer. See gpu_clip_strokes_and_update
+    SDL_AtomicSet(&item->bucket->loading, 0);
+    SDL_AtomicAdd(&pass->num_done, 1);
+    if ( pass->wake_main_thread ) {
+        SDL_Event event = {};
+        event.type = SDL_USEREVENT;
+        SDL_PushEvent(&event);
+    }
+}
+
+// Logs the first item of the pass that could not be decoded. Returns false if there is one.
+static b32
+mlt_check_load_pass(MltLoadPass* pass)
+{
+    int failed = SDL_AtomicGet(&pass->failed);
+    if ( failed ) {
+        MltLoadItem* item = &pass->items[failed - 1];
+        milton_log("Could not decode strokes %d to %d of layer \"%s\".\n",
+                   (int)item->first, (int)(item->first + item->count - 1), item->load->layer->name);
+    }
+    return failed == 0;
+}
+
+// Decodes the items of the pass on the worker pool, with at most `max_workers` threads including the caller.
+static b32
+mlt_run_load_pass(MltLoadPass* pass, i32 max_workers)
+{
+    worker_pool_run(load_task, pass, pass->num_items, max_workers);
+    return mlt_check_load_pass(pass);
+}
+
+static int  // Thread
+milton_load_thread(void* data)
+{
+    CanvasLoad* load = (CanvasLoad*)data;
+    {
+        PROFILE_SCOPE("load strokes");
+        // Leave a core for the main thread, which keeps drawing while we load.
+        mlt_run_load_pass(&load->pass, max(SDL_GetCPUCount() - 1, 1));
+    }
+    // A cancelled pass leaves buckets without checksums.
+    for ( i64 i = 0; i < load->layers.count && !SDL_AtomicGet(&load->pass.cancel); ++i ) {
+        if ( !mlt_verify_layer_chunk(&load->layers.data[i]) ) {
+            load->damaged = true;
+        }
+    }
+    PROFILE_THREAD_RELEASE();
+    return 0;
+}
+
+// Reads the n-th BOUNDS chunk. Returns false if there is none or it doesn't match the layer.
+static b32
+mlt_read_bounds_chunk(MltFile* file, i32 layer_i, i64 num_strokes, i32* out_strokes_per_rect, DArray<Rect>* out_rects)
+{
+    MltReader r = {};
+    i32 strokes_per_rect = 0;
+    i32 num_rects = 0;
+    MltChunkEntry* chunk = mlt_find_chunk(file, MltChunk_BOUNDS, layer_i);
+    b32 ok =    chunk != NULL
+             && mlt_open_chunk(file, chunk, &r)
+             && mlt_read(&r, &strokes_per_rect, sizeof(i32), 1)
+             && mlt_read(&r, &num_rects, sizeof(i32), 1)
+             && strokes_per_rect > 0 && num_rects >= 0
+             && num_rects == (num_strokes + strokes_per_rect - 1) / strokes_per_rect;
+    if ( ok ) {
+        reset(out_rects);
+        reserve(out_rects, max((i64)num_rects, (i64)1));
+        ok = mlt_read(&r, out_rects->data, sizeof(Rect), (size_t)num_rects);
+        out_rects->count = ok ? num_rects : 0;
+        *out_strokes_per_rect = strokes_per_rect;
+    }
+    mlt_close_chunk(&r);
+    return ok;
+}
+
+// Splits the buckets of the scanned layers in the ones to decode before showing the canvas and the
+// ones to decode in the background. With `progressive` false, everything is decoded now.
+//
+// Buckets near the view are decoded now. Without BOUNDS chunks to tell where strokes are, everything
+// is decoded in the background, in order.
+static void
+mlt_plan_load(MltFile* file, CanvasView* view, MltLayerLoad* loads, i64 num_loads, b32 progressive,
+              DArray<MltLoadItem>* now, DArray<MltLoadItem>* later)
+{
+    // The view, with a screen of margin so that the first pans don't show empty space.
+    v2l margin = { view->screen_size.w, view->screen_size.h };
+    Rect near_view = {};
+    near_view.top_left = raster_to_canvas(view, v2l{} - margin);
+    near_view.bot_right = raster_to_canvas(view, VEC2L(view->screen_size) + margin);
+
+    DArray<Rect> rects = {};
+    for ( i64 load_i = 0; load_i < num_loads; ++load_i ) {
+        MltLayerLoad* load = &loads[load_i];
+        StrokeBucket* bucket = &load->layer->strokes.root;
+        mlt_assert(load->layer->strokes.count == load->refs.count);
+
+        i32 strokes_per_rect = 0;
+        b32 has_bounds =    progressive
+                         && (load->layer->flags & LayerFlags_VISIBLE)
+                         && mlt_read_bounds_chunk(file, (i32)load_i, load->refs.count, &strokes_per_rect, &rects);
+
+        for ( i64 first = 0; first < load->refs.count; first += STROKELIST_BUCKET_COUNT ) {
+            MltLoadItem item = {};
+            item.load = load;
+            item.bucket = bucket;
+            item.first = first;
+            item.count = min((i64)STROKELIST_BUCKET_COUNT, load->refs.count - first);
+
+            // The top bucket of each layer is decoded now. New strokes go in it, and undo starts
+            // from it, so that neither has to wait for the load. See history_wait_for_bucket
+            b32 is_near = !progressive || first + item.count == load->refs.count;
+            if ( has_bounds && !is_near ) {
+                for ( i64 rect_i = first / strokes_per_rect;
+                      !is_near && rect_i <= (first + item.count - 1) / strokes_per_rect;
+                      ++rect_i ) {
+                    Rect b = rects.data[rect_i];
+                    is_near = !(   b.left > near_view.right || b.right < near_view.left
+                                || b.top > near_view.bottom || b.bottom < near_view.top);
+                }
+            }
+            push(is_near ? now : later, item);
+            bucket = bucket->next;
+        }
+    }
+    release(&rects);
+}
+
+static void
+mlt_release_layer_loads(DArray<MltLayerLoad>* loads)
+{
+    for ( i64 i = 0; i < loads->count; ++i ) {
+        mlt_close_chunk(&loads->data[i].reader);
+        release(&loads->data[i].refs);
+        release(&loads->data[i].bucket_checksums);
+    }
+    release(loads);
+}
+
+static void
+milton_load_finish(Milton* milton, b32 cancel)
+{
+    CanvasLoad* load = milton->load;
+    if ( load ) {
+        if ( cancel ) {
+            SDL_AtomicSet(&load->pass.cancel, 1);
+        }
+        if ( load->thread ) {
+            SDL_WaitThread(load->thread, NULL);
+        }
+        // Rejected like a load that finds the damage before it returns. Callers of milton_load_wait
+        // may be in the middle of using the canvas, so milton_load_poll replaces it at the next
+        // frame. Until then it is not saved, so that the damaged strokes don't get a new checksum.
+        if ( !cancel && (load->damaged || SDL_AtomicGet(&load->pass.failed)) ) {
+            milton->flags |= MiltonStateFlags_LOAD_REJECTED;
+        }
+        mlt_release_layer_loads(&load->layers);
+        release(&load->items);
+        mlt_free(load, "Persist");
+        milton->load = NULL;
+    }
+}
+
+b32
+milton_load_poll(Milton* milton)
+{
+    PROFILE_SCOPE("load poll");
+    b32 arrived = false;
+    CanvasLoad* load = milton->load;
+    if ( load ) {
+        i64 num_done = SDL_AtomicGet(&load->pass.num_done);
+        arrived = num_done > load->num_seen;
+        load->num_seen = num_done;
+        if ( num_done == load->pass.num_items ) {
+            milton_load_finish(milton, false);
+        }
+    }
+    if ( milton->flags & MiltonStateFlags_LOAD_REJECTED ) {
+        platform_dialog("Tried to load a corrupt Milton file or there was an error reading from disk.", "Error");
+        milton_reset_canvas_and_set_default(milton);
+        arrived = true;
+    }
+    return arrived;
+}
+
+void
+milton_load_wait(Milton* milton)
+{
+    if ( milton->load ) {
+        milton_log("Waiting for the canvas to finish loading.\n");
+        milton_load_finish(milton, false);
+    }
+}
+
+void
+milton_load_cancel(Milton* milton)
+{
+    milton_load_finish(milton, true);
+}
+
+// Reads the layer and scans its strokes. They are decoded later, by mlt_run_load_pass.
+static b32
+milton_read_layer_chunk(Milton* milton, MltLayerLoad* load, u32 version)
+{
+    CanvasState* canvas = milton->canvas;
+    MltReader* r = &load->reader;
+    Layer* layer = load->layer;
+    i32 name_len = 0;
+    i64 num_effects = 0;
+    i32 num_strokes = 0;
+
+    b32 ok =    mlt_read(r, &layer->id, sizeof(i32), 1)
+             && mlt_read(r, &layer->flags, sizeof(layer->flags), 1)
+             && mlt_read(r, &layer->alpha, sizeof(layer->alpha), 1)
+             && mlt_read(r, &name_len, sizeof(i32), 1)
+             && name_len > 0 && name_len <= MAX_LAYER_NAME_LEN
+             && mlt_read(r, layer->name, sizeof(char), (size_t)name_len)
+             && mlt_read(r, &num_effects, sizeof(num_effects), 1)
+             && num_effects >= 0 && num_effects <= LayerEffectType_COUNT * 64;
+    if ( ok ) {
+        layer->name[name_len - 1] = '\0';
+    }
+
+    LayerEffect** e = &layer->effects;
+    for ( i64 i = 0; ok && i < num_effects; ++i ) {
+        *e = arena_alloc_elem(&canvas->arena, LayerEffect);
+        ok =    mlt_read(r, &(*e)->type, sizeof((*e)->type), 1)
+             && mlt_read(r, &(*e)->enabled, sizeof((*e)->enabled), 1);
+        if ( ok ) {
+            switch ( (*e)->type ) {
+                case LayerEffectType_BLUR: {
+                    ok =    mlt_read(r, &(*e)->blur.original_scale, sizeof((*e)->blur.original_scale), 1)
+                         && mlt_read(r, &(*e)->blur.kernel_size, sizeof((*e)->blur.kernel_size), 1);
+                } break;
+                default: {
+                    milton_log("Unknown layer effect %d\n", (*e)->type);
+                    ok = false;
+                } break;
+            }
+        }
+        e = &(*e)->next;
+    }
+
+    ok =    ok
+         && mlt_read(r, &num_strokes, sizeof(i32), 1) && num_strokes >= 0
+         && mlt_scan_layer_strokes(canvas, load, num_strokes, version);
+
+    return ok;
+}
+
+// Loads MLT v7. Chunks are looked up in the directory, so the order in which they are read does not
+// depend on the order in which they were written.
+static b32
+milton_load_chunks(Milton* milton, FILE* fd, u32 version, i32* out_layer_guid)
+{
+    MltFile file = {};
+    MltReader r = {};
+    DArray<MltLayerLoad> loads = {};
+    DArray<MltLoadItem> later = {};
+    i32 num_layers = 0;
+    i32 layer_guid = 0;
+    i32 saved_working_layer_id = 0;
+    auto saved_size = milton->view->screen_size;
+
+    b32 ok = mlt_read_directory(fd, &file);
+
+    // Map the file so that strokes can point into it instead of being copied. The mapping belongs to
+    // the canvas and is released by milton_reset_canvas. Compact strokes are always decoded into the arena.
+    if ( ok && version < 8 ) {
+        CanvasState* canvas = milton->canvas;
+        mlt_assert(canvas->mapped_file == NULL);
+        canvas->mapped_file = platform_map_file(milton->mlt_file_path, &canvas->mapped_file_size);
+        if ( canvas->mapped_file ) {
+            file.mapping = (u8*)canvas->mapped_file;
+            file.mapping_size = canvas->mapped_file_size;
+        }
+    }
+
+    // View
+    if ( ok ) {
+        ok =    mlt_open_chunk(&file, mlt_find_chunk(&file, MltChunk_VIEW, 0), &r)
+             && mlt_read(&r, milton->view, sizeof(CanvasView), 1);
+        mlt_close_chunk(&r);
+
+        // The screen size might hurt us.
+        milton->view->screen_size = saved_size;
+        // The process of loading changes state. working_layer_id changes when creating layers.
+        saved_working_layer_id = milton->view->working_layer_id;
+    }
+
+    // Layers
+    if ( ok ) {
+        ok =    mlt_open_chunk(&file, mlt_find_chunk(&file, MltChunk_CANVAS, 0), &r)
+             && mlt_read(&r, &num_layers, sizeof(i32), 1)
+             && mlt_read(&r, &layer_guid, sizeof(i32), 1);
+        mlt_close_chunk(&r);
+    }
+    if ( ok && num_layers > 0 ) {
+        reserve(&loads, num_layers);
+    }
+    for ( i32 layer_i = 0; ok && layer_i < num_layers; ++layer_i ) {
+        milton_new_layer(milton);
+        MltLayerLoad load = {};
+        load.layer = milton->canvas->working_layer;
+        ok =    mlt_open_chunk(&file, mlt_find_chunk(&file, MltChunk_LAYER, layer_i), &load.reader, false)
+             && milton_read_layer_chunk(milton, &load, version);
+        push(&loads, load);
+    }
+    // Decode the strokes near the view now, and the rest in the background when we can.
+    if ( ok ) {
+#if MILTON_LOAD_PROGRESSIVE
+        b32 progressive = !(milton->flags & MiltonStateFlags_HEADLESS);
+#else
+        b32 progressive = false;
+#endif
+        DArray<MltLoadItem> now = {};
+        mlt_plan_load(&file, milton->view, loads.data, loads.count, progressive, &now, &later);
+
+        MltLoadPass pass = {};
+        pass.version = version;
+        pass.items = now.data;
+        pass.num_items = now.count;
+        ok = mlt_run_load_pass(&pass, LOAD_MAX_WORKERS);
+        release(&now);
+    }
+    if ( ok && later.count > 0 ) {
+        CanvasLoad* load = (CanvasLoad*)mlt_calloc(1, sizeof(CanvasLoad), "Persist");
+        if ( load ) {
+            load->layers = loads;
+            load->items = later;
+            loads = {};
+            later = {};
+            for ( i64 i = 0; i < load->items.count; ++i ) {
+                SDL_AtomicSet(&load->items.data[i].bucket->loading, 1);
+            }
+            load->pass.version = version;
+            load->pass.items = load->items.data;
+            load->pass.num_items = load->items.count;
+            load->pass.wake_main_thread = true;
+            load->thread = SDL_CreateThread(milton_load_thread, "Load Thread", (void*)load);
+            if ( load->thread == NULL ) {
+                // Do it here.
+                milton_load_thread(load);
+            }
+            milton->load = load;
+        } else {
+            MltLoadPass pass = {};
+            pass.version = version;
+            pass.items = later.data;
+            pass.num_items = later.count;
+            ok = mlt_run_load_pass(&pass, LOAD_MAX_WORKERS);
+        }
+    }
+    // Every bucket was decoded here, unless the load thread took them along with the layers.
+    for ( i64 i = 0; ok && i < loads.count; ++i ) {
+        ok = mlt_verify_layer_chunk(&loads.data[i]);
+    }
+    mlt_release_layer_loads(&loads);
+    release(&later);
+    milton->view->working_layer_id = saved_working_layer_id;
+
+    // The rest is optional.
+
+    MltChunkEntry* chunk = mlt_find_chunk(&file, MltChunk_PICKER, 0);
+    if ( ok && chunk ) {
+        v3f rgb = {};
+        i32 button_count = 0;
+        ok =    mlt_open_chunk(&file, chunk, &r)
+             && mlt_read(&r, &rgb, sizeof(v3f), 1)
+             && mlt_read(&r, &button_count, sizeof(i32), 1);
+        if ( ok ) {
+            gui_picker_from_rgb(&milton->gui->picker, rgb);
+            ColorButton* btn = milton->gui->picker.color_buttons;
+            for ( i32 i = 0; ok && btn != NULL && i < button_count; ++i, btn = btn->next ) {
+                ok = mlt_read(&r, &btn->rgba, sizeof(v4f), 1);
+            }
+        }
+        mlt_close_chunk(&r);
+    }
+
+    chunk = mlt_find_chunk(&file, MltChunk_BRUSHES, 0);
+    if ( ok && chunk ) {
+        i32 num_brushes = 0;
+        ok =    mlt_open_chunk(&file, chunk, &r)
+             && mlt_read(&r, &num_brushes, sizeof(i32), 1);
+        if ( ok && (num_brushes < 0 || num_brushes > BrushEnum_COUNT) ) {
+            milton_log("Error loading file: too many brushes: %d\n", num_brushes);
+            num_brushes = min(max(num_brushes, 0), BrushEnum_COUNT);
+        }
+        ok =    ok
+             && mlt_read(&r, &milton->brushes, sizeof(Brush), (size_t)num_brushes)
+             && mlt_read(&r, &milton->brush_sizes, sizeof(i32), (size_t)num_brushes);
+        mlt_close_chunk(&r);
+    }
+
+    chunk = mlt_find_chunk(&file, MltChunk_HISTORY, 0);
+    if ( ok && chunk ) {
+        i32 history_count = 0;
+        ok =    mlt_open_chunk(&file, chunk, &r)
+             && mlt_read(&r, &history_count, sizeof(history_count), 1)
+             && history_count >= 0
+             && (u64)history_count * sizeof(HistoryElement) <= r.size;
+        if ( ok ) {
+            ArenaMark scratch = arena_scratch_begin();
+            HistoryElement* history = arena_alloc_array(scratch.arena, max(history_count, 1), HistoryElement);
+            ok = mlt_read(&r, history, sizeof(HistoryElement), (size_t)history_count);
+            milton_history_from_elements(milton, history, ok ? history_count : 0);
+            arena_scratch_end(scratch);
+        }
+        mlt_close_chunk(&r);
+    }
+
+    chunk = mlt_find_chunk(&file, MltChunk_JOURNAL, 0);
+    if ( ok && chunk ) {
+        ok =    mlt_open_chunk(&file, chunk, &r)
+             && mlt_read(&r, &milton->journal.id, sizeof(u64), 1)
+             && mlt_read(&r, &milton->journal.snapshot_seq, sizeof(u64), 1);
+        mlt_close_chunk(&r);
+    }
+
+    mlt_release_directory(&file);
+
+    *out_layer_guid = layer_guid;
+    return ok;
+}
+
+static MltWriter*
+mlt_begin_chunk(DArray<MltWriter>* chunks, u32 type)
+{
+    MltWriter w = {};
+    w.type = type;
+    push(chunks, w);
+    return peek(chunks);
+}
+
+// Bounds of each group of STROKELIST_BUCKET_COUNT strokes, numbered as in the layer chunk.
+static void
+mlt_write_bounds_chunk(MltWriter* w, Stroke* strokes, i64 count, i32 num_strokes)
+{
+    i32 strokes_per_rect = STROKELIST_BUCKET_COUNT;
+    i32 num_rects = (num_strokes + strokes_per_rect - 1) / strokes_per_rect;
+    mlt_write(w, &strokes_per_rect, sizeof(i32), 1);
+    mlt_write(w, &num_rects, sizeof(i32), 1);
+
+    Rect bounds = rect_without_size();
+    i32 in_rect = 0;
+    for ( i64 stroke_i = 0; stroke_i < count; ++stroke_i ) {
+        Stroke* stroke = &strokes[stroke_i];
+        if ( stroke->num_points > 0 && stroke->num_points <= STROKE_MAX_POINTS ) {
+            bounds = rect_union(bounds, stroke->bounding_rect);
+            if ( ++in_rect == strokes_per_rect ) {
+                mlt_write(w, &bounds, sizeof(Rect), 1);
+                bounds = rect_without_size();
+                in_rect = 0;
+            }
+        }
+    }
+    if ( in_rect > 0 ) {
+        mlt_write(w, &bounds, sizeof(Rect), 1);
+    }
+}
+
+static void
+mlt_write_layer_chunk(Milton* milton, SaveSnapshot* snapshot, SnapshotLayer* layer, MltWriter* w,
+                      MltWriter* bounds_w)
+{
+    u32 version = snapshot->mlt_binary_version;
+    if ( layer->num_strokes > INT_MAX ) {
+        milton_die_gracefully("FATAL. Number of strokes in layer greater than can be stored in file format. ");
+    }
+
+    i32 len = (i32)(strlen(layer->name) + 1);
+    mlt_write(w, &layer->id, sizeof(i32), 1);
+    mlt_write(w, &layer->flags, sizeof(layer->flags), 1);
+    mlt_write(w, &layer->alpha, sizeof(layer->alpha), 1);
+    mlt_write(w, &len, sizeof(i32), 1);
+    mlt_write(w, layer->name, sizeof(char), (size_t)len);
+
+    i64 num_effects = layer->effects.count;
+    mlt_write(w, &num_effects, sizeof(num_effects), 1);
+    for ( LayerEffect* e = begin(layer->effects); e != end(layer->effects); ++e ) {
+        mlt_write(w, &e->type, sizeof(e->type), 1);
+        mlt_write(w, &e->enabled, sizeof(e->enabled), 1);
+        switch ( e->type ) {
+            case LayerEffectType_BLUR: {
+                mlt_write(w, &e->blur.original_scale, sizeof(e->blur.original_scale), 1);
+                mlt_write(w, &e->blur.kernel_size, sizeof(e->blur.kernel_size), 1);
+            } break;
+        }
+    }
+
+    ArenaMark scratch = arena_scratch_begin();
+    DArray<u8*> pages = {};
+    i64 count = layer->num_strokes;
+    Stroke* strokes = snapshot_copy_strokes(milton, layer, scratch.arena, &pages);
+
+    i32 num_strokes = 0;
+    for ( i64 stroke_i = 0; stroke_i < count; ++stroke_i ) {
+        Stroke* stroke = &strokes[stroke_i];
+        if ( stroke->num_points > 0 && stroke->num_points <= STROKE_MAX_POINTS ) {
+            ++num_strokes;
+        }
+    }
+    mlt_write(w, &num_strokes, sizeof(i32), 1);
+    mlt_write_bounds_chunk(bounds_w, strokes, count, num_strokes);
+
+    if ( version >= 8 ) {
+        mlt_write_compact_strokes(w, layer->id, strokes, count);
+    } else {
+        for ( i64 stroke_i = 0; stroke_i < count; ++stroke_i ) {
+            Stroke* stroke = &strokes[stroke_i];
+            if ( stroke->num_points > 0 && stroke->num_points <= STROKE_MAX_POINTS ) {
+                // Points start at an 8 byte boundary.
+                mlt_write_padding(w);
+                mlt_write(w, &stroke->num_points, sizeof(i32), 1);
+                mlt_write(w, &stroke->layer_id, sizeof(i32), 1);
+                mlt_write(w, &stroke->brush, sizeof(Brush), 1);
+                mlt_write(w, stroke->points, sizeof(v2l), (size_t)stroke->num_points);
+                mlt_write(w, stroke->pressures, sizeof(f32), (size_t)stroke->num_points);
+            } else {
+                milton_log("WARNING: Trying to write a stroke of size %d\n", stroke->num_points);
+            }
+        }
+    }
+    snapshot_release_pages(&pages);
+    release(&pages);
+    arena_scratch_end(scratch);
+}
+
+#define SAVE_MAX_WORKERS 16
+
+struct SaveLayerPass
+{
+    Milton*         milton;
+    SaveSnapshot*   snapshot;
+    MltWriter*      chunks;  // One per layer.
+    MltWriter*      bounds_chunks;
+};
+
+static void
+save_layer_task(void* data, i64 layer_i)
+{
+    SaveLayerPass* pass = (SaveLayerPass*)data;
+    PROFILE_SCOPE("save layer");
+    mlt_write_layer_chunk(pass->milton, pass->snapshot, &pass->snapshot->layers[layer_i], &pass->chunks[layer_i],
+                          &pass->bounds_chunks[layer_i]);
+}
+
+// Serializes the chunks of MLT v7 and up, in file order. Layers are encoded in parallel.
+static void
+milton_save_chunks(Milton* milton, SaveSnapshot* snapshot, DArray<MltWriter>* chunks)
+{
+    PROFILE_SCOPE("save chunks");
+    i32 num_layers = snapshot->num_layers;
+    MltWriter* w = NULL;
+
+    w = mlt_begin_chunk(chunks, MltChunk_VIEW);
+    mlt_write(w, &snapshot->view, sizeof(CanvasView), 1);
+
+    w = mlt_begin_chunk(chunks, MltChunk_CANVAS);
+    mlt_write(w, &num_layers, sizeof(i32), 1);
+    mlt_write(w, &snapshot->layer_guid, sizeof(i32), 1);
+
+    i64 first_layer = chunks->count;
+    for ( i32 layer_i = 0; layer_i < num_layers; ++layer_i ) {
+        mlt_begin_chunk(chunks, MltChunk_LAYER);
+    }
+    i64 first_bounds = chunks->count;
+    for ( i32 layer_i = 0; layer_i < num_layers; ++layer_i ) {
+        mlt_begin_chunk(chunks, MltChunk_BOUNDS);
+    }
+    {
+        SaveLayerPass pass = {};
+        pass.milton = milton;
+        pass.snapshot = snapshot;
+        pass.chunks = chunks->data + first_layer;
+        pass.bounds_chunks = chunks->data + first_bounds;
+        worker_pool_run(save_layer_task, &pass, num_layers, SAVE_MAX_WORKERS);
+    }
+
+    {
+        w = mlt_begin_chunk(chunks, MltChunk_PICKER);
+        i32 button_count = (i32)snapshot->button_colors.count;
+        mlt_write(w, &snapshot->picker_rgb, sizeof(v3f), 1);
+        mlt_write(w, &button_count, sizeof(i32), 1);
+        mlt_write(w, snapshot->button_colors.data, sizeof(v4f), (size_t)button_count);
+    }
+
+    {
+        w = mlt_begin_chunk(chunks, MltChunk_BRUSHES);
+        i32 num_brushes = BrushEnum_COUNT;
+        mlt_write(w, &num_brushes, sizeof(num_brushes), 1);
+        mlt_write(w, &snapshot->brushes, sizeof(Brush), (size_t)num_brushes);
+        mlt_write(w, &snapshot->brush_sizes, sizeof(i32), (size_t)num_brushes);
+    }
+
+    {
+        w = mlt_begin_chunk(chunks, MltChunk_HISTORY);
+        i32 history_count = (i32)snapshot->history.count;
+        if ( snapshot->history.count > INT_MAX ) {
+            history_count = 0;
+        }
+        mlt_write(w, &history_count, sizeof(history_count), 1);
+        mlt_write(w, snapshot->history.data, sizeof(*snapshot->history.data), (size_t)history_count);
+    }
+
+    if ( snapshot->preview_jpeg.count > 0 ) {
+        w = mlt_begin_chunk(chunks, MltChunk_PREVIEW);
+        MltPreviewFooter footer = {};
+        footer.magic = MLT_PREVIEW_MAGIC_NUMBER;
+        footer.width = snapshot->preview_width;
+        footer.height = snapshot->preview_height;
+        footer.jpeg_size = (u32)snapshot->preview_jpeg.count;
+        mlt_write(w, &footer, sizeof(footer), 1);
+        mlt_write(w, snapshot->preview_jpeg.data, sizeof(u8), (size_t)snapshot->preview_jpeg.count);
+    }
+
+    if ( snapshot->journal_id != 0 ) {
+        w = mlt_begin_chunk(chunks, MltChunk_JOURNAL);
+        mlt_write(w, &snapshot->journal_id, sizeof(u64), 1);
+        mlt_write(w, &snapshot->journal_seq, sizeof(u64), 1);
+    }
+}
+
+// Builds the header and the directory of MLT v7 and up, and lists the buffers to write in order.
+static void
+mlt_layout_file(u32 version, DArray<MltWriter>* chunks, DArray<u8>* header, DArray<PlatformWriteBuffer>* buffers)
+{
+    static const u8 zeros[MLT_CHUNK_ALIGNMENT] = {};
+
+    u32 num_chunks = (u32)chunks->count;
+    u32 directory_checksum = 0;
+    DArray<MltChunkEntry> directory = {};
+    reserve(&directory, max(chunks->count, (i64)1));
+
+    u64 pos = sizeof(MltFileHeader) + num_chunks * sizeof(MltChunkEntry);
+    for ( i64 i = 0; i < chunks->count; ++i ) {
+        MltWriter* w = &chunks->data[i];
+        size_t padding = (size_t)((MLT_CHUNK_ALIGNMENT - pos % MLT_CHUNK_ALIGNMENT) % MLT_CHUNK_ALIGNMENT);
+        pos += padding;
+
+        MltChunkEntry entry = {};
+        entry.type = w->type;
+        entry.checksum = w->checksum;
+        entry.offset = pos;
+        entry.size = (u64)w->data.count;
+        push(&directory, entry);
+        pos += entry.size;
+    }
+    directory_checksum = mlt_crc32(0, directory.data, num_chunks * sizeof(MltChunkEntry));
+
+    u32 magic = MILTON_MAGIC_NUMBER;
+    push_bytes(header, &magic, sizeof(u32));
+    push_bytes(header, &version, sizeof(u32));
+    push_bytes(header, &num_chunks, sizeof(u32));
+    push_bytes(header, &directory_checksum, sizeof(u32));
+    push_bytes(header, directory.data, num_chunks * sizeof(MltChunkEntry));
+    release(&directory);
+
+    PlatformWriteBuffer b = {};
+    b.data = header->data;
+    b.size = (size_t)header->count;
+    push(buffers, b);
+
+    pos = (u64)header->count;
+    for ( i64 i = 0; i < chunks->count; ++i ) {
+        MltWriter* w = &chunks->data[i];
+        size_t padding = (size_t)((MLT_CHUNK_ALIGNMENT - pos % MLT_CHUNK_ALIGNMENT) % MLT_CHUNK_ALIGNMENT);
+        if ( padding > 0 ) {
+            b.data = zeros;
+            b.size = padding;
+            push(buffers, b);
+        }
+        b.data = w->data.data;
+        b.size = (size_t)w->data.count;
+        push(buffers, b);
+        pos += padding + (u64)w->data.count;
+    }
+}
+
+// ---- Journal
+//
+// Changes to the history (strokes, layer changes, undo and redo) are appended
+// to <mlt file>.journal as they happen, so that they don't need a full save of
+// the canvas. Each record has a sequence number. The MLT file stores the
+// journal id and the sequence number of the first record that it doesn't
+// contain. When loading, records from that number on are replayed on top of
+// the file.
+//
+// MLT files only keep the stroke records of the history. Undoing or redoing a
+// layer change that is not in the journal, a background change, or a failed
+// append stop the journal until the next full save. After each full save the
+// journal is copied, record by record, to a new file without the records that
+// made it into the file. Appends are flushed to disk before returning.
+// See milton_file_format.md
+
+#define MLT_JOURNAL_MAGIC_NUMBER 0x4A544C4D  // "MLTJ"
+#define MLT_JOURNAL_VERSION 1
+
+// Past these, the next change does a full save to compact the journal.
+#define MLT_JOURNAL_MAX_RECORDS 256
+#define MLT_JOURNAL_MAX_SIZE (8 * 1024 * 1024)
+
+#define MLT_JOURNAL_MAX_PAYLOAD (2 * sizeof(i32) + sizeof(Brush) + STROKE_MAX_POINTS * (sizeof(v2l) + sizeof(f32)))
+
+enum JournalRecordType
+{
+    JournalRecord_STROKE_ADD        = 1,  // Stroke
+    JournalRecord_UNDO              = 2,  // Empty
+    JournalRecord_REDO              = 3,  // Stroke, in case the redo stack was not saved. Empty for layer changes.
+    JournalRecord_LAYER_ADD         = 4,  // i32 layer_id
+    JournalRecord_LAYER_DELETE      = 5,  // i32 layer_id
+    JournalRecord_LAYER_MOVE        = 6,  // i32 layer_id, i32 below_id (-1 for the bottom)
+    JournalRecord_LAYER_PROPERTIES  = 7,  // i32 layer_id, u32 merge_id, properties after the change
+};
+
+struct MltJournalHeader
+{
+    u32 magic;
+    u32 version;
+    u64 id;
+};
+
+// Followed by `size` bytes of payload. A stroke payload is:
+//   i32 layer_id, i32 num_points, Brush, v2l points[num_points], f32 pressures[num_points]
+// Properties are:
+//   char name[MAX_LAYER_NAME_LEN], i32 flags, f32 alpha, i32 num_effects, MltJournalEffect effects[num_effects]
+struct MltJournalRecord
+{
+    u32 type;       // JournalRecordType
+    u32 size;
+    u64 seq;
+    u32 checksum;   // CRC-32 of the payload
+    u32 reserved;
+};
+
+struct MltJournalEffect
+{
+    i32 type;
+    b32 enabled;
+    i32 blur_original_scale;
+    i32 blur_kernel_size;
+};
+
+static void
+journal_fname(PATH_CHAR* mlt_path, PATH_CHAR* out_fname)
+{
+    PATH_SNPRINTF(out_fname, MAX_PATH, TO_PATH_STR("%s.journal"), mlt_path);
+}
+
+// Everything about the canvas that the journal does not record. Layers change through the history.
+static u32
+journal_canvas_signature(Milton* milton)
+{
+    return mlt_crc32(0, &milton->view->background_color, sizeof(milton->view->background_color));
+}
+
+// Reads the next record and its payload into journal->buffer. Returns false at the end of the file,
+// or if the record is truncated or damaged.
+static b32
+journal_read_record(MiltonJournal* journal, FILE* fd, MltJournalRecord* out_record)
+{
+    b32 ok =    fread_checked(out_record, sizeof(*out_record), 1, fd)
+             && out_record->size <= MLT_JOURNAL_MAX_PAYLOAD;
+    if ( ok ) {
+        reset(&journal->buffer);
+        reserve(&journal->buffer, max((i64)out_record->size, (i64)1));
+        ok =    (out_record->size == 0 || fread_checked(journal->buffer.data, 1, out_record->size, fd))
+             && mlt_crc32(0, journal->buffer.data, out_record->size) == out_record->checksum;
+    }
+    return ok;
+}
+
+// Writes a new journal next to `mlt_path` with the records of the current one from `first_seq` to
+// `end_seq`, and opens it for appending. Records are copied one at a time. Call with the journal
+// mutex locked.
+static b32
+journal_rewrite(Milton* milton, PATH_CHAR* mlt_path, u64 first_seq, u64 end_seq)
+{
+    MiltonJournal* journal = &milton->journal;
+    PATH_CHAR src_fname[MAX_PATH] = {};
+    PATH_CHAR fname[MAX_PATH] = {};
+    PATH_CHAR tmp_fname[MAX_PATH] = {};
+    MltJournalHeader header = {};
+    header.magic = MLT_JOURNAL_MAGIC_NUMBER;
+    header.version = MLT_JOURNAL_VERSION;
+    header.id = journal->id;
+
+    if ( journal->fd ) {
+        fclose(journal->fd);
+        journal->fd = NULL;
+    }
+    journal->unsynced = false;
+
+    // After a save to a new file, the records are still next to the old one.
+    journal_fname(journal->mlt_path, src_fname);
+    journal_fname(mlt_path, fname);
+    PATH_SNPRINTF(tmp_fname, MAX_PATH, TO_PATH_STR("%s.tmp"), fname);
+
+    i64 num_records = 0;
+    u64 size = 0;
+    b32 ok = false;
+    FILE* fd = platform_fopen(tmp_fname, TO_PATH_STR("wb"));
+    if ( fd ) {
+        ok = fwrite_checked(&header, sizeof(header), 1, fd);
+
+        FILE* src = journal->mlt_path[0] ? platform_fopen(src_fname, TO_PATH_STR("rb")) : NULL;
+        if ( src ) {
+            MltJournalHeader src_header = {};
+            b32 reading =    fread_checked(&src_header, sizeof(src_header), 1, src)
+                          && src_header.magic == MLT_JOURNAL_MAGIC_NUMBER
+                          && src_header.version == MLT_JOURNAL_VERSION
+                          && src_header.id == journal->id;
+            u64 seq = first_seq;
+            MltJournalRecord record = {};
+            while ( ok && reading && seq < end_seq && journal_read_record(journal, src, &record) ) {
+                if ( record.seq < first_seq ) {
+                    continue;
+                }
+                // The records that were replayed or appended are contiguous.
+                reading = record.seq == seq;
+                if ( reading ) {
+                    ok =    fwrite_checked(&record, sizeof(record), 1, fd)
+                         && (record.size == 0 || fwrite_checked(journal->buffer.data, 1, record.size, fd));
+                    ++num_records;
+                    size += sizeof(record) + record.size;
+                    ++seq;
+                }
+            }
+            fclose(src);
+        }
+
+        ok = ok && platform_sync_file(fd);
+        ok = (fclose(fd) == 0) && ok;
+        ok = ok && platform_move_file(tmp_fname, fname);
+    }
+    if ( ok ) {
+        journal->fd = platform_fopen(fname, TO_PATH_STR("ab"));
+        ok = journal->fd != NULL;
+    }
+    if ( ok ) {
+        PATH_STRCPY(journal->mlt_path, mlt_path);
+        journal->num_records = num_records;
+        journal->size = size;
+    } else {
+        milton_log("Could not write the journal. Falling back to full saves.\n");
+    }
+    return ok;
+}
+
+static void
+journal_push_stroke(DArray<u8>* out, Stroke* stroke)
+{
+    push_bytes(out, &stroke->layer_id, sizeof(i32));
+    push_bytes(out, &stroke->num_points, sizeof(i32));
+    push_bytes(out, &stroke->brush, sizeof(Brush));
+    push_bytes(out, stroke->points, (size_t)stroke->num_points * sizeof(v2l));
+    push_bytes(out, stroke->pressures, (size_t)stroke->num_points * sizeof(f32));
+}
+
+static void
+journal_push_properties(DArray<u8>* out, Layer* layer)
+{
+    i32 num_effects = 0;
+    for ( LayerEffect* e = layer->effects; e != NULL; e = e->next ) {
+        ++num_effects;
+    }
+    push_bytes(out, layer->name, MAX_LAYER_NAME_LEN);
+    push_bytes(out, &layer->flags, sizeof(i32));
+    push_bytes(out, &layer->alpha, sizeof(f32));
+    push_bytes(out, &num_effects, sizeof(i32));
+    for ( LayerEffect* e = layer->effects; e != NULL; e = e->next ) {
+        MltJournalEffect effect = { e->type, e->enabled, e->blur.original_scale, e->blur.kernel_size };
+        push_bytes(out, &effect, sizeof(effect));
+    }
+}
+
+static u32
+journal_record_type(HistoryRecord* h)
+{
+    u32 type = 0;
+    switch ( h->type ) {
+        case HistoryElement_STROKE_ADD:       { type = JournalRecord_STROKE_ADD; } break;
+        case HistoryElement_LAYER_ADD:        { type = JournalRecord_LAYER_ADD; } break;
+        case HistoryElement_LAYER_DELETE:     { type = JournalRecord_LAYER_DELETE; } break;
+        case HistoryElement_LAYER_MOVE:       { type = JournalRecord_LAYER_MOVE; } break;
+        case HistoryElement_LAYER_PROPERTIES: { type = JournalRecord_LAYER_PROPERTIES; } break;
+    }
+    return type;
+}
+
+// Appends a record of `type` about `h`, which is a new record for the types of JournalRecordType
+// that match a history record, and the record that was undone or redone otherwise.
+static void
+journal_append(Milton* milton, u32 type, HistoryRecord* h, Stroke* stroke)
+{
+    MiltonJournal* journal = &milton->journal;
+    SDL_LockMutex(journal->mutex);
+
+    if ( journal->replaying ) {
+        // The record being replayed is about `h`.
+        h->journal_seq = journal->next_seq + 1;
+        SDL_UnlockMutex(journal->mutex);
+        return;
+    }
+
+    b32 ok =    journal->fd != NULL
+             && journal->unjournaled_seq <= journal->snapshot_seq
+             && journal->canvas_signature == journal_canvas_signature(milton);
+
+    // The MLT file keeps the stroke records of the history. Other records can only be undone or
+    // redone when replaying the journal brings them back.
+    if (    ok
+         && (type == JournalRecord_UNDO || type == JournalRecord_REDO)
+         && h->type != HistoryElement_STROKE_ADD ) {
+        ok = h->journal_seq > journal->snapshot_seq;
+    }
+
+    if ( ok ) {
+        DArray<u8>* buffer = &journal->buffer;
+        reset(buffer);
+
+        MltJournalRecord record = {};
+        record.type = type;
+        record.seq = journal->next_seq;
+        push_bytes(buffer, &record, sizeof(record));
+        switch ( type ) {
+            case JournalRecord_STROKE_ADD: {
+                journal_push_stroke(buffer, stroke);
+            } break;
+            case JournalRecord_REDO: {
+                if ( h->type == HistoryElement_STROKE_ADD ) {
+                    journal_push_stroke(buffer, stroke);
+                }
+            } break;
+            case JournalRecord_LAYER_ADD:
+            case JournalRecord_LAYER_DELETE: {
+                push_bytes(buffer, &h->layer->id, sizeof(i32));
+            } break;
+            case JournalRecord_LAYER_MOVE: {
+                i32 below_id = h->layer->prev ? h->layer->prev->id : -1;
+                push_bytes(buffer, &h->layer->id, sizeof(i32));
+                push_bytes(buffer, &below_id, sizeof(i32));
+            } break;
+            case JournalRecord_LAYER_PROPERTIES: {
+                push_bytes(buffer, &h->layer->id, sizeof(i32));
+                push_bytes(buffer, &h->merge_id, sizeof(u32));
+                journal_push_properties(buffer, h->layer);
+            } break;
+        }
+        // The pushes may have moved the buffer.
+        MltJournalRecord* dst = (MltJournalRecord*)buffer->data;
+        dst->size = (u32)(buffer->count - (i64)sizeof(record));
+        dst->checksum = mlt_crc32(0, buffer->data + sizeof(record), dst->size);
+
+        ok =    fwrite_checked(buffer->data, 1, (size_t)buffer->count, journal->fd)
+             && fflush(journal->fd) == 0;
+        if ( ok ) {
+            ++journal->num_records;
+            journal->size += (u64)buffer->count;
+            // Every change is synced to disk before the next frame, except property changes, which
+            // come every frame while a slider is dragged. They are synced with the next change.
+            if ( type == JournalRecord_LAYER_PROPERTIES ) {
+                journal->unsynced = true;
+            } else {
+                ok = platform_sync_file(journal->fd);
+                journal->unsynced = false;
+            }
+        }
+        if ( ok ) {
+            h->journal_seq = record.seq + 1;
+        } else {
+            milton_log("Could not append to the journal.\n");
+        }
+    }
+
+    journal->next_seq += 1;
+    if ( !ok ) {
+        // The next full save has to include this change before the journal can be used again.
+        journal->unjournaled_seq = journal->next_seq;
+    }
+
+    SDL_UnlockMutex(journal->mutex);
+}
+
+void
+milton_journal_push(Milton* milton, HistoryRecord* h, Stroke* stroke)
+{
+    journal_append(milton, journal_record_type(h), h, stroke);
+}
+
+void
+milton_journal_undo(Milton* milton, HistoryRecord* h)
+{
+    journal_append(milton, JournalRecord_UNDO, h, NULL);
+}
+
+void
+milton_journal_redo(Milton* milton, HistoryRecord* h, Stroke* stroke)
+{
+    journal_append(milton, JournalRecord_REDO, h, stroke);
+}
+
+b32
+milton_journal_needs_full_save(Milton* milton)
+{
+    MiltonJournal* journal = &milton->journal;
+    SDL_LockMutex(journal->mutex);
+    // The journal only applies on top of the file it was written for. Saving to another file, a
+    // background change or another program writing the file all need a full save.
+    b32 needs_save =    journal->fd == NULL
+                     || journal->unjournaled_seq > journal->snapshot_seq
+                     || journal->num_records > MLT_JOURNAL_MAX_RECORDS
+                     || journal->size > MLT_JOURNAL_MAX_SIZE
+                     || journal->canvas_signature != journal_canvas_signature(milton)
+                     || PATH_STRCMP(journal->mlt_path, milton->mlt_file_path) != 0;
+    u64 mlt_size = journal->mlt_size;
+    SDL_UnlockMutex(journal->mutex);
+    if ( !needs_save ) {
+        needs_save = file_size(milton->mlt_file_path) != mlt_size;
+    }
+    return needs_save;
+}
+
+void
+milton_journal_close(Milton* milton)
+{
+    MiltonJournal* journal = &milton->journal;
+    if ( journal->mutex ) {
+        SDL_LockMutex(journal->mutex);
+    }
+    if ( journal->fd ) {
+        if ( journal->unsynced ) {
+            platform_sync_file(journal->fd);
+        }
+        fclose(journal->fd);
+    }
+    release(&journal->buffer);
+    SDL_mutex* mutex = journal->mutex;
+    *journal = MiltonJournal{};
+    journal->mutex = mutex;
+    if ( mutex ) {
+        SDL_UnlockMutex(mutex);
+    }
+}
+
+static b32
+journal_journaling_enabled(Milton* milton)
+{
+    return    MILTON_SAVE_JOURNAL
+           && !(milton->flags & MiltonStateFlags_HEADLESS)
+           && milton->mlt_binary_version >= 7;
+}
+
+// Reads a stroke payload into the canvas arena.
+static b32
+journal_read_stroke(Milton* milton, u8* payload, u32 size, Stroke* out_stroke)
 {
-    b32 ok = false;
-
-    size_t read = fread(dst, sz, count, fd);
-    if ( read == count && !ferror(fd)) {
-        ok = true;
+    CanvasState* canvas = milton->canvas;
+    Stroke stroke = Stroke{};
+    size_t header_size = 2 * sizeof(i32) + sizeof(Brush);
+    b32 ok = size >= header_size;
+    if ( ok ) {
+        memcpy(&stroke.layer_id, payload, sizeof(i32));
+        memcpy(&stroke.num_points, payload + sizeof(i32), sizeof(i32));
+        memcpy(&stroke.brush, payload + 2 * sizeof(i32), sizeof(Brush));
+        ok =    stroke.num_points > 0 && stroke.num_points <= STROKE_MAX_POINTS
+             && size == header_size + (size_t)stroke.num_points * (sizeof(v2l) + sizeof(f32));
+    }
+    if ( ok ) {
+        stroke.id = canvas->stroke_id_count++;
+        stroke.points = arena_alloc_array(&canvas->arena, stroke.num_points, v2l);
+        stroke.pressures = arena_alloc_array(&canvas->arena, stroke.num_points, f32);
+#if STROKE_DEBUG_VIZ
+        stroke.debug_flags = arena_alloc_array(&canvas->arena, stroke.num_points, int);
+#endif
+        u8* points = payload + header_size;
+        memcpy(stroke.points, points, (size_t)stroke.num_points * sizeof(v2l));
+        memcpy(stroke.pressures, points + (size_t)stroke.num_points * sizeof(v2l), (size_t)stroke.num_points * sizeof(f32));
+        stroke.bounding_rect = bounding_box_for_stroke(&stroke);
+        *out_stroke = stroke;
     }
-
     return ok;
 }
 
+// Reads a properties payload into the layer, as a change that can be undone. New effect nodes go
+// in the canvas arena.
 static b32
-fwrite_checked(void* data, size_t sz, size_t count, FILE* fd)
+journal_read_properties(Milton* milton, u8* payload, u32 size)
 {
-    b32 ok = false;
-    size_t written = fwrite(data, sz, count, fd);
-    if ( written == count ) {
-        ok = true;
+    CanvasState* canvas = milton->canvas;
+    i32 layer_id = 0;
+    u32 merge_id = 0;
+    LayerProperties properties = {};
+    i32 num_effects = 0;
+    size_t header_size = 2*sizeof(i32) + MAX_LAYER_NAME_LEN + sizeof(i32) + sizeof(f32) + sizeof(i32);
+    b32 ok = size >= header_size;
+    if ( ok ) {
+        u8* p = payload;
+        memcpy(&layer_id, p, sizeof(i32));                 p += sizeof(i32);
+        memcpy(&merge_id, p, sizeof(u32));                 p += sizeof(u32);
+        memcpy(properties.name, p, MAX_LAYER_NAME_LEN);    p += MAX_LAYER_NAME_LEN;
+        memcpy(&properties.flags, p, sizeof(i32));         p += sizeof(i32);
+        memcpy(&properties.alpha, p, sizeof(f32));         p += sizeof(f32);
+        memcpy(&num_effects, p, sizeof(i32));
+        properties.name[MAX_LAYER_NAME_LEN - 1] = '\0';
+        ok =    num_effects >= 0 && num_effects <= LayerEffectType_COUNT * 64
+             && size == header_size + (size_t)num_effects * sizeof(MltJournalEffect);
+    }
+    Layer* layer = ok ? layer::get_by_id(canvas->root_layer, layer_id) : NULL;
+    ok = layer != NULL;
+    for ( i32 i = 0; ok && i < num_effects; ++i ) {
+        MltJournalEffect effect = {};
+        memcpy(&effect, payload + header_size + (size_t)i * sizeof(MltJournalEffect), sizeof(effect));
+        ok = effect.type == LayerEffectType_BLUR;
+        if ( ok ) {
+            LayerEffectState state = {};
+            state.effect = arena_alloc_elem(&canvas->arena, LayerEffect);
+            state.value.type = effect.type;
+            state.value.enabled = effect.enabled;
+            state.value.blur.original_scale = effect.blur_original_scale;
+            state.value.blur.kernel_size = effect.blur_kernel_size;
+            push(&properties.effects, state);
+        }
     }
+    if ( ok ) {
+        milton_layer_properties_will_change(milton, layer, merge_id);
+        layer::layer_swap_properties(layer, &properties);
+    }
+    layer::layer_release_properties(&properties);
+    return ok;
+}
 
+static b32
+journal_replay_record(Milton* milton, MltJournalRecord* record, u8* payload)
+{
+    b32 ok = true;
+    Stroke stroke = {};
+    HistoryChange change = {};
+    CanvasState* canvas = milton->canvas;
+    // Layer records other than properties have one id, or two for moves.
+    i32 ids[2] = {};
+    b32 has_ids = record->size == (record->type == JournalRecord_LAYER_MOVE ? sizeof(ids) : sizeof(i32));
+    if ( has_ids ) {
+        memcpy(ids, payload, record->size);
+    }
+    switch ( record->type ) {
+        case JournalRecord_STROKE_ADD: {
+            ok = journal_read_stroke(milton, payload, record->size, &stroke);
+            Layer* layer = ok ? layer::get_by_id(milton->canvas->root_layer, stroke.layer_id) : NULL;
+            ok = layer != NULL;
+            if ( ok ) {
+                milton_add_stroke(milton, layer, stroke);
+            }
+        } break;
+        case JournalRecord_UNDO: {
+            milton_undo(milton, &change);
+        } break;
+        case JournalRecord_REDO: {
+            if ( record->size == 0 ) {
+                // A layer change. It is in the redo stack.
+                ok = milton_redo(milton, &change);
+                break;
+            }
+            ok = journal_read_stroke(milton, payload, record->size, &stroke);
+            if ( ok && !milton_redo(milton, &change) ) {
+                // The stroke was undone before the last full save. The redo stack is not saved.
+                Layer* layer = layer::get_by_id(milton->canvas->root_layer, stroke.layer_id);
+                ok = layer != NULL;
+                if ( ok ) {
+                    milton_add_stroke(milton, layer, stroke);
+                }
+            }
+        } break;
+        case JournalRecord_LAYER_ADD: {
+            // Layer ids come from layer_guid, which the MLT file has.
+            ok = has_ids;
+            if ( ok ) {
+                milton_new_layer(milton, /*undoable*/true);
+                ok = canvas->working_layer->id == ids[0];
+            }
+        } break;
+        case JournalRecord_LAYER_DELETE: {
+            Layer* layer = has_ids ? layer::get_by_id(canvas->root_layer, ids[0]) : NULL;
+            ok = layer != NULL && (layer->next || layer->prev);
+            if ( ok ) {
+                milton_set_working_layer(milton, layer);
+                milton_delete_working_layer(milton);
+            }
+        } break;
+        case JournalRecord_LAYER_MOVE: {
+            Layer* layer = has_ids ? layer::get_by_id(canvas->root_layer, ids[0]) : NULL;
+            Layer* below = layer && ids[1] >= 0 ? layer::get_by_id(canvas->root_layer, ids[1]) : NULL;
+            ok = layer != NULL && (ids[1] < 0 || (below != NULL && below != layer));
+            if ( ok ) {
+                milton_move_layer(milton, layer, below);
+            }
+        } break;
+        case JournalRecord_LAYER_PROPERTIES: {
+            ok = journal_read_properties(milton, payload, record->size);
+        } break;
+        default: {
+            ok = false;
+        } break;
+    }
     return ok;
 }
 
+// Replays the journal of the file that was just loaded and opens it for appending. Records are read
+// until the first one that is truncated or damaged.
+static void
+milton_journal_open(Milton* milton)
+{
+    MiltonJournal* journal = &milton->journal;
+    PATH_CHAR fname[MAX_PATH] = {};
+    i64 num_replayed = 0;
+
+    SDL_LockMutex(journal->mutex);
+
+    journal->next_seq = journal->snapshot_seq;
+    journal->replaying = true;
+    PATH_STRCPY(journal->mlt_path, milton->mlt_file_path);
+    journal->mlt_size = file_size(milton->mlt_file_path);
+
+    journal_fname(milton->mlt_file_path, fname);
+    FILE* fd = journal->id != 0 ? platform_fopen(fname, TO_PATH_STR("rb")) : NULL;
+    if ( fd ) {
+        MltJournalHeader header = {};
+        b32 ok =    fread_checked(&header, sizeof(header), 1, fd)
+                 && header.magic == MLT_JOURNAL_MAGIC_NUMBER
+                 && header.version == MLT_JOURNAL_VERSION
+                 && header.id == journal->id;
+        while ( ok ) {
+            MltJournalRecord record = {};
+            ok = journal_read_record(journal, fd, &record);
+            if ( ok && record.seq >= journal->snapshot_seq ) {
+                // Records are contiguous from the snapshot on.
+                ok =    record.seq == journal->next_seq
+                     && journal_replay_record(milton, &record, journal->buffer.data);
+                if ( ok ) {
+                    ++journal->next_seq;
+                    ++num_replayed;
+                }
+            }
+        }
+        fclose(fd);
+        if ( num_replayed > 0 ) {
+            milton_log("Replayed %d changes from the journal.\n", (int)num_replayed);
+        }
+    }
+    journal->replaying = false;
+    // Replayed properties are in the journal already.
+    milton->canvas->properties_changed = false;
+
+    journal->canvas_signature = journal_canvas_signature(milton);
+
+    // Files without a journal get one on the next full save. The new journal drops the records
+    // that are in the file and the ones after the first that could not be replayed.
+    if ( journal->id != 0 && journal_journaling_enabled(milton) ) {
+        journal_rewrite(milton, milton->mlt_file_path, journal->snapshot_seq, journal->next_seq);
+    }
+
+    SDL_UnlockMutex(journal->mutex);
+}
+
+// Drops the records that are in the snapshot that was just saved.
+static void
+milton_journal_compact(Milton* milton, SaveSnapshot* snapshot)
+{
+    MiltonJournal* journal = &milton->journal;
+    u64 seq = snapshot->journal_seq;
+    SDL_LockMutex(journal->mutex);
+
+    // Otherwise the canvas was replaced while saving.
+    if ( journal->id == snapshot->journal_id ) {
+        journal->snapshot_seq = seq;
+        journal->canvas_signature = snapshot->canvas_signature;
+        journal->mlt_size = file_size(snapshot->mlt_file_path);
+
+        journal_rewrite(milton, snapshot->mlt_file_path, seq, journal->next_seq);
+    }
+
+    SDL_UnlockMutex(journal->mutex);
+}
+
 void
 milton_unset_last_canvas_fname()
 {
@@ -51,25 +2397,235 @@ milton_unset_last_canvas_fname()
     }
 }
 
-void
-milton_load(Milton* milton)
+// Loads MLT v1 to v6. Everything is stored in sequence.
+static b32
+milton_load_v6(Milton* milton, FILE* fd, u32 milton_binary_version, i32* out_layer_guid)
 {
     // Declare variables here to silence compiler warnings about using GOTO.
     i32 history_count = 0;
+    DArray<HistoryElement> history = {};
     i32 num_layers = 0;
     i32 saved_working_layer_id = 0;
-    int err = 0;
 
     i32 layer_guid = 0;
     ColorButton* btn = NULL;
     MiltonGui* gui = NULL;
     auto saved_size = milton->view->screen_size;
 
+    CanvasState* canvas = milton->canvas;
+    b32 ok = true;  // fread check
+    // For the points of files before v4, which are 32 bit.
+    ArenaMark scratch = arena_scratch_begin();
+
+#define READ(address, size, num, fd) do { ok = fread_checked(address,size,num,fd); if (!ok){ goto END; } } while(0)
+
+    if ( milton_binary_version >= 4 ) {
+        READ(milton->view, sizeof(CanvasView), 1, fd);
+    } else {
+        CanvasViewPreV4 legacy_view = {};
+        READ(&legacy_view, sizeof(CanvasViewPreV4), 1, fd);
+        milton->view->screen_size = legacy_view.screen_size;
+        milton->view->scale = legacy_view.scale;
+        milton->view->zoom_center = legacy_view.zoom_center;
+        milton->view->pan_center = VEC2L(legacy_view.pan_center * -1);
+        milton->view->background_color = legacy_view.background_color;
+        milton->view->working_layer_id = legacy_view.working_layer_id;
+        milton->view->num_layers = legacy_view.num_layers;
+    }
+
+    // The screen size might hurt us.
+    milton->view->screen_size = saved_size;
+
+    // The process of loading changes state. working_layer_id changes when creating layers.
+    saved_working_layer_id = milton->view->working_layer_id;
+
+    num_layers = 0;
+    READ(&num_layers, sizeof(i32), 1, fd);
+    READ(&layer_guid, sizeof(i32), 1, fd);
+
+    for ( int layer_i = 0; ok && layer_i < num_layers; ++layer_i ) {
+        i32 len = 0;
+        READ(&len, sizeof(i32), 1, fd);
+
+        if ( len > MAX_LAYER_NAME_LEN ) {
+            milton_log("Corrupt file. Layer name is too long.\n");
+            ok = false;
+            goto END;
+        }
+
+        if (ok) { milton_new_layer(milton); }
+
+        Layer* layer = milton->canvas->working_layer;
+
+        READ(layer->name, sizeof(char), (size_t)len, fd);
+
+        READ(&layer->id, sizeof(i32), 1, fd);
+        READ(&layer->flags, sizeof(layer->flags), 1, fd);
+
+        if ( ok ) {
+            i32 num_strokes = 0;
+            READ(&num_strokes, sizeof(i32), 1, fd);
+
+            for ( i32 stroke_i = 0; ok && stroke_i < num_strokes; ++stroke_i ) {
+                Stroke stroke = Stroke{};
+                Arena* payload = &strokelist_get_bucket(&layer->strokes, layer->strokes.count)->payload;
+
+                stroke.id = milton->canvas->stroke_id_count++;
+
+                READ(&stroke.brush, sizeof(Brush), 1, fd);
+                READ(&stroke.num_points, sizeof(i32), 1, fd);
+
+                if ( stroke.num_points > STROKE_MAX_POINTS || stroke.num_points <= 0 ) {
+                    milton_log("ERROR: File has a stroke with %d points\n",
+                               stroke.num_points);
+                    // Older versions have a possible off-by-one bug here.
+                    if (stroke.num_points <= STROKE_MAX_POINTS)  {
+                        stroke.points = arena_alloc_array(payload, stroke.num_points, v2l);
+                        READ(stroke.points, sizeof(v2l), (size_t)stroke.num_points, fd);
+                        stroke.pressures = arena_alloc_array(payload, stroke.num_points, f32);
+                        READ(stroke.pressures, sizeof(f32), (size_t)stroke.num_points, fd);
+                        READ(&stroke.layer_id, sizeof(i32), 1, fd);
+#if STROKE_DEBUG_VIZ
+                        stroke.debug_flags = arena_alloc_array(payload, stroke.num_points, int);
+#endif
+
+                        stroke.bounding_rect = bounding_box_for_stroke(&stroke);
+
+                        layer::layer_push_stroke(layer, stroke);
+                    } else {
+                        ok = false;
+                        goto END;
+                    }
+                } else {
+                    if ( milton_binary_version >= 4 ) {
+                        stroke.points = arena_alloc_array(payload, stroke.num_points, v2l);
+                        READ(stroke.points, sizeof(v2l), (size_t)stroke.num_points, fd);
+                    } else {
+                        stroke.points = arena_alloc_array(payload, stroke.num_points, v2l);
+                        v2i* points_32bit = arena_alloc_array(scratch.arena, stroke.num_points, v2i);
+
+                        READ(points_32bit, sizeof(v2i), (size_t)stroke.num_points, fd);
+                        for (int i = 0; i < stroke.num_points; ++i) {
+                            stroke.points[i] = VEC2L(points_32bit[i]);
+                        }
+                        arena_reset_to_mark(scratch);
+                    }
+#if STROKE_DEBUG_VIZ
+                    stroke.debug_flags = arena_alloc_array(payload, stroke.num_points, int);
+#endif
+                    stroke.pressures = arena_alloc_array(payload, stroke.num_points, f32);
+                    READ(stroke.pressures, sizeof(f32), (size_t)stroke.num_points, fd);
+                    READ(&stroke.layer_id, sizeof(i32), 1, fd);
+                    stroke.bounding_rect = bounding_box_for_stroke(&stroke);
+                    layer::layer_push_stroke(layer, stroke);
+                }
+            }
+        }
+
+        if ( milton_binary_version >= 4 ) {
+            i64 num_effects = 0;
+            READ(&num_effects, sizeof(num_effects), 1, fd);
+            if ( num_effects > 0 ) {
+                LayerEffect** e = &layer->effects;
+                for ( i64 i = 0; i < num_effects; ++i ) {
+                    mlt_assert(*e == NULL);
+                    *e = arena_alloc_elem(&canvas->arena, LayerEffect);
+                    READ(&(*e)->type, sizeof((*e)->type), 1, fd);
+                    READ(&(*e)->enabled, sizeof((*e)->enabled), 1, fd);
+                    switch ((*e)->type) {
+                        case LayerEffectType_BLUR: {
+                            READ(&(*e)->blur.original_scale, sizeof((*e)->blur.original_scale), 1, fd);
+                            READ(&(*e)->blur.kernel_size, sizeof((*e)->blur.kernel_size), 1, fd);
+                        } break;
+                    }
+                    e = &(*e)->next;
+                }
+            }
+        }
+    }
+    milton->view->working_layer_id = saved_working_layer_id;
+
+    if ( milton_binary_version >= 5 ) {
+       v3f rgb;
+       READ(&rgb, sizeof(v3f), 1, fd);
+       gui_picker_from_rgb(&milton->gui->picker, rgb);
+    } else {
+       READ(&milton->gui->picker.data, sizeof(PickerData), 1, fd);
+    }
+
+
+    // Buttons
+    {
+       i32 button_count = 0;
+       gui = milton->gui;
+       btn = gui->picker.color_buttons;
+
+       READ(&button_count, sizeof(i32), 1, fd);
+       for ( i32 i = 0;
+             btn!=NULL && i < button_count;
+             ++i, btn=btn->next ) {
+          READ(&btn->rgba, sizeof(v4f), 1, fd);
+       }
+    }
+
+    // Brush
+    if ( milton_binary_version >= 2 && milton_binary_version <= 5  ) {
+        // PEN, ERASER
+        READ(&milton->brushes, sizeof(Brush), 2, fd);
+        // Sizes
+        READ(&milton->brush_sizes, sizeof(i32), 2, fd);
+    }
+    else if ( milton_binary_version > 5 ) {
+        u16 num_brushes = 0;
+        READ(&num_brushes, sizeof(u16), 1, fd);
+        if ( num_brushes > BrushEnum_COUNT ) {
+            milton_log("Error loading file: too many brushes: %d\n", num_brushes);
+        }
+        READ(&milton->brushes, sizeof(Brush), num_brushes, fd);
+        READ(&milton->brush_sizes, sizeof(i32), num_brushes, fd);
+    }
+
+    history_count = 0;
+    READ(&history_count, sizeof(history_count), 1, fd);
+    reserve(&history, max(history_count, 1));
+    READ(history.data, sizeof(HistoryElement), (size_t)history_count, fd);
+    milton_history_from_elements(milton, history.data, history_count);
+
+    // MLT 3
+    // Layer alpha
+    if ( milton_binary_version >= 3 ) {
+        Layer* l = milton->canvas->root_layer;
+        for ( i64 i = 0; ok && i < num_layers; ++i ) {
+            mlt_assert(l != NULL);
+            READ(&l->alpha, sizeof(l->alpha), 1, fd);
+            l = l->next;
+        }
+    } else {
+        for ( Layer* l = milton->canvas->root_layer; l != NULL; l = l->next ) {
+            l->alpha = 1.0f;
+        }
+    }
+
+END:
+#undef READ
+    arena_scratch_end(scratch);
+    release(&history);
+    *out_layer_guid = layer_guid;
+    return ok;
+}
+
+void
+milton_load(Milton* milton)
+{
+    PROFILE_SCOPE("load");
+    // Declare variables here to silence compiler warnings about using GOTO.
+    int err = 0;
+    i32 layer_guid = 0;
+
     milton_log("Loading file %s\n", milton->mlt_file_path);
     // Reset the canvas.
     milton_reset_canvas(milton);
 
-    CanvasState* canvas = milton->canvas;
 #define READ(address, size, num, fd) do { ok = fread_checked(address,size,num,fd); if (!ok){ goto END; } } while(0)
 
     // Unload gpu data if the strokes have been cooked.
@@ -85,10 +2641,17 @@ milton_load(Milton* milton)
         READ(&milton_magic, sizeof(u32), 1, fd);
         READ(&milton_binary_version, sizeof(u32), 1, fd);
 
+        if ( milton_magic != MILTON_MAGIC_NUMBER ) {
+            platform_dialog("MLT file could not be loaded. Magic number mismatch.", "Problem");
+            milton_unset_last_canvas_fname();
+            ok = false;
+            goto END;
+        }
+
         if (ok) {
             if ( milton_binary_version < 4 ) {
                 if ( platform_dialog_yesno ("This file will be updated to the new version of Milton. Older versions won't be able to open it. Is this OK?", "File format change") ) {
-                    milton->mlt_binary_version = MILTON_MINOR_VERSION;
+                    milton->mlt_binary_version = MILTON_MLT_VERSION;
                     milton_log("Updating this file to latest mlt version.\n");
                 } else {
                     ok = false;
@@ -100,7 +2663,7 @@ milton_load(Milton* milton)
             }
         }
 
-        if ( milton_binary_version > MILTON_MINOR_VERSION ) {
+        if ( milton_binary_version > MILTON_MLT_VERSION ) {
             platform_dialog("This file was created with a newer version of Milton.", "Could not open.");
 
             // Stop loading, but exit without prompting.
@@ -109,244 +2672,380 @@ milton_load(Milton* milton)
             goto END;
         }
 
-        if ( milton_binary_version >= 4 ) {
-            READ(milton->view, sizeof(CanvasView), 1, fd);
+        if ( milton_binary_version >= 7 ) {
+            ok = milton_load_chunks(milton, fd, milton_binary_version, &layer_guid);
         } else {
-            CanvasViewPreV4 legacy_view = {};
-            READ(&legacy_view, sizeof(CanvasViewPreV4), 1, fd);
-            milton->view->screen_size = legacy_view.screen_size;
-            milton->view->scale = legacy_view.scale;
-            milton->view->zoom_center = legacy_view.zoom_center;
-            milton->view->pan_center = VEC2L(legacy_view.pan_center * -1);
-            milton->view->background_color = legacy_view.background_color;
-            milton->view->working_layer_id = legacy_view.working_layer_id;
-            milton->view->num_layers = legacy_view.num_layers;
+            ok = milton_load_v6(milton, fd, milton_binary_version, &layer_guid);
         }
 
-        // The screen size might hurt us.
-        milton->view->screen_size = saved_size;
-
-        // The process of loading changes state. working_layer_id changes when creating layers.
-        saved_working_layer_id = milton->view->working_layer_id;
-
-        if ( milton_magic != MILTON_MAGIC_NUMBER ) {
-            platform_dialog("MLT file could not be loaded. Magic number mismatch.", "Problem");
-            milton_unset_last_canvas_fname();
+        err = fclose(fd);
+        if ( err != 0 ) {
             ok = false;
-            goto END;
         }
 
-        num_layers = 0;
-        READ(&num_layers, sizeof(i32), 1, fd);
-        READ(&layer_guid, sizeof(i32), 1, fd);
-
-        for ( int layer_i = 0; ok && layer_i < num_layers; ++layer_i ) {
-            i32 len = 0;
-            READ(&len, sizeof(i32), 1, fd);
-
-            if ( len > MAX_LAYER_NAME_LEN ) {
-                milton_log("Corrupt file. Layer name is too long.\n");
-                ok = false;
-                goto END;
+END:
+        // Finished loading
+        if ( !ok ) {
+            if ( !handled ) {
+                platform_dialog("Tried to load a corrupt Milton file or there was an error reading from disk.", "Error");
             }
+            milton_reset_canvas_and_set_default(milton);
+        } else {
+            i32 id = milton->view->working_layer_id;
+            {  // Use working_layer_id to make working_layer point to the correct thing
+                Layer* layer = milton->canvas->root_layer;
+                while ( layer ) {
+                    if ( layer->id == id ) {
+                        milton->canvas->working_layer = layer;
+                        break;
+                    }
+                    layer = layer->next;
+                }
+            }
+            milton->canvas->layer_guid = layer_guid;
 
-            if (ok) { milton_new_layer(milton); }
-
-            Layer* layer = milton->canvas->working_layer;
+            milton_journal_open(milton);
+            geometry_cache_open(&milton->geometry_cache, milton->mlt_file_path);
 
-            READ(layer->name, sizeof(char), (size_t)len, fd);
+            // Update GPU
+            milton_set_background_color(milton, milton->view->background_color);
+            if ( !(milton->flags & MiltonStateFlags_NO_GPU) ) {
+                gpu_update_picker(milton->render_data, &milton->gui->picker);
+            }
+        }
+    } else {
+        milton_log("milton_load: Could not open file!\n");
+        milton_reset_canvas_and_set_default(milton);
+    }
+#undef READ
+}
 
-            READ(&layer->id, sizeof(i32), 1, fd);
-            READ(&layer->flags, sizeof(layer->flags), 1, fd);
+// Serializes MLT v1 to v6, after the magic number and version.
+static void
+milton_save_v6(Milton* milton, SaveSnapshot* snapshot, DArray<u8>* out)
+{
+    u32 milton_binary_version = snapshot->mlt_binary_version;
+    i32 history_count = 0;
+    i32 num_layers = snapshot->num_layers;
+    DArray<u8*> pages = {};
 
-            if ( ok ) {
-                i32 num_strokes = 0;
-                READ(&num_strokes, sizeof(i32), 1, fd);
-
-                for ( i32 stroke_i = 0; ok && stroke_i < num_strokes; ++stroke_i ) {
-                    Stroke stroke = Stroke{};
-
-                    stroke.id = milton->canvas->stroke_id_count++;
-
-                    READ(&stroke.brush, sizeof(Brush), 1, fd);
-                    READ(&stroke.num_points, sizeof(i32), 1, fd);
-
-                    if ( stroke.num_points > STROKE_MAX_POINTS || stroke.num_points <= 0 ) {
-                        milton_log("ERROR: File has a stroke with %d points\n",
-                                   stroke.num_points);
-                        // Older versions have a possible off-by-one bug here.
-                        if (stroke.num_points <= STROKE_MAX_POINTS)  {
-                            stroke.points = arena_alloc_array(&canvas->arena, stroke.num_points, v2l);
-                            READ(stroke.points, sizeof(v2l), (size_t)stroke.num_points, fd);
-                            stroke.pressures = arena_alloc_array(&canvas->arena, stroke.num_points, f32);
-                            READ(stroke.pressures, sizeof(f32), (size_t)stroke.num_points, fd);
-                            READ(&stroke.layer_id, sizeof(i32), 1, fd);
-#if STROKE_DEBUG_VIZ
-                            stroke.debug_flags = arena_alloc_array(&canvas->arena, stroke.num_points, int);
-#endif
+#define WRITE(address, sz, num) push_bytes(out, address, (size_t)(sz) * (size_t)(num))
+    WRITE(&snapshot->view, sizeof(CanvasView), 1);
 
-                            stroke.bounding_rect = bounding_box_for_stroke(&stroke);
+    WRITE(&num_layers, sizeof(i32), 1);
+    WRITE(&snapshot->layer_guid, sizeof(i32), 1);
 
-                            layer::layer_push_stroke(layer, stroke);
-                        } else {
-                            ok = false;
-                            goto END;
-                        }
-                    } else {
-                        if ( milton_binary_version >= 4 ) {
-                            stroke.points = arena_alloc_array(&canvas->arena, stroke.num_points, v2l);
-                            READ(stroke.points, sizeof(v2l), (size_t)stroke.num_points, fd);
-                        } else {
-                            stroke.points = arena_alloc_array(&canvas->arena, stroke.num_points, v2l);
-                            v2i* points_32bit = (v2i*)mlt_calloc((size_t)stroke.num_points, sizeof(v2i), "Persist");
-
-                            READ(points_32bit, sizeof(v2i), (size_t)stroke.num_points, fd);
-                            for (int i = 0; i < stroke.num_points; ++i) {
-                                stroke.points[i] = VEC2L(points_32bit[i]);
-                            }
-                        }
-#if STROKE_DEBUG_VIZ
-                        stroke.debug_flags = arena_alloc_array(&canvas->arena, stroke.num_points, int);
-#endif
-                        stroke.pressures = arena_alloc_array(&canvas->arena, stroke.num_points, f32);
-                        READ(stroke.pressures, sizeof(f32), (size_t)stroke.num_points, fd);
-                        READ(&stroke.layer_id, sizeof(i32), 1, fd);
-                        stroke.bounding_rect = bounding_box_for_stroke(&stroke);
-                        layer::layer_push_stroke(layer, stroke);
-                    }
-                }
+    for ( i32 layer_i = 0; layer_i < num_layers; ++layer_i ) {
+        SnapshotLayer* layer = &snapshot->layers[layer_i];
+        if ( layer->num_strokes > INT_MAX ) {
+            milton_die_gracefully("FATAL. Number of strokes in layer greater than can be stored in file format. ");
+        }
+        ArenaMark scratch = arena_scratch_begin();
+        Stroke* strokes = snapshot_copy_strokes(milton, layer, scratch.arena, &pages);
+        i32 num_strokes = (i32)layer->num_strokes;
+        char* name = layer->name;
+        i32 len = (i32)(strlen(name) + 1);
+        WRITE(&len, sizeof(i32), 1);
+        WRITE(name, sizeof(char), (size_t)len);
+        WRITE(&layer->id, sizeof(i32), 1);
+        WRITE(&layer->flags, sizeof(layer->flags), 1);
+        WRITE(&num_strokes, sizeof(i32), 1);
+        for ( i32 stroke_i = 0; stroke_i < num_strokes; ++stroke_i ) {
+            Stroke* stroke = &strokes[stroke_i];
+            mlt_assert(stroke->num_points > 0);
+            if (stroke->num_points > 0 && stroke->num_points <= STROKE_MAX_POINTS) {
+                WRITE(&stroke->brush, sizeof(Brush), 1);
+                WRITE(&stroke->num_points, sizeof(i32), 1);
+                WRITE(stroke->points, sizeof(v2l), (size_t)stroke->num_points);
+                WRITE(stroke->pressures, sizeof(f32), (size_t)stroke->num_points);
+                WRITE(&stroke->layer_id, sizeof(i32), 1);
+            } else {
+                milton_log("WARNING: Trying to write a stroke of size %d\n", stroke->num_points);
             }
 
-            if ( milton_binary_version >= 4 ) {
-                i64 num_effects = 0;
-                READ(&num_effects, sizeof(num_effects), 1, fd);
-                if ( num_effects > 0 ) {
-                    LayerEffect** e = &layer->effects;
-                    for ( i64 i = 0; i < num_effects; ++i ) {
-                        mlt_assert(*e == NULL);
-                        *e = arena_alloc_elem(&canvas->arena, LayerEffect);
-                        READ(&(*e)->type, sizeof((*e)->type), 1, fd);
-                        READ(&(*e)->enabled, sizeof((*e)->enabled), 1, fd);
-                        switch ((*e)->type) {
-                            case LayerEffectType_BLUR: {
-                                READ(&(*e)->blur.original_scale, sizeof((*e)->blur.original_scale), 1, fd);
-                                READ(&(*e)->blur.kernel_size, sizeof((*e)->blur.kernel_size), 1, fd);
-                            } break;
-                        }
-                        e = &(*e)->next;
-                    }
+        }
+        snapshot_release_pages(&pages);
+        arena_scratch_end(scratch);
+        {
+            i64 num_effects = layer->effects.count;
+            WRITE(&num_effects, sizeof(num_effects), 1);
+            for ( LayerEffect* e = begin(layer->effects); e != end(layer->effects); ++e ) {
+                WRITE(&e->type, sizeof(e->type), 1);
+                WRITE(&e->enabled, sizeof(e->enabled), 1);
+                switch (e->type) {
+                    case LayerEffectType_BLUR: {
+                        WRITE(&e->blur.original_scale, sizeof(e->blur.original_scale), 1);
+                        WRITE(&e->blur.kernel_size, sizeof(e->blur.kernel_size), 1);
+                    } break;
                 }
             }
         }
-        milton->view->working_layer_id = saved_working_layer_id;
+    }
+
+    if ( milton_binary_version >= 5 ) {
+       WRITE(&snapshot->picker_rgb, sizeof(v3f), 1);
+    }
+    else {
+       WRITE(&snapshot->picker_data, sizeof(PickerData), 1);
+    }
+
+    // Buttons
+    {
+        i32 button_count = (i32)snapshot->button_colors.count;
+        WRITE(&button_count, sizeof(i32), 1);
+        WRITE(snapshot->button_colors.data, sizeof(v4f), (size_t)button_count);
+    }
+
+    // Brush
+    if ( milton_binary_version >= 2 && milton_binary_version <= 5 ) {
+        // PEN, ERASER
+        WRITE(&snapshot->brushes, sizeof(Brush), 2);
+        // Sizes
+        WRITE(&snapshot->brush_sizes, sizeof(i32), 2);
+    }
+    else if ( milton_binary_version > 5 ) {
+        u16 num_brushes = 3;  // Brush, eraser, primitive.
+        WRITE(&num_brushes, sizeof(num_brushes), 1);
+        WRITE(&snapshot->brushes, sizeof(Brush), num_brushes);
+        WRITE(&snapshot->brush_sizes, sizeof(i32), num_brushes);
+    }
+
+    history_count = (i32)snapshot->history.count;
+    if ( snapshot->history.count > INT_MAX ) {
+        history_count = 0;
+    }
+    WRITE(&history_count, sizeof(history_count), 1);
+    WRITE(snapshot->history.data, sizeof(*snapshot->history.data), (size_t)history_count);
+
+    // MLT 3
+    // Layer alpha
+    if ( milton_binary_version >= 3 ) {
+        for ( i64 i = 0; i < num_layers; ++i ) {
+            WRITE(&snapshot->layers[i].alpha, sizeof(f32), 1);
+        }
+    }
+
+    // Preview. milton_load stops reading before it.
+    if ( snapshot->preview_jpeg.count > 0 ) {
+        MltPreviewFooter footer = {};
+        footer.magic = MLT_PREVIEW_MAGIC_NUMBER;
+        footer.width = snapshot->preview_width;
+        footer.height = snapshot->preview_height;
+        footer.jpeg_size = (u32)snapshot->preview_jpeg.count;
+        WRITE(snapshot->preview_jpeg.data, sizeof(u8), (size_t)snapshot->preview_jpeg.count);
+        WRITE(&footer, sizeof(footer), 1);
+    }
+
+#undef WRITE
+    release(&pages);
+}
+
+SaveSnapshot*
+milton_save_snapshot(Milton* milton)
+{
+    // The saver reads every stroke. Callers wait for the load, or put the save off until it is done.
+    mlt_assert(milton->load == NULL);
+
+    CanvasState* canvas = milton->canvas;
+    SaveSnapshot* snapshot = (SaveSnapshot*)mlt_calloc(1, sizeof(SaveSnapshot), "Persist");
+    if ( !snapshot ) {
+        return NULL;
+    }
 
-        if ( milton_binary_version >= 5 ) {
-           v3f rgb;
-           READ(&rgb, sizeof(v3f), 1, fd);
-           gui_picker_from_rgb(&milton->gui->picker, rgb);
-        } else {
-           READ(&milton->gui->picker.data, sizeof(PickerData), 1, fd);
+    PATH_STRNCPY(snapshot->mlt_file_path, milton->mlt_file_path, MAX_PATH - 1);
+    snapshot->mlt_binary_version = milton->mlt_binary_version;
+    snapshot->view = *milton->view;
+    snapshot->layer_guid = canvas->layer_guid;
+
+    snapshot->num_layers = layer::number_of_layers(canvas->root_layer);
+    snapshot->layers = (SnapshotLayer*)mlt_calloc((size_t)max(snapshot->num_layers, 1), sizeof(SnapshotLayer), "Persist");
+    if ( !snapshot->layers ) {
+        mlt_free(snapshot, "Persist");
+        return NULL;
+    }
+    i32 layer_i = 0;
+    for ( Layer* layer = canvas->root_layer; layer != NULL; layer = layer->next ) {
+        SnapshotLayer* sl = &snapshot->layers[layer_i++];
+        sl->layer = layer;
+        sl->id = layer->id;
+        sl->flags = layer->flags;
+        sl->alpha = layer->alpha;
+        memcpy(sl->name, layer->name, sizeof(sl->name));
+        for ( LayerEffect* e = layer->effects; e != NULL; e = e->next ) {
+            push(&sl->effects, *e);
         }
+        sl->num_strokes = layer->strokes.count;
+        sl->shared_count = layer->strokes.count;
+        snapshot->num_strokes += layer->strokes.count;
+    }
 
+    snapshot->picker_rgb = gui_get_picker_rgb(milton->gui);
+    snapshot->picker_data = milton->gui->picker.data;
+    for ( ColorButton* b = milton->gui->picker.color_buttons; b != NULL; b = b->next ) {
+        push(&snapshot->button_colors, b->rgba);
+    }
+    memcpy(snapshot->brushes, milton->brushes, sizeof(snapshot->brushes));
+    memcpy(snapshot->brush_sizes, milton->brush_sizes, sizeof(snapshot->brush_sizes));
 
-        // Buttons
-        {
-           i32 button_count = 0;
-           gui = milton->gui;
-           btn = gui->picker.color_buttons;
+    milton_history_to_elements(milton, &snapshot->history);
 
-           READ(&button_count, sizeof(i32), 1, fd);
-           for ( i32 i = 0;
-                 btn!=NULL && i < button_count;
-                 ++i, btn=btn->next ) {
-              READ(&btn->rgba, sizeof(v4f), 1, fd);
-           }
-        }
+    if ( milton->preview_pixels.count > 0 ) {
+        reserve(&snapshot->preview_pixels, milton->preview_pixels.count);
+        memcpy(snapshot->preview_pixels.data, milton->preview_pixels.data, (size_t)milton->preview_pixels.count);
+        snapshot->preview_pixels.count = milton->preview_pixels.count;
+        snapshot->preview_width = milton->preview_width;
+        snapshot->preview_height = milton->preview_height;
+    }
 
-        // Brush
-        if ( milton_binary_version >= 2 && milton_binary_version <= 5  ) {
-            // PEN, ERASER
-            READ(&milton->brushes, sizeof(Brush), 2, fd);
-            // Sizes
-            READ(&milton->brush_sizes, sizeof(i32), 2, fd);
-        }
-        else if ( milton_binary_version > 5 ) {
-            u16 num_brushes = 0;
-            READ(&num_brushes, sizeof(u16), 1, fd);
-            if ( num_brushes > BrushEnum_COUNT ) {
-                milton_log("Error loading file: too many brushes: %d\n", num_brushes);
-            }
-            READ(&milton->brushes, sizeof(Brush), num_brushes, fd);
-            READ(&milton->brush_sizes, sizeof(i32), num_brushes, fd);
+    // Changes from this point on are not in the file. They stay in the journal.
+    if ( journal_journaling_enabled(milton) ) {
+        MiltonJournal* journal = &milton->journal;
+        SDL_LockMutex(journal->mutex);
+        if ( journal->id == 0 ) {
+            journal->id = perf_counter() | 1;
         }
+        snapshot->journal_id = journal->id;
+        snapshot->journal_seq = journal->next_seq;
+        snapshot->canvas_signature = journal_canvas_signature(milton);
+        SDL_UnlockMutex(journal->mutex);
+    }
 
-        history_count = 0;
-        READ(&history_count, sizeof(history_count), 1, fd);
-        reset(&milton->canvas->history);
-        reserve(&milton->canvas->history, history_count);
-        READ(milton->canvas->history.data, sizeof(*milton->canvas->history.data), (size_t)history_count, fd);
-        milton->canvas->history.count = history_count;
-
-        // MLT 3
-        // Layer alpha
-        if ( milton_binary_version >= 3 ) {
-            Layer* l = milton->canvas->root_layer;
-            for ( i64 i = 0; ok && i < num_layers; ++i ) {
-                mlt_assert(l != NULL);
-                READ(&l->alpha, sizeof(l->alpha), 1, fd);
-                l = l->next;
-            }
-        } else {
-            for ( Layer* l = milton->canvas->root_layer; l != NULL; l = l->next ) {
-                l->alpha = 1.0f;
-            }
+    return snapshot;
+}
+
+void
+milton_release_save_snapshot(SaveSnapshot* snapshot)
+{
+    if ( snapshot ) {
+        for ( i32 i = 0; i < snapshot->num_layers; ++i ) {
+            release(&snapshot->layers[i].effects);
+            release(&snapshot->layers[i].undone);
         }
+        mlt_free(snapshot->layers, "Persist");
+        release(&snapshot->button_colors);
+        release(&snapshot->history);
+        release(&snapshot->preview_pixels);
+        release(&snapshot->preview_jpeg);
+        mlt_free(snapshot, "Persist");
+    }
+}
 
-        err = fclose(fd);
-        if ( err != 0 ) {
-            ok = false;
+// Writes the vertex data of every stroke in the snapshot, in the order the MLT file has them.
+static void
+milton_save_geometry_cache(Milton* milton, SaveSnapshot* snapshot)
+{
+    GeometryCache* cache = &milton->geometry_cache;
+    if ( SDL_AtomicGet(&cache->rebuild_pending) ) {
+        milton_log("Writing the geometry cache.\n");
+        DArray<u8*> pages = {};
+        GeometryCacheWriter w = {};
+        geometry_cache_writer_begin(&w, snapshot->mlt_file_path);
+        for ( i32 layer_i = 0; w.ok && layer_i < snapshot->num_layers; ++layer_i ) {
+            SnapshotLayer* layer = &snapshot->layers[layer_i];
+            ArenaMark scratch = arena_scratch_begin();
+            Stroke* strokes = snapshot_copy_strokes(milton, layer, scratch.arena, &pages);
+            geometry_cache_writer_add(&w, strokes, layer->num_strokes);
+            snapshot_release_pages(&pages);
+            arena_scratch_end(scratch);
         }
+        if ( geometry_cache_writer_end(&w) ) {
+            SDL_AtomicSet(&cache->rebuilt, 1);
+        }
+        SDL_AtomicSet(&cache->rebuild_pending, 0);
+        release(&pages);
+    }
+}
 
-END:
-        // Finished loading
-        if ( !ok ) {
-            if ( !handled ) {
-                platform_dialog("Tried to load a corrupt Milton file or there was an error reading from disk.", "Error");
-            }
-            milton_reset_canvas_and_set_default(milton);
-        } else {
-            i32 id = milton->view->working_layer_id;
-            {  // Use working_layer_id to make working_layer point to the correct thing
-                Layer* layer = milton->canvas->root_layer;
-                while ( layer ) {
-                    if ( layer->id == id ) {
-                        milton->canvas->working_layer = layer;
-                        break;
-                    }
-                    layer = layer->next;
+void
+milton_update_geometry_cache(Milton* milton)
+{
+    GeometryCache* cache = &milton->geometry_cache;
+    if ( SDL_AtomicGet(&cache->rebuilt) ) {
+        SDL_AtomicSet(&cache->rebuilt, 0);
+        geometry_cache_install(cache, milton->mlt_file_path);
+    }
+    else if ( milton->save_thread && !milton->load && !(milton->flags & MiltonStateFlags_LOAD_REJECTED)
+              && geometry_cache_wants_rebuild(cache, layer::count_strokes(milton->canvas->root_layer)) ) {
+        cache->rebuild_requested = true;
+        SDL_AtomicSet(&cache->rebuild_pending, 1);
+
+        // A save that is already queued writes it too.
+        SDL_LockMutex(milton->save_mutex);
+        b32 queued = milton->save_pending != NULL;
+        SDL_UnlockMutex(milton->save_mutex);
+        if ( !queued ) {
+            SaveSnapshot* snapshot = milton_save_snapshot(milton);
+            if ( snapshot ) {
+                snapshot->geometry_only = true;
+                SDL_LockMutex(milton->save_mutex);
+                if ( !milton->save_pending ) {
+                    milton->save_pending = snapshot;
+                    snapshot = NULL;
+                    SDL_CondBroadcast(milton->save_cond);
                 }
+                SDL_UnlockMutex(milton->save_mutex);
+                milton_release_save_snapshot(snapshot);
             }
-            milton->canvas->layer_guid = layer_guid;
-
-            // Update GPU
-            milton_set_background_color(milton, milton->view->background_color);
-            gpu_update_picker(milton->render_data, &milton->gui->picker);
         }
-    } else {
-        milton_log("milton_load: Could not open file!\n");
-        milton_reset_canvas_and_set_default(milton);
     }
-#undef READ
+}
+
+// Called by tiny_jpeg
+static void
+preview_write_func(void* context, void* data, int size)
+{
+    DArray<u8>* jpeg = (DArray<u8>*)context;
+    reserve(jpeg, jpeg->count + size);
+    memcpy(jpeg->data + jpeg->count, data, (size_t)size);
+    jpeg->count += size;
+}
+
+// JPEG encoding takes a few milliseconds, so it is done by the saver rather than when the preview is
+// captured.
+static void
+snapshot_encode_preview(SaveSnapshot* snapshot)
+{
+    reset(&snapshot->preview_jpeg);
+    if ( snapshot->preview_pixels.count > 0
+         && !tje_encode_with_func(preview_write_func, &snapshot->preview_jpeg, 2,
+                                  snapshot->preview_width, snapshot->preview_height, 4,
+                                  snapshot->preview_pixels.data) ) {
+        reset(&snapshot->preview_jpeg);
+    }
+}
+
+// Leaves the outcome of a save for the main thread. See milton_apply_save_result
+static void
+milton_save_set_result(Milton* milton, SaveResult* result)
+{
+    SDL_LockMutex(milton->save_mutex);
+    if ( milton->save_result.is_new && milton->save_result.move_file_failed ) {
+        result->move_file_failed = true;
+    }
+    milton->save_result = *result;
+    milton->save_result.is_new = true;
+    SDL_UnlockMutex(milton->save_mutex);
 }
 
 void
-milton_save(Milton* milton)
+milton_save_snapshot_to_file(Milton* milton, SaveSnapshot* snapshot)
 {
-    // Declaring variables here to silence compiler warnings about GOTO jumping declarations.
-    i32 history_count = 0;
-    u32 milton_binary_version = 0;
-    i32 num_layers = 0;
-    milton->flags |= MiltonStateFlags_LAST_SAVE_FAILED;  // Assume failure. Remove flag on success.
+    PROFILE_SCOPE("save");
+    if ( snapshot && snapshot->geometry_only ) {
+        milton_save_geometry_cache(milton, snapshot);
+        return;
+    }
+
+    // This runs on the saver thread. The Milton state is left to the main thread.
+    SaveResult result = {};
+
+    if ( !snapshot ) {
+        milton_log("Not enough memory to save.\n");
+        milton_save_set_result(milton, &result);
+        return;
+    }
+
+    snapshot_encode_preview(snapshot);
 
     int pid = (int)getpid();
     PATH_CHAR tmp_fname[MAX_PATH] = {};
@@ -354,162 +3053,206 @@ milton_save(Milton* milton)
 
     platform_fname_at_config(tmp_fname, MAX_PATH);
 
-    FILE* fd = platform_fopen(tmp_fname, TO_PATH_STR("wb"));
-
-    b32 ok = true;
+    // Serialize the whole file in memory and write it at once.
+    u32 milton_binary_version = snapshot->mlt_binary_version;
+    DArray<u8> header = {};
+    DArray<MltWriter> chunks = {};
+    DArray<PlatformWriteBuffer> buffers = {};
 
-    if ( fd ) {
-#define WRITE(address, sz, num, fd) do { ok = fwrite_checked(address, sz, num, fd); if (!ok) { goto END; }  } while(0)
+    if ( milton_binary_version >= 7 ) {
+        milton_save_chunks(milton, snapshot, &chunks);
+        mlt_layout_file(milton_binary_version, &chunks, &header, &buffers);
+    } else {
         u32 milton_magic = MILTON_MAGIC_NUMBER;
+        push_bytes(&header, &milton_magic, sizeof(u32));
+        push_bytes(&header, &milton_binary_version, sizeof(u32));
+        milton_save_v6(milton, snapshot, &header);
+
+        PlatformWriteBuffer b = {};
+        b.data = header.data;
+        b.size = (size_t)header.count;
+        push(&buffers, b);
+    }
 
-        WRITE(&milton_magic, sizeof(u32), 1, fd);
+    b32 ok = platform_write_file(tmp_fname, buffers.data, buffers.count);
+    if ( ok ) {
+        ok = platform_move_file(tmp_fname, snapshot->mlt_file_path);
+        if ( ok ) {
+            //  \o/
+            result.ok = true;
+            result.time = platform_get_walltime();
+            result.num_strokes = snapshot->num_strokes;
+            if ( snapshot->journal_id != 0 ) {
+                milton_journal_compact(milton, snapshot);
+            }
+            milton_save_geometry_cache(milton, snapshot);
+        }
+        else {
+            milton_log("Could not move file. Moving on. Avoiding this save.\n");
+            result.move_file_failed = true;
+        }
+    }
+    else {
+        milton_log("File IO error when saving.\n");
+    }
 
-        milton_binary_version = milton->mlt_binary_version;
+    for ( i64 i = 0; i < chunks.count; ++i ) {
+        release(&chunks.data[i].data);
+    }
+    release(&chunks);
+    release(&header);
+    release(&buffers);
 
-        WRITE(&milton_binary_version, sizeof(u32), 1, fd);
-        WRITE(milton->view, sizeof(CanvasView), 1, fd);
+    milton_save_set_result(milton, &result);
+}
 
-        num_layers = layer::number_of_layers(milton->canvas->root_layer);
-        WRITE(&num_layers, sizeof(i32), 1, fd);
-        WRITE(&milton->canvas->layer_guid, sizeof(i32), 1, fd);
+void
+milton_save(Milton* milton)
+{
+    // Saves on the saver thread use the same temporary file.
+    milton_save_flush(milton);
+    milton_load_wait(milton);
+    milton->save_after_load = false;
+    if ( milton->flags & MiltonStateFlags_LOAD_REJECTED ) {
+        milton_log("Not saving a canvas that did not load.\n");
+        return;
+    }
 
-        for ( Layer* layer = milton->canvas->root_layer; layer; layer=layer->next  ) {
-            if ( layer->strokes.count > INT_MAX ) {
-                milton_die_gracefully("FATAL. Number of strokes in layer greater than can be stored in file format. ");
-            }
-            i32 num_strokes = (i32)layer->strokes.count;
-            char* name = layer->name;
-            i32 len = (i32)(strlen(name) + 1);
-            WRITE(&len, sizeof(i32), 1, fd);
-            WRITE(name, sizeof(char), (size_t)len, fd);
-            WRITE(&layer->id, sizeof(i32), 1, fd);
-            WRITE(&layer->flags, sizeof(layer->flags), 1, fd);
-            WRITE(&num_strokes, sizeof(i32), 1, fd);
-            if ( ok ) {
-                for ( i32 stroke_i = 0; ok && stroke_i < num_strokes; ++stroke_i ) {
-                    Stroke* stroke = get(&layer->strokes, stroke_i);
-                    mlt_assert(stroke->num_points > 0);
-                    if (stroke->num_points > 0 && stroke->num_points <= STROKE_MAX_POINTS) {
-                        WRITE(&stroke->brush, sizeof(Brush), 1, fd);
-                        WRITE(&stroke->num_points, sizeof(i32), 1, fd);
-                        WRITE(stroke->points, sizeof(v2l), (size_t)stroke->num_points, fd);
-                        WRITE(stroke->pressures, sizeof(f32), (size_t)stroke->num_points, fd);
-                        WRITE(&stroke->layer_id, sizeof(i32), 1, fd);
-                        if ( !ok ) {
-                            break;
-                        }
-                    } else {
-                        milton_log("WARNING: Trying to write a stroke of size %d\n", stroke->num_points);
-                    }
+    if ( milton_request_preview(milton) ) {
+        milton_poll_preview(milton, /*wait*/true);
+    }
 
-                }
-            } else {
-                ok = false;
-            }
-            {
-                i64 num_effects = 0;
-                for ( LayerEffect* e = layer->effects; e != NULL; e = e->next ) {
-                    ++num_effects;
-                }
-                WRITE(&num_effects, sizeof(num_effects), 1, fd);
-                for ( LayerEffect* e = layer->effects; e != NULL; e = e->next ) {
-                    WRITE(&e->type, sizeof(e->type), 1, fd);
-                    WRITE(&e->enabled, sizeof(e->enabled), 1, fd);
-                    switch (e->type) {
-                        case LayerEffectType_BLUR: {
-                            WRITE(&e->blur.original_scale, sizeof(e->blur.original_scale), 1, fd);
-                            WRITE(&e->blur.kernel_size, sizeof(e->blur.kernel_size), 1, fd);
-                        } break;
-                    }
-                }
-            }
-        }
+    SaveSnapshot* snapshot = milton_save_snapshot(milton);
+    milton_save_snapshot_to_file(milton, snapshot);
+    milton_release_save_snapshot(snapshot);
+    milton_apply_save_result(milton);
+}
 
-        if ( milton_binary_version >= 5 ) {
-           v3f rgb = gui_get_picker_rgb(milton->gui);
-           WRITE(&rgb, sizeof(rgb), 1, fd);
-        }
-        else {
-           WRITE(&milton->gui->picker.data, sizeof(PickerData), 1, fd);
-        }
+b32
+milton_request_preview(Milton* milton)
+{
+    i32 w = milton->view->screen_size.w;
+    i32 h = milton->view->screen_size.h;
+    milton->preview_request_size = {};
+    if ( w <= 0 || h <= 0 ) {
+        return false;
+    }
+    // Fit the view in a MLT_PREVIEW_MAX_SIZE square.
+    if ( w > h ) {
+        h = max(1, h * MLT_PREVIEW_MAX_SIZE / w);
+        w = min(w, MLT_PREVIEW_MAX_SIZE);
+    } else {
+        w = max(1, w * MLT_PREVIEW_MAX_SIZE / h);
+        h = min(h, MLT_PREVIEW_MAX_SIZE);
+    }
+    b32 ok = gpu_request_canvas_preview(milton->render_data, w, h);
+    if ( ok ) {
+        milton->preview_request_size = v2i{w, h};
+    }
+    return ok;
+}
 
-        // Buttons
-        if ( ok ) {
-            i32 button_count = 0;
-            MiltonGui* gui = milton->gui;
-            // Count buttons
-            for (ColorButton* b = gui->picker.color_buttons; b!= NULL; b = b->next, button_count++) { }
-            // Write
-            WRITE(&button_count, sizeof(i32), 1, fd);
-            if ( ok ) {
-                for ( ColorButton* b = gui->picker.color_buttons;
-                      ok && b!= NULL;
-                      b = b->next ) {
-                    WRITE(&b->rgba, sizeof(v4f), 1, fd);
-                }
-            }
-        }
+b32
+milton_poll_preview(Milton* milton, b32 wait)
+{
+    i32 w = milton->preview_request_size.w;
+    i32 h = milton->preview_request_size.h;
+    if ( w == 0 || h == 0 ) {
+        return true;
+    }
+    i64 size = (i64)w * h * 4;
+    reserve(&milton->preview_pixels, size);
+    if ( !milton->preview_pixels.data ) {
+        milton->preview_request_size = {};
+        return true;
+    }
+    if ( !gpu_canvas_preview_result(milton->render_data, milton->preview_pixels.data, wait) ) {
+        return false;
+    }
+    milton->preview_pixels.count = size;
+    milton->preview_width = w;
+    milton->preview_height = h;
+    milton->preview_request_size = {};
+    return true;
+}
 
-        // Brush
-        if ( milton_binary_version >= 2 && milton_binary_version <= 5 ) {
-            // PEN, ERASER
-            WRITE(&milton->brushes, sizeof(Brush), 2, fd);
-            // Sizes
-            WRITE(&milton->brush_sizes, sizeof(i32), 2, fd);
-        }
-        else if ( milton_binary_version > 5 ) {
-            u16 num_brushes = 3;  // Brush, eraser, primitive.
-            WRITE(&num_brushes, sizeof(num_brushes), 1, fd);
-            WRITE(&milton->brushes, sizeof(Brush), num_brushes, fd);
-            WRITE(&milton->brush_sizes, sizeof(i32), num_brushes, fd);
-        }
+static b32
+preview_footer_is_valid(MltPreviewFooter* footer)
+{
+    return    footer->magic == MLT_PREVIEW_MAGIC_NUMBER
+           && footer->width > 0 && footer->width <= MLT_PREVIEW_MAX_SIZE
+           && footer->height > 0 && footer->height <= MLT_PREVIEW_MAX_SIZE
+           && footer->jpeg_size > 0 && footer->jpeg_size <= (u32)(footer->width * footer->height * 4 * 2);
+}
 
-        history_count = (i32)milton->canvas->history.count;
-        if ( milton->canvas->history.count > INT_MAX ) {
-            history_count = 0;
-        }
-        WRITE(&history_count, sizeof(history_count), 1, fd);
-        WRITE(milton->canvas->history.data, sizeof(*milton->canvas->history.data), (size_t)history_count, fd);
+b32
+milton_read_preview(PATH_CHAR* fname, MltPreview* out_preview)
+{
+    b32 ok = false;
+    *out_preview = {};
+
+    FILE* fd = platform_fopen(fname, TO_PATH_STR("rb"));
+    if ( !fd ) {
+        return false;
+    }
 
-        // MLT 3
-        // Layer alpha
-        if ( milton_binary_version >= 3 ) {
-            Layer* l = milton->canvas->root_layer;
-            for ( i64 i = 0; ok && i < num_layers; ++i ) {
-                mlt_assert(l);
-                WRITE(&l->alpha, sizeof(l->alpha), 1, fd);
-                l = l->next;
+    u32 milton_magic = 0;
+    u32 milton_binary_version = 0;
+    MltPreviewFooter footer = {};
+    MltFile file = {};
+    MltReader r = {};
+    u8* jpeg = NULL;
+
+    // Strokes are never touched. v7 files have a preview chunk in the directory. Older files have a
+    // footer at the very end, right after the JPEG data.
+    if (    fread_checked(&milton_magic, sizeof(u32), 1, fd)
+         && milton_magic == MILTON_MAGIC_NUMBER
+         && fread_checked(&milton_binary_version, sizeof(u32), 1, fd) ) {
+        if ( milton_binary_version >= 7 ) {
+            if (    mlt_read_directory(fd, &file)
+                 && mlt_open_chunk(&file, mlt_find_chunk(&file, MltChunk_PREVIEW, 0), &r)
+                 && mlt_read(&r, &footer, sizeof(footer), 1)
+                 && preview_footer_is_valid(&footer)
+                 && r.size - r.pos >= footer.jpeg_size ) {
+                jpeg = r.data + r.pos;
             }
-        }
-END:
-        int file_error = ferror(fd);
-        if ( file_error == 0 ) {
-            int close_ret = fclose(fd);
-            if ( close_ret == 0 ) {
-                ok = platform_move_file(tmp_fname, milton->mlt_file_path);
-                if ( ok ) {
-                    //  \o/
-                    milton_save_postlude(milton);
-                }
-                else {
-                    milton_log("Could not move file. Moving on. Avoiding this save.\n");
-                    milton->flags |= MiltonStateFlags_MOVE_FILE_FAILED;
+            mlt_release_directory(&file);
+        } else {
+            if (    fseek(fd, -(long)sizeof(footer), SEEK_END) == 0
+                 && fread_checked(&footer, sizeof(footer), 1, fd)
+                 && preview_footer_is_valid(&footer)
+                 && fseek(fd, -(long)(sizeof(footer) + footer.jpeg_size), SEEK_END) == 0 ) {
+                r.data = (u8*)mlt_calloc(footer.jpeg_size, 1, "Persist");
+                if ( r.data && fread_checked(r.data, 1, footer.jpeg_size, fd) ) {
+                    jpeg = r.data;
                 }
             }
-            else {
-                milton_log("File error when closing handle. Error code %d. \n", close_ret);
-            }
-        }
-        else {
-            milton_log("File IO error. Error code %d. \n", file_error);
         }
+    }
 
+    if ( jpeg ) {
+        int w = 0, h = 0, comp = 0;
+        u8* pixels = stbi_load_from_memory(jpeg, (int)footer.jpeg_size, &w, &h, &comp, 4);
+        if ( pixels ) {
+            out_preview->pixels = pixels;
+            out_preview->width = w;
+            out_preview->height = h;
+            ok = true;
+        }
     }
-    else {
-        milton_die_gracefully("Could not create file for saving! ");
-        return;
+
+    mlt_close_chunk(&r);
+    fclose(fd);
+    return ok;
+}
+
+void
+milton_release_preview(MltPreview* preview)
+{
+    if ( preview->pixels ) {
+        stbi_image_free(preview->pixels);
     }
-#undef WRITE
+    *preview = {};
 }
 
 PATH_CHAR*
@@ -571,9 +3314,10 @@ write_func(void* context, void* data, int size)
     }
 }
 
-void
+b32
 milton_save_buffer_to_file(PATH_CHAR* fname, u8* buffer, i32 w, i32 h)
 {
+    b32 ok = false;
     int len = 0;
     {
         size_t sz = PATH_STRLEN(fname);
@@ -616,6 +3360,7 @@ milton_save_buffer_to_file(PATH_CHAR* fname, u8* buffer, i32 w, i32 h)
         fd = platform_fopen(fname, TO_PATH_STR("wb"));
 
         if ( fd ) {
+            b32 handled = true;
             if ( !PATH_STRCMP(ext, TO_PATH_STR("png")) ) {
                 stbi_write_png_to_func(write_func, &fd, w, h, 4, buffer, 0);
             }
@@ -623,6 +3368,7 @@ milton_save_buffer_to_file(PATH_CHAR* fname, u8* buffer, i32 w, i32 h)
                 tje_encode_with_func(write_func, &fd, 3, w, h, 4, buffer);
             }
             else {
+                handled = false;
                 platform_dialog("File extension not handled by Milton\n", "Info");
             }
 
@@ -631,7 +3377,8 @@ milton_save_buffer_to_file(PATH_CHAR* fname, u8* buffer, i32 w, i32 h)
                 if ( ferror(fd) ) {
                     platform_dialog("Unknown error when writing to file :(", "Unknown error");
                 }
-                else {
+                else if ( handled ) {
+                    ok = true;
                     platform_dialog("Image exported successfully!", "Success");
                 }
                 fclose(fd);
@@ -648,6 +3395,7 @@ milton_save_buffer_to_file(PATH_CHAR* fname, u8* buffer, i32 w, i32 h)
         platform_dialog("File name missing extension!\n", "Error");
     }
     mlt_free(fname_copy, "Strings");
+    return ok;
 }
 
 b32
@@ -744,3 +3492,176 @@ void milton_settings_save(MiltonSettings* settings)
         milton_log("Warning: could not correctly save settings file\n");
     }
 }
+
+b32
+milton_save_memory_telemetry(Milton* milton, PATH_CHAR* out_fname, size_t len)
+{
+    PATH_STRCPY(out_fname, TO_PATH_STR("memory.json"));
+    platform_fname_at_config(out_fname, len);
+
+    char* names[] = { "root", "canvas" };
+    Arena* arenas[] = { &milton->root_arena, &milton->canvas->arena };
+
+    b32 ok = false;
+    FILE* fd = platform_fopen(out_fname, TO_PATH_STR("wb"));
+    if ( fd ) {
+        ok = memory_telemetry_write_json(fd, names, arenas, array_count(arenas));
+        ok = (fclose(fd) == 0) && ok;
+    }
+    if ( !ok ) {
+        milton_log("Warning: could not write memory telemetry\n");
+    }
+    return ok;
+}
+
+b32
+milton_save_render_stats(Milton* milton, PATH_CHAR* out_fname, size_t len)
+{
+    PATH_STRCPY(out_fname, TO_PATH_STR("render_stats.json"));
+    platform_fname_at_config(out_fname, len);
+
+    RenderStats stats = {};
+    gpu_get_stats(milton->render_data, &stats);
+
+    b32 ok = false;
+    FILE* fd = platform_fopen(out_fname, TO_PATH_STR("wb"));
+    if ( fd ) {
+        ok = gpu_write_stats_json(&stats, fd);
+        ok = (fclose(fd) == 0) && ok;
+    }
+    if ( !ok ) {
+        milton_log("Warning: could not write render stats\n");
+    }
+    return ok;
+}
+
+struct SlowFrameCapture
+{
+    PATH_CHAR       fname[MAX_PATH];
+    i32             capture_i;
+    i32             frame;
+    f32             budget_ms;
+    FrameTimes      slow;
+    FrameTimes      recent[PROFILER_NUM_FRAMES];    // Oldest first.
+    i64             num_recent;
+    RenderStats     stats;
+    ProfilerCapture events;
+};
+
+void
+milton_save_slow_frame(Milton* milton)
+{
+    FrameHistory* history = &milton->frame_history;
+    if ( history->count == 0 ) {
+        return;
+    }
+
+    // Copying is fast enough for the frame loop. Formatting and writing the file is not.
+    SlowFrameCapture* capture = (SlowFrameCapture*)mlt_calloc(1, sizeof(SlowFrameCapture), "Profiler");
+    if ( !capture ) {
+        return;
+    }
+    PATH_SNPRINTF(capture->fname, MAX_PATH, TO_PATH_STR("slow_frame_%d.json"),
+                  (history->num_captures - 1) % FLIGHT_RECORDER_MAX_FILES);
+    platform_fname_at_config(capture->fname, MAX_PATH);
+
+    capture->capture_i = history->num_captures;
+    capture->frame = profiler_frame() - 1;
+    capture->budget_ms = history->budget_ms;
+    capture->slow = *frame_history_get(history, 0);
+    capture->num_recent = min(history->count, (i64)PROFILER_NUM_FRAMES);
+    for ( i64 i = 0; i < capture->num_recent; ++i ) {
+        capture->recent[i] = *frame_history_get(history, capture->num_recent - 1 - i);
+    }
+    gpu_get_stats(milton->render_data, &capture->stats);
+
+    u64 since = perf_counter() - FLIGHT_RECORDER_SECONDS * perf_counter_frequency();
+    if ( !profiler_capture(&capture->events, since) ) {
+        milton_log("Warning: not enough memory for a flight recorder capture\n");
+        mlt_free(capture, "Profiler");
+        return;
+    }
+
+    if ( milton->save_thread ) {
+        SlowFrameCapture* replaced = NULL;
+        SDL_LockMutex(milton->save_mutex);
+        replaced = milton->slow_frame_pending;
+        milton->slow_frame_pending = capture;
+        SDL_CondBroadcast(milton->save_cond);
+        SDL_UnlockMutex(milton->save_mutex);
+        milton_release_slow_frame(replaced);
+    } else {
+        milton_write_slow_frame(capture);
+        milton_release_slow_frame(capture);
+    }
+}
+
+b32
+milton_write_slow_frame(SlowFrameCapture* capture)
+{
+    b32 ok = false;
+    FILE* fd = platform_fopen(capture->fname, TO_PATH_STR("wb"));
+    if ( fd ) {
+        FrameTimes* slow = &capture->slow;
+
+        fprintf(fd, "{\"displayTimeUnit\": \"ms\",\n\"milton\": {\n");
+        fprintf(fd, "\"frame\": %d,\n", capture->frame);
+        fprintf(fd, "\"budget_ms\": %.3f,\n", capture->budget_ms);
+        fprintf(fd, "\"cpu_ms\": %.3f,\n", slow->cpu_ms);
+        fprintf(fd, "\"gpu_ms\": %.3f,\n", slow->gpu_ms);
+        for ( i32 i = 0; i < FramePhase_COUNT; ++i ) {
+            fprintf(fd, "\"%s_ms\": %.3f,\n", frame_phase_name(i), slow->phase_ms[i]);
+        }
+
+        // CPU and GPU times of the frames before it, oldest first.
+        fprintf(fd, "\"recent_frames\": [");
+        for ( i64 i = 0; i < capture->num_recent; ++i ) {
+            FrameTimes* f = &capture->recent[i];
+            fprintf(fd, "%s[%.3f, %.3f]", i == 0 ? "" : ", ", f->cpu_ms, f->gpu_ms);
+        }
+        fprintf(fd, "],\n");
+
+        fprintf(fd, "\"render_stats\": ");
+        gpu_write_stats_json(&capture->stats, fd);
+        fprintf(fd, "},\n");
+
+        ok = profiler_write_capture(fd, &capture->events);
+        fprintf(fd, "}\n");
+        ok = !ferror(fd) && ok;
+        ok = (fclose(fd) == 0) && ok;
+    }
+    if ( ok ) {
+        milton_log("Slow frame. Wrote flight recorder capture %d.\n", capture->capture_i);
+    }
+    else {
+        milton_log("Warning: could not write flight recorder capture\n");
+    }
+    return ok;
+}
+
+void
+milton_release_slow_frame(SlowFrameCapture* capture)
+{
+    if ( capture ) {
+        profiler_release_capture(&capture->events);
+        mlt_free(capture, "Profiler");
+    }
+}
+
+b32
+milton_save_profiler_trace(PATH_CHAR* out_fname, size_t len)
+{
+    PATH_STRCPY(out_fname, TO_PATH_STR("milton_trace.json"));
+    platform_fname_at_config(out_fname, len);
+
+    b32 ok = false;
+    FILE* fd = platform_fopen(out_fname, TO_PATH_STR("wb"));
+    if ( fd ) {
+        ok = profiler_write_trace(fd);
+        ok = (fclose(fd) == 0) && ok;
+    }
+    if ( !ok ) {
+        milton_log("Warning: could not write the profiler trace\n");
+    }
+    return ok;
+}
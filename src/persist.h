@@ -11,8 +11,67 @@ struct MiltonSettings;
 PATH_CHAR* milton_get_last_canvas_fname();
 
 void milton_load(Milton* milton);
+// milton_load can return before every stroke is loaded. The rest are loaded in the background, and
+// their buckets are skipped by the renderer until they are done.
+struct CanvasLoad;
+// Returns true if strokes were loaded since the last call. Call once per frame. If some of them are
+// damaged, the canvas is replaced by the default one, like a milton_load that fails.
+b32  milton_load_poll(Milton* milton);
+// Blocks until every stroke is loaded. Call before changing or reading all the strokes. Damaged
+// strokes leave the canvas as it is until the next milton_load_poll, and it is not saved until then.
+void milton_load_wait(Milton* milton);
+// Stops loading, before the canvas is reset.
+void milton_load_cancel(Milton* milton);
+// Saves synchronously, after waiting for the saver thread. See milton_request_save.
 void milton_save(Milton* milton);
-void milton_save_buffer_to_file(PATH_CHAR* fname, u8* buffer, i32 w, i32 h);
+
+// Everything a save writes, taken on the main thread and written from any thread.
+struct SaveSnapshot;
+struct Layer;
+SaveSnapshot* milton_save_snapshot(Milton* milton);
+void          milton_save_snapshot_to_file(Milton* milton, SaveSnapshot* snapshot);
+void          milton_release_save_snapshot(SaveSnapshot* snapshot);
+// Call before popping the top stroke of a layer, so that unwritten snapshots keep it.
+void          milton_save_preserve_top_stroke(Milton* milton, Layer* layer);
+
+// Journal. Changes to the history are appended to a file next to the canvas, and replayed by
+// milton_load. `h` is the record that was pushed, undone or redone, and `stroke` the stroke of a
+// STROKE_ADD record.
+struct Stroke;
+struct HistoryRecord;
+void milton_journal_push(Milton* milton, HistoryRecord* h, Stroke* stroke);
+void milton_journal_undo(Milton* milton, HistoryRecord* h);
+void milton_journal_redo(Milton* milton, HistoryRecord* h, Stroke* stroke);
+// True when the last change has to be saved by rewriting the whole canvas.
+b32  milton_journal_needs_full_save(Milton* milton);
+void milton_journal_close(Milton* milton);
+
+// Asks the saver thread for a new geometry cache when the current one is stale, and maps it
+// once it is written. Call once per frame. See geometry_cache.h
+void milton_update_geometry_cache(Milton* milton);
+
+// MLT files end with an optional preview image of the saved view, which can be
+// read without parsing the rest of the file.
+#define MLT_PREVIEW_MAX_SIZE 256
+
+struct MltPreview
+{
+    u8* pixels;  // RGBA, top row first.
+    i32 width;
+    i32 height;
+};
+
+// Starts capturing a preview of the canvas drawn by the last frame, for the next save. The GPU
+// scales it down and milton_poll_preview reads it on a later frame. Call from the thread that owns
+// the GL context. False if there is nothing to capture.
+b32  milton_request_preview(Milton* milton);
+// True once the requested preview is in Milton::preview_pixels, or when there is no request. With
+// `wait`, it stalls until the GPU is done.
+b32  milton_poll_preview(Milton* milton, b32 wait);
+b32  milton_read_preview(PATH_CHAR* fname, MltPreview* out_preview);
+void milton_release_preview(MltPreview* preview);
+
+b32  milton_save_buffer_to_file(PATH_CHAR* fname, u8* buffer, i32 w, i32 h);
 
 b32  milton_appstate_load(PlatformPrefs* prefs);
 void milton_appstate_save(PlatformPrefs* prefs);
@@ -20,3 +79,17 @@ void milton_appstate_save(PlatformPrefs* prefs);
 void milton_settings_load(MiltonSettings* settings);
 void milton_settings_save(MiltonSettings* settings);
 
+// Writes the memory counters to memory.json in the config folder. See memory_telemetry_write_json
+b32  milton_save_memory_telemetry(Milton* milton, PATH_CHAR* out_fname, size_t len);
+// Writes the RenderStats of the last frame to render_stats.json in the config folder.
+b32  milton_save_render_stats(Milton* milton, PATH_CHAR* out_fname, size_t len);
+// Flight recorder capture of a slow frame: the last FLIGHT_RECORDER_SECONDS of profiler events,
+// with frame times and render stats. They are copied, and the saver thread writes them to
+// slow_frame_<n>.json in the config folder.
+struct SlowFrameCapture;
+void milton_save_slow_frame(Milton* milton);
+b32  milton_write_slow_frame(SlowFrameCapture* capture);
+void milton_release_slow_frame(SlowFrameCapture* capture);
+// Writes the profiler events of the last frames to milton_trace.json in the config folder. See profiler_write_trace
+b32  milton_save_profiler_trace(PATH_CHAR* out_fname, size_t len);
+
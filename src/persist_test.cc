@@ -0,0 +1,365 @@
+// Copyright (c) 2015 Sergio Gonzalez. All rights reserved.
+// License: https://github.com/serge-rgb/milton#license
+
+// Saves a canvas with every MLT version that Milton writes and loads it back,
+// and checks the encodings of v8. Built in place of the entry point, like
+// darray_test.cc. Needs a headless OpenGL context. Leaves no files behind when
+// it passes.
+
+// More than one bucket per layer.
+#define TEST_STROKES_PER_LAYER (STROKELIST_BUCKET_COUNT + 100)
+#define TEST_NUM_LAYERS 2
+#define TEST_MAX_POINTS 64
+
+#define TEST_MLT_FILE "milton_persist_test.mlt"
+
+static void
+test_remove_files()
+{
+    remove(TEST_MLT_FILE);
+    remove(TEST_MLT_FILE ".geometry");
+    remove(TEST_MLT_FILE ".journal");
+}
+
+// Every stroke can be rebuilt from its layer and index.
+static void
+test_fill_stroke(Stroke* stroke, i32 layer_i, i32 stroke_i)
+{
+    i32 n = 1 + (stroke_i * 13 + layer_i) % TEST_MAX_POINTS;
+    stroke->num_points = n;
+    stroke->brush.radius = 1 + stroke_i % 50;
+    stroke->brush.color = v4f{ (stroke_i % 7) / 6.0f, (stroke_i % 5) / 4.0f, layer_i * 0.5f, 1.0f };
+    stroke->brush.alpha = (1 + stroke_i % 10) / 10.0f;
+
+    // Mouse strokes have every pressure at 1.0. Pen strokes need more than 8 bits.
+    b32 is_pen = stroke_i % 3 != 0;
+    v2l p = { (i64)stroke_i * 997 - 2000000, (i64)layer_i * (1 << 30) };
+    for ( i32 i = 0; i < n; ++i ) {
+        p.x += (i % 2) ? 3 : -200;
+        p.y += (i64)i * i;
+        stroke->points[i] = p;
+        stroke->pressures[i] = is_pen ? ((stroke_i + i * 37) % 1000) / 999.0f : 1.0f;
+    }
+}
+
+// Adds a stroke to the working layer like milton_update_and_render does at the end of a stroke.
+static void
+test_push_stroke(Milton* milton, i32 layer_i, i32 stroke_i)
+{
+    test_fill_stroke(&milton->working_stroke, layer_i, stroke_i);
+
+    Stroke new_stroke = {};
+    StrokeList* strokes = &milton->canvas->working_layer->strokes;
+    copy_stroke(strokelist_get_bucket(strokes, strokes->count),
+                milton->view, &milton->working_stroke, &new_stroke);
+    new_stroke.layer_id = milton->view->working_layer_id;
+    new_stroke.bounding_rect = bounding_box_for_stroke(&new_stroke);
+    new_stroke.id = milton->canvas->stroke_id_count++;
+    milton_add_stroke(milton, milton->canvas->working_layer, new_stroke);
+
+    milton->working_stroke.num_points = 0;
+}
+
+static void
+test_add_strokes(Milton* milton)
+{
+    for ( i32 layer_i = 0; layer_i < TEST_NUM_LAYERS; ++layer_i ) {
+        if ( layer_i > 0 ) {
+            milton_new_layer(milton);
+        }
+        for ( i32 stroke_i = 0; stroke_i < TEST_STROKES_PER_LAYER; ++stroke_i ) {
+            test_push_stroke(milton, layer_i, stroke_i);
+        }
+    }
+}
+
+static void
+test_check_stroke(Milton* milton, Layer* layer, i32 layer_i, i32 stroke_i, f32 max_pressure_error)
+{
+    v2l points[TEST_MAX_POINTS] = {};
+    f32 pressures[TEST_MAX_POINTS] = {};
+    Stroke expected = {};
+    expected.points = points;
+    expected.pressures = pressures;
+    test_fill_stroke(&expected, layer_i, stroke_i);
+
+    StrokeBucket* bucket = strokelist_get_bucket(&layer->strokes, stroke_i);
+    if ( bucket->is_paged_out ) {
+        b32 touched = stroke_pager_touch(&milton->canvas->pager, bucket);
+        mlt_assert(touched);
+    }
+    Stroke* stroke = get(&layer->strokes, stroke_i);
+
+    mlt_assert(stroke->layer_id == layer->id);
+    mlt_assert(stroke->num_points == expected.num_points);
+    mlt_assert(stroke->brush.radius == expected.brush.radius);
+    mlt_assert(stroke->brush.color == expected.brush.color);
+    mlt_assert(stroke->brush.alpha == expected.brush.alpha);
+    for ( i32 i = 0; i < expected.num_points; ++i ) {
+        mlt_assert(stroke->points[i] == expected.points[i]);
+        mlt_assert(fabsf(stroke->pressures[i] - expected.pressures[i]) <= max_pressure_error);
+    }
+}
+
+static void
+test_check_strokes(Milton* milton, f32 max_pressure_error)
+{
+    i32 layer_i = 0;
+    for ( Layer* layer = milton->canvas->root_layer; layer != NULL; layer = layer->next, ++layer_i ) {
+        mlt_assert(layer_i < TEST_NUM_LAYERS);
+        mlt_assert(count(&layer->strokes) == TEST_STROKES_PER_LAYER);
+        for ( i32 stroke_i = 0; stroke_i < TEST_STROKES_PER_LAYER; ++stroke_i ) {
+            test_check_stroke(milton, layer, layer_i, stroke_i, max_pressure_error);
+        }
+    }
+    mlt_assert(layer_i == TEST_NUM_LAYERS);
+}
+
+// v8 quantizes pressures to 12 bits.
+static f32
+test_pressure_error(u32 version)
+{
+    return version >= 8 ? 0.5f / 4095.0f + 1e-6f : 0.0f;
+}
+
+static void
+test_save_and_load(Milton* milton, u32 version)
+{
+    milton->mlt_binary_version = version;
+    milton_save(milton);
+    mlt_assert(!(milton->flags & MiltonStateFlags_LAST_SAVE_FAILED));
+
+    milton_load(milton);
+    milton_load_wait(milton);
+    mlt_assert(!(milton->flags & MiltonStateFlags_DEFAULT_CANVAS));
+    mlt_assert(milton->mlt_binary_version == version);
+}
+
+// Each version saves the canvas that the previous one loaded.
+static void
+test_round_trip(Milton* milton)
+{
+    u32 versions[] = { 6, 7, 8 };
+    for ( size_t i = 0; i < array_count(versions); ++i ) {
+        test_save_and_load(milton, versions[i]);
+        test_check_strokes(milton, test_pressure_error(versions[i]));
+    }
+}
+
+static void
+test_varints()
+{
+    struct { u64 value; i64 size; } cases[] = {
+        { 0, 1 }, { 1, 1 }, { 127, 1 }, { 128, 2 }, { 16383, 2 }, { 16384, 3 },
+        { (u64)INT64_MAX, 9 }, { (u64)INT64_MAX + 1, 10 }, { UINT64_MAX, 10 },
+    };
+    for ( size_t i = 0; i < array_count(cases); ++i ) {
+        u8 buffer[16] = {};
+        u8* end = varint_encode(buffer, cases[i].value);
+        mlt_assert(end - buffer == cases[i].size);
+
+        u64 v = 0;
+        mlt_assert(varint_decode(buffer, end, &v) == end);
+        mlt_assert(v == cases[i].value);
+        // Cut short.
+        mlt_assert(varint_decode(buffer, end - 1, &v) == NULL);
+    }
+    {
+        // More than the 10 bytes of a u64.
+        u8 buffer[11] = {};
+        memset(buffer, 0x80, 10);
+        u64 v = 0;
+        mlt_assert(varint_decode(buffer, buffer + sizeof(buffer), &v) == NULL);
+    }
+
+    i64 values[] = { 0, 1, -1, 63, -64, INT32_MAX, INT32_MIN, INT64_MAX, INT64_MIN };
+    for ( size_t i = 0; i < array_count(values); ++i ) {
+        mlt_assert(zigzag_decode(zigzag_encode(values[i])) == values[i]);
+    }
+    // Small deltas of either sign take one byte.
+    mlt_assert(zigzag_encode(-1) == 1);
+    mlt_assert(zigzag_encode(1) == 2);
+    mlt_assert(zigzag_encode(-64) == 127);
+}
+
+// Deltas that take every varint size, with 8 and 12 bit pressures.
+static void
+test_compact_stroke()
+{
+    const i32 n = 11;
+    v2l points[n] = {};
+    f32 pressures[n] = {};
+    v2l decoded_points[n] = {};
+    f32 decoded_pressures[n] = {};
+    u8 buffer[MLT_COMPACT_STROKE_MAX_BYTES(n)] = {};
+
+    for ( i32 pen = 0; pen < 2; ++pen ) {
+        Stroke stroke = {};
+        stroke.points = points;
+        stroke.pressures = pressures;
+        stroke.num_points = n;
+        stroke.layer_id = 3;
+        for ( i32 i = 0; i < n; ++i ) {
+            i64 d = (i64)1 << (i * 6);
+            points[i] = v2l{ (i % 2) ? d : -d, -(i64)i };
+            pressures[i] = pen ? i / (f32)(n - 1) : 1.0f;
+        }
+
+        u8* end = stroke_encode_compact(buffer, &stroke, 5);
+        mlt_assert((size_t)(end - buffer) <= sizeof(buffer));
+
+        Stroke decoded = {};
+        decoded.points = decoded_points;
+        decoded.pressures = decoded_pressures;
+        mlt_assert(mlt_decode_compact_stroke(buffer, end, 5, &decoded));
+        mlt_assert(decoded.num_points == n);
+        mlt_assert(decoded.layer_id == 3);
+        for ( i32 i = 0; i < n; ++i ) {
+            mlt_assert(decoded_points[i] == points[i]);
+            mlt_assert(fabsf(decoded_pressures[i] - pressures[i]) <= test_pressure_error(8));
+        }
+        mlt_assert(!mlt_decode_compact_stroke(buffer, end - 1, 5, &decoded));
+    }
+}
+
+// Flips a bit in the middle of the first chunk of `type`. Returns true if the chunk opens afterwards.
+static b32
+test_flip_chunk_bit(PATH_CHAR* path, u32 type)
+{
+    FILE* fd = platform_fopen(path, TO_PATH_STR("r+b"));
+    mlt_assert(fd != NULL);
+
+    u32 header[2] = {};  // Magic number and version.
+    MltFile file = {};
+    b32 ok =    fread_checked(header, sizeof(u32), 2, fd)
+             && mlt_read_directory(fd, &file);
+    MltChunkEntry* chunk = ok ? mlt_find_chunk(&file, type, 0) : NULL;
+    mlt_assert(chunk != NULL && chunk->size > 0);
+
+    u64 offset = chunk->offset + chunk->size / 2;
+    u8 byte = 0;
+    ok =    fseek_checked(fd, offset)
+         && fread_checked(&byte, 1, 1, fd);
+    byte ^= 0x10;
+    ok =    ok
+         && fseek_checked(fd, offset)
+         && fwrite_checked(&byte, 1, 1, fd)
+         && fflush(fd) == 0;
+    mlt_assert(ok);
+
+    MltReader r = {};
+    b32 opens = mlt_open_chunk(&file, chunk, &r);
+    mlt_close_chunk(&r);
+
+    mlt_release_directory(&file);
+    fclose(fd);
+    return opens;
+}
+
+// The view is checked when its chunk is opened, and layers as their strokes are decoded.
+static void
+test_checksum_mismatch(Milton* milton, PATH_CHAR* path)
+{
+    u32 version = MILTON_MLT_VERSION;
+    u32 types[] = { MltChunk_VIEW, MltChunk_LAYER };
+    test_save_and_load(milton, version);
+    for ( size_t i = 0; i < array_count(types); ++i ) {
+        // Unmaps the file before it is written.
+        milton_reset_canvas(milton);
+        b32 opens = test_flip_chunk_bit(path, types[i]);
+        mlt_assert(!opens);
+        milton_load(milton);
+        mlt_assert(milton->flags & MiltonStateFlags_DEFAULT_CANVAS);
+
+        // Flipped back, the file loads again.
+        opens = test_flip_chunk_bit(path, types[i]);
+        mlt_assert(opens);
+        milton_set_canvas_file(milton, path);
+        milton_load(milton);
+        milton_load_wait(milton);
+        mlt_assert(!(milton->flags & MiltonStateFlags_DEFAULT_CANVAS));
+        mlt_assert(milton->mlt_binary_version == version);
+        test_check_strokes(milton, test_pressure_error(version));
+    }
+}
+
+// Strokes added after a save are replayed from the journal. A record cut short by a crash is dropped,
+// and the ones before it are kept.
+static void
+test_journal_truncation(Milton* milton, PATH_CHAR* path)
+{
+    PATH_CHAR journal_path[MAX_PATH] = {};
+    journal_fname(path, journal_path);
+
+    // Headless instances don't journal.
+    milton->flags &= ~MiltonStateFlags_HEADLESS;
+    test_save_and_load(milton, MILTON_MLT_VERSION);
+    mlt_assert(milton->journal.fd != NULL);
+    mlt_assert(milton->journal.num_records == 0);
+
+    i32 top_layer_i = TEST_NUM_LAYERS - 1;
+    mlt_assert(milton->canvas->working_layer == layer::get_topmost(milton->canvas->root_layer));
+    for ( i32 i = 0; i < 3; ++i ) {
+        test_push_stroke(milton, top_layer_i, TEST_STROKES_PER_LAYER + i);
+    }
+    mlt_assert(milton->journal.num_records == 3);
+
+    // Closes the journal. Then cut one byte off the payload of the last record.
+    milton_reset_canvas(milton);
+    u64 size = file_size(journal_path);
+    mlt_assert(size > 0);
+    u8* data = (u8*)mlt_calloc((size_t)size, 1, "Persist");
+    FILE* fd = platform_fopen(journal_path, TO_PATH_STR("rb"));
+    b32 ok = fd != NULL && fread_checked(data, 1, (size_t)size, fd);
+    ok = fd != NULL && fclose(fd) == 0 && ok;
+    fd = ok ? platform_fopen(journal_path, TO_PATH_STR("wb")) : NULL;
+    ok = fd != NULL && fwrite_checked(data, 1, (size_t)size - 1, fd);
+    ok = fd != NULL && fclose(fd) == 0 && ok;
+    mlt_assert(ok);
+    mlt_free(data, "Persist");
+
+    milton_load(milton);
+    milton_load_wait(milton);
+    mlt_assert(!(milton->flags & MiltonStateFlags_DEFAULT_CANVAS));
+    mlt_assert(milton->journal.num_records == 2);
+
+    Layer* top = layer::get_topmost(milton->canvas->root_layer);
+    mlt_assert(count(&top->strokes) == TEST_STROKES_PER_LAYER + 2);
+    for ( i32 i = 0; i < 2; ++i ) {
+        // The journal keeps pressures as they are.
+        test_check_stroke(milton, top, top_layer_i, TEST_STROKES_PER_LAYER + i, 0.0f);
+    }
+
+    milton->flags |= MiltonStateFlags_HEADLESS;
+}
+
+int
+milton_main()
+{
+    char fname[] = TEST_MLT_FILE;
+    PATH_CHAR path[MAX_PATH] = {};
+    str_to_path_char(fname, path, MAX_PATH*sizeof(PATH_CHAR));
+
+    test_varints();
+    test_compact_stroke();
+
+    // Without the file, loading fails and leaves an empty canvas.
+    test_remove_files();
+    Milton* milton = milton_headless_init(1280, 800, fname);
+    mlt_assert(milton != NULL);
+    milton_set_canvas_file(milton, path);
+
+    test_add_strokes(milton);
+    test_check_strokes(milton, 0.0f);
+
+    test_round_trip(milton);
+    test_checksum_mismatch(milton, path);
+    test_journal_truncation(milton, path);
+
+    // Unmaps the file.
+    milton_reset_canvas(milton);
+    milton_headless_deinit(milton);
+    test_remove_files();
+
+    return 0;
+}
@@ -106,9 +106,44 @@ typedef struct TabletState_s TabletState;
 
 int milton_main(bool is_fullscreen, char* file_to_open);
 
+// Runs the renderer on an offscreen OpenGL context, with no window. Loads
+// file_to_open and logs how long it takes to render it.
+int milton_main_headless(char* file_to_open);
+
+// Exports MLT files to images without a window. Arguments are the command
+// line arguments after --export. See export_usage in sdl_milton.cc.
+int milton_main_export(int argc, char** argv);
+
 void*   platform_allocate(size_t size);
 #define platform_deallocate(pointer) platform_deallocate_internal((pointer)); {(pointer) = NULL;}
 void    platform_deallocate_internal(void* ptr);
+
+// Address space for arenas that grow in place. Reserved memory can't be used
+// until it is committed. Committed pages read as zero, and decommitting them
+// gives them back to the OS.
+void*   platform_reserve(size_t size);
+b32     platform_commit(void* ptr, size_t size);
+void    platform_decommit(void* ptr, size_t size);
+void    platform_release(void* ptr, size_t size);
+
+// Maps a file into memory, read-only. Returns NULL if the file can't be mapped.
+// The mapping must stay valid after the file is replaced by platform_move_file.
+void*   platform_map_file(PATH_CHAR* fname, size_t* out_size);
+void    platform_unmap_file(void* data, size_t size);
+// False where platform_map_file always returns NULL.
+b32     platform_can_map_files();
+
+struct PlatformWriteBuffer
+{
+    const void* data;
+    size_t      size;
+};
+
+// Creates or truncates a file, writes the buffers in order with as few system
+// calls as possible and flushes the file to disk.
+b32     platform_write_file(PATH_CHAR* fname, PlatformWriteBuffer* buffers, i64 num_buffers);
+// Flushes what was written to `fd` to disk.
+b32     platform_sync_file(FILE* fd);
 float   platform_ui_scale(PlatformState* p);
 void    platform_point_to_pixel(PlatformState* ps, v2l* inout);
 void    platform_point_to_pixel_i(PlatformState* ps, v2i* inout);
@@ -158,6 +193,12 @@ b32     platform_dialog_yesno(char* info, char* title);
 void*   platform_get_gl_proc(char* name);
 void    platform_load_gl_func_pointers();
 
+// Offscreen OpenGL context, for running the renderer on machines without a
+// display. The default framebuffer is width x height pixels.
+// Only implemented on Linux. Returns false if a context could not be created.
+b32     platform_headless_gl_init(i32 width, i32 height);
+void    platform_headless_gl_deinit();
+
 void    platform_fname_at_exe(PATH_CHAR* fname, size_t len);
 b32     platform_move_file(PATH_CHAR* src, PATH_CHAR* dest);
 
@@ -185,6 +226,7 @@ i32 platform_monitor_refresh_hz();
 // Microsecond (us) resolution timer.
 u64 perf_counter();
 float perf_count_to_sec(u64 counter);
+u64 perf_counter_frequency();  // Counts per second.
 
 
 #if defined(_WIN32)
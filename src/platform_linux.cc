@@ -8,6 +8,230 @@
 
 #define IMPL_MISSING mlt_assert(!"IMPLEMENT")
 
+// ==== Headless OpenGL context
+//
+// EGL is loaded at runtime so that Milton doesn't depend on it unless it runs
+// headless. GL functions are still called through libGL. With GLVND (and with
+// older Mesa, which shares its dispatch between libGL and libEGL) they go to
+// whichever context is current, including ours.
+
+typedef void*           EGLDisplay;
+typedef void*           EGLConfig;
+typedef void*           EGLContext;
+typedef void*           EGLSurface;
+typedef unsigned int    EGLBoolean;
+typedef unsigned int    EGLenum;
+typedef int32_t         EGLint;
+
+#define EGL_NONE                            0x3038
+#define EGL_ALPHA_SIZE                      0x3021
+#define EGL_BLUE_SIZE                       0x3022
+#define EGL_GREEN_SIZE                      0x3023
+#define EGL_RED_SIZE                        0x3024
+#define EGL_DEPTH_SIZE                      0x3025
+#define EGL_STENCIL_SIZE                    0x3026
+#define EGL_SURFACE_TYPE                    0x3033
+#define EGL_RENDERABLE_TYPE                 0x3040
+#define EGL_HEIGHT                          0x3056
+#define EGL_WIDTH                           0x3057
+#define EGL_PBUFFER_BIT                     0x0001
+#define EGL_OPENGL_BIT                      0x0008
+#define EGL_OPENGL_API                      0x30A2
+#define EGL_CONTEXT_MAJOR_VERSION           0x3098
+#define EGL_CONTEXT_MINOR_VERSION           0x30FB
+#define EGL_CONTEXT_OPENGL_PROFILE_MASK     0x30FD
+#define EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT 0x0001
+#define EGL_PLATFORM_SURFACELESS_MESA       0x31DD
+
+struct HeadlessEGL
+{
+    void* lib;
+
+    EGLDisplay  display;
+    EGLContext  context;
+    EGLSurface  surface;
+
+    EGLDisplay  (*GetDisplay)(void* native_display);
+    void*       (*GetProcAddress)(const char* name);
+    EGLBoolean  (*Initialize)(EGLDisplay dpy, EGLint* major, EGLint* minor);
+    EGLBoolean  (*Terminate)(EGLDisplay dpy);
+    EGLBoolean  (*BindAPI)(EGLenum api);
+    EGLBoolean  (*ChooseConfig)(EGLDisplay dpy, const EGLint* attrib_list, EGLConfig* configs,
+                                EGLint config_size, EGLint* num_config);
+    EGLContext  (*CreateContext)(EGLDisplay dpy, EGLConfig config, EGLContext share_context,
+                                 const EGLint* attrib_list);
+    EGLBoolean  (*DestroyContext)(EGLDisplay dpy, EGLContext ctx);
+    EGLSurface  (*CreatePbufferSurface)(EGLDisplay dpy, EGLConfig config, const EGLint* attrib_list);
+    EGLBoolean  (*DestroySurface)(EGLDisplay dpy, EGLSurface surface);
+    EGLBoolean  (*MakeCurrent)(EGLDisplay dpy, EGLSurface draw, EGLSurface read, EGLContext ctx);
+    EGLint      (*GetError)();
+};
+
+// One context per thread, so that batch exports can render in parallel.
+static thread_local HeadlessEGL g_headless;
+
+// Set once any thread runs headless. There is no display for dialogs after that.
+static b32 g_is_headless;
+
+b32
+platform_headless_gl_init(i32 width, i32 height)
+{
+    HeadlessEGL* egl = &g_headless;
+    mlt_assert(egl->context == NULL);
+
+    b32 ok = true;
+
+    egl->lib = dlopen("libEGL.so.1", RTLD_LAZY);
+    if ( !egl->lib ) {
+        egl->lib = dlopen("libEGL.so", RTLD_LAZY);
+    }
+    if ( !egl->lib ) {
+        milton_log("[headless] Could not load libEGL: %s\n", dlerror());
+        return false;
+    }
+
+#define EGL_LOAD(func) \
+    if ( ok ) { \
+        *(void**)&egl->func = dlsym(egl->lib, "egl" #func); \
+        if ( egl->func == NULL ) { \
+            milton_log("[headless] Could not load egl" #func "\n"); \
+            ok = false; \
+        } \
+    }
+    EGL_LOAD(GetDisplay);
+    EGL_LOAD(GetProcAddress);
+    EGL_LOAD(Initialize);
+    EGL_LOAD(Terminate);
+    EGL_LOAD(BindAPI);
+    EGL_LOAD(ChooseConfig);
+    EGL_LOAD(CreateContext);
+    EGL_LOAD(DestroyContext);
+    EGL_LOAD(CreatePbufferSurface);
+    EGL_LOAD(DestroySurface);
+    EGL_LOAD(MakeCurrent);
+    EGL_LOAD(GetError);
+#undef EGL_LOAD
+
+    if ( ok ) {
+        // Prefer Mesa's surfaceless platform. It doesn't need X or a DRM device, so it works with llvmpipe.
+        typedef EGLDisplay GetPlatformDisplayProc(EGLenum platform, void* native_display, const EGLint* attrib_list);
+        GetPlatformDisplayProc* get_platform_display =
+                (GetPlatformDisplayProc*)egl->GetProcAddress("eglGetPlatformDisplayEXT");
+        if ( get_platform_display ) {
+            egl->display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, NULL, NULL);
+        }
+        if ( egl->display == NULL ) {
+            milton_log("[headless] Surfaceless platform not available. Using the default display.\n");
+            egl->display = egl->GetDisplay(NULL);
+        }
+        EGLint major = 0, minor = 0;
+        if ( egl->display == NULL || !egl->Initialize(egl->display, &major, &minor) ) {
+            milton_log("[headless] Could not initialize EGL display. Error 0x%x\n", egl->GetError());
+            egl->display = NULL;
+            ok = false;
+        } else {
+            milton_log("[headless] Initialized EGL %d.%d\n", major, minor);
+        }
+    }
+
+    EGLConfig config = NULL;
+    if ( ok ) {
+        // The renderer draws to the default framebuffer, so we need a pbuffer surface rather than
+        // a surfaceless context.
+        EGLint config_attribs[] = {
+            EGL_SURFACE_TYPE,       EGL_PBUFFER_BIT,
+            EGL_RENDERABLE_TYPE,    EGL_OPENGL_BIT,
+            EGL_RED_SIZE,           8,
+            EGL_GREEN_SIZE,         8,
+            EGL_BLUE_SIZE,          8,
+            EGL_ALPHA_SIZE,         8,
+            EGL_DEPTH_SIZE,         24,
+            EGL_STENCIL_SIZE,       8,
+            EGL_NONE
+        };
+        EGLint num_configs = 0;
+        if ( !egl->ChooseConfig(egl->display, config_attribs, &config, 1, &num_configs) || num_configs == 0 ) {
+            milton_log("[headless] No suitable EGL config. Error 0x%x\n", egl->GetError());
+            ok = false;
+        }
+    }
+
+    if ( ok ) {
+        if ( !egl->BindAPI(EGL_OPENGL_API) ) {
+            milton_log("[headless] Could not bind the OpenGL API\n");
+            ok = false;
+        }
+    }
+
+    if ( ok ) {
+        EGLint context_attribs[] = {
+        #if USE_GL_3_2
+            EGL_CONTEXT_MAJOR_VERSION,          3,
+            EGL_CONTEXT_MINOR_VERSION,          2,
+            EGL_CONTEXT_OPENGL_PROFILE_MASK,    EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        #else
+            EGL_CONTEXT_MAJOR_VERSION,          2,
+            EGL_CONTEXT_MINOR_VERSION,          1,
+        #endif
+            EGL_NONE
+        };
+        egl->context = egl->CreateContext(egl->display, config, NULL, context_attribs);
+        if ( egl->context == NULL ) {
+            milton_log("[headless] Could not create OpenGL context. Error 0x%x\n", egl->GetError());
+            ok = false;
+        }
+    }
+
+    if ( ok ) {
+        EGLint surface_attribs[] = {
+            EGL_WIDTH,  width,
+            EGL_HEIGHT, height,
+            EGL_NONE
+        };
+        egl->surface = egl->CreatePbufferSurface(egl->display, config, surface_attribs);
+        if ( egl->surface == NULL ) {
+            milton_log("[headless] Could not create %dx%d pbuffer. Error 0x%x\n", width, height, egl->GetError());
+            ok = false;
+        }
+    }
+
+    if ( ok ) {
+        if ( !egl->MakeCurrent(egl->display, egl->surface, egl->surface, egl->context) ) {
+            milton_log("[headless] eglMakeCurrent failed. Error 0x%x\n", egl->GetError());
+            ok = false;
+        }
+    }
+
+    if ( ok ) {
+        g_is_headless = true;
+    }
+
+    if ( !ok ) {
+        platform_headless_gl_deinit();
+    }
+    return ok;
+}
+
+void
+platform_headless_gl_deinit()
+{
+    HeadlessEGL* egl = &g_headless;
+    if ( egl->display ) {
+        egl->MakeCurrent(egl->display, NULL, NULL, NULL);
+        if ( egl->surface ) {
+            egl->DestroySurface(egl->display, egl->surface);
+        }
+        if ( egl->context ) {
+            egl->DestroyContext(egl->display, egl->context);
+        }
+        egl->Terminate(egl->display);
+    }
+    if ( egl->lib ) {
+        dlclose(egl->lib);
+    }
+    *egl = {};
+}
+
 
 float
 perf_count_to_sec(u64 counter)
@@ -16,19 +240,25 @@ perf_count_to_sec(u64 counter)
     return (float)counter * 1e-9;
 }
 
+u64
+perf_counter_frequency()
+{
+    return 1000000000ull;
+}
+
 u64
 perf_counter()
 {
     // http://stackoverflow.com/a/2660610/4717805
     timespec tp;
-    int res = clock_gettime(CLOCK_REALTIME, &tp);
+    int res = clock_gettime(CLOCK_MONOTONIC, &tp);
 
     // TODO: Check errno and provide more information
     if ( res ) {
         milton_log("Something went wrong with clock_gettime\n");
     }
 
-    return tp.tv_nsec;
+    return (u64)tp.tv_sec * 1000000000ull + (u64)tp.tv_nsec;
 }
 
 void
@@ -98,6 +328,9 @@ linux_set_GTK_filter(GtkFileChooser* chooser, GtkFileFilter* filter, FileKind ki
 void
 platform_dialog(char* info, char* title)
 {
+    if ( g_is_headless ) {
+        milton_log("[headless] %s: %s\n", title, info);
+    }
     // IMPL_MISSING;
     return;
 }
@@ -105,6 +338,11 @@ platform_dialog(char* info, char* title)
 b32
 platform_dialog_yesno(char* info, char* title)
 {
+    if ( g_is_headless ) {
+        // No display to show the dialog on.
+        milton_log("[headless] %s: %s -- Answering no.\n", title, info);
+        return false;
+    }
     platform_cursor_show();
     GtkWidget *dialog = gtk_message_dialog_new(
             NULL,
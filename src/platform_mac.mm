@@ -159,20 +159,26 @@ perf_count_to_sec(u64 counter)
     // Input as nanoseconds
     return (float)counter * 1e-9;
 }
+
+u64
+perf_counter_frequency()
+{
+    return 1000000000ull;
+}
 u64
 perf_counter()
 {
     // clock_gettime() on macOS is only supported on macOS Sierra and later.
     // For older macOS operating systems, mach_absolute_time() will be need to be used.
     timespec tp;
-    int res = clock_gettime(CLOCK_REALTIME, &tp);
+    int res = clock_gettime(CLOCK_MONOTONIC, &tp);
 
     // TODO: Check errno and provide more informations
     if ( res ) {
         milton_log("Something went wrong with clock_gettime\n");
     }
 
-    return tp.tv_nsec;
+    return (u64)tp.tv_sec * 1000000000ull + (u64)tp.tv_nsec;
 }
 
 b32
@@ -320,6 +326,19 @@ platform_open_link(char* link)
     extern void platform_open_link_mac(char*);
     platform_open_link_mac(link);
 }
+
+b32
+platform_headless_gl_init(i32 width, i32 height)
+{
+    milton_log("Headless mode is not supported on macOS.\n");
+    return false;
+}
+
+void
+platform_headless_gl_deinit()
+{
+}
+
 PATH_CHAR*
 platform_save_dialog(FileKind kind)
 {
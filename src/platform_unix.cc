@@ -95,6 +95,143 @@ platform_deallocate_internal(void* ptr)
     munmap(ptr, size);
 }
 
+// Transparent huge pages only back aligned ranges.
+#define UNIX_RESERVE_ALIGNMENT (2*1024*1024)
+
+void*
+platform_reserve(size_t size)
+{
+    u8* result = NULL;
+    size_t padded_size = size + UNIX_RESERVE_ALIGNMENT;
+    u8* ptr = (u8*)mmap(NULL, padded_size, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                        -1, 0);
+    if ( ptr != MAP_FAILED ) {
+        result = (u8*)(((uintptr_t)ptr + UNIX_RESERVE_ALIGNMENT - 1) & ~(uintptr_t)(UNIX_RESERVE_ALIGNMENT - 1));
+        size_t head = (size_t)(result - ptr);
+        size_t tail = padded_size - head - size;
+        if ( head ) {
+            munmap(ptr, head);
+        }
+        if ( tail ) {
+            munmap(result + size, tail);
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(result, size, MADV_HUGEPAGE);
+#endif
+    }
+    return result;
+}
+
+b32
+platform_commit(void* ptr, size_t size)
+{
+    return mprotect(ptr, size, PROT_READ | PROT_WRITE) == 0;
+}
+
+void
+platform_decommit(void* ptr, size_t size)
+{
+#ifdef __linux__
+    // Private anonymous pages read as zero after MADV_DONTNEED.
+    madvise(ptr, size, MADV_DONTNEED);
+    mprotect(ptr, size, PROT_NONE);
+#else
+    // MADV_DONTNEED doesn't drop the contents on macOS. Map new pages over them.
+    mmap(ptr, size, PROT_NONE, MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+#endif
+}
+
+void
+platform_release(void* ptr, size_t size)
+{
+    munmap(ptr, size);
+}
+
+void*
+platform_map_file(PATH_CHAR* fname, size_t* out_size)
+{
+    void* data = NULL;
+    int fd = open(fname, O_RDONLY);
+    if ( fd >= 0 ) {
+        struct stat st = {};
+        if ( fstat(fd, &st) == 0 && st.st_size > 0 ) {
+            // A file replaced by rename() stays alive while it is mapped.
+            data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if ( data == MAP_FAILED ) {
+                data = NULL;
+            } else {
+                *out_size = (size_t)st.st_size;
+            }
+        }
+        close(fd);
+    }
+    return data;
+}
+
+void
+platform_unmap_file(void* data, size_t size)
+{
+    munmap(data, size);
+}
+
+b32
+platform_can_map_files()
+{
+    return true;
+}
+
+b32
+platform_write_file(PATH_CHAR* fname, PlatformWriteBuffer* buffers, i64 num_buffers)
+{
+    int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if ( fd < 0 ) {
+        return false;
+    }
+
+    b32 ok = true;
+    struct iovec iov[64];
+    i64 buffer_i = 0;
+    size_t offset = 0;  // Into buffers[buffer_i], after a short write.
+    while ( ok && buffer_i < num_buffers ) {
+        int iov_count = 0;
+        for ( i64 i = buffer_i; i < num_buffers && iov_count < min(64, IOV_MAX); ++i ) {
+            size_t skip = (i == buffer_i) ? offset : 0;
+            if ( buffers[i].size > skip ) {
+                iov[iov_count].iov_base = (u8*)buffers[i].data + skip;
+                iov[iov_count].iov_len = buffers[i].size - skip;
+                ++iov_count;
+            }
+        }
+        if ( iov_count == 0 ) {
+            break;
+        }
+        ssize_t written = writev(fd, iov, iov_count);
+        if ( written < 0 ) {
+            ok = (errno == EINTR);
+            continue;
+        }
+        // Advance past what was written.
+        size_t remaining = (size_t)written;
+        while ( buffer_i < num_buffers && remaining >= buffers[buffer_i].size - offset ) {
+            remaining -= buffers[buffer_i].size - offset;
+            offset = 0;
+            ++buffer_i;
+        }
+        offset += remaining;
+    }
+
+    ok = ok && fsync(fd) == 0;
+    ok = (close(fd) == 0) && ok;
+    return ok;
+}
+
+b32
+platform_sync_file(FILE* fd)
+{
+    return fflush(fd) == 0 && fsync(fileno(fd)) == 0;
+}
+
 void
 platform_cursor_hide()
 {
@@ -128,7 +265,10 @@ i32
 platform_monitor_refresh_hz()
 {
     i32 hz = 60;
-    // TODO: Implement this on macOs and Linux.
+    SDL_DisplayMode mode = {};
+    if ( SDL_GetDesktopDisplayMode(0, &mode) == 0 && mode.refresh_rate > 0 ) {
+        hz = mode.refresh_rate;
+    }
     return hz;
 }
 
@@ -136,6 +276,15 @@ int
 main(int argc, char** argv)
 {
     char* file_to_open = NULL;
+    if ( argc >= 2 && strcmp(argv[1], "--export") == 0 ) {
+        return milton_main_export(argc - 2, argv + 2);
+    }
+    if ( argc >= 2 && strcmp(argv[1], "--headless") == 0 ) {
+        if ( argc == 3 ) {
+            file_to_open = argv[2];
+        }
+        return milton_main_headless(file_to_open);
+    }
     if ( argc == 2 ) {
         file_to_open = argv[1];
     }
@@ -10,6 +10,7 @@
     #include <sys/mman.h>
     #undef __USE_MISC
     #include <unistd.h>
+    #include <fcntl.h>
 
     #include <X11/Xlib.h>
     #include <X11/extensions/XInput.h>
@@ -20,6 +21,8 @@
     // #define _GNU_SOURCE //temporarily targeting gcc for program_invocation_name
     #include <sys/stat.h>
     #include <sys/time.h>
+    #include <sys/uio.h>
+    #include <limits.h>
     #include <errno.h>
     #include <time.h>
     #include <ctype.h>
@@ -28,6 +31,11 @@
 
 #elif defined(__MACH__)
     #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <sys/uio.h>
+    #include <limits.h>
+    #include <fcntl.h>
+    #include <errno.h>
     #include <unistd.h> // getpid
     #else
     #error "This is not the Unix you're looking for"
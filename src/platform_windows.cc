@@ -4,6 +4,8 @@
 
 #include "platform.h"
 
+#include <io.h>  // _get_osfhandle
+
 #include "memory.h"
 
 extern "C" {
@@ -54,6 +56,18 @@ platform_get_gl_proc(char* name)
     return func;
 }
 
+b32
+platform_headless_gl_init(i32 width, i32 height)
+{
+    milton_log("Headless mode is not supported on Windows.\n");
+    return false;
+}
+
+void
+platform_headless_gl_deinit()
+{
+}
+
 void
 win_load_dpi_api(WinDpiApi* api) {
     HMODULE shcore = LoadLibrary("Shcore.dll");
@@ -113,6 +127,49 @@ platform_deallocate_internal(void* pointer)
     VirtualFree(pointer, 0, MEM_RELEASE);
 }
 
+void*
+platform_reserve(size_t size)
+{
+    return VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_READWRITE);
+}
+
+b32
+platform_commit(void* ptr, size_t size)
+{
+    return VirtualAlloc(ptr, size, MEM_COMMIT, PAGE_READWRITE) != NULL;
+}
+
+void
+platform_decommit(void* ptr, size_t size)
+{
+    VirtualFree(ptr, size, MEM_DECOMMIT);
+}
+
+void
+platform_release(void* ptr, size_t size)
+{
+    VirtualFree(ptr, 0, MEM_RELEASE);
+}
+
+void*
+platform_map_file(PATH_CHAR* fname, size_t* out_size)
+{
+    // MoveFileEx can't replace a file while it is mapped, so saving would fail.
+    // Files are read with fread on Windows.
+    return NULL;
+}
+
+void
+platform_unmap_file(void* data, size_t size)
+{
+}
+
+b32
+platform_can_map_files()
+{
+    return false;
+}
+
 void
 win32_debug_output(char* str)
 {
@@ -397,6 +454,42 @@ platform_move_file(PATH_CHAR* src, PATH_CHAR* dest)
     return ok;
 }
 
+b32
+platform_write_file(PATH_CHAR* fname, PlatformWriteBuffer* buffers, i64 num_buffers)
+{
+    // WriteFileGather needs unbuffered, page-aligned writes. Buffers are written one by one.
+    HANDLE file = CreateFileW(fname, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if ( file == INVALID_HANDLE_VALUE ) {
+        win32_print_error((int)GetLastError());
+        return false;
+    }
+
+    b32 ok = true;
+    for ( i64 i = 0; ok && i < num_buffers; ++i ) {
+        const u8* data = (const u8*)buffers[i].data;
+        size_t size = buffers[i].size;
+        while ( ok && size > 0 ) {
+            DWORD to_write = (DWORD)min(size, (size_t)(1u << 30));
+            DWORD written = 0;
+            ok = WriteFile(file, data, to_write, &written, NULL) && written > 0;
+            data += written;
+            size -= written;
+        }
+    }
+    ok = ok && FlushFileBuffers(file);
+    if ( !ok ) {
+        win32_print_error((int)GetLastError());
+    }
+    ok = CloseHandle(file) && ok;
+    return ok;
+}
+
+b32
+platform_sync_file(FILE* fd)
+{
+    return fflush(fd) == 0 && FlushFileBuffers((HANDLE)_get_osfhandle(_fileno(fd)));
+}
+
 void
 platform_fname_at_config(PATH_CHAR* fname, size_t len)
 {
@@ -525,6 +618,14 @@ perf_count_to_sec(u64 counter)
     return sec;
 }
 
+u64
+perf_counter_frequency()
+{
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    return (u64)freq.QuadPart;
+}
+
 void
 platform_cursor_hide()
 {
@@ -1,33 +1,385 @@
 // Copyright (c) 2015 Sergio Gonzalez. All rights reserved.
 // License: https://github.com/serge-rgb/milton#license
 
-#if defined(_WIN32) && MILTON_ENABLE_PROFILING
-u64 g_profiler_ticks[PROF_COUNT];
-u64 g_profiler_last[PROF_COUNT];
-u64 g_profiler_count[PROF_COUNT];
-#endif
+#include "profiler.h"
 
+#include "memory.h"
+#include "platform.h"
 
-#if MILTON_ENABLE_PROFILING
+// Deeper scopes are counted but not recorded.
+#define PROFILER_MAX_DEPTH 32
+// Events this close to being overwritten are not exported. The thread might be writing them.
+#define PROFILER_WRITE_MARGIN 1024
+
+struct ProfilerThread
+{
+    SDL_atomic_t    in_use;
+    ProfilerEvent*  events;         // Ring of PROFILER_MAX_EVENTS.
+    i64             num_events;     // Written so far. Only the owner writes it.
+    char            name[64];
+
+    // Open scopes.
+    const char*     names[PROFILER_MAX_DEPTH];
+    u64             starts[PROFILER_MAX_DEPTH];
+    i32             depth;
+};
+
+// The last one is not taken by a thread. It has the GPU passes.
+#define PROFILER_GPU_SLOT PROFILER_MAX_THREADS
+
+static ProfilerThread               g_profiler_threads[PROFILER_MAX_THREADS + 1];
+static thread_local ProfilerThread* g_profiler_thread;
+static SDL_atomic_t                 g_profiler_frame;
+
+// The buffer of the calling thread. NULL when every buffer is taken.
+static ProfilerThread*
+profiler_thread()
+{
+    ProfilerThread* t = g_profiler_thread;
+    for ( i32 i = 0; t == NULL && i < PROFILER_MAX_THREADS; ++i ) {
+        if ( SDL_AtomicCAS(&g_profiler_threads[i].in_use, 0, 1) ) {
+            t = &g_profiler_threads[i];
+            if ( t->events == NULL ) {
+                t->events = (ProfilerEvent*)mlt_calloc(PROFILER_MAX_EVENTS, sizeof(ProfilerEvent), "Profiler");
+            }
+            snprintf(t->name, array_count(t->name), "Thread %lu", (unsigned long)SDL_ThreadID());
+            t->depth = 0;
+            g_profiler_thread = t;
+        }
+    }
+    return t;
+}
+
+// `end` is the value of instants and counters.
+static void
+profiler_push(ProfilerThread* t, ProfilerEventKind kind, const char* name, u64 start, u64 end, i32 depth, i32 frame)
+{
+    ProfilerEvent* e = &t->events[t->num_events % PROFILER_MAX_EVENTS];
+    e->name = name;
+    e->start = start;
+    e->end = end;
+    e->depth = (i16)depth;
+    e->kind = (i16)kind;
+    e->frame = frame;
+    // profiler_write_trace reads the count first. The event has to be there.
+    SDL_MemoryBarrierRelease();
+    t->num_events += 1;
+}
 
 void
-profiler_reset()
+profiler_begin(const char* name)
 {
-    for ( i32 i = 0; i < PROF_COUNT; ++i ) {
-        g_profiler_count[i] = 0;
+    ProfilerThread* t = profiler_thread();
+    if ( t ) {
+        if ( t->depth < PROFILER_MAX_DEPTH ) {
+            t->names[t->depth] = name;
+            t->starts[t->depth] = perf_counter();
+        }
+        t->depth += 1;
     }
 }
 
+void
+profiler_end()
+{
+    ProfilerThread* t = g_profiler_thread;
+    if ( t && t->depth > 0 ) {
+        t->depth -= 1;
+        if ( t->depth < PROFILER_MAX_DEPTH ) {
+            profiler_push(t, ProfilerEvent_SCOPE, t->names[t->depth], t->starts[t->depth], perf_counter(), t->depth,
+                          profiler_frame());
+        }
+    }
+}
+
+u64
+profiler_record(const char* name, u64 start)
+{
+    u64 end = perf_counter();
+    ProfilerThread* t = profiler_thread();
+    if ( t ) {
+        profiler_push(t, ProfilerEvent_SCOPE, name, start, end, t->depth, profiler_frame());
+    }
+    return end - start;
+}
 
 void
-profiler_init()
+profiler_record_instant(const char* name, i64 value)
 {
-    for( i64 i=0; i<PROF_COUNT; ++i ) {
-        g_profiler_ticks[i] = 0;
-        g_profiler_last[i]  = 0;
-        g_profiler_count[i] = 0;
+    ProfilerThread* t = profiler_thread();
+    if ( t ) {
+        profiler_push(t, ProfilerEvent_INSTANT, name, perf_counter(), (u64)value, t->depth, profiler_frame());
     }
 }
 
+void
+profiler_record_counter(const char* name, i64 value)
+{
+    ProfilerThread* t = profiler_thread();
+    if ( t ) {
+        profiler_push(t, ProfilerEvent_COUNTER, name, perf_counter(), (u64)value, t->depth, profiler_frame());
+    }
+}
 
-#endif
+void
+profiler_record_gpu(const char* name, u64 start, u64 end, i32 frame)
+{
+    ProfilerThread* t = &g_profiler_threads[PROFILER_GPU_SLOT];
+    if ( t->events == NULL ) {
+        t->events = (ProfilerEvent*)mlt_calloc(PROFILER_MAX_EVENTS, sizeof(ProfilerEvent), "Profiler");
+        snprintf(t->name, array_count(t->name), "GPU");
+    }
+    profiler_push(t, ProfilerEvent_SCOPE, name, start, end, 0, frame);
+}
+
+void
+profiler_end_frame()
+{
+    SDL_AtomicAdd(&g_profiler_frame, 1);
+}
+
+i32
+profiler_frame()
+{
+    return SDL_AtomicGet(&g_profiler_frame);
+}
+
+void
+profiler_set_thread_name(const char* name)
+{
+    ProfilerThread* t = profiler_thread();
+    if ( t ) {
+        snprintf(t->name, array_count(t->name), "%s", name);
+    }
+}
+
+void
+profiler_thread_release()
+{
+    ProfilerThread* t = g_profiler_thread;
+    if ( t && t->depth == 0 ) {
+        g_profiler_thread = NULL;
+        SDL_AtomicSet(&t->in_use, 0);
+    }
+}
+
+static const char* g_frame_phase_names[FramePhase_COUNT] =
+{
+    "Polling",
+    "Update",
+    "Clipping",
+    "Cooking",
+    "Submit",
+};
+
+const char*
+frame_phase_name(i32 phase)
+{
+    mlt_assert(phase >= 0 && phase < FramePhase_COUNT);
+    return g_frame_phase_names[phase];
+}
+
+static f32
+ms_from_counts(u64 counts)
+{
+    return perf_count_to_sec(counts) * 1000.0f;
+}
+
+void
+frame_history_push(FrameHistory* history, GraphData* graph, f32 gpu_ms, i32 refresh_hz)
+{
+    FrameTimes* f = &history->frames[history->count % FRAME_HISTORY_SIZE];
+
+    f32 update = ms_from_counts(graph->update);
+    f32 clipping = ms_from_counts(graph->clipping);
+    f32 cooking = min(ms_from_counts(graph->cooking), clipping);
+
+    f->phase_ms[FramePhase_POLLING] = ms_from_counts(graph->polling);
+    f->phase_ms[FramePhase_UPDATE] = update;
+    f->phase_ms[FramePhase_CLIPPING] = clipping - cooking;
+    f->phase_ms[FramePhase_COOKING] = cooking;
+    // The GL timer wraps everything after polling.
+    f->phase_ms[FramePhase_SUBMIT] = max(ms_from_counts(graph->GL) - update - clipping, 0.0f);
+
+    f->cpu_ms = 0.0f;
+    for ( i32 i = 0; i < FramePhase_COUNT; ++i ) {
+        f->cpu_ms += f->phase_ms[i];
+    }
+    f->gpu_ms = gpu_ms;
+
+    history->budget_ms = 1000.0f / (f32)max(refresh_hz, 1);
+    if ( max(f->cpu_ms, f->gpu_ms) > history->budget_ms ) {
+        history->num_missed += 1;
+    }
+    history->count += 1;
+}
+
+FrameTimes*
+frame_history_get(FrameHistory* history, i64 age)
+{
+    mlt_assert(age >= 0 && age < min(history->count, (i64)FRAME_HISTORY_SIZE));
+    return &history->frames[(history->count - 1 - age) % FRAME_HISTORY_SIZE];
+}
+
+static int
+compare_ms(const void* a, const void* b)
+{
+    f32 fa = *(f32*)a;
+    f32 fb = *(f32*)b;
+    return (fa > fb) - (fa < fb);
+}
+
+void
+frame_history_stats(FrameHistory* history, b32 gpu, FrameStats* out_stats)
+{
+    *out_stats = {};
+
+    f32 sorted[FRAME_HISTORY_SIZE];
+    i32 n = (i32)min(history->count, (i64)FRAME_HISTORY_SIZE);
+    for ( i32 i = 0; i < n; ++i ) {
+        FrameTimes* f = &history->frames[i];
+        sorted[i] = gpu ? f->gpu_ms : f->cpu_ms;
+        if ( sorted[i] > history->budget_ms ) {
+            out_stats->num_missed += 1;
+        }
+    }
+    if ( n > 0 ) {
+        qsort(sorted, (size_t)n, sizeof(*sorted), compare_ms);
+        // Nearest rank.
+        out_stats->p50 = sorted[(i32)ceilf(0.50f * n) - 1];
+        out_stats->p95 = sorted[(i32)ceilf(0.95f * n) - 1];
+        out_stats->p99 = sorted[(i32)ceilf(0.99f * n) - 1];
+    }
+    out_stats->num_frames = n;
+}
+
+b32
+frame_history_should_capture(FrameHistory* history)
+{
+    b32 result = false;
+    if ( history->count > FLIGHT_RECORDER_WARMUP_FRAMES ) {
+        FrameTimes* f = frame_history_get(history, 0);
+        u64 now = perf_counter();
+        b32 slow = f->cpu_ms > FLIGHT_RECORDER_THRESHOLD * history->budget_ms;
+        b32 waited =    history->num_captures == 0
+                     || now - history->last_capture > FLIGHT_RECORDER_MIN_INTERVAL * perf_counter_frequency();
+        if ( slow && waited ) {
+            history->last_capture = now;
+            history->num_captures += 1;
+            result = true;
+        }
+    }
+    return result;
+}
+
+// Copies the events of frames from `first_frame` on that started after `since`.
+static b32
+capture_events(ProfilerCapture* capture, i32 first_frame, u64 since)
+{
+    *capture = {};
+
+    // Events other threads write from now on are left out.
+    i64 first[PROFILER_MAX_THREADS + 1] = {};
+    i64 last[PROFILER_MAX_THREADS + 1] = {};
+    i64 total = 0;
+    for ( i32 ti = 0; ti <= PROFILER_GPU_SLOT; ++ti ) {
+        ProfilerThread* t = &g_profiler_threads[ti];
+        last[ti] = t->num_events;
+        SDL_MemoryBarrierAcquire();
+        first[ti] = max(last[ti] - (PROFILER_MAX_EVENTS - PROFILER_WRITE_MARGIN), (i64)0);
+        total += last[ti] - first[ti];
+    }
+
+    capture->events = (ProfilerEvent*)mlt_calloc((size_t)max(total, (i64)1), sizeof(ProfilerEvent), "Profiler");
+    if ( !capture->events ) {
+        return false;
+    }
+
+    capture->epoch = ~0ull;  // Timestamps are relative to the oldest event.
+    i64 count = 0;
+    for ( i32 ti = 0; ti <= PROFILER_GPU_SLOT; ++ti ) {
+        ProfilerThread* t = &g_profiler_threads[ti];
+        i64 thread_start = count;
+        for ( i64 i = first[ti]; i < last[ti]; ++i ) {
+            ProfilerEvent e = t->events[i % PROFILER_MAX_EVENTS];
+            if ( e.frame >= first_frame && e.start >= since ) {
+                capture->events[count++] = e;
+                capture->epoch = min(capture->epoch, e.start);
+            }
+        }
+        capture->num_events[ti] = count - thread_start;
+        if ( last[ti] > 0 ) {
+            memcpy(capture->thread_names[ti], t->name, sizeof(t->name));
+        }
+    }
+    return true;
+}
+
+b32
+profiler_capture(ProfilerCapture* capture, u64 since)
+{
+    return capture_events(capture, INT_MIN, since);
+}
+
+void
+profiler_release_capture(ProfilerCapture* capture)
+{
+    mlt_free(capture->events, "Profiler");
+    *capture = {};
+}
+
+b32
+profiler_write_capture(FILE* fd, ProfilerCapture* capture)
+{
+    double us_per_count = 1000000.0 / (double)perf_counter_frequency();
+    b32 first_event = true;
+
+    fprintf(fd, "\"traceEvents\": [\n");
+    ProfilerEvent* events = capture->events;
+    for ( i32 ti = 0; ti <= PROFILER_GPU_SLOT; ++ti ) {
+        i64 num_events = capture->num_events[ti];
+        if ( num_events == 0 ) {
+            continue;
+        }
+        fprintf(fd, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                first_event ? "" : ",\n", ti, capture->thread_names[ti]);
+        first_event = false;
+        for ( i64 i = 0; i < num_events; ++i ) {
+            ProfilerEvent e = events[i];
+            double ts = (double)(e.start - capture->epoch) * us_per_count;
+            if ( e.kind == ProfilerEvent_SCOPE && e.end >= e.start ) {
+                fprintf(fd, ",\n{\"name\": \"%s\", \"cat\": \"milton\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                            "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"frame\": %d}}",
+                        e.name, ti, ts, (double)(e.end - e.start) * us_per_count, e.frame);
+            }
+            else if ( e.kind == ProfilerEvent_INSTANT ) {
+                fprintf(fd, ",\n{\"name\": \"%s\", \"cat\": \"milton\", \"ph\": \"i\", \"s\": \"t\", \"pid\": 1, \"tid\": %d, "
+                            "\"ts\": %.3f, \"args\": {\"value\": %" PRIi64 ", \"frame\": %d}}",
+                        e.name, ti, ts, e.value, e.frame);
+            }
+            else if ( e.kind == ProfilerEvent_COUNTER ) {
+                fprintf(fd, ",\n{\"name\": \"%s\", \"cat\": \"milton\", \"ph\": \"C\", \"pid\": 1, \"tid\": %d, "
+                            "\"ts\": %.3f, \"args\": {\"value\": %" PRIi64 "}}",
+                        e.name, ti, ts, e.value);
+            }
+        }
+        events += num_events;
+    }
+    int written = fprintf(fd, "\n]");
+    return written > 0 && !ferror(fd);
+}
+
+b32
+profiler_write_trace(FILE* fd)
+{
+    ProfilerCapture capture = {};
+    b32 ok = capture_events(&capture, profiler_frame() - PROFILER_NUM_FRAMES, 0);
+    if ( ok ) {
+        fprintf(fd, "{\"displayTimeUnit\": \"ms\", ");
+        ok = profiler_write_capture(fd, &capture);
+        int written = fprintf(fd, "}\n");
+        ok = ok && written > 0 && !ferror(fd);
+    }
+    profiler_release_capture(&capture);
+    return ok;
+}
@@ -3,105 +3,206 @@
 
 #pragma once
 
+#include "common.h"
 
+#include <stdio.h>
 
 // Profiler
 //
-// The PROFILE_RASTER_BEGIN and PROFILE_RASTER_PUSH macros report the rasterizer performance
-// to the Windows console output.
+// PROFILE_SCOPE("name") times the rest of the enclosing scope. Scopes nest, and
+// each thread records into its own ring buffer, so the last events of every
+// thread are kept without locks. profiler_end_frame counts frames, and
+// profiler_write_trace writes the events of the last PROFILER_NUM_FRAMES frames
+// as Chrome trace_event JSON, to open in chrome://tracing or Perfetto.
 //
-// The PROFILE_GRAPH_BEGIN and PROFILE_GRAPH_END macros write to the
-// g_profiler_last array.
+// PROFILE_GRAPH_BEGIN and PROFILE_GRAPH_END time the parts of the frame shown in
+// the debug window. They write to milton->graph_frame and record an event too.
 //
+// GPU passes are timed by the renderer and show up in traces as a thread of their
+// own, named GPU. See profiler_record_gpu.
 //
-enum
-{
-    PROF_RASTER_render_canvas,
-    PROF_RASTER_sse2,
-    PROF_RASTER_preamble,
-    PROF_RASTER_load,
-    PROF_RASTER_work,
-    PROF_RASTER_gather,
-    PROF_RASTER_sampling,
-    PROF_RASTER_total_work_loop,
-    PROF_RASTER_sample,
+// PROFILE_INSTANT marks something that happened, like an undo, and PROFILE_COUNTER
+// records a value, like the draw calls of a frame. Both show up in traces.
+//
+// The buffers double as a flight recorder. When a frame takes more than
+// FLIGHT_RECORDER_THRESHOLD refresh intervals, the last FLIGHT_RECORDER_SECONDS of
+// events are written to the config folder. See frame_history_should_capture.
+//
+// Threads name themselves with PROFILE_THREAD_NAME. Threads that are done call
+// PROFILE_THREAD_RELEASE, so that the next thread reuses their buffer.
+//
+// Without MILTON_ENABLE_PROFILING, the macros compile to nothing.
 
+#define PROFILER_MAX_THREADS    64
+#define PROFILER_MAX_EVENTS     (1 << 15)   // Per thread.
+#define PROFILER_NUM_FRAMES     120         // Exported by profiler_write_trace.
 
-    PROF_RASTER_COUNT, // Number of raster profiler counters for Win32 Console output
+#define FLIGHT_RECORDER_SECONDS         5
+#define FLIGHT_RECORDER_THRESHOLD       2.0f    // Refresh intervals.
+#define FLIGHT_RECORDER_MIN_INTERVAL    30      // Seconds between captures.
+#define FLIGHT_RECORDER_WARMUP_FRAMES   60      // Loading the canvas is slow. Don't capture it.
+#define FLIGHT_RECORDER_MAX_FILES       8       // Older captures are overwritten.
 
+// Durations of the last frame, and when the ones that are being timed started. The parts nest.
+struct GraphData
+{
+    u64 polling;
+    u64 update;
+    u64 clipping;
+    u64 GL;
+    u64 system;
+    u64 cooking;    // Part of clipping. Measured by the renderer.
 
-    PROF_GRAPH_polling=0,     // Time spent gathering input.
-    PROF_GRAPH_update,      // Time spent processing input.
-    PROF_GRAPH_raster,      // Time spent rasterizing the canvas.
-    PROF_GRAPH_GL,          // Time spent sending data and draw commands to GL
+    u64 polling_start;
+    u64 update_start;
+    u64 clipping_start;
+    u64 GL_start;
+    u64 system_start;
+};
 
-    PROF_COUNT = PROF_RASTER_COUNT+4,
-    //PROF_COUNT,
+// Frame times of the last FRAME_HISTORY_SIZE frames, for the Frame Timing window.
+#define FRAME_HISTORY_SIZE 512
 
-};
+enum FramePhase
+{
+    FramePhase_POLLING,
+    FramePhase_UPDATE,
+    FramePhase_CLIPPING,    // Without cooking.
+    FramePhase_COOKING,
+    FramePhase_SUBMIT,      // The rest of the frame: GL commands, ImGui.
 
+    FramePhase_COUNT,
+};
 
-struct GraphData
+struct FrameTimes
 {
-    u64 start;
+    f32 phase_ms[FramePhase_COUNT];  // They add up to cpu_ms.
+    f32 cpu_ms;
+    f32 gpu_ms;     // Of a frame submitted a few frames earlier. Zero without GPU timers.
+};
 
+struct FrameHistory
+{
+    FrameTimes  frames[FRAME_HISTORY_SIZE];  // Ring.
+    i64         count;          // Frames pushed.
+    i64         num_missed;     // Frames, out of count, over budget_ms on the CPU or the GPU.
+    f32         budget_ms;      // One refresh of the monitor.
+
+    // Flight recorder.
+    u64         last_capture;   // perf_counter
+    i32         num_captures;
+};
 
-    u64 polling;
-    u64 update;
-    u64 clipping;
-    u64 raster;
-    u64 GL;
-    u64 system;
+struct FrameStats
+{
+    f32 p50;
+    f32 p95;
+    f32 p99;
+    i32 num_frames;
+    i32 num_missed;     // Frames over budget.
 };
 
-extern GraphData g_graphframe;
+enum ProfilerEventKind
+{
+    ProfilerEvent_SCOPE,
+    ProfilerEvent_INSTANT,
+    ProfilerEvent_COUNTER,
+};
 
-static char* g_profiler_names[PROF_RASTER_COUNT] =
+struct ProfilerEvent
 {
-    "render_canvas",
-    "sse2",
-    "preamble",
-    "load",
-    "work",
-    "gather",
-    "sampling",
-    "total_work_loop",
-    "sample",
+    const char* name;   // Static string.
+    u64         start;  // perf_counter
+    union {
+        u64     end;    // Scopes.
+        i64     value;  // Instants and counters.
+    };
+    i16         depth;
+    i16         kind;   // ProfilerEventKind
+    i32         frame;
 };
 
-void profiler_init();
-void profiler_output();
-void profiler_reset();
+void profiler_begin(const char* name);
+void profiler_end();
+// Records an event that started at `start` and ends now. Returns its duration.
+u64  profiler_record(const char* name, u64 start);
+void profiler_record_instant(const char* name, i64 value);
+void profiler_record_counter(const char* name, i64 value);
+// Records a GPU pass of frame `frame`, in perf_counter units. Only the thread with the GL context calls it.
+void profiler_record_gpu(const char* name, u64 start, u64 end, i32 frame);
 
-#if defined(_WIN64) && MILTON_ENABLE_PROFILING
-    extern u64 g_profiler_ticks[PROF_COUNT];     // Total cpu clocks
-    extern u64 g_profiler_last[PROF_COUNT];
-    extern u64 g_profiler_count[PROF_COUNT];     // How many calls
+void profiler_end_frame();
+i32  profiler_frame();
 
+// Shown as the name of the calling thread in traces.
+void profiler_set_thread_name(const char* name);
+// Lets another thread take the buffer of the calling thread. The events stay. Does nothing inside
+// a scope, so it is safe in worker functions that the main thread also runs.
+void profiler_thread_release();
 
-    static u32 TSC_AUX;
-    static int CPUID_AUX1[4];
-    static int CPUID_AUX2;
+b32  profiler_write_trace(FILE* fd);
 
-    /////////
-    #define PROFILE_GRAPH_BEGIN(name) \
-            milton->graph_frame.start = perf_counter();
+// Copy of the recorded events, which can be written later, on another thread.
+struct ProfilerCapture
+{
+    ProfilerEvent*  events;     // Grouped by thread.
+    i64             num_events[PROFILER_MAX_THREADS + 1];  // Of each thread. The last one is the GPU.
+    char            thread_names[PROFILER_MAX_THREADS + 1][64];
+    u64             epoch;      // Start of the oldest event.
+};
+// Copies the events that started after `since` (perf_counter). Returns false if there was not enough memory.
+b32  profiler_capture(ProfilerCapture* capture, u64 since);
+// Writes `"traceEvents": [...]` as a member of a JSON object that the caller writes.
+b32  profiler_write_capture(FILE* fd, ProfilerCapture* capture);
+void profiler_release_capture(ProfilerCapture* capture);
+
+const char* frame_phase_name(i32 phase);
+
+void        frame_history_push(FrameHistory* history, GraphData* graph, f32 gpu_ms, i32 refresh_hz);
+// `age` 0 is the last frame pushed. Must be less than min(count, FRAME_HISTORY_SIZE).
+FrameTimes* frame_history_get(FrameHistory* history, i64 age);
+// Percentiles of the CPU or GPU times of the frames in the history.
+void        frame_history_stats(FrameHistory* history, b32 gpu, FrameStats* out_stats);
+// True if the last frame was slow enough for the flight recorder, and the last capture was long
+// enough ago. Counts the capture.
+b32         frame_history_should_capture(FrameHistory* history);
+
+struct ProfilerScope
+{
+    ProfilerScope(const char* name) { profiler_begin(name); }
+    ~ProfilerScope() { profiler_end(); }
+};
 
-    #define PROFILE_GRAPH_END(name)  \
-            milton->graph_frame.##name = perf_counter() - milton->graph_frame.start
+#if MILTON_ENABLE_PROFILING
 
-#elif defined(__linux__) && MILTON_ENABLE_PROFILING
+    #define PROFILE_CONCAT_(a, b) a##b
+    #define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+
+    #define PROFILE_SCOPE(name) \
+            ProfilerScope PROFILE_CONCAT(profile_scope_, __LINE__)(name)
 
     #define PROFILE_GRAPH_BEGIN(name) \
-            milton->graph_frame.start = perf_counter();
+            milton->graph_frame.name##_start = perf_counter();
 
     #define PROFILE_GRAPH_END(name)  \
-            milton->graph_frame.name = perf_counter() - milton->graph_frame.start
+            milton->graph_frame.name = profiler_record(#name, milton->graph_frame.name##_start)
+
+    #define PROFILE_INSTANT(name, value)    profiler_record_instant(name, value)
+    #define PROFILE_COUNTER(name, value)    profiler_record_counter(name, value)
+
+    #define PROFILE_END_FRAME()         profiler_end_frame()
+    #define PROFILE_THREAD_NAME(name)   profiler_set_thread_name(name)
+    #define PROFILE_THREAD_RELEASE()    profiler_thread_release()
 
 #else
 
+#define PROFILE_SCOPE(name)
 #define PROFILE_GRAPH_BEGIN(name)
 #define PROFILE_GRAPH_END(name)
+#define PROFILE_INSTANT(name, value)
+#define PROFILE_COUNTER(name, value)
+#define PROFILE_END_FRAME()
+#define PROFILE_THREAD_NAME(name)
+#define PROFILE_THREAD_RELEASE()
 
 #endif
-
@@ -0,0 +1,651 @@
+// Copyright (c) 2015 Sergio Gonzalez. All rights reserved.
+// License: https://github.com/serge-rgb/milton#license
+
+#include "rasterizer.h"
+
+#include "canvas.h"
+#include "DArray.h"
+#include "profiler.h"
+#include "StrokePager.h"
+#include "utils.h"
+#include "WorkerPool.h"
+
+// The AVX coverage test is compiled for AVX whatever the flags of the rest of the build, and used
+// when the CPU has it. See raster_tile_strokes. GCC and clang won't inline it into functions that
+// are not compiled for AVX, so the functions with AVX code are flattened.
+#if defined(_MSC_VER)
+    #define RASTER_HAS_AVX_PATH 1
+    #define RASTER_TARGET_AVX
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define RASTER_HAS_AVX_PATH 1
+    #define RASTER_TARGET_AVX __attribute__((target("avx"), flatten))
+#else
+    #define RASTER_HAS_AVX_PATH 0
+#endif
+
+#if RASTER_HAS_AVX_PATH
+#include <immintrin.h>
+#endif
+
+#define RASTER_TILE_SIZE    64
+#define RASTER_MAX_KERNEL   200  // Same limit as gpu_render_canvas
+
+// Stroke segment, in raster coordinates.
+struct RasterSegment
+{
+    f32 ax, ay;
+    f32 abx, aby;
+    f32 inv_len2;   // 1 / |ab|^2, or 0 when a == b.
+    f32 ra;         // Radius at a
+    f32 dr;         // Radius at b minus radius at a
+
+    // Pixel bounds, inclusive.
+    i32 left;
+    i32 top;
+    i32 right;
+    i32 bottom;
+};
+
+struct RasterStroke
+{
+    v4f     color;
+    b32     is_eraser;
+    i64     first_segment;  // Segments of a stroke are sorted by `top`.
+    i64     num_segments;
+    Rect    bounds;  // Pixel bounds, inclusive.
+};
+
+// Per-worker memory, reused across tiles.
+struct RasterScratch
+{
+    Arena* arena;   // The worker's scratch arena.
+};
+
+struct RasterContext
+{
+    i32 width;
+    i32 height;
+
+    // RGBA buffers with premultiplied alpha. The canvas holds all the layers
+    // composited so far, which is also what erasers paint with.
+    f32* canvas;
+    f32* layer;
+    f32* scratch;
+
+    // Strokes of the layer being rendered.
+    DArray<RasterStroke>  strokes;
+    DArray<RasterSegment> segments;
+
+    v4f clear_color;
+    f32 layer_alpha;
+
+    // Box filter parameters
+    i32  kernel_size;
+    f32* blur_in;
+    f32* blur_out;
+
+    u8* out_buffer;
+
+    Rect* tiles;
+    i32   num_tiles;
+
+    b32   use_avx;
+};
+
+typedef void RasterTileFunc(RasterContext* ctx, Rect tile, RasterScratch* scratch);
+
+struct RasterPass
+{
+    RasterContext*  ctx;
+    RasterTileFunc* func;
+};
+
+static void
+raster_task(void* data, i64 tile_i)
+{
+    PROFILE_SCOPE("raster tile");
+    RasterPass* pass = (RasterPass*)data;
+    ArenaMark mark = arena_scratch_begin();
+    RasterScratch scratch = {};
+    scratch.arena = mark.arena;
+    pass->func(pass->ctx, pass->ctx->tiles[tile_i], &scratch);
+    arena_scratch_end(mark);
+}
+
+// Runs func over every tile, on the worker pool.
+static void
+raster_run_pass(RasterContext* ctx, RasterTileFunc* func)
+{
+    RasterPass pass = {};
+    pass.ctx = ctx;
+    pass.func = func;
+    worker_pool_run(raster_task, &pass, ctx->num_tiles);
+}
+
+static int
+compare_segment_top(const void* a, const void* b)
+{
+    i32 ta = ((RasterSegment*)a)->top;
+    i32 tb = ((RasterSegment*)b)->top;
+    return (ta > tb) - (ta < tb);
+}
+
+// Same transformation that gpu_render_to_buffer applies to the view before rendering.
+static CanvasView
+raster_export_view(CanvasView* view, i32 scale, i32 x, i32 y, i32 w, i32 h)
+{
+    CanvasView result = *view;
+
+    v2i center = result.screen_size / 2;
+    v2i pan_delta = v2i{x + (w / 2), y + (h / 2)} - center;
+
+    result.pan_center += VEC2L(center - result.zoom_center) * result.scale;
+    result.zoom_center = center;
+    result.pan_center = result.pan_center + VEC2L(pan_delta)*result.scale;
+
+    result.screen_size = v2i{w * scale, h * scale};
+    result.zoom_center = result.screen_size / 2;
+    if ( scale > 1 ) {
+        result.scale = (i64)ceill(((f32)result.scale / (f32)scale));
+    }
+    return result;
+}
+
+static v2f
+raster_point(CanvasView* view, v2l canvas_point)
+{
+    // Subtract in integer space to keep precision far away from the origin.
+    double x = (double)(canvas_point.x - view->pan_center.x) / (double)view->scale + view->zoom_center.x;
+    double y = (double)(canvas_point.y - view->pan_center.y) / (double)view->scale + view->zoom_center.y;
+    v2f result = { (f32)x, (f32)y };
+    return result;
+}
+
+// Converts the visible strokes of a layer into raster-space segments.
+static void
+raster_prepare_layer(RasterContext* ctx, Layer* layer, CanvasView* view)
+{
+    reset(&ctx->strokes);
+    reset(&ctx->segments);
+
+    StrokeList* list = &layer->strokes;
+    StrokeBucket* bucket = &list->root;
+    i64 bucket_i = 0;
+
+    while ( bucket ) {
+        if ( list->count <= bucket_i * STROKELIST_BUCKET_COUNT ) {
+            break;
+        }
+        i64 count = min(list->count - bucket_i*STROKELIST_BUCKET_COUNT, (i64)STROKELIST_BUCKET_COUNT);
+
+        Rect bbox = canvas_rect_to_raster_rect(view, bucket->bounding_rect);
+        b32 bucket_outside =   bbox.right < 0 || bbox.bottom < 0
+                            || bbox.left > ctx->width || bbox.top > ctx->height;
+        // Skip buckets whose points could not be read back.
+        b32 skip_bucket = bucket_outside || !stroke_pager_touch(list->pager, bucket);
+
+        for ( i64 i = 0; !skip_bucket && i < count; ++i ) {
+            Stroke* s = &bucket->data[i];
+
+            // Skip the same strokes as gpu_clip_strokes_and_update.
+            Rect bounds = canvas_rect_to_raster_rect(view, s->bounding_rect);
+            b32 is_outside =   bounds.left > ctx->width || bounds.right < 0
+                            || bounds.top > ctx->height || bounds.bottom < 0;
+            i64 area = (bounds.right-bounds.left) * (bounds.bottom-bounds.top);
+            if ( is_outside || area == 0 || s->num_points <= 0 ) {
+                continue;
+            }
+
+            RasterStroke rs = {};
+            rs.color = s->brush.color;
+            rs.is_eraser = is_eraser(s->brush.color);
+            rs.first_segment = ctx->segments.count;
+            rs.bounds = rect_without_size();
+
+            // A single point is drawn as a zero-length segment.
+            i32 num_segments = max(s->num_points - 1, 1);
+            for ( i32 pi = 0; pi < num_segments; ++pi ) {
+                i32 pj = min(pi + 1, s->num_points - 1);
+
+                v2f a = raster_point(view, s->points[pi]);
+                v2f b = raster_point(view, s->points[pj]);
+                f32 ra = s->pressures[pi] * s->brush.radius / (f32)view->scale;
+                f32 rb = s->pressures[pj] * s->brush.radius / (f32)view->scale;
+
+                RasterSegment seg = {};
+                seg.ax = a.x;
+                seg.ay = a.y;
+                seg.abx = b.x - a.x;
+                seg.aby = b.y - a.y;
+                f32 len2 = seg.abx*seg.abx + seg.aby*seg.aby;
+                seg.inv_len2 = len2 > 0.0f ? 1.0f / len2 : 0.0f;
+                seg.ra = ra;
+                seg.dr = rb - ra;
+
+                // Pixel x is covered when the distance to its center (x + 0.5) is less than the radius.
+                f32 left   = min(a.x - ra, b.x - rb) - 0.5f;
+                f32 right  = max(a.x + ra, b.x + rb) - 0.5f;
+                f32 top    = min(a.y - ra, b.y - rb) - 0.5f;
+                f32 bottom = max(a.y + ra, b.y + rb) - 0.5f;
+                if ( right < 0 || bottom < 0 || left >= ctx->width || top >= ctx->height ) {
+                    continue;
+                }
+                seg.left   = max((i32)floorf(left), 0);
+                seg.top    = max((i32)floorf(top), 0);
+                seg.right  = min((i32)ceilf(right), ctx->width - 1);
+                seg.bottom = min((i32)ceilf(bottom), ctx->height - 1);
+
+                rs.bounds.left   = min(rs.bounds.left, (i64)seg.left);
+                rs.bounds.top    = min(rs.bounds.top, (i64)seg.top);
+                rs.bounds.right  = max(rs.bounds.right, (i64)seg.right);
+                rs.bounds.bottom = max(rs.bounds.bottom, (i64)seg.bottom);
+
+                push(&ctx->segments, seg);
+            }
+            rs.num_segments = ctx->segments.count - rs.first_segment;
+            if ( rs.num_segments > 0 ) {
+                // So that tiles can walk down the rows adding and removing segments.
+                qsort(ctx->segments.data + rs.first_segment, (size_t)rs.num_segments,
+                      sizeof(RasterSegment), compare_segment_top);
+                push(&ctx->strokes, rs);
+            }
+        }
+        bucket = bucket->next;
+        bucket_i += 1;
+    }
+}
+
+// Capsule distance test from stroke_raster.f.glsl for 4 horizontally adjacent
+// pixels. Returns a bit mask of covered pixels.
+static u32
+raster_coverage4(RasterSegment* seg, __m128 px, __m128 dy)
+{
+    __m128 abx = _mm_set1_ps(seg->abx);
+    __m128 aby = _mm_set1_ps(seg->aby);
+
+    __m128 dx = _mm_sub_ps(px, _mm_set1_ps(seg->ax));
+
+    __m128 t = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(dx, abx), _mm_mul_ps(dy, aby)),
+                          _mm_set1_ps(seg->inv_len2));
+    t = _mm_min_ps(_mm_max_ps(t, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+
+    __m128 ex = _mm_sub_ps(dx, _mm_mul_ps(t, abx));
+    __m128 ey = _mm_sub_ps(dy, _mm_mul_ps(t, aby));
+    __m128 r = _mm_add_ps(_mm_set1_ps(seg->ra), _mm_mul_ps(t, _mm_set1_ps(seg->dr)));
+
+    __m128 dist2 = _mm_add_ps(_mm_mul_ps(ex, ex), _mm_mul_ps(ey, ey));
+    __m128 inside = _mm_cmplt_ps(dist2, _mm_mul_ps(r, r));
+
+    u32 mask = (u32)_mm_movemask_ps(inside);
+    return mask;
+}
+
+// The same test for 8 pixels, starting at pixel x.
+static u32
+raster_coverage8_sse(RasterSegment* seg, i32 x, f32 py)
+{
+    __m128 px0 = _mm_add_ps(_mm_set1_ps((f32)x + 0.5f), _mm_setr_ps(0, 1, 2, 3));
+    __m128 px1 = _mm_add_ps(px0, _mm_set1_ps(4.0f));
+    __m128 dy = _mm_set1_ps(py - seg->ay);
+
+    u32 mask = raster_coverage4(seg, px0, dy) | (raster_coverage4(seg, px1, dy) << 4);
+    return mask;
+}
+
+#if RASTER_HAS_AVX_PATH
+RASTER_TARGET_AVX static u32
+raster_coverage8_avx(RasterSegment* seg, i32 x, f32 py)
+{
+    __m256 px = _mm256_add_ps(_mm256_set1_ps((f32)x + 0.5f),
+                              _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7));
+    __m256 abx = _mm256_set1_ps(seg->abx);
+    __m256 aby = _mm256_set1_ps(seg->aby);
+
+    __m256 dx = _mm256_sub_ps(px, _mm256_set1_ps(seg->ax));
+    __m256 dy = _mm256_set1_ps(py - seg->ay);
+
+    __m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(dx, abx), _mm256_mul_ps(dy, aby)),
+                             _mm256_set1_ps(seg->inv_len2));
+    t = _mm256_min_ps(_mm256_max_ps(t, _mm256_setzero_ps()), _mm256_set1_ps(1.0f));
+
+    __m256 ex = _mm256_sub_ps(dx, _mm256_mul_ps(t, abx));
+    __m256 ey = _mm256_sub_ps(dy, _mm256_mul_ps(t, aby));
+    __m256 r = _mm256_add_ps(_mm256_set1_ps(seg->ra), _mm256_mul_ps(t, _mm256_set1_ps(seg->dr)));
+
+    __m256 dist2 = _mm256_add_ps(_mm256_mul_ps(ex, ex), _mm256_mul_ps(ey, ey));
+    __m256 inside = _mm256_cmp_ps(dist2, _mm256_mul_ps(r, r), _CMP_LT_OQ);
+
+    u32 mask = (u32)_mm256_movemask_ps(inside);
+    return mask;
+}
+#endif  // RASTER_HAS_AVX_PATH
+
+// dst = src + dst*(1-src.a)
+static void
+raster_blend(f32* dst, __m128 src)
+{
+    __m128 src_a = _mm_shuffle_ps(src, src, _MM_SHUFFLE(3,3,3,3));
+    __m128 d = _mm_loadu_ps(dst);
+    d = _mm_add_ps(src, _mm_mul_ps(d, _mm_sub_ps(_mm_set1_ps(1.0f), src_a)));
+    _mm_storeu_ps(dst, d);
+}
+
+// Draws the part of a stroke in the rows [top, bottom] and columns [left, right]. Instantiated once
+// for each coverage test, so that the test is inlined in the pixel loop.
+template <u32 Coverage8(RasterSegment*, i32, f32)>
+static void
+raster_stroke_rows(RasterContext* ctx, RasterStroke* stroke, RasterSegment** active,
+                   i32 left, i32 top, i32 right, i32 bottom)
+{
+    __m128 color = _mm_loadu_ps(stroke->color.d);
+    RasterSegment* segments = ctx->segments.data + stroke->first_segment;
+
+    // Segments that touch the current row of the tile. Segments are sorted by their top row, so
+    // going down the rows only adds the next ones and drops the ones that ended.
+    i64 num_active = 0;
+    i64 next = 0;
+    for ( i32 y = top; y <= bottom; ++y ) {
+        for ( ; next < stroke->num_segments && segments[next].top <= y; ++next ) {
+            RasterSegment* seg = &segments[next];
+            if ( seg->bottom >= y && seg->left <= right && seg->right >= left ) {
+                active[num_active++] = seg;
+            }
+        }
+        i64 num_kept = 0;
+        for ( i64 i = 0; i < num_active; ++i ) {
+            if ( active[i]->bottom >= y ) {
+                active[num_kept++] = active[i];
+            }
+        }
+        num_active = num_kept;
+        if ( num_active == 0 ) {
+            if ( next == stroke->num_segments ) {
+                break;
+            }
+            continue;
+        }
+
+        f32 py = (f32)y + 0.5f;
+        size_t row = (size_t)y * ctx->width;
+
+        for ( i32 x = left; x <= right; x += 8 ) {
+            u32 mask = 0;
+            for ( i64 i = 0; i < num_active && mask != 0xff; ++i ) {
+                RasterSegment* seg = active[i];
+                if ( seg->left <= x + 7 && seg->right >= x ) {
+                    mask |= Coverage8(seg, x, py);
+                }
+            }
+
+            // Each pixel gets blended once per stroke, like the depth test does in the GL path.
+            i32 n = min(8, right - x + 1);
+            for ( i32 i = 0; i < n; ++i ) {
+                if ( mask & (1u << i) ) {
+                    size_t idx = 4 * (row + x + i);
+                    __m128 src = stroke->is_eraser ? _mm_loadu_ps(ctx->canvas + idx) : color;
+                    raster_blend(ctx->layer + idx, src);
+                }
+            }
+        }
+    }
+}
+
+static void
+raster_stroke_rows_sse(RasterContext* ctx, RasterStroke* stroke, RasterSegment** active,
+                       i32 left, i32 top, i32 right, i32 bottom)
+{
+    raster_stroke_rows<raster_coverage8_sse>(ctx, stroke, active, left, top, right, bottom);
+}
+
+#if RASTER_HAS_AVX_PATH
+RASTER_TARGET_AVX static void
+raster_stroke_rows_avx(RasterContext* ctx, RasterStroke* stroke, RasterSegment** active,
+                       i32 left, i32 top, i32 right, i32 bottom)
+{
+    raster_stroke_rows<raster_coverage8_avx>(ctx, stroke, active, left, top, right, bottom);
+}
+#endif
+
+static void
+raster_tile_strokes(RasterContext* ctx, Rect tile, RasterScratch* scratch)
+{
+    for ( i64 si = 0; si < ctx->strokes.count; ++si ) {
+        RasterStroke* stroke = &ctx->strokes.data[si];
+
+        i32 left   = (i32)max(tile.left, stroke->bounds.left);
+        i32 top    = (i32)max(tile.top, stroke->bounds.top);
+        i32 right  = (i32)min(tile.right - 1, stroke->bounds.right);
+        i32 bottom = (i32)min(tile.bottom - 1, stroke->bounds.bottom);
+        if ( left > right || top > bottom ) {
+            continue;
+        }
+
+        ArenaMark mark = arena_mark(scratch->arena);
+        RasterSegment** active = arena_alloc_array(scratch->arena, stroke->num_segments, RasterSegment*);
+#if RASTER_HAS_AVX_PATH
+        if ( ctx->use_avx ) {
+            raster_stroke_rows_avx(ctx, stroke, active, left, top, right, bottom);
+        } else
+#endif
+        {
+            raster_stroke_rows_sse(ctx, stroke, active, left, top, right, bottom);
+        }
+        arena_reset_to_mark(mark);
+    }
+}
+
+// Box filter. Matches blur.f.glsl with linear filtering: each output pixel is
+// the average of 2*kernel_size input pixels, clamped to the edges.
+static void
+raster_tile_blur_vertical(RasterContext* ctx, Rect tile, RasterScratch*)
+{
+    i32 k = ctx->kernel_size;
+    i32 w = ctx->width;
+    i32 h = ctx->height;
+    __m128 inv = _mm_set1_ps(1.0f / (2*k));
+    __m128 sums[RASTER_TILE_SIZE];
+
+    i32 tile_w = (i32)(tile.right - tile.left);
+    mlt_assert(tile_w <= RASTER_TILE_SIZE);
+
+    // GL rows are bottom-up, so the window is [y-k+1, y+k] in top-down rows.
+    for ( i32 i = 0; i < tile_w; ++i ) {
+        sums[i] = _mm_setzero_ps();
+        for ( i32 j = (i32)tile.top - k + 1; j <= (i32)tile.top + k; ++j ) {
+            i32 row = min(max(j, 0), h - 1);
+            sums[i] = _mm_add_ps(sums[i], _mm_loadu_ps(ctx->blur_in + 4*((size_t)row*w + tile.left + i)));
+        }
+    }
+    for ( i32 y = (i32)tile.top; y < tile.bottom; ++y ) {
+        i32 row_add = min(y + k + 1, h - 1);
+        i32 row_sub = min(max(y - k + 1, 0), h - 1);
+        for ( i32 i = 0; i < tile_w; ++i ) {
+            size_t x = (size_t)tile.left + i;
+            _mm_storeu_ps(ctx->blur_out + 4*((size_t)y*w + x), _mm_mul_ps(sums[i], inv));
+            sums[i] = _mm_add_ps(sums[i], _mm_loadu_ps(ctx->blur_in + 4*((size_t)row_add*w + x)));
+            sums[i] = _mm_sub_ps(sums[i], _mm_loadu_ps(ctx->blur_in + 4*((size_t)row_sub*w + x)));
+        }
+    }
+}
+
+static void
+raster_tile_blur_horizontal(RasterContext* ctx, Rect tile, RasterScratch*)
+{
+    i32 k = ctx->kernel_size;
+    i32 w = ctx->width;
+    __m128 inv = _mm_set1_ps(1.0f / (2*k));
+
+    for ( i32 y = (i32)tile.top; y < tile.bottom; ++y ) {
+        f32* in = ctx->blur_in + 4*(size_t)y*w;
+        f32* out = ctx->blur_out + 4*(size_t)y*w;
+
+        // Window is [x-k, x+k-1]
+        __m128 sum = _mm_setzero_ps();
+        for ( i32 j = (i32)tile.left - k; j < (i32)tile.left + k; ++j ) {
+            i32 col = min(max(j, 0), w - 1);
+            sum = _mm_add_ps(sum, _mm_loadu_ps(in + 4*col));
+        }
+        for ( i32 x = (i32)tile.left; x < tile.right; ++x ) {
+            _mm_storeu_ps(out + 4*x, _mm_mul_ps(sum, inv));
+            i32 col_add = min(x + k, w - 1);
+            i32 col_sub = max(x - k, 0);
+            sum = _mm_add_ps(sum, _mm_loadu_ps(in + 4*col_add));
+            sum = _mm_sub_ps(sum, _mm_loadu_ps(in + 4*col_sub));
+        }
+    }
+}
+
+static void
+raster_tile_clear(RasterContext* ctx, Rect tile, RasterScratch*)
+{
+    __m128 color = _mm_loadu_ps(ctx->clear_color.d);
+    for ( i64 y = tile.top; y < tile.bottom; ++y ) {
+        for ( i64 x = tile.left; x < tile.right; ++x ) {
+            size_t idx = 4 * ((size_t)y*ctx->width + x);
+            _mm_storeu_ps(ctx->canvas + idx, color);
+            _mm_storeu_ps(ctx->layer + idx, _mm_setzero_ps());
+        }
+    }
+}
+
+// Blend the layer onto the canvas with the layer alpha, and clear the layer for the next one.
+static void
+raster_tile_composite(RasterContext* ctx, Rect tile, RasterScratch*)
+{
+    __m128 alpha = _mm_set1_ps(ctx->layer_alpha);
+    for ( i64 y = tile.top; y < tile.bottom; ++y ) {
+        for ( i64 x = tile.left; x < tile.right; ++x ) {
+            size_t idx = 4 * ((size_t)y*ctx->width + x);
+            __m128 src = _mm_mul_ps(_mm_loadu_ps(ctx->layer + idx), alpha);
+            raster_blend(ctx->canvas + idx, src);
+            _mm_storeu_ps(ctx->layer + idx, _mm_setzero_ps());
+        }
+    }
+}
+
+static void
+raster_tile_resolve(RasterContext* ctx, Rect tile, RasterScratch*)
+{
+    __m128 zero = _mm_setzero_ps();
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 k255 = _mm_set1_ps(255.0f);
+    for ( i64 y = tile.top; y < tile.bottom; ++y ) {
+        for ( i64 x = tile.left; x < tile.right; ++x ) {
+            size_t idx = 4 * ((size_t)y*ctx->width + x);
+            __m128 c = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(ctx->canvas + idx), zero), one);
+            __m128i ci = _mm_cvtps_epi32(_mm_mul_ps(c, k255));  // Round to nearest
+            ci = _mm_packs_epi32(ci, ci);
+            ci = _mm_packus_epi16(ci, ci);
+            u32 pixel = (u32)_mm_cvtsi128_si32(ci);
+            memcpy(ctx->out_buffer + idx, &pixel, sizeof(pixel));
+        }
+    }
+}
+
+b32
+cpu_render_to_buffer(Layer* root_layer, CanvasView* view, u8* buffer,
+                     i32 scale, i32 x, i32 y, i32 w, i32 h, f32 background_alpha)
+{
+    PROFILE_SCOPE("cpu render");
+    b32 ok = true;
+    CanvasView export_view = raster_export_view(view, scale, x, y, w, h);
+
+    RasterContext ctx = {};
+    ctx.width = w * scale;
+    ctx.height = h * scale;
+    ctx.out_buffer = buffer;
+
+    size_t num_floats = (size_t)ctx.width * ctx.height * 4;
+    ctx.canvas  = (f32*)mlt_calloc(num_floats, sizeof(f32), "Bitmap");
+    ctx.layer   = (f32*)mlt_calloc(num_floats, sizeof(f32), "Bitmap");
+    ctx.scratch = (f32*)mlt_calloc(num_floats, sizeof(f32), "Bitmap");
+
+    Rect screen = {};
+    screen.right = ctx.width;
+    screen.bottom = ctx.height;
+
+    Rect single_tile = screen;
+    b32 split = false;
+
+    if ( !ctx.canvas || !ctx.layer || !ctx.scratch ) {
+        ok = false;
+        goto END;
+    }
+
+    ctx.num_tiles = rect_split(&ctx.tiles, screen, RASTER_TILE_SIZE, RASTER_TILE_SIZE);
+    split = ctx.num_tiles > 0;
+    if ( !split ) {
+        // Smaller than a tile
+        mlt_assert(ctx.width <= RASTER_TILE_SIZE || ctx.height <= RASTER_TILE_SIZE);
+        if ( ctx.width > RASTER_TILE_SIZE || ctx.height > RASTER_TILE_SIZE ) {
+            // rect_split gives up when one dimension is smaller than a tile. Split into columns ourselves.
+            // (Vertical blur needs tiles no wider than RASTER_TILE_SIZE)
+            DArray<Rect> columns = {};
+            for ( i32 col = 0; col < ctx.width; col += RASTER_TILE_SIZE ) {
+                Rect r = screen;
+                r.left = col;
+                r.right = min(ctx.width, col + RASTER_TILE_SIZE);
+                push(&columns, r);
+            }
+            ctx.tiles = columns.data;
+            ctx.num_tiles = (i32)columns.count;
+            split = true;
+        } else {
+            ctx.tiles = &single_tile;
+            ctx.num_tiles = 1;
+        }
+    }
+
+#if RASTER_HAS_AVX_PATH
+    ctx.use_avx = SDL_HasAVX();
+#endif
+
+    if ( background_alpha != 0.0f ) {
+        ctx.clear_color = { view->background_color.r, view->background_color.g, view->background_color.b, background_alpha };
+    }
+    raster_run_pass(&ctx, raster_tile_clear);
+
+    for ( Layer* l = root_layer; l != NULL; l = l->next ) {
+        if ( !(l->flags & LayerFlags_VISIBLE) ) {
+            continue;
+        }
+
+        raster_prepare_layer(&ctx, l, &export_view);
+        raster_run_pass(&ctx, raster_tile_strokes);
+
+        for ( LayerEffect* e = l->effects; e != NULL; e = e->next ) {
+            if ( !e->enabled || e->type != LayerEffectType_BLUR ) { continue; }
+
+            ctx.kernel_size = (i32)(e->blur.kernel_size * e->blur.original_scale / export_view.scale);
+            ctx.kernel_size = min(RASTER_MAX_KERNEL, ctx.kernel_size);
+            if ( ctx.kernel_size <= 1 ) {
+                continue;
+            }
+            // Three box filter iterations approximate a Gaussian blur
+            for ( int blur_iter = 0; blur_iter < 3; ++blur_iter ) {
+                ctx.blur_in = ctx.layer;
+                ctx.blur_out = ctx.scratch;
+                raster_run_pass(&ctx, raster_tile_blur_vertical);
+                ctx.blur_in = ctx.scratch;
+                ctx.blur_out = ctx.layer;
+                raster_run_pass(&ctx, raster_tile_blur_horizontal);
+            }
+        }
+
+        ctx.layer_alpha = l->alpha;
+        raster_run_pass(&ctx, raster_tile_composite);
+    }
+
+    raster_run_pass(&ctx, raster_tile_resolve);
+
+END:
+    if ( split ) {
+        mlt_free(ctx.tiles, "DArray");
+    }
+    release(&ctx.strokes);
+    release(&ctx.segments);
+    if ( ctx.canvas ) { mlt_free(ctx.canvas, "Bitmap"); }
+    if ( ctx.layer ) { mlt_free(ctx.layer, "Bitmap"); }
+    if ( ctx.scratch ) { mlt_free(ctx.scratch, "Bitmap"); }
+    return ok;
+}
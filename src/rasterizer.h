@@ -0,0 +1,29 @@
+// Copyright (c) 2015 Sergio Gonzalez. All rights reserved.
+// License: https://github.com/serge-rgb/milton#license
+
+// CPU rasterizer
+//
+// Software implementation of the stroke renderer. It follows the same steps as
+// gpu_render_canvas: strokes are drawn with the capsule distance test from
+// stroke_raster.f.glsl, blended with premultiplied alpha onto a per-layer
+// buffer, blurred, and composited onto the canvas with the layer alpha.
+//
+// It does not need an OpenGL context, so it can be used on machines without a
+// display. Output matches gpu_render_to_buffer within a small tolerance. (GL
+// textures are 8 bits per channel and the GL path applies FXAA.)
+
+
+#pragma once
+
+#include "common.h"
+
+struct CanvasView;
+struct Layer;
+
+// Renders the screen rectangle (x, y, w, h) of `view` into `buffer`, scaled up
+// by `scale`. `buffer` must hold (w*scale)*(h*scale) RGBA pixels. Rows are
+// stored top to bottom, like the output of gpu_render_to_buffer.
+//
+// Returns false if there was not enough memory.
+b32 cpu_render_to_buffer(Layer* root_layer, CanvasView* view, u8* buffer,
+                         i32 scale, i32 x, i32 y, i32 w, i32 h, f32 background_alpha);
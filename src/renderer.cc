@@ -5,8 +5,10 @@
 
 #include "color.h"
 #include "gl_helpers.h"
+#include "geometry_cache.h"
 #include "gui.h"
 #include "milton.h"
+#include "persist.h"
 #include "vector.h"
 
 #define MAX_DEPTH_VALUE (1<<20)     // Strokes have MAX_DEPTH_VALUE different z values. 1/i for each i in [1, MAX_DEPTH_VALUE)
@@ -29,6 +31,24 @@
 // render center.
 #define RENDER_CHUNK_SIZE_LOG2 28
 
+// GPU pass timing. Query results are read GPU_TIMER_LATENCY frames after they were issued, so
+// that reading them doesn't stall the pipeline.
+#define GPU_TIMER_LATENCY       4
+#define GPU_TIMER_MAX_QUERIES   256  // Per frame. One for each run of a pass. Frames that need more are not timed.
+
+// Buffer names that DEBUG_gl_validate_buffer can check.
+#define DEBUG_MAX_GL_BUFFERS    100000
+
+struct GpuTimerFrame
+{
+    GLuint  queries[GPU_TIMER_MAX_QUERIES];
+    i32     passes[GPU_TIMER_MAX_QUERIES];  // GpuPass timed by each query.
+    i32     num_queries;
+    b32     incomplete;  // Ran out of queries.
+    i32     frame;       // profiler_frame
+    u64     cpu_start;   // perf_counter when gpu_render began.
+};
+
 struct RenderData
 {
     f32 viewport_limits[2];  // OpenGL limits to the framebuffer size.
@@ -89,15 +109,54 @@ struct RenderData
     v3f background_color;
     i32 scale;  // zoom
 
-    // See MAX_DEPTH_VALUE
+    // See MAX_DEPTH_VALUE. Each stroke that is drawn gets the next one.
     i32 stroke_z;
 
+    // Per-stroke uniforms of stroke_program.
+    GLint stroke_origin_loc;
+    GLint stroke_z_loc;
+
+    GeometryCache* geometry_cache;  // Can be NULL.
+
     // Cached values for stroke rendering uniforms.
     v4f current_color;
     float current_radius;
 
+    i32 gpu_pass;  // GpuPass being drawn, or -1.
+
+    // Eyedropper. See gpu_request_canvas_pixel
+    gl::AsyncRead   pixel_read;
+    v2i             pixel_point;        // Screen point of the last request.
+    b32             pixel_stale;        // The canvas was drawn over pixel_point after the request.
+    u8              pixel[4];           // Read synchronously, without GLHelperFlags_ASYNC_READBACK.
+    b32             pixel_ready;
+
+    // Preview for saves. See gpu_request_canvas_preview
+    GLuint          preview_textures[2];    // Each step of the downsampling reads one and draws to the other.
+    GLuint          preview_fbos[2];
+    i32             preview_texture_w;
+    i32             preview_texture_h;
+    i32             preview_fbo_i;          // The one with the result.
+    i32             preview_w;              // Zero when there is no preview.
+    i32             preview_h;
+    gl::AsyncRead   preview_read;
+
+    RenderStats stats;          // Of the frame being drawn.
+    RenderStats last_stats;     // See gpu_get_stats
+    u64         uniform_updates_start;  // gl::num_uniform_updates when the frame began.
+
+    // Buffers of this context that are alive. Each export worker has its own context, where the
+    // same names mean different buffers.
+    char DEBUG_buffers[DEBUG_MAX_GL_BUFFERS];
+
 #if MILTON_ENABLE_PROFILING
-    u64 clipped_count;
+    u64 cook_time;  // perf_counter time spent cooking, during the last gpu_clip_strokes_and_update.
+
+    GpuTimerFrame   gpu_timer_frames[GPU_TIMER_LATENCY];
+    i32             gpu_timer_frame_i;
+    b32             gpu_timing;     // Inside gpu_render, with timer queries. Exports are not timed.
+    b32             has_gpu_times;
+    u64             gpu_pass_ns[GpuPass_COUNT];  // Of the last frame with results.
 #endif
 };
 
@@ -116,27 +175,35 @@ enum GLVendor
     GLVendor_UNKNOWN,
 };
 
-char DEBUG_g_buffers[100000];
+static void
+DEBUG_gl_mark_buffer(RenderData* render_data, GLuint buffer)
+{
+    mlt_assert(buffer < DEBUG_MAX_GL_BUFFERS);
+    render_data->DEBUG_buffers[buffer] = 1;
+}
 
 static void
-DEBUG_gl_mark_buffer(GLuint buffer)
+DEBUG_gl_unmark_buffer(RenderData* render_data, GLuint buffer)
 {
-    mlt_assert(buffer < 100000);
-    DEBUG_g_buffers[buffer] = 1;
+    mlt_assert(buffer < DEBUG_MAX_GL_BUFFERS);
+    render_data->DEBUG_buffers[buffer] = 0;
 }
 
 static void
-DEBUG_gl_unmark_buffer(GLuint buffer)
+DEBUG_gl_validate_buffer(RenderData* render_data, GLuint buffer)
 {
-    mlt_assert(buffer < 100000);
-    DEBUG_g_buffers[buffer] = 0;
+    mlt_assert(buffer < DEBUG_MAX_GL_BUFFERS);
+    mlt_assert(render_data->DEBUG_buffers[buffer]);
 }
 
+// glBufferData, counted in RenderStats.
 static void
-DEBUG_gl_validate_buffer(GLuint buffer)
+gpu_buffer_data(RenderData* render_data, GLenum target, size_t size, void* data, GLenum usage)
 {
-    mlt_assert(buffer < 100000);
-    mlt_assert(DEBUG_g_buffers[buffer]);
+    glBufferData(target, (GLsizeiptr)size, data, usage);
+    if ( data ) {
+        render_data->stats.bytes_uploaded += (i64)size;
+    }
 }
 
 static void
@@ -272,12 +339,12 @@ gpu_update_picker(RenderData* render_data, ColorPicker* picker)
 
         // Create buffers and upload
         glBindBuffer(GL_ARRAY_BUFFER, render_data->vbo_picker);
-        DEBUG_gl_mark_buffer(render_data->vbo_picker);
-        glBufferData(GL_ARRAY_BUFFER, array_count(data)*sizeof(*data), data, GL_STATIC_DRAW);
+        DEBUG_gl_mark_buffer(render_data, render_data->vbo_picker);
+        gpu_buffer_data(render_data, GL_ARRAY_BUFFER, array_count(data)*sizeof(*data), data, GL_STATIC_DRAW);
 
         glBindBuffer(GL_ARRAY_BUFFER, render_data->vbo_picker_norm);
-        DEBUG_gl_mark_buffer(render_data->vbo_picker_norm);
-        glBufferData(GL_ARRAY_BUFFER, array_count(norm)*sizeof(*norm), norm, GL_STATIC_DRAW);
+        DEBUG_gl_mark_buffer(render_data, render_data->vbo_picker_norm);
+        gpu_buffer_data(render_data, GL_ARRAY_BUFFER, array_count(norm)*sizeof(*norm), norm, GL_STATIC_DRAW);
     }
 }
 
@@ -313,12 +380,12 @@ gpu_update_brush_outline(RenderData* render_data, i32 cx, i32 cy, i32 radius,
     };
 
     glBindBuffer(GL_ARRAY_BUFFER, render_data->vbo_outline_sizes);
-    DEBUG_gl_mark_buffer(render_data->vbo_outline_sizes);
-    glBufferData(GL_ARRAY_BUFFER, array_count(sizes)*sizeof(*sizes), sizes, GL_DYNAMIC_DRAW);
+    DEBUG_gl_mark_buffer(render_data, render_data->vbo_outline_sizes);
+    gpu_buffer_data(render_data, GL_ARRAY_BUFFER, array_count(sizes)*sizeof(*sizes), sizes, GL_DYNAMIC_DRAW);
 
     glBindBuffer(GL_ARRAY_BUFFER, render_data->vbo_outline);
-    DEBUG_gl_mark_buffer(render_data->vbo_outline);
-    glBufferData(GL_ARRAY_BUFFER, array_count(data)*sizeof(*data), data, GL_DYNAMIC_DRAW);
+    DEBUG_gl_mark_buffer(render_data, render_data->vbo_outline);
+    gpu_buffer_data(render_data, GL_ARRAY_BUFFER, array_count(data)*sizeof(*data), data, GL_DYNAMIC_DRAW);
 
     gl::set_uniform_i(render_data->outline_program, "u_radius", radius);
     if ( outline_enum == BrushOutline_FILL ) {
@@ -334,6 +401,15 @@ b32
 gpu_init(RenderData* render_data, CanvasView* view, ColorPicker* picker)
 {
     render_data->stroke_z = MAX_DEPTH_VALUE - 20;
+    render_data->gpu_pass = -1;
+
+#if MILTON_ENABLE_PROFILING
+    if ( gl::check_flags(GLHelperFlags_TIMER_QUERY) ) {
+        for ( i32 i = 0; i < GPU_TIMER_LATENCY; ++i ) {
+            gl::gen_queries(GPU_TIMER_MAX_QUERIES, render_data->gpu_timer_frames[i].queries);
+        }
+    }
+#endif
 
     if ( gl::check_flags(GLHelperFlags_TEXTURE_MULTISAMPLE) ) {
         glEnable(GL_MULTISAMPLE);
@@ -399,8 +475,8 @@ gpu_init(RenderData* render_data, CanvasView* view, ColorPicker* picker)
         GLuint vbo = 0;
         glGenBuffers(1, &vbo);
         glBindBuffer(GL_ARRAY_BUFFER, vbo);
-        DEBUG_gl_mark_buffer(vbo);
-        glBufferData(GL_ARRAY_BUFFER, array_count(quad_data)*sizeof(*quad_data), quad_data, GL_STATIC_DRAW);
+        DEBUG_gl_mark_buffer(render_data, vbo);
+        gpu_buffer_data(render_data, GL_ARRAY_BUFFER, array_count(quad_data)*sizeof(*quad_data), quad_data, GL_STATIC_DRAW);
 
         float u = 1.0f;
         GLfloat uv_data[] = {
@@ -412,8 +488,8 @@ gpu_init(RenderData* render_data, CanvasView* view, ColorPicker* picker)
         GLuint vbo_uv = 0;
         glGenBuffers(1, &vbo_uv);
         glBindBuffer(GL_ARRAY_BUFFER, vbo_uv);
-        DEBUG_gl_mark_buffer(vbo_uv);
-        glBufferData(GL_ARRAY_BUFFER, array_count(uv_data)*sizeof(*uv_data), uv_data, GL_STATIC_DRAW);
+        DEBUG_gl_mark_buffer(render_data, vbo_uv);
+        gpu_buffer_data(render_data, GL_ARRAY_BUFFER, array_count(uv_data)*sizeof(*uv_data), uv_data, GL_STATIC_DRAW);
 
         render_data->vbo_screen_quad = vbo;
 
@@ -453,6 +529,9 @@ gpu_init(RenderData* render_data, CanvasView* view, ColorPicker* picker)
         gl::link_program(render_data->stroke_program, objs, array_count(objs));
 
         gl::set_uniform_i(render_data->stroke_program, "u_canvas", 0);
+
+        render_data->stroke_origin_loc = glGetUniformLocation(render_data->stroke_program, "u_stroke_origin");
+        render_data->stroke_z_loc = glGetUniformLocation(render_data->stroke_program, "u_stroke_z");
     }
 #if STROKE_DEBUG_VIZ
     {  // Stroke debug program
@@ -608,11 +687,18 @@ gpu_init(RenderData* render_data, CanvasView* view, ColorPicker* picker)
     return result;
 }
 
+void
+gpu_set_geometry_cache(RenderData* render_data, GeometryCache* cache)
+{
+    render_data->geometry_cache = cache;
+}
+
 void
 gpu_resize(RenderData* render_data, CanvasView* view)
 {
     render_data->width = view->screen_size.w;
     render_data->height = view->screen_size.h;
+    render_data->pixel_stale = true;
 
     if ( gl::check_flags(GLHelperFlags_TEXTURE_MULTISAMPLE) ) {
         gl::resize_color_texture_multisample(render_data->eraser_texture, render_data->width, render_data->height);
@@ -672,8 +758,8 @@ gpu_update_export_rect(RenderData* render_data, Exporter* exporter)
         normalized_rect[6], normalized_rect[1],
     };
     glBindBuffer(GL_ARRAY_BUFFER, render_data->vbo_exporter[0]);
-    DEBUG_gl_mark_buffer(render_data->vbo_exporter[0]);
-    glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)array_count(top)*sizeof(*top), top, GL_DYNAMIC_DRAW);
+    DEBUG_gl_mark_buffer(render_data, render_data->vbo_exporter[0]);
+    gpu_buffer_data(render_data, GL_ARRAY_BUFFER, array_count(top)*sizeof(*top), top, GL_DYNAMIC_DRAW);
 
     float bottom[] = {
         normalized_rect[0], normalized_rect[3]-line_length,
@@ -682,8 +768,8 @@ gpu_update_export_rect(RenderData* render_data, Exporter* exporter)
         normalized_rect[6], normalized_rect[3]-line_length,
     };
     glBindBuffer(GL_ARRAY_BUFFER, render_data->vbo_exporter[1]);
-    DEBUG_gl_mark_buffer(render_data->vbo_exporter[1]);
-    glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)array_count(bottom)*sizeof(*bottom), bottom, GL_DYNAMIC_DRAW);
+    DEBUG_gl_mark_buffer(render_data, render_data->vbo_exporter[1]);
+    gpu_buffer_data(render_data, GL_ARRAY_BUFFER, array_count(bottom)*sizeof(*bottom), bottom, GL_DYNAMIC_DRAW);
 
     line_length = px / (render_data->width);
 
@@ -694,8 +780,8 @@ gpu_update_export_rect(RenderData* render_data, Exporter* exporter)
         normalized_rect[4], normalized_rect[7],
     };
     glBindBuffer(GL_ARRAY_BUFFER, render_data->vbo_exporter[2]);
-    DEBUG_gl_mark_buffer(render_data->vbo_exporter[2]);
-    glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)array_count(right)*sizeof(*right), right, GL_DYNAMIC_DRAW);
+    DEBUG_gl_mark_buffer(render_data, render_data->vbo_exporter[2]);
+    gpu_buffer_data(render_data, GL_ARRAY_BUFFER, array_count(right)*sizeof(*right), right, GL_DYNAMIC_DRAW);
 
     float left[] = {
         normalized_rect[0], normalized_rect[1],
@@ -704,8 +790,8 @@ gpu_update_export_rect(RenderData* render_data, Exporter* exporter)
         normalized_rect[0]+line_length, normalized_rect[7],
     };
     glBindBuffer(GL_ARRAY_BUFFER, render_data->vbo_exporter[3]);
-    DEBUG_gl_mark_buffer(render_data->vbo_exporter[3]);
-    glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)array_count(left)*sizeof(*left), left, GL_DYNAMIC_DRAW);
+    DEBUG_gl_mark_buffer(render_data, render_data->vbo_exporter[3]);
+    gpu_buffer_data(render_data, GL_ARRAY_BUFFER, array_count(left)*sizeof(*left), left, GL_DYNAMIC_DRAW);
 }
 
 void
@@ -723,24 +809,6 @@ gpu_get_viewport_limits(RenderData* render_data, float* out_viewport_limits)
     }
 }
 
-i32
-gpu_get_num_clipped_strokes(Layer* root_layer)
-{
-    i32 count = 0;
-    #if MILTON_ENABLE_PROFILING
-    for ( Layer* l = root_layer; l != NULL; l = l->next ) {
-        StrokeList strokes = l->strokes;
-        for ( i64 si = 0; si < strokes.count; ++si ) {
-            Stroke* s = strokes[si];
-            if ( s->render_element.vbo_stroke != 0 ) {
-                ++count;
-            }
-        }
-    }
-    #endif
-    return count;
-}
-
 static void
 set_screen_size(RenderData* render_data, float* fscreen)
 {
@@ -774,9 +842,9 @@ gpu_update_canvas(RenderData* render_data, CanvasState* canvas, CanvasView* view
     v2l pan = view->pan_center;
     v2i new_render_center = VEC2I(pan / (i64)(1<<RENDER_CHUNK_SIZE_LOG2));
     if ( new_render_center != render_data->render_center ) {
-        milton_log("Moving to new render center. %d, %d Clearing render data.\n", new_render_center.x, new_render_center.y);
+        // Stroke vertices are relative to each stroke. Only the uniforms change.
+        milton_log("Moving to new render center. %d, %d\n", new_render_center.x, new_render_center.y);
         render_data->render_center = new_render_center;
-        gpu_free_strokes(render_data, canvas);
     }
     gl::set_uniform_vec2i(render_data->stroke_program, "u_pan_center", 1, relative_to_render_center(render_data, pan).d);
     gl::set_uniform_vec2i(render_data->stroke_program, "u_zoom_center", 1, center.d);
@@ -787,220 +855,166 @@ gpu_update_canvas(RenderData* render_data, CanvasState* canvas, CanvasView* view
     set_screen_size(render_data, fscreen);
 }
 
-void
-gpu_cook_stroke(Arena* arena, RenderData* render_data, Stroke* stroke, CookStrokeOpt cook_option)
+// Bytes of the vertex and index buffers of a stroke.
+static i64
+stroke_buffer_bytes(i64 count_indices)
 {
-    render_data->stroke_z = (render_data->stroke_z + 1) % (MAX_DEPTH_VALUE-1);
-    const i32 stroke_z = render_data->stroke_z + 1;
+    i64 num_segments = count_indices / 6;
+    return num_segments * (i64)(4*sizeof(v2f) + 8*sizeof(v3f) + 6*sizeof(u16));
+}
 
+// Stroke buffers were created or deleted.
+static void
+gpu_resident_bytes(RenderData* render_data, i64 delta)
+{
+    render_data->stats.gpu_bytes += delta;
+    memory_telemetry_gpu_bytes(delta);
+}
+
+void
+gpu_cook_stroke(RenderData* render_data, Stroke* stroke, CookStrokeOpt cook_option)
+{
     if ( cook_option == CookStroke_NEW && stroke->render_element.vbo_stroke != 0 ) {
         // We already have our data cooked
         mlt_assert(stroke->render_element.vbo_pointa != 0);
         mlt_assert(stroke->render_element.vbo_pointb != 0);
-    } else {
-        auto npoints = stroke->num_points;
-        if ( npoints == 1 ) {
-            // Create a 2-point stroke and recurse
-            Stroke duplicate = *stroke;
-            duplicate.num_points = 2;
-            Arena scratch_arena = arena_push(arena);
-            duplicate.points = arena_alloc_array(&scratch_arena, 2, v2l);
-            duplicate.pressures = arena_alloc_array(&scratch_arena, 2, f32);
-            duplicate.points[0] = stroke->points[0];  // It will be set relative to the center in the recursed call.
-            duplicate.points[1] = stroke->points[0];
-            duplicate.pressures[0] = stroke->pressures[0];
-            duplicate.pressures[1] = stroke->pressures[0];
-
-            gpu_cook_stroke(&scratch_arena, render_data, &duplicate, cook_option);
-
-            // Copy render element to stroke
-            stroke->render_element = duplicate.render_element;
-
-            arena_pop(&scratch_arena);
-        }
-        else if ( npoints > 1 ) {
-            // 3 (triangle) *
-            // 2 (two per segment) *
-            // N-1 (segments per stroke)
-            // Reduced to 4 by using indices
-            const size_t count_attribs = 4*((size_t)npoints-1);
-
-            // 6 (3 * 2 from count_attribs)
-            // N-1 (num segments)
-            const size_t count_indices = 6*((size_t)npoints-1);
-
-            size_t count_debug = 0;
-#if STROKE_DEBUG_VIZ
-            count_debug = count_attribs;
-#endif
-            v3f* bounds;
-            v3f* apoints;
-            v3f* bpoints;
-            v3f* debug = NULL;
-            u16* indices;
-            Arena scratch_arena = arena_push(arena,
-                                             count_attribs*sizeof(decltype(*bounds))  // Bounds
-                                             + 2*count_attribs*sizeof(decltype(*apoints)) // Attributes a,b
-                                             + count_debug*sizeof(decltype(*debug))    // Visualization
-                                             + count_indices*sizeof(decltype(*indices)));  // Indices
-
-            bounds  = arena_alloc_array(&scratch_arena, count_attribs, v3f);
-            apoints = arena_alloc_array(&scratch_arena, count_attribs, v3f);
-            bpoints = arena_alloc_array(&scratch_arena, count_attribs, v3f);
-            indices = arena_alloc_array(&scratch_arena, count_indices, u16);
-#if STROKE_DEBUG_VIZ
-            debug = arena_alloc_array(&scratch_arena, count_debug, v3f);
+    } else if ( stroke->num_points > 0 ) {
+#if MILTON_ENABLE_PROFILING
+        u64 cook_start = perf_counter();
 #endif
+        render_data->stats.strokes_cooked += 1;
+        const i64 num_segments = stroke_geometry_num_segments(stroke);
 
-            mlt_assert(render_data->scale > 0);
-
-            size_t bounds_i = 0;
-            size_t apoints_i = 0;
-            size_t bpoints_i = 0;
-            size_t indices_i = 0;
-            size_t debug_i = 0;
-            for ( i64 i=0; i < npoints-1; ++i ) {
-                v2i point_i = relative_to_render_center(render_data, stroke->points[i]);
-                v2i point_j = relative_to_render_center(render_data, stroke->points[i+1]);
-
-                Brush brush = stroke->brush;
-                float radius_i = stroke->pressures[i]*brush.radius;
-                float radius_j = stroke->pressures[i+1]*brush.radius;
-
-                i32 min_x = min(point_i.x-radius_i, point_j.x-radius_j);
-                i32 min_y = min(point_i.y-radius_i, point_j.y-radius_j);
-
-                i32 max_x = max(point_i.x+radius_i, point_j.x+radius_j);
-                i32 max_y = max(point_i.y+radius_i, point_j.y+radius_j);
-
-                // Bounding geometry and attributes
-
-                mlt_assert (bounds_i < ((1<<16)-4));
-                u16 idx = (u16)bounds_i;
-
-                bounds[bounds_i++] = { (float)min_x, (float)min_y, (float)stroke_z };
-                bounds[bounds_i++] = { (float)min_x, (float)max_y, (float)stroke_z };
-                bounds[bounds_i++] = { (float)max_x, (float)max_y, (float)stroke_z };
-                bounds[bounds_i++]   = { (float)max_x, (float)min_y, (float)stroke_z };
-
-                indices[indices_i++] = (u16)(idx + 0);
-                indices[indices_i++] = (u16)(idx + 1);
-                indices[indices_i++] = (u16)(idx + 2);
-
-                indices[indices_i++] = (u16)(idx + 2);
-                indices[indices_i++] = (u16)(idx + 0);
-                indices[indices_i++] = (u16)(idx + 3);
-
-
-                // Pressures are in (0,1] but we need to encode them as integers.
-                float pressure_a = stroke->pressures[i];
-                float pressure_b = stroke->pressures[i+1];
+        // 4 vertices per segment, reduced from 6 by using indices.
+        const size_t count_attribs = 4*(size_t)num_segments;
+        const size_t count_indices = 6*(size_t)num_segments;
 
+        size_t count_debug = 0;
 #if STROKE_DEBUG_VIZ
-                v3f debug_color;
-
-                if ( stroke->debug_flags[i] & Stroke::INTERPOLATED ) {
-                  debug_color = { 1.0f, 0.0f, 0.0f };
-                }
-                else {
-                  debug_color = { 0.0f, 1.0f, 0.0f };
-                }
+        count_debug = count_attribs;
 #endif
-
-                // Add attributes for each new vertex.
-                for ( int repeat = 0; repeat < 4; ++repeat ) {
-                    apoints[apoints_i++] = { (float)point_i.x, (float)point_i.y, pressure_a };
-                    bpoints[bpoints_i++] = { (float)point_j.x, (float)point_j.y, pressure_b };
+        StrokeGeometry geometry = {};
+        v3f* debug = NULL;
+
+        // Uploaded to the GPU before returning.
+        ArenaMark scratch = arena_scratch_begin();
+        geometry.bounds  = arena_alloc_array(scratch.arena, count_attribs, v2f);
+        geometry.apoints = arena_alloc_array(scratch.arena, count_attribs, v3f);
+        geometry.bpoints = arena_alloc_array(scratch.arena, count_attribs, v3f);
+        geometry.indices = arena_alloc_array(scratch.arena, count_indices, u16);
+
+        // The working stroke changes every frame. Don't count it as a miss.
+        b32 cached =    cook_option == CookStroke_NEW
+                     && geometry_cache_find(render_data->geometry_cache, stroke, &geometry);
+        if ( !cached ) {
+            stroke_geometry_fill(stroke, &geometry);
+        }
+        mlt_assert(geometry.num_vertices == (i64)count_attribs);
+        mlt_assert(geometry.num_indices == (i64)count_indices);
+        mlt_assert(count_attribs <= (1<<16));
 
 #if STROKE_DEBUG_VIZ
-                    debug[debug_i++] = debug_color;
-#endif
-                }
-            }
+        debug = arena_alloc_array(scratch.arena, count_debug, v3f);
+        for ( i64 i = 0; i < num_segments; ++i ) {
+            v3f debug_color;
 
-            mlt_assert(bounds_i == count_attribs);
-            mlt_assert(apoints_i == bpoints_i);
-            mlt_assert(apoints_i == bounds_i);
+            if ( stroke->debug_flags[i] & Stroke::INTERPOLATED ) {
+              debug_color = { 1.0f, 0.0f, 0.0f };
+            }
+            else {
+              debug_color = { 0.0f, 1.0f, 0.0f };
+            }
+            for ( int repeat = 0; repeat < 4; ++repeat ) {
+                debug[4*i + repeat] = debug_color;
+            }
+        }
+#endif
 
-            // TODO: check for GL_OUT_OF_MEMORY
+        // TODO: check for GL_OUT_OF_MEMORY
 
-            GLuint vbo_stroke = 0;
-            GLuint vbo_pointa = 0;
-            GLuint vbo_pointb = 0;
-            GLuint indices_buffer = 0;
-            GLuint vbo_debug = 0;
+        GLuint vbo_stroke = 0;
+        GLuint vbo_pointa = 0;
+        GLuint vbo_pointb = 0;
+        GLuint indices_buffer = 0;
+        GLuint vbo_debug = 0;
 
 
-            GLenum hint = GL_STATIC_DRAW;
-            if ( cook_option == CookStroke_UPDATE_WORKING_STROKE ) {
-                hint = GL_DYNAMIC_DRAW;
-            }
-            if ( stroke->render_element.vbo_stroke != 0 ) {
-                vbo_stroke = stroke->render_element.vbo_stroke;
-                vbo_pointa = stroke->render_element.vbo_pointa;
-                vbo_pointb = stroke->render_element.vbo_pointb;
-                indices_buffer = stroke->render_element.indices;
+        GLenum hint = GL_STATIC_DRAW;
+        if ( cook_option == CookStroke_UPDATE_WORKING_STROKE ) {
+            hint = GL_DYNAMIC_DRAW;
+        }
+        if ( stroke->render_element.vbo_stroke != 0 ) {
+            vbo_stroke = stroke->render_element.vbo_stroke;
+            vbo_pointa = stroke->render_element.vbo_pointa;
+            vbo_pointb = stroke->render_element.vbo_pointb;
+            indices_buffer = stroke->render_element.indices;
 #if STROKE_DEBUG_VIZ
-                vbo_debug = stroke->render_element.vbo_debug;
+            vbo_debug = stroke->render_element.vbo_debug;
 #endif
 
-                auto clear_array_buffer = [hint](GLint vbo, size_t size) {
-                  glBindBuffer(GL_ARRAY_BUFFER, vbo);
-                  glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)(size), NULL, hint);
-                };
-                clear_array_buffer(vbo_stroke, bounds_i*sizeof(decltype(*bounds)));
-                clear_array_buffer(vbo_pointa, bounds_i*sizeof(decltype(*apoints)));
-                clear_array_buffer(vbo_pointb, bounds_i*sizeof(decltype(*bpoints)));
-                clear_array_buffer(indices_buffer, indices_i*sizeof(decltype(*indices)));
-            }
-            else {
-                glGenBuffers(1, &vbo_stroke);
-                glGenBuffers(1, &vbo_pointa);
-                glGenBuffers(1, &vbo_pointb);
-                glGenBuffers(1, &indices_buffer);
+            auto clear_array_buffer = [hint, render_data](GLint vbo, size_t size) {
+              glBindBuffer(GL_ARRAY_BUFFER, vbo);
+              gpu_buffer_data(render_data, GL_ARRAY_BUFFER, size, NULL, hint);
+            };
+            clear_array_buffer(vbo_stroke, count_attribs*sizeof(v2f));
+            clear_array_buffer(vbo_pointa, count_attribs*sizeof(v3f));
+            clear_array_buffer(vbo_pointb, count_attribs*sizeof(v3f));
+            clear_array_buffer(indices_buffer, count_indices*sizeof(u16));
+            gpu_resident_bytes(render_data, -stroke_buffer_bytes(stroke->render_element.count));
+        }
+        else {
+            glGenBuffers(1, &vbo_stroke);
+            glGenBuffers(1, &vbo_pointa);
+            glGenBuffers(1, &vbo_pointb);
+            glGenBuffers(1, &indices_buffer);
 #if STROKE_DEBUG_VIZ
-                glGenBuffers(1, &vbo_debug);
+            glGenBuffers(1, &vbo_debug);
 #endif
 
-                DEBUG_gl_mark_buffer(vbo_stroke);
-                DEBUG_gl_mark_buffer(vbo_pointa);
-                DEBUG_gl_mark_buffer(vbo_pointb);
-                DEBUG_gl_mark_buffer(indices_buffer);
-            }
+            DEBUG_gl_mark_buffer(render_data, vbo_stroke);
+            DEBUG_gl_mark_buffer(render_data, vbo_pointa);
+            DEBUG_gl_mark_buffer(render_data, vbo_pointb);
+            DEBUG_gl_mark_buffer(render_data, indices_buffer);
+            render_data->stats.gpu_strokes += 1;
+        }
 
-            /*Send data to GPU*/ {
-                auto send_buffer_data = [hint](GLint vbo, size_t size, void* data) {
-                  glBindBuffer(GL_ARRAY_BUFFER, vbo);
-                  glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)(size), data, hint);
-                };
+        /*Send data to GPU*/ {
+            auto send_buffer_data = [hint, render_data](GLint vbo, size_t size, void* data) {
+              glBindBuffer(GL_ARRAY_BUFFER, vbo);
+              gpu_buffer_data(render_data, GL_ARRAY_BUFFER, size, data, hint);
+            };
 
-                send_buffer_data(vbo_stroke, bounds_i*sizeof(decltype(*bounds)), bounds);
-                send_buffer_data(vbo_pointa, bounds_i*sizeof(decltype(*apoints)), apoints);
-                send_buffer_data(vbo_pointb, bounds_i*sizeof(decltype(*bpoints)), bpoints);
-                send_buffer_data(indices_buffer, indices_i*sizeof(decltype(*indices)), indices);
+            send_buffer_data(vbo_stroke, count_attribs*sizeof(v2f), geometry.bounds);
+            send_buffer_data(vbo_pointa, count_attribs*sizeof(v3f), geometry.apoints);
+            send_buffer_data(vbo_pointb, count_attribs*sizeof(v3f), geometry.bpoints);
+            send_buffer_data(indices_buffer, count_indices*sizeof(u16), geometry.indices);
 #if STROKE_DEBUG_VIZ
-                send_buffer_data(vbo_debug, debug_i*sizeof(decltype(*debug)), debug);
+            send_buffer_data(vbo_debug, count_debug*sizeof(v3f), debug);
+#endif
+            gpu_resident_bytes(render_data, stroke_buffer_bytes((i64)count_indices));
+        }
+#if MILTON_ENABLE_PROFILING
+        render_data->cook_time += perf_counter() - cook_start;
 #endif
-            }
 
-            RenderElement re = stroke->render_element;
-            re.vbo_stroke = vbo_stroke;
-            re.vbo_pointa = vbo_pointa;
-            re.vbo_pointb = vbo_pointb;
-            re.indices = indices_buffer;
+        RenderElement re = stroke->render_element;
+        re.vbo_stroke = vbo_stroke;
+        re.vbo_pointa = vbo_pointa;
+        re.vbo_pointb = vbo_pointb;
+        re.indices = indices_buffer;
 #if STROKE_DEBUG_VIZ
-            re.vbo_debug = vbo_debug;
+        re.vbo_debug = vbo_debug;
 #endif
-            re.count = (i64)(indices_i);
-            re.color = { stroke->brush.color.r, stroke->brush.color.g, stroke->brush.color.b, stroke->brush.color.a };
-            re.radius = stroke->brush.radius;
+        re.count = (i64)(count_indices);
+        re.color = { stroke->brush.color.r, stroke->brush.color.g, stroke->brush.color.b, stroke->brush.color.a };
+        re.radius = stroke->brush.radius;
+        re.origin = geometry.origin;
 
-            mlt_assert(re.count > 1);
+        mlt_assert(re.count > 1);
 
-            stroke->render_element = re;
+        stroke->render_element = re;
 
-            arena_pop(&scratch_arena);
-        }
+        arena_scratch_end(scratch);
     }
 }
 
@@ -1015,26 +1029,46 @@ gpu_free_strokes(Stroke* strokes, i64 count, RenderData* render_data)
             mlt_assert(re->vbo_pointb != 0);
             mlt_assert(re->indices != 0);
 
-            DEBUG_gl_validate_buffer(re->vbo_stroke);
-            DEBUG_gl_validate_buffer(re->vbo_pointa);
-            DEBUG_gl_validate_buffer(re->vbo_pointb);
-            DEBUG_gl_validate_buffer(re->indices);
+            DEBUG_gl_validate_buffer(render_data, re->vbo_stroke);
+            DEBUG_gl_validate_buffer(render_data, re->vbo_pointa);
+            DEBUG_gl_validate_buffer(render_data, re->vbo_pointb);
+            DEBUG_gl_validate_buffer(render_data, re->indices);
 
             glDeleteBuffers(1, &re->vbo_stroke);
             glDeleteBuffers(1, &re->vbo_pointa);
             glDeleteBuffers(1, &re->vbo_pointb);
             glDeleteBuffers(1, &re->indices);
 
-            DEBUG_gl_unmark_buffer(re->vbo_stroke);
-            DEBUG_gl_unmark_buffer(re->vbo_pointa);
-            DEBUG_gl_unmark_buffer(re->vbo_pointb);
-            DEBUG_gl_unmark_buffer(re->indices);
+            DEBUG_gl_unmark_buffer(render_data, re->vbo_stroke);
+            DEBUG_gl_unmark_buffer(render_data, re->vbo_pointa);
+            DEBUG_gl_unmark_buffer(render_data, re->vbo_pointb);
+            DEBUG_gl_unmark_buffer(render_data, re->indices);
 
+            gpu_resident_bytes(render_data, -stroke_buffer_bytes(re->count));
+            render_data->stats.gpu_strokes -= 1;
             *re = {};
         }
     }
 }
 
+void
+gpu_free_layer_strokes(RenderData* render_data, Layer* layer)
+{
+    StrokeList* sl = &layer->strokes;
+    StrokeBucket* bucket = &sl->root;
+    i64 count = sl->count;
+    while ( bucket ) {
+        if ( count >= STROKELIST_BUCKET_COUNT ) {
+            count -= STROKELIST_BUCKET_COUNT;
+            gpu_free_strokes(bucket->data, STROKELIST_BUCKET_COUNT, render_data);
+        } else {
+            gpu_free_strokes(bucket->data, count, render_data);
+            count = 0;
+        }
+        bucket = bucket->next;
+    }
+}
+
 void
 gpu_free_strokes(RenderData* render_data, CanvasState* canvas)
 {
@@ -1042,29 +1076,18 @@ gpu_free_strokes(RenderData* render_data, CanvasState* canvas)
         for ( Layer* l = canvas->root_layer;
               l != NULL;
               l = l->next ) {
-            StrokeList* sl = &l->strokes;
-            StrokeBucket* bucket = &sl->root;
-            i64 count = sl->count;
-            while ( bucket ) {
-                if ( count >= STROKELIST_BUCKET_COUNT ) {
-                    count -= STROKELIST_BUCKET_COUNT;
-                    gpu_free_strokes(bucket->data, STROKELIST_BUCKET_COUNT, render_data);
-                } else {
-                    gpu_free_strokes(bucket->data, count, render_data);
-                }
-                bucket = bucket->next;
-            }
+            gpu_free_layer_strokes(render_data, l);
         }
     }
 }
 
 void
-gpu_clip_strokes_and_update(Arena* arena,
-                            RenderData* render_data,
+gpu_clip_strokes_and_update(RenderData* render_data,
                             CanvasView* view,
                             Layer* root_layer, Stroke* working_stroke,
                             i32 x, i32 y, i32 w, i32 h, ClipFlags flags)
 {
+    PROFILE_SCOPE("clip");
     DArray<RenderElement>* clip_array = &render_data->clip_array;
 
     RenderElement layer_element = {};
@@ -1080,7 +1103,7 @@ gpu_clip_strokes_and_update(Arena* arena,
     reset(clip_array);
     #if MILTON_ENABLE_PROFILING
     {
-        render_data->clipped_count = 0;
+        render_data->cook_time = 0;
     }
     #endif
     for ( Layer* l = root_layer;
@@ -1106,6 +1129,9 @@ gpu_clip_strokes_and_update(Arena* arena,
             } else {
                 count = l->strokes.count % STROKELIST_BUCKET_COUNT;
             }
+            // Buckets still being loaded are drawn once milton_load_poll sees them.
+            b32 bucket_loading = SDL_AtomicGet(&bucket->loading) != 0;
+
             Rect bbox = bucket->bounding_rect;
             bbox.top_left = canvas_to_raster(view, bbox.top_left);
             bbox.bot_right = canvas_to_raster(view, bbox.bot_right);
@@ -1115,7 +1141,10 @@ gpu_clip_strokes_and_update(Arena* arena,
                                 || screen_bounds.right  < bbox.left
                                 || screen_bounds.bottom < bbox.top;
 
-            if ( !bucket_outside ) {
+            // Buckets whose points could not be read back are skipped, like the ones still loading.
+            b32 bucket_ready = !bucket_loading && !bucket_outside && stroke_pager_touch(l->strokes.pager, bucket);
+
+            if ( bucket_ready ) {
                 for ( i64 i = 0; i < count; ++i ) {
                     Stroke* s = &bucket->data[i];
 
@@ -1126,13 +1155,15 @@ gpu_clip_strokes_and_update(Arena* arena,
 
                         b32 is_outside = bounds.left > (x+w) || bounds.right < x
                                 || bounds.top > (y+h) || bounds.bottom < y;
+                        render_data->stats.strokes_tested += 1;
 
                         i32 area = (bounds.right-bounds.left) * (bounds.bottom-bounds.top);
                         // Area might be 0 if the stroke is smaller than
                         // a pixel. We don't draw it in that case.
                         if ( !is_outside && area!=0 ) {
-                            gpu_cook_stroke(arena, render_data, s);
+                            gpu_cook_stroke(render_data, s);
                             push(clip_array, s->render_element);
+                            render_data->stats.strokes_clipped += 1;
                         }
                         else if ( is_outside && ( flags & ClipFlags_UPDATE_GPU_DATA ) ) {
                             // If it is far away, delete.
@@ -1148,19 +1179,9 @@ gpu_clip_strokes_and_update(Arena* arena,
                     }
                 }
             }
-            else if ( flags & ClipFlags_UPDATE_GPU_DATA ) {
+            else if ( !bucket_loading && bucket_outside && (flags & ClipFlags_UPDATE_GPU_DATA) ) {
                 gpu_free_strokes(bucket->data, count, render_data);
             }
-            #if MILTON_ENABLE_PROFILING
-            {
-                for ( i64 i = 0; i < count; ++i ) {
-                    Stroke* s = &bucket->data[i];
-                    if ( s->render_element.vbo_stroke != 0 ) {
-                        render_data->clipped_count++;
-                    }
-                }
-            }
-            #endif
             bucket = bucket->next;
             bucket_i += 1;
         }
@@ -1168,9 +1189,10 @@ gpu_clip_strokes_and_update(Arena* arena,
         // Add the working stroke on the current layer.
         if ( working_stroke->layer_id == l->id ) {
             if ( working_stroke->num_points > 0 ) {
-                gpu_cook_stroke(arena, render_data, working_stroke, CookStroke_UPDATE_WORKING_STROKE);
+                gpu_cook_stroke(render_data, working_stroke, CookStroke_UPDATE_WORKING_STROKE);
 
                 push(clip_array, working_stroke->render_element);
+                render_data->stats.strokes_clipped += 1;
             }
         }
 
@@ -1178,6 +1200,191 @@ gpu_clip_strokes_and_update(Arena* arena,
         p->layer_alpha = l->alpha;
         p->effects = l->effects;
     }
+
+#if MILTON_ENABLE_PROFILING
+    // One event for all the strokes, which can be thousands after a zoom. The number of them is
+    // the "strokes cooked" counter of the frame.
+    if ( render_data->cook_time > 0 ) {
+        profiler_record("cook", perf_counter() - render_data->cook_time);
+    }
+#endif
+}
+
+static const char* g_gpu_pass_names[GpuPass_COUNT] =
+{
+    "clear",
+    "strokes",
+    "blur",
+    "composite",
+    "postprocess",
+    "overlays",
+};
+
+const char*
+gpu_pass_name(i32 pass)
+{
+    mlt_assert(pass >= 0 && pass < GpuPass_COUNT);
+    return g_gpu_pass_names[pass];
+}
+
+// Ends the pass being drawn, if there is one.
+static void
+gpu_pass_end(RenderData* render_data)
+{
+    if ( render_data->gpu_pass >= 0 ) {
+#if MILTON_ENABLE_PROFILING
+        if ( render_data->gpu_timing ) {
+            gl::end_time_elapsed();
+        }
+#endif
+        gl::pop_debug_group();
+        render_data->gpu_pass = -1;
+    }
+}
+
+// Ends the pass being drawn and begins `pass`. Does nothing if `pass` is being drawn already.
+static void
+gpu_pass_begin(RenderData* render_data, GpuPass pass)
+{
+    if ( render_data->gpu_pass != pass ) {
+        gpu_pass_end(render_data);
+        gl::push_debug_group(g_gpu_pass_names[pass]);
+#if MILTON_ENABLE_PROFILING
+        if ( render_data->gpu_timing ) {
+            GpuTimerFrame* f = &render_data->gpu_timer_frames[render_data->gpu_timer_frame_i];
+            if ( f->num_queries < GPU_TIMER_MAX_QUERIES ) {
+                f->passes[f->num_queries] = pass;
+                gl::begin_time_elapsed(f->queries[f->num_queries++]);
+            }
+            else {
+                f->incomplete = true;
+                render_data->gpu_timing = false;
+            }
+        }
+#endif
+        render_data->gpu_pass = pass;
+    }
+}
+
+#if MILTON_ENABLE_PROFILING
+// Reads the queries of the frame that last used this set, and starts timing a new frame.
+static void
+gpu_timers_begin_frame(RenderData* render_data)
+{
+    if ( gl::check_flags(GLHelperFlags_TIMER_QUERY) ) {
+        GpuTimerFrame* f = &render_data->gpu_timer_frames[render_data->gpu_timer_frame_i];
+
+        if ( f->num_queries > 0 && !f->incomplete ) {
+            // Queries finish in order. If the last one is done, all of them are.
+            u64 ns[GPU_TIMER_MAX_QUERIES];
+            b32 ready = true;
+            for ( i32 i = f->num_queries - 1; ready && i >= 0; --i ) {
+                ready = gl::time_elapsed_result(f->queries[i], &ns[i]);
+            }
+            if ( ready ) {
+                // We only know how long each pass took, so the events are laid end to end from
+                // the time the frame was submitted.
+                u64 frequency = perf_counter_frequency();
+                u64 cursor = f->cpu_start;
+                u64 pass_ns[GpuPass_COUNT] = {};
+                for ( i32 i = 0; i < f->num_queries; ++i ) {
+                    u64 duration = ns[i] * frequency / 1000000000;
+                    profiler_record_gpu(g_gpu_pass_names[f->passes[i]], cursor, cursor + duration, f->frame);
+                    cursor += duration;
+                    pass_ns[f->passes[i]] += ns[i];
+                }
+                memcpy(render_data->gpu_pass_ns, pass_ns, sizeof(pass_ns));
+                render_data->has_gpu_times = true;
+            }
+        }
+
+        f->num_queries = 0;
+        f->incomplete = false;
+        f->frame = profiler_frame();
+        f->cpu_start = perf_counter();
+        render_data->gpu_timing = true;
+    }
+}
+
+static void
+gpu_timers_end_frame(RenderData* render_data)
+{
+    if ( gl::check_flags(GLHelperFlags_TIMER_QUERY) ) {
+        render_data->gpu_timing = false;
+        render_data->gpu_timer_frame_i = (render_data->gpu_timer_frame_i + 1) % GPU_TIMER_LATENCY;
+    }
+}
+#endif
+
+// Adds the uniform updates since the last call to the stats of the frame.
+static void
+gpu_stats_count_uniforms(RenderData* render_data)
+{
+    u64 uniform_updates = gl::num_uniform_updates();
+    render_data->stats.uniform_updates += (i64)(uniform_updates - render_data->uniform_updates_start);
+    render_data->uniform_updates_start = uniform_updates;
+}
+
+static void
+gpu_stats_end_frame(RenderData* render_data)
+{
+    RenderStats* stats = &render_data->stats;
+    gpu_stats_count_uniforms(render_data);
+
+    render_data->last_stats = *stats;
+
+    RenderStats next = {};
+    next.gpu_strokes = stats->gpu_strokes;
+    next.gpu_bytes = stats->gpu_bytes;
+    *stats = next;
+}
+
+void
+gpu_get_stats(RenderData* render_data, RenderStats* out_stats)
+{
+    *out_stats = render_data->last_stats;
+}
+
+b32
+gpu_write_stats_json(RenderStats* stats, FILE* fd)
+{
+    fprintf(fd, "{\n");
+    fprintf(fd, "  \"strokes_tested\": %" PRIi64 ",\n", stats->strokes_tested);
+    fprintf(fd, "  \"strokes_clipped\": %" PRIi64 ",\n", stats->strokes_clipped);
+    fprintf(fd, "  \"strokes_cooked\": %" PRIi64 ",\n", stats->strokes_cooked);
+    fprintf(fd, "  \"bytes_uploaded\": %" PRIi64 ",\n", stats->bytes_uploaded);
+    fprintf(fd, "  \"draw_calls\": %" PRIi64 ",\n", stats->draw_calls);
+    fprintf(fd, "  \"uniform_updates\": %" PRIi64 ",\n", stats->uniform_updates);
+    fprintf(fd, "  \"fullscreen_passes\": %" PRIi64 ",\n", stats->fullscreen_passes);
+    fprintf(fd, "  \"layers_composited\": %" PRIi64 ",\n", stats->layers_composited);
+    fprintf(fd, "  \"blur_passes\": %" PRIi64 ",\n", stats->blur_passes);
+    fprintf(fd, "  \"gpu_strokes\": %" PRIi64 ",\n", stats->gpu_strokes);
+    fprintf(fd, "  \"gpu_bytes\": %" PRIi64 "\n", stats->gpu_bytes);
+    int written = fprintf(fd, "}\n");
+    return written > 0 && !ferror(fd);
+}
+
+u64
+gpu_get_cook_time(RenderData* render_data)
+{
+    u64 result = 0;
+#if MILTON_ENABLE_PROFILING
+    result = render_data->cook_time;
+#endif
+    return result;
+}
+
+b32
+gpu_get_pass_times(RenderData* render_data, u64* out_ns)
+{
+    b32 result = false;
+#if MILTON_ENABLE_PROFILING
+    if ( render_data->has_gpu_times ) {
+        memcpy(out_ns, render_data->gpu_pass_ns, sizeof(render_data->gpu_pass_ns));
+        result = true;
+    }
+#endif
+    return result;
 }
 
 static void
@@ -1195,6 +1402,8 @@ gpu_fill_with_texture(RenderData* render_data, float alpha = 1.0f)
                                   /*size*/ 2, GL_FLOAT, /*normalize*/ GL_FALSE,
                                   /*stride*/ 0, /*ptr*/ 0);
             glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+            ++render_data->stats.draw_calls;
+            ++render_data->stats.fullscreen_passes;
         }
     }
 }
@@ -1219,6 +1428,9 @@ box_filter_pass(RenderData* render_data, int kernel_size, int direction)
                                   /*size*/ 2, GL_FLOAT, /*normalize*/ GL_FALSE,
                                   /*stride*/ 0, /*ptr*/ 0);
             glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+            ++render_data->stats.draw_calls;
+            ++render_data->stats.fullscreen_passes;
+            ++render_data->stats.blur_passes;
         }
     }
 }
@@ -1233,6 +1445,10 @@ gpu_render_canvas(RenderData* render_data, i32 view_x, i32 view_y,
     i32 w = view_width;
     i32 h = view_height;
     glScissor(x, y, w, h);
+    v2i p = render_data->pixel_point;
+    if ( p.x >= view_x && p.x < view_x + view_width && p.y >= view_y && p.y < view_y + view_height ) {
+        render_data->pixel_stale = true;
+    }
 
     glClearDepth(0.0f);
 
@@ -1255,6 +1471,8 @@ gpu_render_canvas(RenderData* render_data, i32 view_x, i32 view_y,
         glClearColor(0,0,0,0);
     }
 
+    gpu_pass_begin(render_data, GpuPass_CLEAR);
+
     glBindTexture(texture_target, render_data->eraser_texture);
 
     glFramebufferTexture2DEXT(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, texture_target,
@@ -1310,6 +1528,7 @@ gpu_render_canvas(RenderData* render_data, i32 view_x, i32 view_y,
                         if ( e->enabled == false ) { continue; }
 
                         if ( (render_data->flags & RenderDataFlags_WITH_BLUR) && e->type == LayerEffectType_BLUR ) {
+                            gpu_pass_begin(render_data, GpuPass_BLUR);
                             glBindTexture(texture_target, in_texture);
                             glFramebufferTexture2DEXT(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
                                                       texture_target, out_texture, 0);
@@ -1345,6 +1564,9 @@ gpu_render_canvas(RenderData* render_data, i32 view_x, i32 view_y,
                     glEnable(GL_DEPTH_TEST);
                 }
 
+                gpu_pass_begin(render_data, GpuPass_COMPOSITE);
+                render_data->stats.layers_composited += 1;
+
                 // Blit layer contents to canvas_texture
                 {
                     glFramebufferTexture2DEXT(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
@@ -1387,6 +1609,8 @@ gpu_render_canvas(RenderData* render_data, i32 view_x, i32 view_y,
                 i64 count = re->count;
 
                 if ( count > 0 ) {
+                    gpu_pass_begin(render_data, GpuPass_STROKES);
+
                     if ( !(render_data->current_color == re->color) ) {
                         gl::set_uniform_vec4(render_data->stroke_program, "u_brush_color", 1, re->color.d);
                         gl::set_uniform_vec4(render_data->stroke_debug_program, "u_brush_color", 1, re->color.d);
@@ -1397,11 +1621,16 @@ gpu_render_canvas(RenderData* render_data, i32 view_x, i32 view_y,
                         gl::set_uniform_i(render_data->stroke_debug_program, "u_radius", re->radius);
                         render_data->current_radius = re->radius;
                     }
+                    render_data->stroke_z = (render_data->stroke_z + 1) % (MAX_DEPTH_VALUE-1);
+                    v2i origin = relative_to_render_center(render_data, re->origin);
+                    glUniform2i(render_data->stroke_origin_loc, origin.x, origin.y);
+                    glUniform1i(render_data->stroke_z_loc, render_data->stroke_z + 1);
+                    render_data->stats.uniform_updates += 2;
 
-                    DEBUG_gl_validate_buffer(re->vbo_stroke);
-                    DEBUG_gl_validate_buffer(re->vbo_pointa);
-                    DEBUG_gl_validate_buffer(re->vbo_pointb);
-                    DEBUG_gl_validate_buffer(re->indices);
+                    DEBUG_gl_validate_buffer(render_data, re->vbo_stroke);
+                    DEBUG_gl_validate_buffer(render_data, re->vbo_pointa);
+                    DEBUG_gl_validate_buffer(render_data, re->vbo_pointb);
+                    DEBUG_gl_validate_buffer(render_data, re->indices);
 
                     if ( loc_a >= 0 ) {
                         glBindBuffer(GL_ARRAY_BUFFER, re->vbo_pointa);
@@ -1421,7 +1650,7 @@ gpu_render_canvas(RenderData* render_data, i32 view_x, i32 view_y,
                     glBindBuffer(GL_ARRAY_BUFFER, re->vbo_stroke);
                     glEnableVertexAttribArray((GLuint)loc);
                     glVertexAttribPointer(/*attrib location*/ (GLuint)loc,
-                                          /*size*/ 3, GL_FLOAT, /*normalize*/ GL_FALSE,
+                                          /*size*/ 2, GL_FLOAT, /*normalize*/ GL_FALSE,
                                           /*stride*/ 0, /*ptr*/ 0);
 
                     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, re->indices);
@@ -1435,10 +1664,14 @@ gpu_render_canvas(RenderData* render_data, i32 view_x, i32 view_y,
                     }
 
                     glDrawElements(GL_TRIANGLES, count, GL_UNSIGNED_SHORT, 0);
+                    ++render_data->stats.draw_calls;
 
 #if STROKE_DEBUG_VIZ
                     glUseProgram(render_data->stroke_debug_program);
                     glDisable(GL_DEPTH_TEST);
+                    glUniform2i(glGetUniformLocation(render_data->stroke_debug_program, "u_stroke_origin"), origin.x, origin.y);
+                    glUniform1i(glGetUniformLocation(render_data->stroke_debug_program, "u_stroke_z"), render_data->stroke_z + 1);
+                    render_data->stats.uniform_updates += 2;
                     loc = glGetAttribLocation(render_data->stroke_debug_program, "a_position");
                     loc_a = glGetAttribLocation(render_data->stroke_debug_program, "a_pointa");
                     glBindBuffer(GL_ARRAY_BUFFER, re->vbo_pointa);
@@ -1464,12 +1697,13 @@ gpu_render_canvas(RenderData* render_data, i32 view_x, i32 view_y,
                     glBindBuffer(GL_ARRAY_BUFFER, re->vbo_stroke);
                     glEnableVertexAttribArray((GLuint)loc);
                     glVertexAttribPointer(/*attrib location*/ (GLuint)loc,
-                                          /*size*/ 3, GL_FLOAT, /*normalize*/ GL_FALSE,
+                                          /*size*/ 2, GL_FLOAT, /*normalize*/ GL_FALSE,
                                           /*stride*/ 0, /*ptr*/ 0);
 
                     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, re->indices);
 
                     glDrawElements(GL_TRIANGLES, count, GL_UNSIGNED_SHORT, 0);
+                    ++render_data->stats.draw_calls;
                     glUseProgram(render_data->stroke_program);
                     glEnable(GL_DEPTH_TEST);
 #endif
@@ -1485,6 +1719,8 @@ gpu_render_canvas(RenderData* render_data, i32 view_x, i32 view_y,
             }
         }
     }
+    gpu_pass_end(render_data);
+
     glViewport(0, 0, render_data->width, render_data->height);
     glScissor(0, 0, render_data->width, render_data->height);
 }
@@ -1492,6 +1728,10 @@ gpu_render_canvas(RenderData* render_data, i32 view_x, i32 view_y,
 void
 gpu_render(RenderData* render_data,  i32 view_x, i32 view_y, i32 view_width, i32 view_height)
 {
+    PROFILE_SCOPE("render");
+#if MILTON_ENABLE_PROFILING
+    gpu_timers_begin_frame(render_data);
+#endif
     glViewport(0, 0, render_data->width, render_data->height);
     glScissor(0, 0, render_data->width, render_data->height);
     glEnable(GL_BLEND);
@@ -1511,6 +1751,8 @@ gpu_render(RenderData* render_data,  i32 view_x, i32 view_y, i32 view_width, i32
 
     // Blit the canvas to helper_texture
 
+    gpu_pass_begin(render_data, GpuPass_POSTPROCESS);
+
     glDisable(GL_DEPTH_TEST);
 
     if ( !gl::check_flags(GLHelperFlags_TEXTURE_MULTISAMPLE) ) {
@@ -1518,6 +1760,7 @@ gpu_render(RenderData* render_data,  i32 view_x, i32 view_y, i32 view_width, i32
                                   render_data->canvas_texture, 0);
         glBindTexture(texture_target, render_data->helper_texture);
         glCopyTexImage2D(texture_target, 0, GL_RGBA8, 0,0, render_data->width, render_data->height, 0);
+        ++render_data->stats.fullscreen_passes;
 
         glFramebufferTexture2DEXT(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, texture_target,
                                   render_data->helper_texture, 0);
@@ -1535,12 +1778,14 @@ gpu_render(RenderData* render_data,  i32 view_x, i32 view_y, i32 view_width, i32
     // Render color picker
     // TODO: Only render if view rect intersects picker rect
     if ( render_data->flags & RenderDataFlags_GUI_VISIBLE ) {
+        gpu_pass_begin(render_data, GpuPass_OVERLAYS);
+
         // Render picker
         glUseProgram(render_data->picker_program);
         GLint loc = glGetAttribLocation(render_data->picker_program, "a_position");
 
         if ( loc >= 0 ) {
-            DEBUG_gl_validate_buffer(render_data->vbo_picker);
+            DEBUG_gl_validate_buffer(render_data, render_data->vbo_picker);
             glBindBuffer(GL_ARRAY_BUFFER, render_data->vbo_picker);
             glVertexAttribPointer(/*attrib location*/(GLuint)loc,
                                   /*size*/2, GL_FLOAT, /*normalize*/GL_FALSE,
@@ -1549,7 +1794,7 @@ gpu_render(RenderData* render_data,  i32 view_x, i32 view_y, i32 view_width, i32
             GLint loc_norm = glGetAttribLocation(render_data->picker_program, "a_norm");
 
             if ( loc_norm >= 0 ) {
-                DEBUG_gl_validate_buffer(render_data->vbo_picker_norm);
+                DEBUG_gl_validate_buffer(render_data, render_data->vbo_picker_norm);
                 glBindBuffer(GL_ARRAY_BUFFER, render_data->vbo_picker_norm);
                 glVertexAttribPointer(/*attrib location*/(GLuint)loc_norm,
                                       /*size*/2, GL_FLOAT, /*normalize*/GL_FALSE,
@@ -1558,11 +1803,14 @@ gpu_render(RenderData* render_data,  i32 view_x, i32 view_y, i32 view_width, i32
 
             }
             glDrawArrays(GL_TRIANGLE_FAN,0,4);
+            ++render_data->stats.draw_calls;
         }
     }
 
     // Do post-processing on painting and on GUI elements. Draw to backbuffer
 
+    gpu_pass_begin(render_data, GpuPass_POSTPROCESS);
+
     if ( !gl::check_flags(GLHelperFlags_TEXTURE_MULTISAMPLE) ) {
         glBindFramebufferEXT(GL_FRAMEBUFFER, 0);
 
@@ -1575,7 +1823,7 @@ gpu_render(RenderData* render_data,  i32 view_x, i32 view_y, i32 view_width, i32
 
         GLint loc = glGetAttribLocation(render_data->postproc_program, "a_position");
         if ( loc >= 0 ) {
-            DEBUG_gl_validate_buffer(render_data->vbo_screen_quad);
+            DEBUG_gl_validate_buffer(render_data, render_data->vbo_screen_quad);
             glBindBuffer(GL_ARRAY_BUFFER, render_data->vbo_screen_quad);
             glVertexAttribPointer((GLuint)loc, 2, GL_FLOAT, GL_FALSE, 0, 0);
             glEnableVertexAttribArray((GLuint)loc);
@@ -1584,6 +1832,8 @@ gpu_render(RenderData* render_data,  i32 view_x, i32 view_y, i32 view_width, i32
                                   /*stride*/ 0, /*ptr*/ 0);
 
             glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+            ++render_data->stats.draw_calls;
+            ++render_data->stats.fullscreen_passes;
         }
     }
     else {  // Resolve
@@ -1591,16 +1841,19 @@ gpu_render(RenderData* render_data,  i32 view_x, i32 view_y, i32 view_width, i32
         glBindFramebufferEXT(GL_READ_FRAMEBUFFER, render_data->fbo);
         glBlitFramebufferEXT(0, 0, render_data->width, render_data->height,
                              0, 0, render_data->width, render_data->height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        ++render_data->stats.fullscreen_passes;
     }
 
     // Render outlines after doing AA.
 
+    gpu_pass_begin(render_data, GpuPass_OVERLAYS);
+
     // Brush outline
     {
         glUseProgram(render_data->outline_program);
         GLint loc = glGetAttribLocation(render_data->outline_program, "a_position");
         if ( loc >= 0 ) {
-            DEBUG_gl_validate_buffer(render_data->vbo_outline);
+            DEBUG_gl_validate_buffer(render_data, render_data->vbo_outline);
             glBindBuffer(GL_ARRAY_BUFFER, render_data->vbo_outline);
 
             glVertexAttribPointer(/*attrib location*/(GLuint)loc,
@@ -1609,7 +1862,7 @@ gpu_render(RenderData* render_data,  i32 view_x, i32 view_y, i32 view_width, i32
             glEnableVertexAttribArray((GLuint)loc);
             GLint loc_s = glGetAttribLocation(render_data->outline_program, "a_sizes");
             if ( loc_s >= 0 ) {
-                DEBUG_gl_validate_buffer(render_data->vbo_outline_sizes);
+                DEBUG_gl_validate_buffer(render_data, render_data->vbo_outline_sizes);
                 glBindBuffer(GL_ARRAY_BUFFER, render_data->vbo_outline_sizes);
                 glVertexAttribPointer(/*attrib location*/(GLuint)loc_s,
                                       /*size*/2, GL_FLOAT, /*normalize*/GL_FALSE,
@@ -1618,6 +1871,7 @@ gpu_render(RenderData* render_data,  i32 view_x, i32 view_y, i32 view_width, i32
             }
         }
         glDrawArrays(GL_TRIANGLE_FAN, 0,4);
+        ++render_data->stats.draw_calls;
     }
     glDisable(GL_BLEND);
 
@@ -1629,26 +1883,40 @@ gpu_render(RenderData* render_data,  i32 view_x, i32 view_y, i32 view_width, i32
         GLint loc = glGetAttribLocation(render_data->exporter_program, "a_position");
         if ( loc>=0 && render_data->vbo_exporter[0] > 0 ) {
             for ( int vbo_i = 0; vbo_i < 4; ++vbo_i ) {
-                DEBUG_gl_validate_buffer(render_data->vbo_exporter[vbo_i]);
+                DEBUG_gl_validate_buffer(render_data, render_data->vbo_exporter[vbo_i]);
                 glBindBuffer(GL_ARRAY_BUFFER, render_data->vbo_exporter[vbo_i]);
                 glVertexAttribPointer((GLuint)loc, 2, GL_FLOAT, GL_FALSE, 0,0);
                 glEnableVertexAttribArray((GLuint)loc);
 
                 glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+                ++render_data->stats.draw_calls;
             }
         }
     }
 
+    gpu_pass_end(render_data);
+#if MILTON_ENABLE_PROFILING
+    gpu_timers_end_frame(render_data);
+#endif
+    gpu_stats_end_frame(render_data);
+
     glUseProgram(0);
 }
 
 void
 gpu_render_to_buffer(Milton* milton, u8* buffer, i32 scale, i32 x, i32 y, i32 w, i32 h, f32 background_alpha)
 {
+    // Exports have every stroke.
+    milton_load_wait(milton);
+
     CanvasView saved_view = *milton->view;
     RenderData* render_data = milton->render_data;
     CanvasView* view = milton->view;
 
+    // Export work is not part of the interactive frame. Its stats are dropped at the end.
+    gpu_stats_count_uniforms(render_data);
+    RenderStats saved_stats = render_data->stats;
+
     i32 saved_width = render_data->width;
     i32 saved_height = render_data->height;
     GLuint saved_fbo = render_data->fbo;
@@ -1683,7 +1951,7 @@ gpu_render_to_buffer(Milton* milton, u8* buffer, i32 scale, i32 x, i32 y, i32 w,
 
     glViewport(0, 0, buf_w, buf_h);
     glScissor(0, 0, buf_w, buf_h);
-    gpu_clip_strokes_and_update(&milton->root_arena, render_data, milton->view, milton->canvas->root_layer,
+    gpu_clip_strokes_and_update(render_data, milton->view, milton->canvas->root_layer,
                                 &milton->working_stroke, 0, 0, buf_w, buf_h);
 
     render_data->flags |= RenderDataFlags_WITH_BLUR;
@@ -1697,18 +1965,21 @@ gpu_render_to_buffer(Milton* milton, u8* buffer, i32 scale, i32 x, i32 y, i32 w,
 
         GLint loc = glGetAttribLocation(render_data->postproc_program, "a_position");
         if ( loc >= 0 ) {
-            DEBUG_gl_validate_buffer(render_data->vbo_screen_quad);
+            DEBUG_gl_validate_buffer(render_data, render_data->vbo_screen_quad);
             glBindBuffer(GL_ARRAY_BUFFER, render_data->vbo_screen_quad);
             glVertexAttribPointer((GLuint)loc, 2, GL_FLOAT, GL_FALSE, 0, 0);
             glEnableVertexAttribArray((GLuint)loc);
 
             glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+            ++render_data->stats.draw_calls;
+            ++render_data->stats.fullscreen_passes;
         }
     } else {
         glBindFramebufferEXT(GL_DRAW_FRAMEBUFFER, 0);
         glBindFramebufferEXT(GL_READ_FRAMEBUFFER, render_data->fbo);
         glBlitFramebufferEXT(0, 0, buf_w, buf_h,
                              0, 0, buf_w, buf_h, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+        ++render_data->stats.fullscreen_passes;
         glBindFramebufferEXT(GL_FRAMEBUFFER, 0);
     }
 
@@ -1748,18 +2019,196 @@ gpu_render_to_buffer(Milton* milton, u8* buffer, i32 scale, i32 x, i32 y, i32 w,
     gpu_resize(render_data, view);
     gpu_update_canvas(render_data, milton->canvas, view);
 
+    // Keep the counts of GPU resources, which the export changed.
+    gpu_stats_count_uniforms(render_data);
+    saved_stats.gpu_strokes = render_data->stats.gpu_strokes;
+    saved_stats.gpu_bytes = render_data->stats.gpu_bytes;
+    render_data->stats = saved_stats;
+
     // Re-render
-    gpu_clip_strokes_and_update(&milton->root_arena,
-                                render_data, milton->view, milton->canvas->root_layer,
+    gpu_clip_strokes_and_update(render_data, milton->view, milton->canvas->root_layer,
                                 &milton->working_stroke, 0, 0, render_data->width,
                                 render_data->height);
     gpu_render(render_data, 0, 0, render_data->width, render_data->height);
 }
 
+// Binds framebuffers so that glReadPixels reads the canvas texture left over from the last call to
+// gpu_render. It holds the composited painting without GUI elements, so nothing has to be rendered.
+static void
+gpu_bind_canvas_for_reading(RenderData* render_data, i32 x, i32 y, i32 w, i32 h)
+{
+    glBindFramebufferEXT(GL_FRAMEBUFFER, render_data->fbo);
+    if ( !gl::check_flags(GLHelperFlags_TEXTURE_MULTISAMPLE) ) {
+        glFramebufferTexture2DEXT(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                                  render_data->canvas_texture, 0);
+    } else {
+        // Multisample textures can't be read directly. Resolve the pixels into the back buffer,
+        // which gets completely overwritten by the next call to gpu_render.
+        glFramebufferTexture2DEXT(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D_MULTISAMPLE,
+                                  render_data->canvas_texture, 0);
+        glBindFramebufferEXT(GL_DRAW_FRAMEBUFFER, 0);
+        glBindFramebufferEXT(GL_READ_FRAMEBUFFER, render_data->fbo);
+        glBlitFramebufferEXT(x, y, x+w, y+h,
+                             x, y, x+w, y+h, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        glBindFramebufferEXT(GL_READ_FRAMEBUFFER, 0);
+    }
+}
+
+void
+gpu_request_canvas_pixel(RenderData* render_data, i32 x, i32 y)
+{
+    render_data->pixel_ready = false;
+    render_data->pixel_point = v2i{ x, y };
+    render_data->pixel_stale = false;
+    if ( x < 0 || x >= render_data->width || y < 0 || y >= render_data->height ) {
+        memset(render_data->pixel, 0, sizeof(render_data->pixel));
+        render_data->pixel_ready = true;
+        return;
+    }
+
+    i32 gl_y = render_data->height - 1 - y;  // GL is bottom-left.
+    gpu_bind_canvas_for_reading(render_data, x, gl_y, 1, 1);
+    if ( gl::check_flags(GLHelperFlags_ASYNC_READBACK) ) {
+        gl::async_read_begin(&render_data->pixel_read, x, gl_y, 1, 1);
+    } else {
+        glReadPixels(x, gl_y, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, (GLvoid*)render_data->pixel);
+        render_data->pixel_ready = true;
+    }
+    glBindFramebufferEXT(GL_FRAMEBUFFER, 0);
+}
+
+b32
+gpu_canvas_pixel_result(RenderData* render_data, v3f* out_color)
+{
+    if ( !render_data->pixel_ready && gl::check_flags(GLHelperFlags_ASYNC_READBACK) ) {
+        render_data->pixel_ready = gl::async_read_result(&render_data->pixel_read, render_data->pixel);
+    }
+    if ( render_data->pixel_ready ) {
+        u8* pixel = render_data->pixel;
+        *out_color = v3f{ pixel[0] / 255.0f, pixel[1] / 255.0f, pixel[2] / 255.0f };
+    }
+    return render_data->pixel_ready;
+}
+
+b32
+gpu_canvas_pixel_is_stale(RenderData* render_data)
+{
+    return render_data->pixel_stale;
+}
+
+b32
+gpu_request_canvas_preview(RenderData* render_data, i32 out_w, i32 out_h)
+{
+    i32 w = render_data->width;
+    i32 h = render_data->height;
+    render_data->preview_w = 0;
+    render_data->preview_h = 0;
+    if ( w <= 0 || h <= 0 || out_w <= 0 || out_h <= 0 || out_w > w || out_h > h ) {
+        return false;
+    }
+
+    // The first step halves the canvas.
+    i32 texture_w = max((w + 1) / 2, out_w);
+    i32 texture_h = max((h + 1) / 2, out_h);
+    if ( texture_w != render_data->preview_texture_w || texture_h != render_data->preview_texture_h ) {
+        for ( int i = 0; i < 2; ++i ) {
+            if ( render_data->preview_textures[i] == 0 ) {
+                render_data->preview_textures[i] = gl::new_color_texture(texture_w, texture_h);
+                render_data->preview_fbos[i] = gl::new_fbo(render_data->preview_textures[i]);
+            } else {
+                gl::resize_color_texture(render_data->preview_textures[i], texture_w, texture_h);
+            }
+        }
+        glBindTexture(GL_TEXTURE_2D, 0);
+        render_data->preview_texture_w = texture_w;
+        render_data->preview_texture_h = texture_h;
+    }
+
+    glDisable(GL_SCISSOR_TEST);
+    gpu_bind_canvas_for_reading(render_data, 0, 0, w, h);
+
+    // A linear blit to half the size averages 2x2 blocks. Halving until the preview size is close
+    // is a box filter, and the last step scales by less than two.
+    i32 src_w = w;
+    i32 src_h = h;
+    i32 dst_i = 0;
+    do {
+        i32 dst_w = src_w >= 2*out_w ? src_w / 2 : out_w;
+        i32 dst_h = src_h >= 2*out_h ? src_h / 2 : out_h;
+        glBindFramebufferEXT(GL_DRAW_FRAMEBUFFER, render_data->preview_fbos[dst_i]);
+        glBlitFramebufferEXT(0, 0, src_w, src_h,
+                             0, 0, dst_w, dst_h, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+        glBindFramebufferEXT(GL_READ_FRAMEBUFFER, render_data->preview_fbos[dst_i]);
+        src_w = dst_w;
+        src_h = dst_h;
+        dst_i = 1 - dst_i;
+    } while ( src_w != out_w || src_h != out_h );
+
+    render_data->preview_fbo_i = 1 - dst_i;
+    render_data->preview_w = out_w;
+    render_data->preview_h = out_h;
+    if ( gl::check_flags(GLHelperFlags_ASYNC_READBACK) ) {
+        gl::async_read_begin(&render_data->preview_read, 0, 0, out_w, out_h);
+    }
+
+    glBindFramebufferEXT(GL_FRAMEBUFFER, 0);
+    glEnable(GL_SCISSOR_TEST);
+    return true;
+}
+
+b32
+gpu_canvas_preview_result(RenderData* render_data, u8* out_pixels, b32 wait)
+{
+    i32 w = render_data->preview_w;
+    i32 h = render_data->preview_h;
+    if ( w == 0 || h == 0 ) {
+        return false;
+    }
+
+    b32 ok = false;
+    if ( gl::check_flags(GLHelperFlags_ASYNC_READBACK) && !wait ) {
+        ok = gl::async_read_result(&render_data->preview_read, out_pixels);
+    } else {
+        glBindFramebufferEXT(GL_FRAMEBUFFER, render_data->preview_fbos[render_data->preview_fbo_i]);
+        glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, (GLvoid*)out_pixels);
+        glBindFramebufferEXT(GL_FRAMEBUFFER, 0);
+        ok = true;
+    }
+
+    if ( ok ) {
+        // GL rows are bottom-up.
+        size_t row_size = (size_t)w * 4;
+        for ( i32 y = 0; y < h / 2; ++y ) {
+            u8* a = out_pixels + (size_t)y * row_size;
+            u8* b = out_pixels + (size_t)(h - 1 - y) * row_size;
+            for ( size_t i = 0; i < row_size; ++i ) {
+                u8 t = a[i];
+                a[i] = b[i];
+                b[i] = t;
+            }
+        }
+        render_data->preview_w = 0;
+        render_data->preview_h = 0;
+    }
+    return ok;
+}
+
 void
 gpu_release_data(RenderData* render_data)
 {
     release(&render_data->clip_array);
+    if ( gl::check_flags(GLHelperFlags_ASYNC_READBACK) ) {
+        gl::async_read_release(&render_data->pixel_read);
+        gl::async_read_release(&render_data->preview_read);
+    }
+
+#if MILTON_ENABLE_PROFILING
+    if ( gl::check_flags(GLHelperFlags_TIMER_QUERY) ) {
+        for ( i32 i = 0; i < GPU_TIMER_LATENCY; ++i ) {
+            gl::delete_queries(GPU_TIMER_MAX_QUERIES, render_data->gpu_timer_frames[i].queries);
+        }
+    }
+#endif
 }
 
 
@@ -1779,7 +2228,7 @@ gpu_push_debug_point(RenderData* r, v2l point, v3f color)
     GLuint vbo_uv = 0;
     glGenBuffers(1, &vbo_uv);
     glBindBuffer(GL_ARRAY_BUFFER, vbo_uv);
-    DEBUG_gl_mark_buffer(vbo_uv);
+    DEBUG_gl_mark_buffer(r, vbo_uv);
     glBufferData(GL_ARRAY_BUFFER, array_count(uv_data)*sizeof(*uv_data), uv_data, GL_STATIC_DRAW);
     // push(r->debug_points, {vbo_uv, color});
 #endif
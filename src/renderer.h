@@ -26,6 +26,7 @@ struct RenderElement
         struct {  // For when element is a stroke.
             v4f     color;
             i32     radius;
+            v2l     origin;  // Canvas point the vertices are relative to. See StrokeGeometry
         };
         struct {  // For when element is layer.
             f32          layer_alpha;
@@ -55,11 +56,15 @@ struct Stroke;
 struct Layer;
 struct Milton;
 struct CanvasState;
+struct GeometryCache;
 
 RenderData* gpu_allocate_render_data(Arena* arena);
 
 b32 gpu_init(RenderData* render_data, CanvasView* view, ColorPicker* picker);
 
+// Strokes in the cache are cooked from it.
+void gpu_set_geometry_cache(RenderData* render_data, GeometryCache* cache);
+
 
 enum BrushOutlineEnum
 {
@@ -82,7 +87,8 @@ void gpu_update_background(RenderData* render_data, v3f background_color);
 void gpu_update_canvas(RenderData* render_data, CanvasState* canvas, CanvasView* view);
 
 void gpu_get_viewport_limits(RenderData* render_data, float* out_viewport_limits);
-i32  gpu_get_num_clipped_strokes(Layer* root_layer);
+// perf_counter time spent cooking strokes during the last call to gpu_clip_strokes_and_update.
+u64  gpu_get_cook_time(RenderData* render_data);
 
 
 enum CookStrokeOpt
@@ -90,10 +96,12 @@ enum CookStrokeOpt
     CookStroke_NEW                   = 0,
     CookStroke_UPDATE_WORKING_STROKE = 1,
 };
-void gpu_cook_stroke(Arena* arena, RenderData* render_data, Stroke* stroke,
+void gpu_cook_stroke(RenderData* render_data, Stroke* stroke,
                      CookStrokeOpt cook_option = CookStroke_NEW);
 
+void gpu_free_strokes(Stroke* strokes, i64 count, RenderData* render_data);
 void gpu_free_strokes(RenderData* render_data, CanvasState* canvas);
+void gpu_free_layer_strokes(RenderData* render_data, Layer* layer);
 
 
 // Creates OpenGL objects for strokes that are in view but are not loaded on the GPU. Deletes
@@ -103,8 +111,7 @@ enum ClipFlags
     ClipFlags_UPDATE_GPU_DATA   = 1<<0,  // Free all strokes that are far away.
     ClipFlags_JUST_CLIP         = 1<<1,
 };
-void gpu_clip_strokes_and_update(Arena* arena,
-                                 RenderData* render_data,
+void gpu_clip_strokes_and_update(RenderData* render_data,
                                  CanvasView* view,
                                  Layer* root_layer, Stroke* working_stroke,
                                  i32 x, i32 y, i32 w, i32 h, ClipFlags flags = ClipFlags_JUST_CLIP);
@@ -112,7 +119,67 @@ void gpu_clip_strokes_and_update(Arena* arena,
 void gpu_reset_render_flags(RenderData* render_data, int flags);
 
 void gpu_render(RenderData* render_data,  i32 view_x, i32 view_y, i32 view_width, i32 view_height);
+
+// Render work of a frame. Counted always; it's a few increments per stroke.
+struct RenderStats
+{
+    i64 strokes_tested;     // Against the view, in buckets that are in view.
+    i64 strokes_clipped;    // In view. These are drawn.
+    i64 strokes_cooked;
+    i64 bytes_uploaded;     // With glBufferData.
+    i64 draw_calls;
+    i64 uniform_updates;
+    i64 fullscreen_passes;
+    i64 layers_composited;
+    i64 blur_passes;        // Box filter passes. Each blur effect takes six.
+
+    // Not per frame.
+    i64 gpu_strokes;        // Strokes with buffers on the GPU.
+    i64 gpu_bytes;          // Size of those buffers.
+};
+
+// Stats of the last frame drawn by gpu_render. Work done between frames is counted in the next one,
+// except for gpu_render_to_buffer, which is not counted.
+void gpu_get_stats(RenderData* render_data, RenderStats* out_stats);
+// Writes the stats as a JSON object.
+b32  gpu_write_stats_json(RenderStats* stats, FILE* fd);
+
+// Passes of gpu_render. Each one is a KHR_debug group, and its GPU time is measured when the
+// driver has timer queries.
+enum GpuPass
+{
+    GpuPass_CLEAR,
+    GpuPass_STROKES,
+    GpuPass_BLUR,           // Layer effects.
+    GpuPass_COMPOSITE,      // Layers blended into the canvas.
+    GpuPass_POSTPROCESS,    // FXAA, or the MSAA resolve.
+    GpuPass_OVERLAYS,       // Color picker, brush outline, exporter rectangle.
+
+    GpuPass_COUNT,
+};
+
+const char* gpu_pass_name(i32 pass);
+// GPU nanoseconds of each pass, for a frame drawn a few frames ago. Returns false if there are none.
+b32  gpu_get_pass_times(RenderData* render_data, u64* out_ns /*[GpuPass_COUNT]*/);
 void gpu_render_to_buffer(Milton* milton, u8* buffer, i32 scale, i32 x, i32 y, i32 w, i32 h, f32 background_alpha);
 
+// Eyedropper. Reads the color of the canvas at screen point (x,y), as it was drawn by the last call
+// to gpu_render. With GLHelperFlags_ASYNC_READBACK the GPU copies the pixel in the background and
+// the result comes in a later frame. Without it, the pixel is read right away.
+// Another request replaces a read in flight, whose result is then lost.
+void gpu_request_canvas_pixel(RenderData* render_data, i32 x, i32 y);
+// True once the last requested pixel is read. Doesn't wait for the GPU.
+b32  gpu_canvas_pixel_result(RenderData* render_data, v3f* out_color);
+// True if gpu_render drew over the last requested pixel, or the canvas was resized, after the
+// request. Redraws of other parts of the canvas don't count.
+b32  gpu_canvas_pixel_is_stale(RenderData* render_data);
+
+// Box-filters the canvas drawn by the last call to gpu_render down to out_w*out_h on the GPU, and
+// starts reading it back. out_w and out_h are at most the screen size. False if nothing is drawn.
+b32  gpu_request_canvas_preview(RenderData* render_data, i32 out_w, i32 out_h);
+// Copies the requested preview as RGBA pixels, top row first. False until the GPU is done, unless
+// `wait` is set. Also false if there was no request.
+b32  gpu_canvas_preview_result(RenderData* render_data, u8* out_pixels, b32 wait);
+
 void gpu_release_data(RenderData* render_data);
 
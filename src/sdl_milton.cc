@@ -8,6 +8,7 @@
 #include "gl_helpers.h"
 #include "gui.h"
 #include "persist.h"
+#include "rasterizer.h"
 
 
 static void
@@ -90,6 +91,41 @@ panning_update(PlatformState* platform_state)
     }
 }
 
+#if MILTON_ENABLE_PROFILING
+// Input that might explain a slow frame, for the flight recorder.
+static void
+record_input_events(MiltonInput* input)
+{
+    struct { int flag; const char* name; } flags[] =
+    {
+        { MiltonInputFlags_UNDO, "undo" },
+        { MiltonInputFlags_REDO, "redo" },
+        { MiltonInputFlags_END_STROKE, "end stroke" },
+        { MiltonInputFlags_FULL_REFRESH, "full refresh" },
+        { MiltonInputFlags_OPEN_FILE, "open file" },
+        { MiltonInputFlags_SAVE_FILE, "save file" },
+        { MiltonInputFlags_CLICK, "click" },
+    };
+    for ( size_t i = 0; i < array_count(flags); ++i ) {
+        if ( input->flags & flags[i].flag ) {
+            PROFILE_INSTANT(flags[i].name, 0);
+        }
+    }
+    if ( input->input_count > 0 ) {
+        PROFILE_INSTANT("stroke input", input->input_count);
+    }
+    if ( input->scale != 0 ) {
+        PROFILE_INSTANT("zoom", input->scale);
+    }
+    if ( input->pan_delta.x != 0 || input->pan_delta.y != 0 ) {
+        PROFILE_INSTANT("pan", 0);
+    }
+    if ( input->mode_to_set != MiltonMode::NONE ) {
+        PROFILE_INSTANT("mode", (i64)input->mode_to_set);
+    }
+}
+#endif
+
 MiltonInput
 sdl_event_loop(Milton* milton, PlatformState* platform_state)
 {
@@ -764,7 +800,7 @@ milton_main(bool is_fullscreen, char* file_to_open)
 
     // ==== Initialize milton
 
-    Milton* milton = arena_bootstrap(Milton, root_arena, 1024*1024);
+    Milton* milton = arena_bootstrap_reserve(Milton, root_arena, 1024*1024);
 
     // Ask for native events to poll tablet events.
     SDL_EventState(SDL_SYSWMEVENT, SDL_ENABLE);
@@ -1208,6 +1244,10 @@ milton_main(bool is_fullscreen, char* file_to_open)
         // Reset pan_start. Delta is not cumulative.
         platform_state.pan_start = platform_state.pan_point;
 
+#if MILTON_ENABLE_PROFILING
+        record_input_events(&milton_input);
+#endif
+
         // ==== Update and render
         PROFILE_GRAPH_END(polling);
         PROFILE_GRAPH_BEGIN(GL);
@@ -1217,12 +1257,51 @@ milton_main(bool is_fullscreen, char* file_to_open)
         }
         ImGui::Render();
         PROFILE_GRAPH_END(GL);
+#if MILTON_ENABLE_PROFILING
+        {
+            u64 gpu_ns[GpuPass_COUNT] = {};
+            f32 gpu_ms = 0.0f;
+            if ( gpu_get_pass_times(milton->render_data, gpu_ns) ) {
+                for ( i32 i = 0; i < GpuPass_COUNT; ++i ) {
+                    gpu_ms += (f32)gpu_ns[i] / 1000000.0f;
+                }
+            }
+            frame_history_push(&milton->frame_history, &milton->graph_frame, gpu_ms, display_hz);
+
+            FrameTimes* frame = frame_history_get(&milton->frame_history, 0);
+            PROFILE_COUNTER("frame us", (i64)(frame->cpu_ms * 1000.0f));
+            PROFILE_COUNTER("gpu us", (i64)(gpu_ms * 1000.0f));
+
+            RenderStats stats = {};
+            gpu_get_stats(milton->render_data, &stats);
+            PROFILE_COUNTER("strokes tested", stats.strokes_tested);
+            PROFILE_COUNTER("strokes clipped", stats.strokes_clipped);
+            PROFILE_COUNTER("strokes cooked", stats.strokes_cooked);
+            PROFILE_COUNTER("bytes uploaded", stats.bytes_uploaded);
+            PROFILE_COUNTER("draw calls", stats.draw_calls);
+            PROFILE_COUNTER("uniform updates", stats.uniform_updates);
+            PROFILE_COUNTER("fullscreen passes", stats.fullscreen_passes);
+            PROFILE_COUNTER("layers composited", stats.layers_composited);
+            PROFILE_COUNTER("blur passes", stats.blur_passes);
+            PROFILE_COUNTER("gpu strokes", stats.gpu_strokes);
+            PROFILE_COUNTER("gpu bytes", stats.gpu_bytes);
+        }
+#endif
         PROFILE_GRAPH_BEGIN(system);
         SDL_GL_SwapWindow(window);
 
 #ifdef __linux__
         gtk_main_iteration_do(FALSE);
 #endif
+        PROFILE_END_FRAME();
+
+#if MILTON_ENABLE_PROFILING
+        // After the frame, so that copying the capture doesn't count as part of a frame.
+        if ( frame_history_should_capture(&milton->frame_history) ) {
+            milton_save_slow_frame(milton);
+        }
+#endif
+
         // Sleep if the frame took less time than the refresh rate.
         u64 frame_time_us = perf_counter() - frame_start_us;
 
@@ -1263,3 +1342,487 @@ milton_main(bool is_fullscreen, char* file_to_open)
 
     return 0;
 }
+
+// ---- Headless mode
+
+#define HEADLESS_WIDTH          1280
+#define HEADLESS_HEIGHT         800
+#define HEADLESS_BENCH_FRAMES   60
+
+// Creates an offscreen OpenGL context with a width x height framebuffer and
+// initializes Milton with the canvas at file_to_open. Returns NULL on failure.
+// With `use_cpu` there is no GL context, and the canvas can only be drawn with
+// cpu_render_to_buffer.
+static Milton*
+milton_headless_init(i32 width, i32 height, char* file_to_open, b32 use_cpu = false)
+{
+    if ( !use_cpu ) {
+        if ( !platform_headless_gl_init(width, height) ) {
+            milton_log("Could not create a headless OpenGL context.\n");
+            return NULL;
+        }
+        if ( !gl::load() ) {
+            milton_log("Milton could not load the necessary OpenGL functionality.\n");
+            platform_headless_gl_deinit();
+            return NULL;
+        }
+        milton_log("Created OpenGL context with version %s\n", glGetString(GL_VERSION));
+        milton_log("    and GLSL %s\n", glGetString(GL_SHADING_LANGUAGE_VERSION));
+    }
+
+    Milton* milton = arena_bootstrap_reserve(Milton, root_arena, 1024*1024);
+    milton->render_data = gpu_allocate_render_data(&milton->root_arena);
+
+    PATH_CHAR* path = arena_alloc_array(&milton->root_arena, MAX_PATH, PATH_CHAR);
+    str_to_path_char(file_to_open, path, MAX_PATH*sizeof(PATH_CHAR));
+
+    int init_flags = MiltonInitFlags_HEADLESS;
+    if ( use_cpu ) {
+        init_flags |= MiltonInitFlags_NO_GPU;
+    }
+    milton_init(milton, width, height, 1.0f, path, init_flags);
+    milton_resize_and_pan(milton, {}, {width, height});
+
+    return milton;
+}
+
+static void
+milton_headless_deinit(Milton* milton)
+{
+    b32 has_gl = !(milton->flags & MiltonStateFlags_NO_GPU);
+    arena_free(&milton->root_arena);
+    if ( has_gl ) {
+        platform_headless_gl_deinit();
+    }
+}
+
+int
+milton_main_headless(char* file_to_open)
+{
+    milton_log("Running Milton %d.%d.%d (headless)\n", MILTON_MAJOR_VERSION, MILTON_MINOR_VERSION, MILTON_MICRO_VERSION);
+
+    if ( file_to_open == NULL ) {
+        milton_log("Usage: milton --headless <file.mlt>\n");
+        return EXIT_FAILURE;
+    }
+    {
+        PATH_CHAR path[MAX_PATH] = {};
+        str_to_path_char(file_to_open, path, MAX_PATH*sizeof(PATH_CHAR));
+        FILE* fd = platform_fopen(path, TO_PATH_STR("rb"));
+        if ( !fd ) {
+            milton_log("Could not open %s\n", file_to_open);
+            return EXIT_FAILURE;
+        }
+        fclose(fd);
+    }
+
+    Milton* milton = milton_headless_init(HEADLESS_WIDTH, HEADLESS_HEIGHT, file_to_open);
+    if ( !milton ) {
+        return EXIT_FAILURE;
+    }
+
+    RenderData* render_data = milton->render_data;
+    CanvasView* view = milton->view;
+    i32 width = view->screen_size.w;
+    i32 height = view->screen_size.h;
+
+    // The first frame cooks every visible stroke. The ones after it only clip and draw.
+    float frame_ms[HEADLESS_BENCH_FRAMES + 1] = {};
+    for ( int i = 0; i < HEADLESS_BENCH_FRAMES + 1; ++i ) {
+        u64 start = perf_counter();
+        gpu_clip_strokes_and_update(render_data, view, milton->canvas->root_layer,
+                                    &milton->working_stroke, 0, 0, width, height, ClipFlags_UPDATE_GPU_DATA);
+        gpu_render(render_data, 0, 0, width, height);
+        glFinish();
+        frame_ms[i] = perf_count_to_sec(perf_counter() - start) * 1000.0f;
+    }
+
+    float average_ms = 0.0f;
+    float worst_ms = 0.0f;
+    for ( int i = 1; i < HEADLESS_BENCH_FRAMES + 1; ++i ) {
+        average_ms += frame_ms[i];
+        worst_ms = max(worst_ms, frame_ms[i]);
+    }
+    average_ms /= HEADLESS_BENCH_FRAMES;
+
+    // Render the whole view through the exporter path.
+    float export_ms = -1.0f;
+    u8* buffer = (u8*)mlt_calloc((size_t)width*height, 4, "Bitmap");
+    if ( buffer ) {
+        u64 start = perf_counter();
+        gpu_render_to_buffer(milton, buffer, 1, 0, 0, width, height, 1.0f);
+        glFinish();
+        export_ms = perf_count_to_sec(perf_counter() - start) * 1000.0f;
+        mlt_free(buffer, "Bitmap");
+    }
+
+    milton_log("%s: %" PRIi64 " strokes, %dx%d\n", file_to_open,
+               layer::count_strokes(milton->canvas->root_layer), width, height);
+    milton_log("    First frame: %.2f ms\n", frame_ms[0]);
+    milton_log("    %d frames: %.2f ms average, %.2f ms worst\n", HEADLESS_BENCH_FRAMES, average_ms, worst_ms);
+    milton_log("    gpu_render_to_buffer: %.2f ms\n", export_ms);
+
+    u64 gpu_ns[GpuPass_COUNT] = {};
+    if ( gpu_get_pass_times(render_data, gpu_ns) ) {
+        for ( i32 i = 0; i < GpuPass_COUNT; ++i ) {
+            milton_log("    GPU %s: %.2f ms\n", gpu_pass_name(i), (float)gpu_ns[i] / 1000000.0f);
+        }
+    }
+
+    // Stats of the last benchmark frame, as JSON for scripts.
+    RenderStats stats = {};
+    gpu_get_stats(render_data, &stats);
+    gpu_write_stats_json(&stats, stdout);
+
+    milton_headless_deinit(milton);
+
+    return EXIT_SUCCESS;
+}
+
+// ---- Batch export
+
+#define EXPORT_MAX_WORKERS 64
+#define EXPORT_MAX_SIZE     (1<<16)  // Pixels on each side of an exported image.
+
+struct ExportOptions
+{
+    b32     has_rect;
+    i32     x;
+    i32     y;
+    i32     w;
+    i32     h;
+    i32     scale;
+    char*   layers;         // Comma separated layer names. NULL to keep layer visibility as saved.
+    b32     transparent;
+    b32     use_cpu;        // Render with cpu_render_to_buffer instead of gpu_render_to_buffer
+};
+
+struct ExportJob
+{
+    char*   in_file;
+    char*   out_file;
+    b32     ok;
+};
+
+struct ExportBatch
+{
+    ExportOptions   options;
+
+    ExportJob*      jobs;
+    i32             num_jobs;
+    SDL_atomic_t    next_job;
+
+    // Size of each worker's headless framebuffer.
+    i32             width;
+    i32             height;
+
+    // milton_init touches global state (localization). Only one worker runs it at a time.
+    SDL_mutex*      init_mutex;
+};
+
+static b32
+export_layer_is_listed(char* list, char* name)
+{
+    size_t name_len = strlen(name);
+    char* token = list;
+    while ( token ) {
+        char* comma = strchr(token, ',');
+        size_t token_len = comma ? (size_t)(comma - token) : strlen(token);
+        if ( token_len == name_len && strncmp(token, name, name_len) == 0 ) {
+            return true;
+        }
+        token = comma ? comma + 1 : NULL;
+    }
+    return false;
+}
+
+// Shows only the layers in --layers.
+static void
+export_set_visible_layers(Milton* milton, ExportOptions* options, ExportJob* job)
+{
+    if ( options->layers ) {
+        i32 num_visible = 0;
+        for ( Layer* l = milton->canvas->root_layer; l != NULL; l = l->next ) {
+            if ( export_layer_is_listed(options->layers, l->name) ) {
+                l->flags |= LayerFlags_VISIBLE;
+                ++num_visible;
+            } else {
+                l->flags &= ~LayerFlags_VISIBLE;
+            }
+        }
+        if ( num_visible == 0 ) {
+            milton_log("[export] Warning: %s has none of the layers %s\n", job->in_file, options->layers);
+        }
+    }
+}
+
+// Screen rect to export. Without --rect, the strokes of the visible layers at the zoom of the saved
+// view, or the whole view if there are none.
+static Rect
+export_region(Milton* milton, ExportOptions* options)
+{
+    Rect region = {};
+    if ( options->has_rect ) {
+        region.left = options->x;
+        region.top = options->y;
+        region.right = options->x + options->w;
+        region.bottom = options->y + options->h;
+    }
+    else {
+        milton_load_wait(milton);
+        Rect bounds = rect_without_size();
+        for ( Layer* l = milton->canvas->root_layer; l != NULL; l = l->next ) {
+            if ( l->flags & LayerFlags_VISIBLE ) {
+                bounds = rect_union(bounds, layer::layer_bounds(l));
+            }
+        }
+        if ( rect_is_valid(bounds) ) {
+            region = canvas_rect_to_raster_rect(milton->view, bounds);
+        } else {
+            region.right = milton->view->screen_size.w;
+            region.bottom = milton->view->screen_size.h;
+        }
+    }
+    return region;
+}
+
+static b32
+export_canvas(Milton* milton, ExportOptions* options, ExportJob* job, Rect region)
+{
+    b32 ok = true;
+
+    i32 x = (i32)region.left;
+    i32 y = (i32)region.top;
+    i32 w = (i32)(region.right - region.left);
+    i32 h = (i32)(region.bottom - region.top);
+    i32 scale = options->scale;
+    f32 background_alpha = options->transparent ? 0.0f : 1.0f;
+
+    i32 buf_w = w * scale;
+    i32 buf_h = h * scale;
+    u8* buffer = (u8*)mlt_calloc((size_t)buf_w*buf_h, 4, "Bitmap");
+    if ( !buffer ) {
+        milton_log("[export] Not enough memory to export %s\n", job->out_file);
+        return false;
+    }
+
+    if ( options->use_cpu ) {
+        ok = cpu_render_to_buffer(milton->canvas->root_layer, milton->view, buffer,
+                                  scale, x, y, w, h, background_alpha);
+    } else {
+        gpu_render_to_buffer(milton, buffer, scale, x, y, w, h, background_alpha);
+    }
+
+    if ( ok ) {
+        PATH_CHAR out_path[MAX_PATH] = {};
+        str_to_path_char(job->out_file, out_path, MAX_PATH*sizeof(PATH_CHAR));
+        ok = milton_save_buffer_to_file(out_path, buffer, buf_w, buf_h);
+    }
+    if ( ok ) {
+        milton_log("[export] %s -> %s (%dx%d)\n", job->in_file, job->out_file, buf_w, buf_h);
+    } else {
+        milton_log("[export] Failed to write %s\n", job->out_file);
+    }
+
+    mlt_free(buffer, "Bitmap");
+    return ok;
+}
+
+// Each worker owns a Milton instance, and an offscreen GL context unless it
+// renders with --cpu. It takes jobs until there are none left.
+static int
+export_worker(void* data)
+{
+    ExportBatch* batch = (ExportBatch*)data;
+    Milton* milton = NULL;
+    PATH_CHAR path[MAX_PATH] = {};
+
+    // Size of the headless framebuffer, which gpu_render_to_buffer draws to.
+    i32 width = batch->width;
+    i32 height = batch->height;
+
+    for ( ;; ) {
+        int job_i = SDL_AtomicAdd(&batch->next_job, 1);
+        if ( job_i >= batch->num_jobs ) {
+            break;
+        }
+        ExportJob* job = &batch->jobs[job_i];
+
+        if ( milton == NULL ) {
+            // milton_init loads the first file.
+            SDL_LockMutex(batch->init_mutex);
+            milton = milton_headless_init(width, height, job->in_file, batch->options.use_cpu);
+            SDL_UnlockMutex(batch->init_mutex);
+            if ( milton == NULL ) {
+                milton_log("[export] Could not initialize a headless renderer for %s\n", job->in_file);
+                break;
+            }
+        } else {
+            str_to_path_char(job->in_file, path, MAX_PATH*sizeof(PATH_CHAR));
+            milton_set_canvas_file(milton, path);
+            milton_load(milton);
+        }
+
+        if ( milton->flags & MiltonStateFlags_DEFAULT_CANVAS ) {
+            // milton_load falls back to the default canvas when it can't read the file.
+            milton_log("[export] Could not load %s\n", job->in_file);
+            continue;
+        }
+
+        export_set_visible_layers(milton, &batch->options, job);
+        Rect region = export_region(milton, &batch->options);
+        i64 buf_w = (region.right - region.left) * batch->options.scale;
+        i64 buf_h = (region.bottom - region.top) * batch->options.scale;
+        if ( buf_w > EXPORT_MAX_SIZE || buf_h > EXPORT_MAX_SIZE ) {
+            milton_log("[export] %s is %" PRIi64 "x%" PRIi64 " pixels. Use --rect or a smaller --scale.\n",
+                       job->in_file, buf_w, buf_h);
+            continue;
+        }
+
+        if ( !batch->options.use_cpu && (buf_w > width || buf_h > height) ) {
+            float viewport_limits[2] = {};
+            gpu_get_viewport_limits(milton->render_data, viewport_limits);
+            if ( buf_w > viewport_limits[0] || buf_h > viewport_limits[1] ) {
+                milton_log("[export] %s is %" PRIi64 "x%" PRIi64 " pixels, more than the GPU can draw. "
+                           "Use --rect, a smaller --scale or --cpu.\n", job->in_file, buf_w, buf_h);
+                continue;
+            }
+            // The canvas doesn't fit. Start over with a larger framebuffer.
+            milton_headless_deinit(milton);
+            width = max(width, (i32)buf_w);
+            height = max(height, (i32)buf_h);
+            SDL_LockMutex(batch->init_mutex);
+            milton = milton_headless_init(width, height, job->in_file);
+            SDL_UnlockMutex(batch->init_mutex);
+            if ( milton == NULL ) {
+                milton_log("[export] Could not initialize a %dx%d headless renderer for %s\n",
+                           width, height, job->in_file);
+                break;
+            }
+            // The view has a new screen size.
+            export_set_visible_layers(milton, &batch->options, job);
+            region = export_region(milton, &batch->options);
+        }
+
+        job->ok = export_canvas(milton, &batch->options, job, region);
+    }
+
+    if ( milton ) {
+        milton_headless_deinit(milton);
+    }
+    // Cooking and --cpu rasterizing used them for every job.
+    arena_scratch_release();
+    return 0;
+}
+
+static void
+export_usage()
+{
+    milton_log("Usage: milton --export <in.mlt> <out.png|out.jpg> [<in.mlt> <out.png|out.jpg> ...]\n"
+               "           [--rect x,y,w,h] [--scale N] [--layers name1,name2,...]\n"
+               "           [--transparent] [--cpu] [--jobs N]\n"
+               "\n"
+               "    --rect          Region to export, in screen pixels of the view saved in the file.\n"
+               "                    Defaults to the bounds of the strokes in the exported layers.\n"
+               "    --scale         Scale up the exported region. Defaults to 1.\n"
+               "    --layers        Export only these layers.\n"
+               "    --transparent   Transparent background.\n"
+               "    --cpu           Render on the CPU rasterizer.\n"
+               "    --jobs          Number of files to export in parallel. Defaults to the number of cores.\n");
+}
+
+int
+milton_main_export(int argc, char** argv)
+{
+    ExportBatch batch = {};
+    ExportOptions* options = &batch.options;
+    options->scale = 1;
+
+    i32 num_workers = min(max(SDL_GetCPUCount(), 1), EXPORT_MAX_WORKERS);
+
+    DArray<char*> files = {};
+    b32 ok = true;
+    for ( int i = 0; ok && i < argc; ++i ) {
+        char* arg = argv[i];
+        b32 has_value = i + 1 < argc;
+        if ( !strcmp(arg, "--rect") && has_value ) {
+            options->has_rect = sscanf(argv[++i], "%d,%d,%d,%d",
+                                       &options->x, &options->y, &options->w, &options->h) == 4;
+            ok = options->has_rect && options->w > 0 && options->h > 0;
+        }
+        else if ( !strcmp(arg, "--scale") && has_value ) {
+            options->scale = atoi(argv[++i]);
+            ok = options->scale > 0;
+        }
+        else if ( !strcmp(arg, "--layers") && has_value ) {
+            options->layers = argv[++i];
+        }
+        else if ( !strcmp(arg, "--jobs") && has_value ) {
+            num_workers = min(atoi(argv[++i]), EXPORT_MAX_WORKERS);
+            ok = num_workers > 0;
+        }
+        else if ( !strcmp(arg, "--transparent") ) {
+            options->transparent = true;
+        }
+        else if ( !strcmp(arg, "--cpu") ) {
+            options->use_cpu = true;
+        }
+        else if ( !strncmp(arg, "--", 2) ) {
+            ok = false;
+        }
+        else {
+            push(&files, arg);
+        }
+    }
+    if ( !ok || files.count == 0 || files.count % 2 != 0 ) {
+        export_usage();
+        release(&files);
+        return EXIT_FAILURE;
+    }
+
+    batch.num_jobs = (i32)(files.count / 2);
+    batch.jobs = (ExportJob*)mlt_calloc((size_t)batch.num_jobs, sizeof(ExportJob), "Setup");
+    for ( i32 i = 0; i < batch.num_jobs; ++i ) {
+        batch.jobs[i].in_file = files.data[2*i];
+        batch.jobs[i].out_file = files.data[2*i + 1];
+    }
+    release(&files);
+
+    // gpu_render_to_buffer draws the exported image to the default framebuffer. Workers make theirs
+    // larger when a canvas doesn't fit.
+    i32 w = options->has_rect ? options->w : HEADLESS_WIDTH;
+    i32 h = options->has_rect ? options->h : HEADLESS_HEIGHT;
+    batch.width = max(HEADLESS_WIDTH, w * options->scale);
+    batch.height = max(HEADLESS_HEIGHT, h * options->scale);
+
+    batch.init_mutex = SDL_CreateMutex();
+    SDL_AtomicSet(&batch.next_job, 0);
+
+    num_workers = min(num_workers, batch.num_jobs);
+    milton_log("[export] Exporting %d files with %d workers\n", batch.num_jobs, num_workers);
+
+    SDL_Thread* threads[EXPORT_MAX_WORKERS] = {};
+    for ( i32 i = 0; i < num_workers - 1; ++i ) {
+        threads[i] = SDL_CreateThread(export_worker, "Export Worker", (void*)&batch);
+    }
+    export_worker(&batch);
+    for ( i32 i = 0; i < num_workers - 1; ++i ) {
+        if ( threads[i] ) {
+            SDL_WaitThread(threads[i], NULL);
+        }
+    }
+
+    i32 num_failed = 0;
+    for ( i32 i = 0; i < batch.num_jobs; ++i ) {
+        if ( !batch.jobs[i].ok ) {
+            milton_log("[export] FAILED: %s\n", batch.jobs[i].in_file);
+            ++num_failed;
+        }
+    }
+    milton_log("[export] %d of %d files exported\n", batch.num_jobs - num_failed, batch.num_jobs);
+
+    SDL_DestroyMutex(batch.init_mutex);
+    mlt_free(batch.jobs, "Setup");
+
+    return num_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
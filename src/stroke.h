@@ -21,9 +21,13 @@ struct Stroke
     i32             id;
 
     Brush           brush;
+    // Strokes loaded from MLT v7 files point into the read-only mapping of the
+    // file (see CanvasState::mapped_file). Strokes are not modified once they
+    // are added to a layer. Copy them to an arena before changing them.
     v2l*            points;
     f32*            pressures;
     i32             num_points;
+    i32             payload_class;  // 1 + log2 of the capacity of the points, when they come from strokelist_alloc_payload. Zero otherwise.
     i32             layer_id;
     Rect            bounding_rect;
     RenderElement   render_element;
@@ -1,7 +1,7 @@
 // Copyright (c) 2015 Sergio Gonzalez. All rights reserved.
 // License: https://github.com/serge-rgb/milton#license
 
-in vec3 a_position;
+in vec2 a_position;
 in vec3 a_pointa;
 in vec3 a_pointb;
 
@@ -19,14 +19,15 @@ out vec3 v_debug_color;
 void
 main()
 {
-    v_pointa = a_pointa;
-    v_pointb = a_pointb;
+    vec2 origin = vec2(u_stroke_origin);
+    v_pointa = vec3(a_pointa.xy + origin, a_pointa.z);
+    v_pointb = vec3(a_pointb.xy + origin, a_pointb.z);
 #if STROKE_DEBUG_VIZ
     v_debug_color = a_debug_color;
 #endif
-    gl_Position.xy = canvas_to_raster_gl(a_position.xy);
+    gl_Position.xy = canvas_to_raster_gl(a_position + origin);
     gl_Position.w = 1;
 
-    gl_Position.z = a_position.z / MAX_DEPTH_VALUE;
+    gl_Position.z = float(u_stroke_z) / MAX_DEPTH_VALUE;
 }
 
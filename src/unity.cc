@@ -2,8 +2,11 @@
 // License: https://github.com/serge-rgb/milton#license
 
 #include "StrokeList.cc"
+#include "StrokePager.cc"
+#include "WorkerPool.cc"
 #include "canvas.cc"
 #include "color.cc"
+#include "geometry_cache.cc"
 #include "gl_helpers.cc"
 #include "gui.cc"
 #include "localization.cc"
@@ -11,6 +14,7 @@
 #include "milton.cc"
 #include "persist.cc"
 #include "profiler.cc"
+#include "rasterizer.cc"
 #include "renderer.cc"
 #include "sdl_milton.cc"
 #include "utils.cc"
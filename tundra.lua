@@ -75,8 +75,11 @@ Build {
             Name = "Milton",
             Sources = {
                 "src/StrokeList.cc",
+                "src/StrokePager.cc",
+                "src/WorkerPool.cc",
                 "src/canvas.cc",
                 "src/color.cc",
+                "src/geometry_cache.cc",
                 "src/gl_helpers.cc",
                 "src/gui.cc",
                 "src/localization.cc",
@@ -84,6 +87,7 @@ Build {
                 "src/milton.cc",
                 "src/persist.cc",
                 "src/profiler.cc",
+                "src/rasterizer.cc",
                 "src/renderer.cc",
                 "src/sdl_milton.cc",
                 "src/utils.cc",